@@ -289,6 +289,48 @@ OSDictionary * AsusFnKeys::readDataBlock(char *str)
     return dict;
 }
 
+/**
+ * wmi_guid_hash - hash a binary GUID into the WDG index
+ *
+ * The first field of a GUID is effectively random, so folding a few of its
+ * bytes with the tail is enough to spread _WDG tables of a few hundred blocks.
+ */
+UInt8 AsusFnKeys::wmi_guid_hash(const UInt8 *guid)
+{
+    return guid[0] ^ guid[1] ^ guid[2] ^ guid[3] ^ guid[15];
+}
+
+/**
+ * wmi_index_wdg - copy the _WDG blocks and build the GUID hash index
+ *
+ */
+void AsusFnKeys::wmi_index_wdg(const struct guid_block *blocks, UInt32 total)
+{
+    UInt32 i;
+    UInt8 slot;
+    
+    if (total > WMI_GUID_MAX_BLOCKS)
+    {
+        IOLog("%s::_WDG has %u blocks, indexing first %u\n", getName(), (unsigned int)total, WMI_GUID_MAX_BLOCKS);
+        total = WMI_GUID_MAX_BLOCKS;
+    }
+    
+    wdgBlocks = (struct guid_block *) IOMalloc(total * sizeof(struct guid_block));
+    if (NULL == wdgBlocks)
+        return;
+    
+    memcpy(wdgBlocks, blocks, total * sizeof(struct guid_block));
+    wdgCount = total;
+    bzero(wdgHash, sizeof(wdgHash));
+    
+    for (i = 0; i < total; i++) {
+        slot = wmi_guid_hash((const UInt8 *) wdgBlocks[i].guid);
+        while (wdgHash[slot])
+            slot++;
+        wdgHash[slot] = i + 1;
+    }
+}
+
 /*
  * Parse the _WDG method for the GUID data blocks
  */
@@ -319,6 +361,7 @@ int AsusFnKeys::parse_wdg(OSDictionary *dict)
         for (i = 0; i < total; i++) {
             wmi_wdg2reg((struct guid_block *) data->getBytesNoCopy(i * sizeof(struct guid_block), sizeof(struct guid_block)), array, dataArray);
         }
+        wmi_index_wdg((const struct guid_block *) data->getBytesNoCopy(), total);
         setProperty("WDG", array);
         setProperty("DataBlocks", dataArray);
         data->release();
@@ -336,6 +379,29 @@ int AsusFnKeys::parse_wdg(OSDictionary *dict)
 
 OSDefineMetaClassAndStructors(AsusFnKeys, IOService)
 
+static const char *wedStatNames[kWEDStatCount] = {
+    "WEDDecodeFailures",
+    "WEDDecodedNumber",
+    "WEDDecodedPackage",
+    "WEDDecodedBuffer",
+    "WEDCacheHits",
+    "WEDShapeChanges",
+};
+
+static const char *stateWriteNames[kStateItemCount][2] = {
+    { "KeyboardBacklightWritesAvoided", "KeyboardBacklightWritesIssued" },
+    { "ALSWritesAvoided",               "ALSWritesIssued" },
+    { "NVRAMBacklightWritesAvoided",    "NVRAMBacklightWritesIssued" },
+};
+
+static const char *latencyStageNames[kLatencyStageCount] = {
+    "Queue",
+    "WED",
+    "Decision",
+    "State",
+    "KeyPressed",
+};
+
 const FnKeysKeyMap AsusFnKeys::keyMap[] = {
     {0x30, NX_KEYTYPE_SOUND_UP, "NX_KEYTYPE_SOUND_UP"},
     {0x31, NX_KEYTYPE_SOUND_DOWN, "NX_KEYTYPE_SOUND_DOWN"},
@@ -359,20 +425,80 @@ bool AsusFnKeys::init(OSDictionary *dict)
     keybrdBLight16 = false;
     keybrdBLightLvl = 0; // Stating with Zero Level
     panelBrightnessLevel = 16; // Mac starts with level 16
+    panelRestoreLevel = 16;
     
     touchpadEnabled = true; // touch enabled by default on startup
     isALSenabled  = false;
+    
+    curKeybrdBlvl = 0xFF;
+    _nvramTimer = NULL;
+    _nvramNotify = NULL;
+    _backlightDisplay = NULL;
+    _displayPublishNotify = _displayTerminateNotify = _displayInterest = NULL;
+    memset(nvramValues, 0xFF, sizeof(nvramValues));
+    nvramDirty = 0;
+    nvramFlushDelay = kNVRAMFlushDelayDefault;
+    nvramReadsBroken = false;
+    nvramCoalesced = nvramCommitted = 0;
+    nvramCoalescedNum = nvramCommittedNum = NULL;
+    appliedALS = -1;
+    appliedTouchpad = -1;
+    bzero(stateWrites, sizeof(stateWrites));
+    bzero(stateWritesNum, sizeof(stateWritesNum));
+    keyboardBLightLevelNum = panelToggleTimeNum = NULL;
+    alsNotifies = alsCoalesced = 0;
+    alsCoalescedNum = NULL;
     isPanelBackLightOn = true;
     hasKeybrdBLight = false;
     hasMediaButtons = true;
     
     isautoOff = false;
+    wakeRequest = false;
     autoOffEnable = true;
+    _autoOffTimer = NULL;
+    _repeatTimer = NULL;
+    buildKeyActions();
+    wedShape = kWEDShapeUnknown;
+    wedCacheTime = 0;
+    memset(wedCache, 0, sizeof(wedCache));
+    memset(wedStats, 0, sizeof(wedStats));
+    memset(wedStatsNum, 0, sizeof(wedStatsNum));
+    for (int i = 0; i < kLatencyStageCount; i++)
+        latencyReset(&latency[i]);
+    latencyStamp = 0;
+    capture.setDrained(true);
+    resetACPIStats();
+    acpiSlowCallMS = kACPISlowCallDefault;
+    heldKey = heldCode = heldRepeats = 0;
+    heldLastSeen = heldPeriodNS = 0;
+    keyRepeatDelay = kKeyRepeatDelayDefault;
+    keyRepeatInterval = kKeyRepeatIntervalDefault;
+    keyReleaseTimeout = kKeyReleaseTimeoutDefault;
+    repeatsAbsorbed = 0;
+    repeatsAbsorbedNum = NULL;
+    autoOffWakeups = 0;
+    autoOffWakeupsNum = NULL;
     
     _notificationServices = OSSet::withCapacity(1);
     
+    wdgBlocks = NULL;
+    wdgCount = 0;
+    bzero(wdgHash, sizeof(wdgHash));
+    bzero(&wmiDSTS, sizeof(wmiDSTS));
+    bzero(&wmiDEVS, sizeof(wmiDEVS));
+    bzero(acpiArgPool, sizeof(acpiArgPool));
+    acpiArgAllocs = 0;
+    bzero(acpiMethods, sizeof(acpiMethods));
+    acpiCaps = 0;
+    
+    _workLoop = NULL;
+    _notifySource = NULL;
+    notifyRing = NULL;
+    notifyRingSize = kNotifyRingDefaultSize;
+    
     kev.setVendorID("com.hieplpvip");
     kev.setEventCode(AsusFnKeysEventCode);
+    kev.setTrace(&trace);
     
     bool result = super::init(dict);
     properties = dict;
@@ -383,6 +509,15 @@ bool AsusFnKeys::init(OSDictionary *dict)
 void AsusFnKeys::free(void)
 {
     DEBUG_LOG("%s::Free\n", getName());
+    trace.free();
+    capture.free();
+    freeNotifyRing();
+    OSSafeReleaseNULL(_workLoop);
+    if (wdgBlocks)
+    {
+        IOFree(wdgBlocks, wdgCount * sizeof(struct guid_block));
+        wdgBlocks = NULL;
+    }
     super::free();
 }
 
@@ -427,16 +562,71 @@ bool AsusFnKeys::start(IOService *provider)
         return false;
     }
     
+    clock_get_uptime(&startTime);
+    
     WMIDevice = (IOACPIPlatformDevice *) provider;
     
     IOLog("%s::Found WMI Device %s\n", getName(), WMIDevice->getName());
     
+    for (int i = 0; i < kACPIArgPoolSize; i++)
+        acpiArg(i, 0);
+    
     _keyboardDevice = NULL;
     
     parse_wdg(properties);
     
+    prepareWMICall(&wmiDSTS, ASUS_WMI_MGMT_GUID_BIN, ASUS_WMI_METHODID_DSTS, kWMICallArgNumber);
+    prepareWMICall(&wmiDEVS, ASUS_WMI_MGMT_GUID_BIN, ASUS_WMI_METHODID_DEVS, kWMICallArgDevice);
+    
     parseConfig();
     
+    _workLoop = getWorkLoop();
+    if (!_workLoop){
+        DEBUG_LOG("%s::Failed to get workloop!\n", getName());
+        return false;
+    }
+    _workLoop->retain();
+    
+    command_gate = IOCommandGate::commandGate(this);
+    if (!command_gate) {
+        return false;
+    }
+    _workLoop->addEventSource(command_gate);
+    
+    for (int i = 0; i < kStateItemCount; i++)
+    {
+        stateWritesNum[i][false] = publishCounter(stateWriteNames[i][false]);
+        stateWritesNum[i][true] = publishCounter(stateWriteNames[i][true]);
+    }
+    nvramCoalescedNum = publishCounter("NVRAMWritesCoalesced");
+    nvramCommittedNum = publishCounter("NVRAMWritesCommitted");
+    for (int i = 0; i < kWEDStatCount; i++)
+        wedStatsNum[i] = publishCounter(wedStatNames[i]);
+    panelToggleTimeNum = publishCounter("PanelToggleTimeUS", 64);
+    if (hasKeybrdBLight)
+        keyboardBLightLevelNum = publishCounter("KeyboardBLightLevel", 8);
+    if (hasALSensor)
+        alsCoalescedNum = publishCounter("ALSNotifiesCoalesced");
+    
+    if (keyRepeatDelay && keyRepeatInterval)
+    {
+        _repeatTimer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &AsusFnKeys::repeatTimer));
+        if (!_repeatTimer)
+            return false;
+        _workLoop->addEventSource(_repeatTimer);
+        repeatsAbsorbedNum = publishCounter("FirmwareRepeatsAbsorbed");
+    }
+    
+    _nvramTimer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &AsusFnKeys::flushNVRAMGated));
+    if (_nvramTimer && _workLoop->addEventSource(_nvramTimer) != kIOReturnSuccess)
+        OSSafeReleaseNULL(_nvramTimer);
+    
+    if (!allocNotifyRing())
+    {
+        IOLog("%s::Failed to create notification ring\n", getName());
+        return false;
+    }
+    
     enableEvent();
     
     PMinit();
@@ -466,32 +656,35 @@ bool AsusFnKeys::start(IOService *provider)
     
     propertyMatch->release();
     
-    _workLoop = getWorkLoop();
-    if (!_workLoop){
-        DEBUG_LOG("%s::Failed to get workloop!\n", getName());
-        return false;
-    }
-    _workLoop->retain();
-    
-    command_gate = IOCommandGate::commandGate(this);
-    if (!command_gate) {
-        return false;
+    //
+    // Find the panel once instead of probing IORegistry paths on every backlight toggle
+    //
+    if (OSDictionary * displayMatch = serviceMatching("AppleBacklightDisplay"))
+    {
+        IOServiceMatchingNotificationHandler displayHandler = OSMemberFunctionCast(IOServiceMatchingNotificationHandler, this, &AsusFnKeys::displayNotificationHandler);
+        
+        _displayPublishNotify = addMatchingNotification(gIOFirstPublishNotification, displayMatch, displayHandler, this, (void *) true);
+        _displayTerminateNotify = addMatchingNotification(gIOTerminatedNotification, displayMatch, displayHandler, this, (void *) false);
+        displayMatch->release();
     }
-    _workLoop->addEventSource(command_gate);
     
     if (autoOffEnable && hasKeybrdBLight)
     {
-        resetTimer();
-        keytime += 1000000000; // small hack to avoid auto off on start
-        
         _autoOffTimer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &AsusFnKeys::autoOffTimer));
-        _workLoop->addEventSource(_autoOffTimer);
-        _autoOffTimer->setTimeoutMS(500);
-        
         if (!_autoOffTimer)
             return false;
+        _workLoop->addEventSource(_autoOffTimer);
+        autoOffWakeupsNum = publishCounter("AutoOffWakeups");
+        
+        resetTimer();
+        armAutoOffTimer();
     }
     
+    uint64_t now_abs, start_ns;
+    clock_get_uptime(&now_abs);
+    absolutetime_to_nanoseconds(now_abs - startTime, &start_ns);
+    setProperty("StartTimeUS", start_ns / 1000, 64);
+    
     return true;
 }
 
@@ -501,16 +694,66 @@ void AsusFnKeys::stop(IOService *provider)
     
     if (_autoOffTimer){
         _autoOffTimer->cancelTimeout();
+        _workLoop->removeEventSource(_autoOffTimer);
     }
     OSSafeReleaseNULL(_autoOffTimer);
+    OSSafeReleaseNULL(autoOffWakeupsNum);
+    
+    if (_repeatTimer)
+    {
+        _repeatTimer->cancelTimeout();
+        _workLoop->removeEventSource(_repeatTimer);
+    }
+    OSSafeReleaseNULL(_repeatTimer);
+    OSSafeReleaseNULL(repeatsAbsorbedNum);
+    
+    // message() can run until the driver is detached, only stop the drains here,
+    // the ring and its source are freed in free()
+    if (_notifySource)
+        _notifySource->disable();
+    
+    if (command_gate)
+        command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &AsusFnKeys::removeNVRAMNotifyGated));
+    
+    flushNVRAM();
+    if (_nvramTimer)
+    {
+        _nvramTimer->cancelTimeout();
+        _workLoop->removeEventSource(_nvramTimer);
+    }
+    OSSafeReleaseNULL(_nvramTimer);
+    
+    // Display handlers run through the gate, stop them before it goes away
+    if (_displayPublishNotify)
+        _displayPublishNotify->remove();
+    if (_displayTerminateNotify)
+        _displayTerminateNotify->remove();
+    _displayPublishNotify = _displayTerminateNotify = NULL;
+    releaseBacklightDisplay();
     
     _workLoop->removeEventSource(command_gate);
     OSSafeReleaseNULL(command_gate);
-    OSSafeReleaseNULL(_workLoop);
     
     disableEvent();
     PMstop();
     
+    releaseWMICall(&wmiDSTS);
+    releaseWMICall(&wmiDEVS);
+    releaseACPIArgs();
+    releaseACPIMethods();
+    for (int i = 0; i < kStateItemCount; i++)
+    {
+        OSSafeReleaseNULL(stateWritesNum[i][false]);
+        OSSafeReleaseNULL(stateWritesNum[i][true]);
+    }
+    OSSafeReleaseNULL(keyboardBLightLevelNum);
+    OSSafeReleaseNULL(panelToggleTimeNum);
+    OSSafeReleaseNULL(alsCoalescedNum);
+    OSSafeReleaseNULL(nvramCoalescedNum);
+    OSSafeReleaseNULL(nvramCommittedNum);
+    for (int i = 0; i < kWEDStatCount; i++)
+        OSSafeReleaseNULL(wedStatsNum[i]);
+    
     _publishNotify->remove();
     _terminateNotify->remove();
     OSSafeReleaseNULL(_publishNotify);
@@ -527,57 +770,256 @@ IOReturn AsusFnKeys::setPowerState(unsigned long powerStateOrdinal, IOService *w
     if (whatDevice != this)
         return IOPMAckImplied;
     
-    if (!powerStateOrdinal)
+    if (powerStateOrdinal)
     {
+        DEBUG_LOG("%s::Woke up from sleep\n", getName());
+        IOSleep(1000);
+        _keyboardDevice->keyPressed(0);
+    }
+    else
         DEBUG_LOG("%s::Going to sleep\n", getName());
+    
+    // Runs on the power management thread, the state below is the work loop's
+    if (command_gate)
+        command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &AsusFnKeys::setPowerStateGated), &powerStateOrdinal);
+    
+    return IOPMAckImplied;
+}
+
+void AsusFnKeys::setPowerStateGated(unsigned long *powerStateOrdinal)
+{
+    if (!*powerStateOrdinal)
+    {
+        flushNVRAMGated();
         if (_autoOffTimer){
             _autoOffTimer->cancelTimeout();
         }
-        OSSafeReleaseNULL(_autoOffTimer);
+        return;
+    }
+    
+    // Restore keyboard backlight, firmware state is unknown after sleep
+    resetTimer();
+    curKeybrdBlvl = 0xFF;
+    if(hasKeybrdBLight && keybrdBLightLvl >= 0)
+    {
+        setKeyboardBackLight(keybrdBLightLvl);
+        DEBUG_LOG("%s::Restore keyboard backlight %d\n", getName(), keybrdBLightLvl);
+    }
+    
+    armAutoOffTimer();
+}
+
+#pragma mark -
+#pragma mark AsusFnKeys Methods
+#pragma mark -
+
+/*
+ * Resolve every ACPI method the driver evaluates once, so the hot paths
+ * only test a bit and pass a prebuilt symbol to the ACPI family.
+ */
+void AsusFnKeys::probeACPIMethods()
+{
+    static const char * const names[kACPIMethodCount - 1] = {
+        "SKBL", "GKBL", "KBPW", "ALSC", "ALSS", "INIT", "_WED"
+    };
+    
+    acpiCaps = 0;
+    for (int i = 0; i < kACPIMethodCount; i++)
+    {
+        const char *name = (i == kACPIMethodWMxx) ? wmiDSTS.method : names[i];
+        if (!name[0])
+            continue;
+        
+        acpiMethods[i] = OSSymbol::withCString(name);
+        if (acpiMethods[i] && WMIDevice->validateObject(acpiMethods[i]) == kIOReturnSuccess)
+            acpiCaps |= ACPI_CAP(i);
+        else
+            DEBUG_LOG("%s::Method %s not found\n", getName(), name);
+    }
+    
+    setProperty("ACPICapabilities", acpiCaps, 32);
+}
+
+/*
+ * Instrumented evaluation of a probed method, see acpiCallDone().
+ * A symbol evaluates another method of the same kind, e.g. the WMxx of a
+ * prepared WMI call, accounted as method.
+ */
+IOReturn AsusFnKeys::acpiEvaluate(UInt8 method, OSObject **result, OSObject **params, IOItemCount count)
+{
+    uint64_t start;
+    clock_get_uptime(&start);
+    IOReturn ret = WMIDevice->evaluateObject(acpiMethods[method], result, params, count);
+    UInt32 us = acpiCallDone(method, start, ret);
+    if (capture.active())
+        captureACPIResult(method, ret, result ? *result : NULL, us);
+    return ret;
+}
+
+IOReturn AsusFnKeys::acpiEvaluateInteger(UInt8 method, UInt32 *result, OSObject **params, IOItemCount count, const OSSymbol *symbol)
+{
+    uint64_t start;
+    clock_get_uptime(&start);
+    IOReturn ret = WMIDevice->evaluateInteger(symbol ? symbol : acpiMethods[method], result, params, count);
+    UInt32 us = acpiCallDone(method, start, ret);
+    if (ret == kIOReturnSuccess)
+        capture.record(kCaptureACPI, kCaptureObjectNumber << 8 | method, ((UInt64) us << 32) | *result);
+    else
+        capture.record(kCaptureACPI, (ret & 0xFFFF) << 16 | kCaptureObjectNone << 8 | method, (UInt64) us << 32);
+    return ret;
+}
+
+/*
+ * Account one call and return its latency in us. Calls slower than
+ * acpiSlowCallMS are logged, at most one line every kACPISlowLogInterval seconds.
+ */
+UInt32 AsusFnKeys::acpiCallDone(UInt8 method, uint64_t start, IOReturn ret)
+{
+    uint64_t end, call_ns;
+    clock_get_uptime(&end);
+    absolutetime_to_nanoseconds(end - start, &call_ns);
+    UInt32 us = call_ns / 1000 > 0xFFFFFFFF ? 0xFFFFFFFF : (UInt32)(call_ns / 1000);
+    
+    ACPIMethodStats *stats = &acpiStats[method];
+    stats->samples[stats->calls % kACPIStatSamples] = us;
+    if (!stats->calls || us < stats->minUS)
+        stats->minUS = us;
+    if (us > stats->maxUS)
+        stats->maxUS = us;
+    stats->totalUS += us;
+    stats->calls++;
+    if (ret != kIOReturnSuccess)
+        stats->errors++;
+    trace.record(kTraceACPICall, method, ((UInt64) us << 32) | (UInt32) ret);
+    
+    if (!acpiSlowCallMS || us < acpiSlowCallMS * 1000)
+        return us;
+    
+    acpiSlowCalls++;
+    uint64_t since_ns;
+    absolutetime_to_nanoseconds(end - acpiSlowLogTime, &since_ns);
+    if (acpiSlowLogTime && since_ns < kACPISlowLogInterval * 1000000000ULL)
+        return us;
+    
+    IOLog("%s::%s took %u us, %u slow ACPI calls since the last report\n", getName(),
+          acpiMethods[method]->getCStringNoCopy(), (unsigned int)us, (unsigned int)(acpiSlowCalls - acpiSlowCallsLogged));
+    acpiSlowCallsLogged = acpiSlowCalls;
+    acpiSlowLogTime = end;
+    return us;
+}
+
+/*
+ * Record what an object returning method gave back and how long it took,
+ * enough for a replay to rebuild the object decodeWED() and the other
+ * callers look at
+ */
+void AsusFnKeys::captureACPIResult(UInt8 method, IOReturn ret, OSObject *result, UInt32 us)
+{
+    UInt32 kind = kCaptureObjectNone, length = 0, value = 0;
+    
+    if (ret != kIOReturnSuccess)
+        length = ret & 0xFFFF;
+    else if (NULL == result)
+        ;
+    else if (OSNumber * number = OSDynamicCast(OSNumber, result))
+    {
+        kind = kCaptureObjectNumber;
+        value = number->unsigned32BitValue();
+    }
+    else if (OSArray * array = OSDynamicCast(OSArray, result))
+    {
+        length = array->getCount();
+        if (OSNumber * number = OSDynamicCast(OSNumber, array->getObject(0)))
+        {
+            kind = kCaptureObjectPackage;
+            value = number->unsigned32BitValue();
+        }
+        else
+            kind = kCaptureObjectOther;
+    }
+    else if (OSData * data = OSDynamicCast(OSData, result))
+    {
+        kind = kCaptureObjectBuffer;
+        length = data->getLength();
+        if (length)
+            memcpy(&value, data->getBytesNoCopy(), length < sizeof(value) ? length : sizeof(value));
     }
     else
+        kind = kCaptureObjectOther;
+    
+    if (length > 0xFFFF)
+        length = 0xFFFF;
+    capture.record(kCaptureACPI, length << 16 | kind << 8 | method, ((UInt64) us << 32) | value);
+}
+
+void AsusFnKeys::publishACPIStats(OSDictionary *dict) const
+{
+    for (int i = 0; i < kACPIMethodCount; i++)
     {
-        DEBUG_LOG("%s::Woke up from sleep\n", getName());
-        IOSleep(1000);
-        _keyboardDevice->keyPressed(0);
+        const ACPIMethodStats *stats = &acpiStats[i];
+        if (!acpiMethods[i] || !stats->calls)
+            continue;
         
-        // Restore keyboard backlight
-        if(hasKeybrdBLight && keybrdBLightLvl >= 0)
+        // p99 over the latest samples, insertion sort of at most kACPIStatSamples
+        UInt32 sorted[kACPIStatSamples];
+        UInt32 n = stats->calls < kACPIStatSamples ? stats->calls : kACPIStatSamples;
+        for (UInt32 j = 0; j < n; j++)
         {
-            setKeyboardBackLight(keybrdBLightLvl);
-            DEBUG_LOG("%s::Restore keyboard backlight %d\n", getName(), keybrdBLightLvl);
+            UInt32 k = j, v = stats->samples[j];
+            for (; k > 0 && sorted[k - 1] > v; k--)
+                sorted[k] = sorted[k - 1];
+            sorted[k] = v;
         }
         
-        if (autoOffEnable && hasKeybrdBLight)
+        OSDictionary *method = OSDictionary::withCapacity(6);
+        if (!method)
+            continue;
+        
+        const struct { const char *key; UInt64 value; } values[] = {
+            { "Calls",  stats->calls },
+            { "Errors", stats->errors },
+            { "MinUS",  stats->minUS },
+            { "MeanUS", stats->totalUS / stats->calls },
+            { "MaxUS",  stats->maxUS },
+            { "P99US",  sorted[(n * 99 + 99) / 100 - 1] },
+        };
+        for (unsigned int j = 0; j < sizeof(values) / sizeof(values[0]); j++)
         {
-            resetTimer();
-            
-            if (_autoOffTimer){
-                _autoOffTimer->cancelTimeout();
+            if (OSNumber *number = OSNumber::withNumber(values[j].value, 64))
+            {
+                method->setObject(values[j].key, number);
+                number->release();
             }
-            OSSafeReleaseNULL(_autoOffTimer);
-            
-            _autoOffTimer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &AsusFnKeys::autoOffTimer));
-            _workLoop->addEventSource(_autoOffTimer);
-            _autoOffTimer->setTimeoutMS(500);
         }
+        dict->setObject(acpiMethods[i]->getCStringNoCopy(), method);
+        method->release();
     }
-    
-    return IOPMAckImplied;
 }
 
-#pragma mark -
-#pragma mark AsusFnKeys Methods
-#pragma mark -
+void AsusFnKeys::resetACPIStats()
+{
+    memset(acpiStats, 0, sizeof(acpiStats));
+    acpiSlowCalls = acpiSlowCallsLogged = 0;
+    acpiSlowLogTime = 0;
+}
+
+void AsusFnKeys::releaseACPIMethods()
+{
+    acpiCaps = 0;
+    for (int i = 0; i < kACPIMethodCount; i++)
+        OSSafeReleaseNULL(acpiMethods[i]);
+}
 
 void AsusFnKeys::parseConfig()
 {
+    probeACPIMethods();
+    
     // Detect keyboard backlight support
-    if (WMIDevice->validateObject("SKBL") == kIOReturnSuccess && WMIDevice->validateObject("GKBL") == kIOReturnSuccess)
+    if ((acpiCaps & ACPI_CAP(kACPIMethodSKBL)) && (acpiCaps & ACPI_CAP(kACPIMethodGKBL)))
     {
         hasKeybrdBLight = true;
         // Detect keyboard backlight levels
-        if (WMIDevice->validateObject("KBPW") == kIOReturnSuccess)
+        if (acpiCaps & ACPI_CAP(kACPIMethodKBPW))
             keybrdBLight16 = true;
         else
             keybrdBLight16 = false;
@@ -590,7 +1032,7 @@ void AsusFnKeys::parseConfig()
     }
     
     // Detect ALS sensor
-    if (WMIDevice->validateObject("ALSC") == kIOReturnSuccess && WMIDevice->validateObject("ALSS") == kIOReturnSuccess)
+    if ((acpiCaps & ACPI_CAP(kACPIMethodALSC)) && (acpiCaps & ACPI_CAP(kACPIMethodALSS)))
     {
         hasALSensor = true;
         IOLog("%s::Found ALS sensor\n", getName());
@@ -607,6 +1049,7 @@ void AsusFnKeys::parseConfig()
     if (Configuration){
         OSNumber *tmpNumber = 0;
         OSBoolean *tmpBoolean = FALSE;
+        OSDictionary *tmpDict = 0;
         
         OSIterator *iter = 0;
         const OSSymbol *dictKey = 0;
@@ -616,6 +1059,7 @@ void AsusFnKeys::parseConfig()
             while ((dictKey = (const OSSymbol *)iter->getNextObject())) {
                 tmpNumber = OSDynamicCast(OSNumber, Configuration->getObject(dictKey));
                 tmpBoolean = OSDynamicCast(OSBoolean, Configuration->getObject(dictKey));
+                tmpDict = OSDynamicCast(OSDictionary, Configuration->getObject(dictKey));
                 
                 const char *tmpStr = dictKey->getCStringNoCopy();
                 
@@ -625,256 +1069,873 @@ void AsusFnKeys::parseConfig()
                     
                     else if(!strncmp(tmpStr, "IdleKBacklightAutoOffTimeout", strlen(tmpStr)))
                         autoOffTimeout = tmpNumber->unsigned64BitValue() * 1000000;
+                    
+                    else if(!strncmp(tmpStr, "NotifyRingSize", strlen(tmpStr)))
+                        notifyRingSize = tmpNumber->unsigned32BitValue();
+                    
+                    else if(!strncmp(tmpStr, "NVRAMFlushDelay", strlen(tmpStr)))
+                        nvramFlushDelay = tmpNumber->unsigned32BitValue();
+                    
+                    else if(!strncmp(tmpStr, "ACPISlowCallThreshold", strlen(tmpStr)))
+                        acpiSlowCallMS = tmpNumber->unsigned32BitValue();
+                    
+                    else if(!strncmp(tmpStr, "WEDCacheTime", strlen(tmpStr)))
+                        wedCacheTime = tmpNumber->unsigned32BitValue();
+                    
+                    else if(!strncmp(tmpStr, "KeyRepeatDelay", strlen(tmpStr)))
+                        keyRepeatDelay = tmpNumber->unsigned32BitValue();
+                    
+                    else if(!strncmp(tmpStr, "KeyRepeatInterval", strlen(tmpStr)))
+                        keyRepeatInterval = tmpNumber->unsigned32BitValue();
+                    
+                    else if(!strncmp(tmpStr, "KeyReleaseTimeout", strlen(tmpStr)))
+                        keyReleaseTimeout = tmpNumber->unsigned32BitValue();
                 }
                 
                 if (tmpBoolean)
                 {
-                    if(!strncmp(tmpStr, "HasMediaButtons", strlen(tmpStr)))
+                    if(!strncmp(tmpStr, "CaptureEnabled", strlen(tmpStr)))
+                        capture.enable(tmpBoolean->getValue());
+                    
+                    else if(!strncmp(tmpStr, "HasMediaButtons", strlen(tmpStr)))
                         hasMediaButtons = tmpBoolean->getValue();
                     
                     else if(!strncmp(tmpStr, "IdleKBacklightAutoOff", strlen(tmpStr)))
                         autoOffEnable = tmpBoolean->getValue();
+                    
+                    else if(!strncmp(tmpStr, "NVRAMReadsBroken", strlen(tmpStr)))
+                        nvramReadsBroken = tmpBoolean->getValue();
+                    
+                    else if(!strncmp(tmpStr, "TraceEnabled", strlen(tmpStr)))
+                        trace.enable(tmpBoolean->getValue());
+                }
+                
+                if (tmpDict)
+                {
+                    if(!strncmp(tmpStr, "KeyActions", strlen(tmpStr)))
+                        overrideKeyActions(tmpDict);
                 }
             }
+            iter->release();
         }
     }
+    
+    // A release timeout at or above the repeat interval keeps repeating after the key is up
+    if (keyRepeatInterval && keyReleaseTimeout >= keyRepeatInterval)
+        keyReleaseTimeout = keyRepeatInterval - 1;
+    
+    // Ring indices wrap, so keep the size a power of two
+    if (notifyRingSize < kNotifyRingMinSize)
+        notifyRingSize = kNotifyRingMinSize;
+    if (notifyRingSize > kNotifyRingMaxSize)
+        notifyRingSize = kNotifyRingMaxSize;
+    while (notifyRingSize & (notifyRingSize - 1))
+        notifyRingSize += notifyRingSize & -notifyRingSize;
 }
 
-IOReturn AsusFnKeys::message(UInt32 type, IOService * provider, void * argument)
+/*
+ * Close the current pipeline stage, the next one is measured from here
+ */
+void AsusFnKeys::latencyMark(UInt8 stage)
 {
-    if (type == kKeyboardKeyPressTime || type == kKeyboardModifierKeyPressTime)
-    {
-        DEBUG_LOG("%s::keyPressed = %llu\n", getName(), keytime);
-        keytime = *((uint64_t*)argument);
-        if (isautoOff && keybrdBLightLvl)
-        {
-            setKeyboardBackLight(keybrdBLightLvl);
-            isautoOff = false;
-        }
-    }
-    else if (type == kIOACPIMessageDeviceNotification)
+    uint64_t now;
+    clock_get_uptime(&now);
+    if (now > latencyStamp)
+        latencyRecord(&latency[stage], now - latencyStamp);
+    latencyStamp = now;
+}
+
+/*
+ * Histograms are refreshed when the registry is read, not on the hot path
+ */
+bool AsusFnKeys::serializeProperties(OSSerialize * s) const
+{
+    if (OSDictionary *dict = OSDictionary::withCapacity(kLatencyStageCount))
     {
-        UInt32 event = *((UInt32 *) argument);
-        OSObject * wed;
-        
-        OSNumber * number = OSNumber::withNumber(event,32);
-        WMIDevice->evaluateObject("_WED", &wed, (OSObject**)&number,1);
-        number->release();
-        number = OSDynamicCast(OSNumber, wed);
-        if (NULL == number)
-        {
-            // try a package
-            OSArray * array = OSDynamicCast(OSArray, wed);
-            if (NULL == array)
-            {
-                // try a buffer
-                OSData * data = OSDynamicCast(OSData, wed);
-                if ( (NULL == data) || (data->getLength() == 0))
-                {
-                    DEBUG_LOG("%s::Fail to cast _WED returned objet %s\n", getName(), wed->getMetaClass()->getClassName());
-                    return kIOReturnError;
-                }
-                const char * bytes = (const char *) data->getBytesNoCopy();
-                number = OSNumber::withNumber(bytes[0],32);
-            }
-            else
-            {
-                number = OSDynamicCast(OSNumber, array->getObject(0));
-                if (NULL == number)
-                {
-                    DEBUG_LOG("%s::Fail to cast _WED returned 1st objet in array %s\n", getName(), array->getObject(0)->getMetaClass()->getClassName());
-                    return kIOReturnError;
-                }
-            }
-        }
-        
-        handleMessage(number->unsigned32BitValue());
+        for (int i = 0; i < kLatencyStageCount; i++)
+            latencyPublish(dict, latencyStageNames[i], &latency[i]);
+        const_cast<AsusFnKeys *>(this)->setProperty("LatencyHistograms", dict);
+        dict->release();
     }
-    else
+    if (OSDictionary *dict = OSDictionary::withCapacity(kACPIMethodCount))
     {
-        DEBUG_LOG("%s::Unexpected message: %u Type %x Provider %s \n", getName(), *((UInt32 *) argument), uint(type), provider->getName());
+        publishACPIStats(dict);
+        const_cast<AsusFnKeys *>(this)->setProperty("ACPIMethodStats", dict);
+        dict->release();
     }
-    
-    return kIOReturnSuccess;
+    trace.publish(const_cast<AsusFnKeys *>(this));
+    if (UInt32 dropped = capture.dropped())
+        const_cast<AsusFnKeys *>(this)->setProperty("CaptureDropped", dropped, 32);
+    return super::serializeProperties(s);
 }
 
-void AsusFnKeys::autoOffTimer()
+/*
+ * Writing ResetLatency clears the histograms and the ACPI method statistics,
+ * TraceEnabled switches the trace ring and CaptureEnabled starts or stops a
+ * capture, which is read through AsusFnKeysUserClient. All three need an
+ * administrator.
+ */
+IOReturn AsusFnKeys::setProperties(OSObject * properties)
 {
-    uint64_t now_abs;
-    clock_get_uptime(&now_abs);
-    uint64_t now_ns;
-    absolutetime_to_nanoseconds(now_abs, &now_ns);
+    static const char * const instrumentationKeys[] = { "TraceEnabled", "ResetLatency", "CaptureEnabled", NULL };
+    
+    OSDictionary *dict = OSDynamicCast(OSDictionary, properties);
+    if (instrumentationDenied(dict, instrumentationKeys))
+        return kIOReturnNotPrivileged;
+    
+    bool handled = trace.setProperties(dict);
+    handled |= capture.setProperties(dict, "CaptureEnabled");
     
-    DEBUG_LOG("%s::autoOffTimer %llu\n", getName(), now_ns - keytime);
-    if (now_ns - keytime > autoOffTimeout && !isautoOff)
+    if (dict && dict->getObject("ResetLatency"))
     {
-        keybrdBLightLvl = getKeyboardBackLight();
-        if (keybrdBLightLvl>0) setKeyboardBackLight(0, false);
-        isautoOff = true;
+        for (int i = 0; i < kLatencyStageCount; i++)
+            latencyReset(&latency[i]);
+        if (command_gate)
+            command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &AsusFnKeys::resetACPIStats));
+        handled = true;
     }
+    return handled ? kIOReturnSuccess : super::setProperties(properties);
+}
+
+/*
+ * The work loop is the only consumer of the capture ring
+ */
+UInt32 AsusFnKeys::drainCapture(FnKeysTraceRecord *out, UInt32 max)
+{
+    UInt32 count = 0;
     
-    _autoOffTimer->setTimeoutMS(500);
+    if (command_gate)
+        command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &AsusFnKeys::drainCaptureGated), out, &max, &count);
+    
+    return count;
 }
 
-void AsusFnKeys::resetTimer()
+void AsusFnKeys::drainCaptureGated(FnKeysTraceRecord *out, UInt32 *max, UInt32 *count)
 {
-    uint64_t now_abs;
-    clock_get_uptime(&now_abs);
-    absolutetime_to_nanoseconds(now_abs, &keytime);
-    isautoOff = false;
+    *count = capture.drain(out, *max);
 }
 
-void AsusFnKeys::handleMessage(int code)
+IOReturn AsusFnKeys::message(UInt32 type, IOService * provider, void * argument)
 {
-    loopCount = 0;
-    bool show = false;
-    
-    resetTimer();
-    
-    // Processing the code
-    switch (code) {
-        case 0x57: // AC disconnected
-        case 0x58: // AC connected
-            // ignore silently
-            break;
-            
-        // Backlight
-        case 0x33:// hardwired On
-        case 0x34:// hardwired Off
-        case 0x35:// Soft Event, Fn + F7
-            if(isPanelBackLightOn)
-            {
-                code = NOTIFY_BRIGHTNESS_DOWN_MIN;
-                loopCount = 16;
-                
-                // Read Panel brigthness value to restore later with backlight toggle
-                readPanelBrightnessValue();
-            }
-            else
-            {
-                code = NOTIFY_BRIGHTNESS_UP_MIN;
-                loopCount = panelBrightnessLevel;
-            }
-            
-            isPanelBackLightOn = !isPanelBackLightOn;
-            break;
-            
-        case 0x6B: // Fn + F9, Touchpad On/Off
-            touchpadEnabled = !touchpadEnabled;
-            if(touchpadEnabled)
-            {
-                setProperty("TouchpadEnabled", true);
-                removeProperty("TouchpadDisabled");
-                DEBUG_LOG("%s::Touchpad Enabled\n", getName());
-            }
-            else
-            {
-                removeProperty("TouchpadEnabled");
-                setProperty("TouchpadDisabled", true);
-                DEBUG_LOG("%s::Touchpad Disabled\n", getName());
-            }
-            
-            // send to 3rd party drivers
-            dispatchMessage(kKeyboardSetTouchStatus, &touchpadEnabled);
-            break;
-            
-        case 0x5C: // Fn + Space bar, Processor Speedstepping changes
-            
-            /*params[0] = OSNumber::withNumber(4, 8);
-             
-             if(WMIDevice->evaluateInteger("PSTT", &res, params, 1))
-             IOLog("%s::Processor speedstep Changed\n", getName());
-             else
-             IOLog("%s::Processor speedstep change failed %d\n", getName(), res);*/
-            
-            break;
-            
-        case 0x5E:
-            kev.sendMessage(kevSleep, 0, 0);
-            break;
-            
-        case 0x7A: // Fn + A, ALS Sensor
-            if(hasALSensor)
-            {
-                isALSenabled = !isALSenabled;
-                enableALS(isALSenabled);
-            }
-            break;
+    if (type == kKeyboardKeyPressTime || type == kKeyboardModifierKeyPressTime)
+    {
+        // Runs on the keyboard driver's thread for every keystroke: publish the
+        // timestamp and, if the light is auto-off, ask the work loop to restore it
+        capture.record(kCaptureKeyTime, type, *((uint64_t*)argument));
+        __atomic_store_n(&keytime, *((uint64_t*)argument), __ATOMIC_RELEASE);
+        if (__atomic_load_n(&isautoOff, __ATOMIC_RELAXED) &&
+            !__atomic_exchange_n(&wakeRequest, true, __ATOMIC_ACQ_REL) && _notifySource)
+            _notifySource->interruptOccurred(0, 0, 0);
+    }
+    else if (type == kIOACPIMessageDeviceNotification)
+    {
+        // Only record the event here, _WED and the rest run on the work loop
+        trace.record(kTraceNotify, *((UInt32 *) argument));
+        capture.record(kCaptureNotify, *((UInt32 *) argument));
+        if (queueNotification(*((UInt32 *) argument)) && _notifySource)
+            _notifySource->interruptOccurred(0, 0, 0);
+    }
+    else
+    {
+        DEBUG_LOG("%s::Unexpected message: %u Type %x Provider %s \n", getName(), *((UInt32 *) argument), uint(type), provider->getName());
+    }
+    
+    return kIOReturnSuccess;
+}
+
+bool AsusFnKeys::allocNotifyRing()
+{
+    notifyRing = (NotifyEvent *) IOMalloc(notifyRingSize * sizeof(NotifyEvent));
+    if (NULL == notifyRing)
+        return false;
+    
+    notifyHead = notifyTail = 0;
+    notifyDrops = notifyDropsPublished = 0;
+    
+    _notifySource = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventSource::Action, this, &AsusFnKeys::drainNotifications));
+    if (!_notifySource || _workLoop->addEventSource(_notifySource) != kIOReturnSuccess)
+        return false;
+    
+    setProperty("NotifyRingSize", notifyRingSize, 32);
+    return true;
+}
+
+void AsusFnKeys::freeNotifyRing()
+{
+    if (_notifySource)
+    {
+        _notifySource->disable();
+        if (_workLoop)
+            _workLoop->removeEventSource(_notifySource);
+    }
+    OSSafeReleaseNULL(_notifySource);
+    
+    if (notifyRing)
+    {
+        IOFree(notifyRing, notifyRingSize * sizeof(NotifyEvent));
+        notifyRing = NULL;
+    }
+}
+
+/*
+ * Producer side, called from the ACPI notification context
+ */
+bool AsusFnKeys::queueNotification(UInt32 event)
+{
+    if (NULL == notifyRing)
+        return false;
+    
+    UInt32 head = notifyHead;
+    if (head - __atomic_load_n(&notifyTail, __ATOMIC_ACQUIRE) >= notifyRingSize)
+    {
+        __atomic_add_fetch(&notifyDrops, 1, __ATOMIC_RELAXED);
+        return true;    // let the consumer publish the drop
+    }
+    
+    NotifyEvent *slot = &notifyRing[head & (notifyRingSize - 1)];
+    slot->event = event;
+    clock_get_uptime(&slot->time);
+    __atomic_store_n(&notifyHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/*
+ * Consumer side, runs on the work loop and handles everything queued so far
+ */
+void AsusFnKeys::drainNotifications(IOInterruptEventSource *sender, int count)
+{
+    // Key pressed while the backlight was auto-off, see message()
+    if (__atomic_exchange_n(&wakeRequest, false, __ATOMIC_ACQ_REL) && isautoOff && keybrdBLightLvl)
+    {
+        setKeyboardBackLight(keybrdBLightLvl);
+        __atomic_store_n(&isautoOff, false, __ATOMIC_RELAXED);
+        armAutoOffTimer();
+    }
+    
+    UInt32 tail = notifyTail;
+    UInt32 head = __atomic_load_n(&notifyHead, __ATOMIC_ACQUIRE);
+    bool handled = false;
+    
+    while (tail != head)
+    {
+        for (; tail != head; tail++)
+        {
+            NotifyEvent *slot = &notifyRing[tail & (notifyRingSize - 1)];
+            UInt32 code;
             
-        case 0x7D: // Airplane mode
-            kev.sendMessage(kevAirplaneMode, 0, 0);
-            break;
+            latencyStamp = slot->time;
+            latencyMark(kLatencyQueue);
             
-        case 0xC6:
-        case 0xC7: // ALS Notifcations
-            if(hasALSensor)
+            if (decodeWED(slot->event, slot->time, &code))
             {
-                UInt32 alsValue = 0;
-                WMIDevice->evaluateInteger("ALSS", &alsValue, NULL, NULL);
-                DEBUG_LOG("%s::ALS %d\n", getName(), alsValue);
+                latencyMark(kLatencyWED);
+                if (!absorbRepeat(code, slot->time))
+                {
+                    handleMessage(code);
+                    handled = true;
+                }
             }
-            break;
-            
-        case 0xC5: // Fn + F3, Decrease Keyboard Backlight
-            if(hasKeybrdBLight)
+        }
+        __atomic_store_n(&notifyTail, tail, __ATOMIC_RELEASE);
+        
+        // Once per pass over what was queued, so a storm that keeps the
+        // ring busy still gets the sensor read and the keys out
+        if (alsNotifies)
+            readALS();
+        
+        // Everything handled above reaches the keyboard in one message
+        if (handled)
+            latencyMark(kLatencyKeyPressed);
+        _keyboardDevice->flushKeys();
+        handled = false;
+        
+        head = __atomic_load_n(&notifyHead, __ATOMIC_ACQUIRE);
+    }
+    
+    UInt32 drops = __atomic_load_n(&notifyDrops, __ATOMIC_RELAXED);
+    if (drops != notifyDropsPublished)
+    {
+        IOLog("%s::Notification ring full, %u events dropped\n", getName(), (unsigned int)(drops - notifyDropsPublished));
+        notifyDropsPublished = drops;
+        setProperty("NotifyDrops", drops, 32);
+    }
+}
+
+/*
+ * Keys worth repeating while held, brightness codes carry the level so the
+ * whole up/down range counts as one key
+ */
+UInt32 AsusFnKeys::repeatKeyClass(UInt32 code)
+{
+    if (code >= NOTIFY_BRIGHTNESS_UP_MIN && code <= NOTIFY_BRIGHTNESS_UP_MAX)
+        return NOTIFY_BRIGHTNESS_UP_MIN;
+    if (code >= NOTIFY_BRIGHTNESS_DOWN_MIN && code <= NOTIFY_BRIGHTNESS_DOWN_MAX)
+        return NOTIFY_BRIGHTNESS_DOWN_MIN;
+    
+    switch (code) {
+        case 0x30: // Volume up
+        case 0x31: // Volume down
+        case 0xC4: // Keyboard backlight up
+        case 0xC5: // Keyboard backlight down
+            return code;
+    }
+    return 0;
+}
+
+/*
+ * The firmware has no key up event, it keeps sending the key while it is held.
+ * An event of the held key that follows the previous one within the release
+ * window is a firmware repeat: it only proves the key is still down and is
+ * absorbed here, the repeat timer generates repeats at keyRepeatInterval
+ * instead. Any other event is a key down and is handled normally, so two
+ * quick taps still make two steps.
+ */
+bool AsusFnKeys::absorbRepeat(UInt32 code, uint64_t time)
+{
+    if (!_repeatTimer)
+        return false;
+    
+    UInt32 keyClass = repeatKeyClass(code);
+    
+    if (keyClass && keyClass == heldKey && time >= heldLastSeen)
+    {
+        uint64_t gap_ns;
+        absolutetime_to_nanoseconds(time - heldLastSeen, &gap_ns);
+        
+        if (gap_ns <= heldReleaseNS())
+        {
+            // Smoothed so one late firmware event does not end the hold
+            heldPeriodNS = heldPeriodNS ? (3 * heldPeriodNS + gap_ns) / 4 : gap_ns;
+            heldCode = code;
+            heldLastSeen = time;
+            heldRepeats++;
+            repeatsAbsorbed++;
+            if (repeatsAbsorbedNum)
+                repeatsAbsorbedNum->setValue(repeatsAbsorbed);
+            return true;
+        }
+    }
+    
+    // Key down, any other key releases the held one
+    heldKey = keyClass;
+    heldCode = code;
+    heldLastSeen = time;
+    heldRepeats = 0;
+    heldPeriodNS = 0;
+    
+    if (keyClass)
+        _repeatTimer->setTimeoutMS(keyRepeatDelay);
+    else
+        _repeatTimer->cancelTimeout();
+    
+    return false;
+}
+
+/*
+ * How long the held key may stay silent before it counts as released: a bit
+ * more than the measured firmware repeat period, at most keyReleaseTimeout.
+ * Kept below keyRepeatInterval, so a release costs at most one extra repeat.
+ */
+uint64_t AsusFnKeys::heldReleaseNS() const
+{
+    uint64_t timeout_ns = MS_TO_NS((uint64_t) keyReleaseTimeout);
+    uint64_t period_ns = heldPeriodNS + heldPeriodNS / 2;
+    
+    return heldPeriodNS && period_ns < timeout_ns ? period_ns : timeout_ns;
+}
+
+void AsusFnKeys::repeatTimer()
+{
+    if (!heldKey)
+        return;
+    
+    uint64_t now_abs, idle_ns;
+    clock_get_uptime(&now_abs);
+    absolutetime_to_nanoseconds(now_abs - heldLastSeen, &idle_ns);
+    
+    if (idle_ns > heldReleaseNS())
+    {
+        DEBUG_LOG("%s::Key %x released after %u firmware repeats\n", getName(), heldKey, heldRepeats);
+        heldKey = 0;
+        return;
+    }
+    
+    // Repeat only once the firmware has confirmed the key is held
+    if (heldRepeats)
+    {
+        latencyStamp = now_abs;
+        trace.record(kTraceKeyRepeat, heldCode, heldRepeats);
+        handleMessage(heldCode);
+        latencyMark(kLatencyKeyPressed);
+        _keyboardDevice->flushKeys();
+    }
+    
+    _repeatTimer->setTimeoutMS(keyRepeatInterval);
+}
+
+void AsusFnKeys::countWED(UInt8 counter)
+{
+    wedStats[counter]++;
+    if (wedStatsNum[counter])
+        wedStatsNum[counter]->setValue(wedStats[counter]);
+}
+
+/*
+ * Evaluate _WED for a notify value and decode the event code it returns.
+ * The return shape learnt from the first event is tried alone, the other
+ * shapes are only probed when the firmware returns something else.
+ */
+bool AsusFnKeys::decodeWED(UInt32 event, UInt64 time, UInt32 *code)
+{
+    WEDCacheEntry *entry = event < kWEDCacheSize ? &wedCache[event] : NULL;
+    
+    if (entry && wedCacheTime && !entry->variable && entry->seen >= kWEDCacheConfirm)
+    {
+        uint64_t age_ns;
+        absolutetime_to_nanoseconds(time - entry->time, &age_ns);
+        if (time >= entry->time && age_ns < (uint64_t) wedCacheTime * 1000000)
+        {
+            *code = entry->code;
+            countWED(kWEDStatCacheHits);
+            capture.record(kCaptureWED, event, *code);
+            return true;
+        }
+    }
+    
+    ACPIResult wed;
+    
+    if (!(acpiCaps & ACPI_CAP(kACPIMethodWED)) ||
+        acpiEvaluate(kACPIMethodWED, wed.out(), acpiArg(kACPIArgWED, event), 1) != kIOReturnSuccess)
+    {
+        DEBUG_LOG("%s::Failed to evaluate _WED\n", getName());
+        countWED(kWEDShapeUnknown);
+        capture.record(kCaptureWED, event, 0xFFFFFFFF);
+        return false;
+    }
+    
+    if (wedShape == kWEDShapeUnknown || !decodeWEDShape(wed.get(), wedShape, code))
+    {
+        UInt8 shape;
+        for (shape = kWEDShapeNumber; shape < kWEDShapeCount; shape++)
+            if (shape != wedShape && decodeWEDShape(wed.get(), shape, code))
+                break;
+        
+        if (shape == kWEDShapeCount)
+        {
+            DEBUG_LOG("%s::Fail to cast _WED returned objet %s\n", getName(), wed.get() ? wed.get()->getMetaClass()->getClassName() : "NULL");
+            countWED(kWEDShapeUnknown);
+            capture.record(kCaptureWED, event, 0xFFFFFFFF);
+            return false;
+        }
+        
+        if (wedShape != kWEDShapeUnknown)
+            countWED(kWEDStatShapeChanges);
+        wedShape = shape;
+        setProperty("WEDShape", wedStatNames[shape] + strlen("WEDDecoded"));
+    }
+    countWED(wedShape);
+    trace.record(kTraceWED, event, *code);
+    capture.record(kCaptureWED, event, *code);
+    
+    if (entry)
+    {
+        if (entry->seen && entry->code != *code)
+            entry->variable = true;
+        entry->code = *code;
+        entry->time = time;
+        if (entry->seen < 0xFF)
+            entry->seen++;
+    }
+    
+    return true;
+}
+
+bool AsusFnKeys::decodeWEDShape(OSObject *wed, UInt8 shape, UInt32 *code)
+{
+    switch (shape) {
+        case kWEDShapeNumber:
+            if (OSNumber * number = OSDynamicCast(OSNumber, wed))
             {
-                if(keybrdBLightLvl>0)
-                    keybrdBLightLvl--;
-                else
-                    keybrdBLightLvl = 0;
-                show = true;
+                *code = number->unsigned32BitValue();
+                return true;
             }
             break;
             
-        case 0xC4: // Fn + F4, Increase Keyboard Backlight
-            if(hasKeybrdBLight)
+        case kWEDShapePackage:
+            if (OSArray * array = OSDynamicCast(OSArray, wed))
             {
-                if(keybrdBLight16)
+                if (OSNumber * number = OSDynamicCast(OSNumber, array->getObject(0)))
                 {
-                    if(keybrdBLightLvl < 16)
-                        keybrdBLightLvl++;
-                    else
-                        keybrdBLightLvl = 16;
+                    *code = number->unsigned32BitValue();
+                    return true;
                 }
-                else
-                {
-                    if(keybrdBLightLvl < 3)
-                        keybrdBLightLvl++;
-                    else
-                        keybrdBLightLvl = 3;
-                }
-                show = true;
             }
             break;
             
-        default:
-            // Fn + F5, Panel Brightness Down
-            if(code >= NOTIFY_BRIGHTNESS_DOWN_MIN && code<= NOTIFY_BRIGHTNESS_DOWN_MAX)
-            {
-                code = NOTIFY_BRIGHTNESS_DOWN_MIN;
-                
-                if(panelBrightnessLevel > 0)
-                    panelBrightnessLevel--;
-            }
-            // Fn + F6, Panel Brightness Up
-            else if(code >= NOTIFY_BRIGHTNESS_UP_MIN && code<= NOTIFY_BRIGHTNESS_UP_MAX)
+        case kWEDShapeBuffer:
+            if (OSData * data = OSDynamicCast(OSData, wed))
             {
-                code = NOTIFY_BRIGHTNESS_UP_MIN;
-                
-                panelBrightnessLevel++;
-                if(panelBrightnessLevel>16)
-                    panelBrightnessLevel = 16;
+                if (data->getLength() != 0)
+                {
+                    *code = ((const UInt8 *) data->getBytesNoCopy())[0];
+                    return true;
+                }
             }
             break;
     }
+    return false;
+}
+
+/*
+ * One-shot timer armed for keytime + autoOffTimeout. Keys pressed meanwhile
+ * only move keytime, the timer then re-arms itself for the remaining time.
+ */
+void AsusFnKeys::autoOffTimer()
+{
+    uint64_t now_abs;
+    clock_get_uptime(&now_abs);
+    uint64_t now_ns;
+    absolutetime_to_nanoseconds(now_abs, &now_ns);
+    
+    autoOffWakeups++;
+    if (autoOffWakeupsNum)
+        autoOffWakeupsNum->setValue(autoOffWakeups);
+    
+    uint64_t lastKey = __atomic_load_n(&keytime, __ATOMIC_ACQUIRE);
+    DEBUG_LOG("%s::autoOffTimer %llu\n", getName(), now_ns - lastKey);
+    if (now_ns > lastKey && now_ns - lastKey >= autoOffTimeout && !isautoOff)
+    {
+        if (keybrdBLightLvl>0) setKeyboardBackLight(0, false);
+        __atomic_store_n(&isautoOff, true, __ATOMIC_RELAXED);
+    }
+    
+    armAutoOffTimer();
+}
+
+/*
+ * Arm the timer for the current deadline, or disarm it while the light is off
+ */
+void AsusFnKeys::armAutoOffTimer()
+{
+    if (!_autoOffTimer)
+        return;
+    
+    if (isautoOff || !keybrdBLightLvl)
+    {
+        _autoOffTimer->cancelTimeout();
+        return;
+    }
+    
+    uint64_t now_abs, now_ns;
+    clock_get_uptime(&now_abs);
+    absolutetime_to_nanoseconds(now_abs, &now_ns);
+    
+    uint64_t deadline = __atomic_load_n(&keytime, __ATOMIC_ACQUIRE) + autoOffTimeout;
+    UInt32 ms = deadline > now_ns ? (UInt32)((deadline - now_ns + 999999) / 1000000) : 1;
+    _autoOffTimer->setTimeoutMS(ms);
+}
+
+void AsusFnKeys::resetTimer()
+{
+    uint64_t now_abs;
+    clock_get_uptime(&now_abs);
+    uint64_t now_ns;
+    absolutetime_to_nanoseconds(now_abs, &now_ns);
+    __atomic_store_n(&keytime, now_ns, __ATOMIC_RELEASE);
+    __atomic_store_n(&isautoOff, false, __ATOMIC_RELAXED);
+}
+
+/*
+ * Default actions, applied in order so later entries override earlier ones
+ */
+const FnKeyActionDesc AsusFnKeys::keyActionDescs[] = {
+    {"Forward",         0x00, 0xFF, &AsusFnKeys::keyNone,           kKeyResetsIdle | kKeyForwardHID},
+    {"Ignore",          0x57, 0x58, &AsusFnKeys::keyNone,           0},     // AC disconnected/connected
+    {"BrightnessUp",    NOTIFY_BRIGHTNESS_UP_MIN, NOTIFY_BRIGHTNESS_UP_MAX, &AsusFnKeys::keyBrightnessUp, kKeyResetsIdle | kKeyForwardHID},       // Fn + F6
+    {"BrightnessDown",  NOTIFY_BRIGHTNESS_DOWN_MIN, NOTIFY_BRIGHTNESS_DOWN_MAX, &AsusFnKeys::keyBrightnessDown, kKeyResetsIdle | kKeyForwardHID}, // Fn + F5
+    {"PanelToggle",     0x33, 0x35, &AsusFnKeys::keyPanelToggle,    kKeyResetsIdle | kKeyForwardHID},   // hardwired On/Off, Fn + F7
+    {"Sleep",           0x5E, 0x5E, &AsusFnKeys::keySleep,          kKeyResetsIdle},
+    {"Touchpad",        0x6B, 0x6B, &AsusFnKeys::keyTouchpad,       kKeyResetsIdle | kKeyTouchesTouchpad},  // Fn + F9
+    {"ALSToggle",       0x7A, 0x7A, &AsusFnKeys::keyALSToggle,      kKeyResetsIdle | kKeyTouchesALS},  // Fn + A
+    {"AirplaneMode",    0x7D, 0x7D, &AsusFnKeys::keyAirplaneMode,   kKeyResetsIdle},
+    {"BacklightUp",     0xC4, 0xC4, &AsusFnKeys::keyBacklightUp,    kKeyResetsIdle | kKeyTouchesBacklight},  // Fn + F4
+    {"BacklightDown",   0xC5, 0xC5, &AsusFnKeys::keyBacklightDown,  kKeyResetsIdle | kKeyTouchesBacklight},  // Fn + F3
+    {"ALSNotify",       0xC6, 0xC7, &AsusFnKeys::keyALSNotify,      0},
+    {NULL, 0, 0, NULL, 0}
+};
+
+void AsusFnKeys::buildKeyActions()
+{
+    for (const FnKeyActionDesc *desc = keyActionDescs; desc->name; desc++)
+    {
+        for (unsigned int code = desc->first; code <= desc->last; code++)
+        {
+            keyActions[code].handler = desc->handler;
+            keyActions[code].flags = desc->flags;
+        }
+    }
+}
+
+/*
+ * Per-model overrides from Preferences, e.g. KeyActions = { "0x5C" = "Ignore" }
+ */
+void AsusFnKeys::overrideKeyActions(OSDictionary *overrides)
+{
+    OSCollectionIterator *iter = OSCollectionIterator::withCollection(overrides);
+    if (!iter)
+        return;
+    
+    while (const OSSymbol *dictKey = (const OSSymbol *)iter->getNextObject())
+    {
+        char *end;
+        unsigned long code = strtoul(dictKey->getCStringNoCopy(), &end, 0);
+        OSString *name = OSDynamicCast(OSString, overrides->getObject(dictKey));
+        
+        const FnKeyActionDesc *desc = keyActionDescs;
+        if (name)
+            while (desc->name && !name->isEqualTo(desc->name))
+                desc++;
+        
+        if (*end || code >= kKeyActionCount || !name || !desc->name)
+        {
+            IOLog("%s::Invalid KeyActions entry %s\n", getName(), dictKey->getCStringNoCopy());
+            continue;
+        }
+        
+        keyActions[code].handler = desc->handler;
+        keyActions[code].flags = desc->flags;
+        IOLog("%s::Key 0x%02lx handled as %s\n", getName(), code, desc->name);
+    }
+    iter->release();
+}
+
+void AsusFnKeys::handleMessage(int code)
+{
+    if ((unsigned int) code >= kKeyActionCount)
+    {
+        DEBUG_LOG("%s::Unknown event code 0x%x\n", getName(), code);
+        return;
+    }
+    
+    const FnKeyAction *action = &keyActions[code];
+    FnKeyEvent event = { code, 0, false, (action->flags & kKeyForwardHID) != 0 };
+    UInt8 flags = action->flags;
+    
+    // A key ending auto-off has to bring the keyboard backlight back too
+    if (flags & kKeyResetsIdle)
+    {
+        if (isautoOff)
+            flags |= kKeyTouchesBacklight;
+        resetTimer();
+    }
+    
+    trace.record(kTraceKeyAction, code, action->flags);
+    (this->*action->handler)(&event);
+    latencyMark(kLatencyDecision);
+    
+    DEBUG_LOG("%s::Received Key %d(0x%x)\n", getName(), event.code, event.code);
+    
+    reconcileState(flags, event.show);
+    latencyMark(kLatencyState);
+    if (flags & (kKeyResetsIdle | kKeyTouchesBacklight))
+        armAutoOffTimer();
+    
+    // Sending the code for the keyboard handler
+    if (event.forward)
+        processFnKeyEvents(event.code, event.loopCount);
+}
+
+void AsusFnKeys::keyNone(FnKeyEvent *event)
+{
+}
+
+void AsusFnKeys::keyPanelToggle(FnKeyEvent *event)
+{
+    uint64_t begin, end, toggle_ns;
+    clock_get_uptime(&begin);
+    
+    if(isPanelBackLightOn)
+    {
+        // Read Panel brigthness value to restore later with backlight toggle,
+        // kept apart from panelBrightnessLevel which follows the display
+        readPanelBrightnessValue();
+        panelRestoreLevel = panelBrightnessLevel;
+        isPanelBackLightOn = false;
+        
+        // Set the target level in one go, fall back to synthetic key presses
+        if (setPanelBrightness(0))
+            event->forward = false;
+        else
+        {
+            event->code = NOTIFY_BRIGHTNESS_DOWN_MIN;
+            event->loopCount = kPanelBrightnessLevels;
+        }
+    }
+    else
+    {
+        // Never restore a black panel, the level may have been read at 0
+        UInt32 level = panelRestoreLevel ? panelRestoreLevel : 1;
+        isPanelBackLightOn = true;
+        
+        if (setPanelBrightness(level))
+            event->forward = false;
+        else
+        {
+            event->code = NOTIFY_BRIGHTNESS_UP_MIN;
+            event->loopCount = level;
+        }
+    }
+    
+    clock_get_uptime(&end);
+    absolutetime_to_nanoseconds(end - begin, &toggle_ns);
+    if (panelToggleTimeNum)
+        panelToggleTimeNum->setValue(toggle_ns / 1000);
+}
+
+void AsusFnKeys::keyTouchpad(FnKeyEvent *event)
+{
+    touchpadEnabled = !touchpadEnabled;
+}
+
+void AsusFnKeys::keySleep(FnKeyEvent *event)
+{
+    kev.sendMessage(kevSleep, 0, 0);
+}
+
+void AsusFnKeys::keyALSToggle(FnKeyEvent *event)
+{
+    if(hasALSensor)
+        isALSenabled = !isALSenabled;
+}
+
+void AsusFnKeys::keyAirplaneMode(FnKeyEvent *event)
+{
+    kev.sendMessage(kevAirplaneMode, 0, 0);
+}
+
+void AsusFnKeys::keyALSNotify(FnKeyEvent *event)
+{
+    // Read once at the end of the drain, ALS flicker sends these in bursts
+    if(hasALSensor)
+        alsNotifies++;
+}
+
+void AsusFnKeys::readALS()
+{
+    UInt32 alsValue = 0;
+    acpiEvaluateInteger(kACPIMethodALSS, &alsValue);
+    DEBUG_LOG("%s::ALS %d\n", getName(), alsValue);
+    
+    if (alsNotifies > 1)
+    {
+        alsCoalesced += alsNotifies - 1;
+        if (alsCoalescedNum)
+            alsCoalescedNum->setValue(alsCoalesced);
+    }
+    alsNotifies = 0;
+}
+
+void AsusFnKeys::keyBacklightDown(FnKeyEvent *event)
+{
+    if(hasKeybrdBLight)
+    {
+        if(keybrdBLightLvl>0)
+            keybrdBLightLvl--;
+        else
+            keybrdBLightLvl = 0;
+        event->show = true;
+    }
+}
+
+void AsusFnKeys::keyBacklightUp(FnKeyEvent *event)
+{
+    if(hasKeybrdBLight)
+    {
+        UInt8 maxLevel = keybrdBLight16 ? 16 : 3;
+        if(keybrdBLightLvl < maxLevel)
+            keybrdBLightLvl++;
+        else
+            keybrdBLightLvl = maxLevel;
+        event->show = true;
+    }
+}
+
+// The firmware nibble is only a hint, the display reports the real level
+void AsusFnKeys::keyBrightnessDown(FnKeyEvent *event)
+{
+    if (!_backlightDisplay)
+        panelBrightnessLevel = NOTIFY_BRIGHTNESS_LEVEL(event->code);
+    event->code = NOTIFY_BRIGHTNESS_DOWN_MIN;
+}
+
+void AsusFnKeys::keyBrightnessUp(FnKeyEvent *event)
+{
+    if (!_backlightDisplay)
+        panelBrightnessLevel = NOTIFY_BRIGHTNESS_LEVEL(event->code);
+    event->code = NOTIFY_BRIGHTNESS_UP_MIN;
+}
+
+//
+// Bring firmware, NVRAM and registry in line with the desired state,
+// skipping every write whose value is already applied
+//
+void AsusFnKeys::reconcileState(UInt8 flags, bool show)
+{
+    if ((flags & kKeyTouchesBacklight) && hasKeybrdBLight)
+        setKeyboardBackLight(keybrdBLightLvl, true, show);
     
-    DEBUG_LOG("%s::Received Key %d(0x%x)\n", getName(), code, code);
+    if ((flags & kKeyTouchesALS) && hasALSensor)
+    {
+        if (appliedALS != isALSenabled)
+            enableALS(isALSenabled);
+        else
+            countStateWrite(kStateALS, false);
+    }
     
-    if (hasKeybrdBLight)
-        setKeyboardBackLight(keybrdBLightLvl, true, show);
+    if ((flags & kKeyTouchesTouchpad) && appliedTouchpad != touchpadEnabled)
+    {
+        applyTouchpadState();
+        
+        // send to 3rd party drivers
+        dispatchMessage(kKeyboardSetTouchStatus, &touchpadEnabled);
+    }
+}
+
+void AsusFnKeys::countStateWrite(UInt8 item, bool issued)
+{
+    stateWrites[item][issued]++;
+    if (stateWritesNum[item][issued])
+        stateWritesNum[item][issued]->setValue(stateWrites[item][issued]);
+}
+
+/*
+ * Counters are published once and then updated in place with setValue(),
+ * so bumping them on the hotkey path never allocates
+ */
+OSNumber * AsusFnKeys::publishCounter(const char * name, int bits)
+{
+    OSNumber *counter = OSNumber::withNumber(0ULL, bits);
+    if (counter)
+        setProperty(name, counter);
+    return counter;
+}
+
+void AsusFnKeys::applyTouchpadState()
+{
+    if(touchpadEnabled)
+    {
+        setProperty("TouchpadEnabled", true);
+        removeProperty("TouchpadDisabled");
+        DEBUG_LOG("%s::Touchpad Enabled\n", getName());
+    }
+    else
+    {
+        removeProperty("TouchpadEnabled");
+        setProperty("TouchpadDisabled", true);
+        DEBUG_LOG("%s::Touchpad Disabled\n", getName());
+    }
     
-    // Sending the code for the keyboard handler
-    processFnKeyEvents(code, loopCount);
+    appliedTouchpad = touchpadEnabled;
 }
 
 //
@@ -882,45 +1943,66 @@ void AsusFnKeys::handleMessage(int code)
 //
 void AsusFnKeys::processFnKeyEvents(int code, int bLoopCount)
 {
-    if(bLoopCount>0)
+    // Queued on the keyboard device, drainNotifications() sends the batch
+    _keyboardDevice->queueKey(code, bLoopCount > 0 ? bLoopCount : 1);
+    DEBUG_LOG("%s::Loop Count %d, Dispatch Key %d(0x%x)\n", getName(), bLoopCount, code, code);
+}
+
+/*
+ * Returns the reusable argument of an ACPI method set to value.
+ * Slots are filled in start(), so this only allocates if that failed.
+ */
+OSObject ** AsusFnKeys::acpiArg(UInt8 slot, UInt64 value)
+{
+    static const UInt8 bits[kACPIArgPoolSize] = { 8, 8, 8, 32 };
+    
+    if (NULL == acpiArgPool[slot])
     {
-        for (int j = 0; j < bLoopCount; j++)
-            _keyboardDevice->keyPressed(code);
-        DEBUG_LOG("%s::Loop Count %d, Dispatch Key %d(0x%x)\n", getName(), bLoopCount, code, code);
+        acpiArgPool[slot] = OSNumber::withNumber(value, bits[slot]);
+        acpiArgAllocs++;
+        setProperty("ACPIArgAllocations", acpiArgAllocs, 32);
     }
     else
-    {
-        _keyboardDevice->keyPressed(code);
-        DEBUG_LOG("%s::Dispatch Key %d(0x%x)\n", getName(), code, code);
-    }
+        acpiArgPool[slot]->setValue(value);
+    
+    return (OSObject **) &acpiArgPool[slot];
+}
+
+void AsusFnKeys::releaseACPIArgs()
+{
+    for (int i = 0; i < kACPIArgPoolSize; i++)
+        OSSafeReleaseNULL(acpiArgPool[i]);
 }
 
 void AsusFnKeys::enableALS(bool state)
 {
-    OSObject * params[1];
     UInt32 res;
-    params[0] = OSNumber::withNumber(state, 8);
     
-    if(WMIDevice->evaluateInteger("ALSC", &res, params, 1) == kIOReturnSuccess)
+    if (!(acpiCaps & ACPI_CAP(kACPIMethodALSC)))
+        return;
+    
+    if(acpiEvaluateInteger(kACPIMethodALSC, &res, acpiArg(kACPIArgALSC, state), 1) == kIOReturnSuccess)
+    {
         DEBUG_LOG("%s::ALS %s %d\n", getName(), state ? "enabled" : "disabled", res);
+        appliedALS = state;
+        countStateWrite(kStateALS, true);
+    }
     else
         DEBUG_LOG("%s::Failed to call ALSC\n", getName());
 }
 
 UInt8 AsusFnKeys::getKeyboardBackLight()
 {
-    if (WMIDevice->validateObject("GKBL") != kIOReturnSuccess)
+    if (!(acpiCaps & ACPI_CAP(kACPIMethodGKBL)))
     {
         DEBUG_LOG("%s::Keyboard backlight not found\n", getName());
         return -1;
     }
     else
     {
-        OSObject * params[1];
         UInt32 res;
-        params[0] = OSNumber::withNumber(0ULL, 8);
         
-        if (WMIDevice->evaluateInteger("GKBL", &res, params, 1) != kIOReturnSuccess)
+        if (acpiEvaluateInteger(kACPIMethodGKBL, &res, acpiArg(kACPIArgGKBL, 0), 1) != kIOReturnSuccess)
         {
             DEBUG_LOG("%s::Failed to get keyboard backlight\n", getName());
             return -1;
@@ -932,90 +2014,98 @@ UInt8 AsusFnKeys::getKeyboardBackLight()
 
 void AsusFnKeys::setKeyboardBackLight(UInt8 level, bool nvram, bool display)
 {
-    if (WMIDevice->validateObject("SKBL") != kIOReturnSuccess)
+    if (!(acpiCaps & ACPI_CAP(kACPIMethodSKBL)))
+    {
         DEBUG_LOG("%s::Keyboard backlight not found\n", getName());
-    else
+        return;
+    }
+    
+    if (level != curKeybrdBlvl)
     {
-        OSObject * params[1];
-        OSObject * ret = NULL;
-        params[0] = OSNumber::withNumber(level, sizeof(level)*8);
+        ACPIResult ret;
         
-        if (WMIDevice->evaluateObject("SKBL", &ret, params, 1) != kIOReturnSuccess)
+        if (acpiEvaluate(kACPIMethodSKBL, ret.out(), acpiArg(kACPIArgSKBL, level), 1) != kIOReturnSuccess)
         {
             DEBUG_LOG("%s::Failed to set keyboard backlight\n", getName());
             return;
         }
         
-        if (nvram) saveKBBacklightToNVRAM(level);
-        
-        if (display)
-        {
-            kev.sendMessage(kevKeyboardBacklight, level, keybrdBLight16?16:3);
-            DEBUG_LOG("%s::Sent message to user space daemon\n", getName());
-        }
-        
         curKeybrdBlvl = level;
-        
-        setProperty("KeyboardBLightLevel", level, sizeof(level)*8);
+        trace.record(kTraceKeyboardBacklight, level);
+        countStateWrite(kStateKeyboardBacklight, true);
+        if (keyboardBLightLevelNum)
+            keyboardBLightLevelNum->setValue(level);
     }
-}
-
-int AsusFnKeys::checkBacklightEntry()
-{
-    if(IORegistryEntry::fromPath(backlightEntry))
-        return 1;
     else
+        countStateWrite(kStateKeyboardBacklight, false);
+    
+    if (nvram)
+        persistToNVRAM(kNVRAMKeyboardBacklight, level);
+    
+    if (display)
     {
-        DEBUG_LOG("%s::Failed to find backlight entry for %s\n", getName(), backlightEntry);
-        return 0;
+        kev.sendMessage(kevKeyboardBacklight, level, keybrdBLight16?16:3);
+        DEBUG_LOG("%s::Sent message to user space daemon\n", getName());
     }
 }
 
-int AsusFnKeys::findBacklightEntry()
+#pragma mark -
+#pragma mark Backlight display methods
+#pragma mark -
+
+bool AsusFnKeys::displayNotificationHandler(void * refCon, IOService * newService, IONotifier * notifier)
+{
+    command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &AsusFnKeys::displayNotificationGated), newService, refCon);
+    return true;
+}
+
+void AsusFnKeys::displayNotificationGated(IOService * display, void * published)
 {
-    snprintf(backlightEntry, 1000, "IOService:/AppleACPIPlatformExpert/PCI0@0/AppleACPIPCI/GFX0@2/AppleIntelFramebuffer@0/display0/AppleBacklightDisplay");
-    if(checkBacklightEntry())
-        return 1;
-    
-    snprintf(backlightEntry, 1000, "IOService:/AppleACPIPlatformExpert/PCI0@0/AppleACPIPCI/IGPU@2/AppleIntelFramebuffer@0/display0/AppleBacklightDisplay");
-    if (checkBacklightEntry())
-        return 1;
-    
-    char deviceName[5][5] = {"PEG0", "PEGP", "PEGR", "P0P2", "IXVE"};
-    for (int i = 0; i < 5; i++)
+    if (published)
     {
-        snprintf(backlightEntry, 1000, "IOService:/AppleACPIPlatformExpert/PCI0@0/AppleACPIPCI/%s@1/IOPP/GFX0@0", deviceName[i]);
-        snprintf(backlightEntry, 1000, "%s%s", backlightEntry, "/NVDA,Display-A@0/NVDA/display0/AppleBacklightDisplay");
-        if (checkBacklightEntry())
-            return 1;
-        
-        snprintf(backlightEntry, 1000, "IOService:/AppleACPIPlatformExpert/PCI0@0/AppleACPIPCI/%s@3/IOPP/GFX0@0", deviceName[i]);
-        snprintf(backlightEntry, 1000, "%s%s", backlightEntry, "/NVDA,Display-A@0/NVDATesla/display0/AppleBacklightDisplay");
-        if (checkBacklightEntry())
-            return 1;
-        
-        snprintf(backlightEntry, 1000, "IOService:/AppleACPIPlatformExpert/PCI0@0/AppleACPIPCI/%s@10/IOPP/GFX0@0", deviceName[i]);
-        snprintf(backlightEntry, 1000, "%s%s", backlightEntry, "/NVDA,Display-A@0/NVDATesla/display0/AppleBacklightDisplay");
-        if (checkBacklightEntry())
-            return 1;
-        
-        snprintf(backlightEntry, 1000, "IOService:/AppleACPIPlatformExpert/PCI0@0/AppleACPIPCI/%s@1/IOPP/display@0", deviceName[i]);
-        snprintf(backlightEntry, 1000, "%s%s", backlightEntry, "/NVDA,Display-A@0/NVDA/display0/AppleBacklightDisplay");
-        if (checkBacklightEntry())
-            return 1;
+        if (_backlightDisplay)
+            return;
         
-        snprintf(backlightEntry, 1000, "IOService:/AppleACPIPlatformExpert/PCI0@0/AppleACPIPCI/%s@3/IOPP/display@0", deviceName[i]);
-        snprintf(backlightEntry, 1000, "%s%s", backlightEntry, "/NVDA,Display-A@0/NVDATesla/display0/AppleBacklightDisplay");
-        if (checkBacklightEntry())
-            return 1;
+        IOLog("%s::Found backlight display %s\n", getName(), display->getName());
+        _backlightDisplay = display;
+        _backlightDisplay->retain();
         
-        snprintf(backlightEntry, 1000, "IOService:/AppleACPIPlatformExpert/PCI0@0/AppleACPIPCI/%s@10/IOPP/display@0", deviceName[i]);
-        snprintf(backlightEntry, 1000, "%s%s", backlightEntry, "/NVDA,Display-A@0/NVDATesla/display0/AppleBacklightDisplay");
-        if (checkBacklightEntry())
-            return 1;
+        // Track brightness changes made by the system without polling the display
+        _displayInterest = _backlightDisplay->registerInterest(gIOGeneralInterest,
+                                                               OSMemberFunctionCast(IOServiceInterestHandler, this, &AsusFnKeys::displayInterestHandler),
+                                                               this);
+        readPanelBrightnessValue();
+    }
+    else if (display == _backlightDisplay)
+    {
+        IOLog("%s::Backlight display terminated\n", getName());
+        releaseBacklightDisplay();
     }
+}
+
+IOReturn AsusFnKeys::displayInterestHandler(void * refCon, UInt32 messageType, IOService * provider, void * messageArgument, vm_size_t argSize)
+{
+    if (messageType == kIOMessageServicePropertyChange)
+        command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &AsusFnKeys::displayBrightnessChangedGated));
     
-    return 0;
+    return kIOReturnSuccess;
+}
+
+void AsusFnKeys::displayBrightnessChangedGated()
+{
+    // Tested in the gate, keyPanelToggle flips it before its own write
+    if (isPanelBackLightOn)
+        readPanelBrightnessValue();
+}
+
+void AsusFnKeys::releaseBacklightDisplay()
+{
+    if (_displayInterest)
+    {
+        _displayInterest->remove();
+        _displayInterest = NULL;
+    }
+    OSSafeReleaseNULL(_backlightDisplay);
 }
 
 void AsusFnKeys::readPanelBrightnessValue()
@@ -1024,43 +2114,139 @@ void AsusFnKeys::readPanelBrightnessValue()
     //Reading AppleBezel Values from Apple Backlight Panel driver for controlling the bezel levels
     //
     
-    if(!findBacklightEntry())
+    if(!_backlightDisplay)
     {
         DEBUG_LOG("%s::GPU device not found\n", getName());
         return;
     }
     
-    IORegistryEntry *displayDeviceEntry = IORegistryEntry::fromPath(backlightEntry);
-    
-    if (displayDeviceEntry != NULL) {
-        if(OSDictionary* ioDisplayParaDict = OSDynamicCast(OSDictionary, displayDeviceEntry->getProperty("IODisplayParameters")))
+    if(OSDictionary* ioDisplayParaDict = OSDynamicCast(OSDictionary, _backlightDisplay->getProperty("IODisplayParameters")))
+    {
+        if(OSDictionary* brightnessDict = OSDynamicCast(OSDictionary, ioDisplayParaDict->getObject("brightness")))
         {
-            if(OSDictionary* brightnessDict = OSDynamicCast(OSDictionary, ioDisplayParaDict->getObject("brightness")))
+            if (OSNumber* brightnessValue = OSDynamicCast(OSNumber, brightnessDict->getObject("value")))
             {
-                if (OSNumber* brightnessValue = OSDynamicCast(OSNumber, brightnessDict->getObject("value")))
-                {
-                    panelBrightnessLevel = brightnessValue->unsigned32BitValue()/64;
-                    DEBUG_LOG("%s::Panel brightness level from AppleBacklightDisplay: %d\n", getName(), brightnessValue->unsigned32BitValue());
-                    DEBUG_LOG("%s::Read panel brightness level: %d\n", getName(), panelBrightnessLevel);
-                }
-                else
-                    DEBUG_LOG("%s::Can't not read brightness value\n", getName());
+                panelBrightnessLevel = brightnessValue->unsigned32BitValue()/kPanelBrightnessStep;
+                DEBUG_LOG("%s::Panel brightness level from AppleBacklightDisplay: %d\n", getName(), brightnessValue->unsigned32BitValue());
+                DEBUG_LOG("%s::Read panel brightness level: %d\n", getName(), panelBrightnessLevel);
             }
             else
-                DEBUG_LOG("%s::Can't not find dictionary brightness\n", getName());
+                DEBUG_LOG("%s::Can't not read brightness value\n", getName());
         }
         else
-            DEBUG_LOG("%s::Can't not find dictionary IODisplayParameters\n", getName());
+            DEBUG_LOG("%s::Can't not find dictionary brightness\n", getName());
+    }
+    else
+        DEBUG_LOG("%s::Can't not find dictionary IODisplayParameters\n", getName());
+}
+
+/*
+ * Set the panel to an absolute level (0-16) through the AppleBacklightDisplay
+ * parameters, one registry write instead of up to 16 synthetic key presses
+ */
+bool AsusFnKeys::setPanelBrightness(UInt32 level)
+{
+    bool ret = false;
+    
+    if (NULL == _backlightDisplay)
+        return false;
+    
+    if (OSNumber* value = OSNumber::withNumber(level * kPanelBrightnessStep, 32))
+    {
+        if (OSDictionary* params = OSDictionary::withCapacity(1))
+        {
+            params->setObject("brightness", value);
+            ret = _backlightDisplay->setProperties(params) == kIOReturnSuccess;
+            params->release();
+        }
+        value->release();
+    }
+    
+    DEBUG_LOG("%s::Set panel brightness level %d %s\n", getName(), (int)level, ret ? "done" : "failed");
+    return ret;
+}
+
+/*
+ * Record the latest value of an NVRAM key. Nothing is written here, the
+ * flush timer commits every dirty key once nvramFlushDelay ms after the
+ * first change, so a burst of changes costs a single NVRAM commit.
+ * Returns false if the value was already the one persisted or pending.
+ */
+bool AsusFnKeys::persistToNVRAM(UInt8 key, UInt8 value)
+{
+    bool queued = false;
+    
+    if (command_gate)
+        command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &AsusFnKeys::persistToNVRAMGated), &key, &value, &queued);
+    
+    return queued;
+}
+
+void AsusFnKeys::persistToNVRAMGated(UInt8 *key, UInt8 *value, bool *queued)
+{
+    if (nvramValues[*key] == *value)
+    {
+        countStateWrite(kStateNVRAM + *key, false);
+        return;
+    }
+    
+    nvramValues[*key] = *value;
+    *queued = true;
+    
+    // The pending value is replaced, its write never happens
+    if (nvramDirty & (1U << *key))
+    {
+        countStateWrite(kStateNVRAM + *key, false);
+        nvramCoalesced++;
+        if (nvramCoalescedNum)
+            nvramCoalescedNum->setValue(nvramCoalesced);
+        return;
+    }
+    
+    if (!nvramDirty && _nvramTimer)
+        _nvramTimer->setTimeoutMS(nvramFlushDelay);
+    nvramDirty |= 1U << *key;
+    
+    if (!_nvramTimer)
+        flushNVRAMGated();
+}
+
+void AsusFnKeys::flushNVRAM()
+{
+    if (command_gate)
+        command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &AsusFnKeys::flushNVRAMGated));
+}
+
+void AsusFnKeys::flushNVRAMGated()
+{
+    static const char * const keys[kNVRAMKeyCount] = {
+        kAsusKeyboardBacklight,
+    };
+    
+    if (_nvramTimer)
+        _nvramTimer->cancelTimeout();
+    
+    for (int i = 0; i < kNVRAMKeyCount; i++)
+    {
+        if (!(nvramDirty & (1U << i)))
+            continue;
+        
+        writeNVRAM(keys[i], nvramValues[i]);
+        countStateWrite(kStateNVRAM + i, true);
+        nvramCommitted++;
+        if (nvramCommittedNum)
+            nvramCommittedNum->setValue(nvramCommitted);
     }
+    nvramDirty = 0;
 }
 
-void AsusFnKeys::saveKBBacklightToNVRAM(UInt8 level)
+void AsusFnKeys::writeNVRAM(const char *key, UInt8 value)
 {
     if (IORegistryEntry* nvram = OSDynamicCast(IORegistryEntry, fromPath("/options", gIODTPlane)))
     {
-        if (const OSSymbol* symbol = OSSymbol::withCString(kAsusKeyboardBacklight))
+        if (const OSSymbol* symbol = OSSymbol::withCString(key))
         {
-            if (OSData* number = OSData::withBytes(&level, sizeof(level)))
+            if (OSData* number = OSData::withBytes(&value, sizeof(value)))
             {
                 if (!nvram->setProperty(symbol, number))
                     DEBUG_LOG("%s::nvram->setProperty failed\n", getName());
@@ -1072,176 +2258,221 @@ void AsusFnKeys::saveKBBacklightToNVRAM(UInt8 level)
     }
 }
 
-UInt8 AsusFnKeys::readKBBacklightFromNVRAM(void)
+UInt8 AsusFnKeys::readKBBacklightFromNVRAM(IORegistryEntry *nvram)
 {
-    IORegistryEntry* nvram = IORegistryEntry::fromPath("/chosen/nvram", gIODTPlane);
-    if (!nvram)
+    UInt8 val = 100;
+    
+    // Fetch only our key instead of serializing the whole NVRAM. A missing
+    // key is normal (first boot), serialize only where reads are known broken
+    OSObject* obj;
+    if (nvramReadsBroken)
+        obj = copyNVRAMPropertySerialized(nvram, kAsusKeyboardBacklight);
+    else
+        obj = nvram->copyProperty(kAsusKeyboardBacklight);
+    
+    if (OSData* number = OSDynamicCast(OSData, obj))
     {
-        if (OSDictionary* matching = serviceMatching("IODTNVRAM"))
-        {
-            nvram = waitForMatchingService(matching, MS_TO_NS(15000));
-            matching->release();
-        }
+        val = 0;
+        unsigned l = number->getLength();
+        if (l <= sizeof(val))
+            memcpy(&val, number->getBytesNoCopy(), l);
+        DEBUG_LOG("%s::Keyboard backlight value from NVRAM: %d\n", getName(), val);
     }
-    UInt8 val = 100;
-    if (nvram)
+    else
+        IOLog("%s::Keyboard backlight value not found in NVRAM\n", getName());
+    OSSafeReleaseNULL(obj);
+    
+    return val;
+}
+
+OSObject * AsusFnKeys::copyNVRAMPropertySerialized(IORegistryEntry *nvram, const char *key)
+{
+    OSObject* value = NULL;
+    
+    // need to serialize as getProperty on nvram does not work
+    if (OSSerialize* serial = OSSerialize::withCapacity(0))
     {
-        // need to serialize as getProperty on nvram does not work
-        if (OSSerialize* serial = OSSerialize::withCapacity(0))
+        if (nvram->serializeProperties(serial))
         {
-            nvram->serializeProperties(serial);
-            if (OSDictionary* props = OSDynamicCast(OSDictionary, OSUnserializeXML(serial->text())))
+            if (OSObject* obj = OSUnserializeXML(serial->text()))
             {
-                if (OSData* number = OSDynamicCast(OSData, props->getObject(kAsusKeyboardBacklight)))
+                if (OSDictionary* props = OSDynamicCast(OSDictionary, obj))
                 {
-                    val = 0;
-                    unsigned l = number->getLength();
-                    if (l <= sizeof(val))
-                        memcpy(&val, number->getBytesNoCopy(), l);
-                    DEBUG_LOG("%s::Keyboard backlight value from NVRAM: %d\n", getName(), val);
+                    value = props->getObject(key);
+                    if (value)
+                        value->retain();
                 }
-                else
-                    IOLog("%s::Keyboard backlight value not found in NVRAM\n", getName());
-                props->release();
+                obj->release();
             }
-            serial->release();
         }
-        nvram->release();
+        serial->release();
     }
-    else
-        IOLog("%s::NVRAM not available\n", getName());
-    return val;
+    
+    return value;
 }
 
-void AsusFnKeys::getDeviceStatus(const char * guid, UInt32 methodId, UInt32 deviceId, UInt32 *status)
+/*
+ * Apply the NVRAM backlight level once IODTNVRAM is available. start() never
+ * waits for it, the level from Preferences is used until then.
+ */
+void AsusFnKeys::restoreFromNVRAM(IORegistryEntry *nvram)
 {
-    DEBUG_LOG("%s::getDeviceStatus()\n", getName());
+    if (command_gate)
+        command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &AsusFnKeys::restoreFromNVRAMGated), nvram);
+}
+
+void AsusFnKeys::restoreFromNVRAMGated(IORegistryEntry *nvram)
+{
+    removeNVRAMNotifyGated();
     
-    char method[5];
-    OSObject * params[3];
-    OSString *str;
-    OSDictionary *dict = getDictByUUID(guid);
-    if (NULL == dict)
-        return;
+    UInt8 tmp = readKBBacklightFromNVRAM(nvram);
     
-    str = OSDynamicCast(OSString, dict->getObject("object_id"));
-    if (NULL == str)
-        return;
+    // Keep a level the user already changed while we were waiting
+    if (tmp != 100 && nvramValues[kNVRAMKeyboardBacklight] == 0xFF)
+    {
+        keybrdBLightLvl = nvramValues[kNVRAMKeyboardBacklight] = tmp;
+        if(!keybrdBLight16 && keybrdBLightLvl>3) keybrdBLightLvl=3;
+        
+        // While auto-off the light stays dark, the next key brings this level back
+        if(hasKeybrdBLight && !isautoOff)
+            setKeyboardBackLight(keybrdBLightLvl, false);
+        
+        // A level restored from 0 needs the timer, one restored to 0 does not
+        armAutoOffTimer();
+    }
+    
+    uint64_t now_abs, delay_ns;
+    clock_get_uptime(&now_abs);
+    absolutetime_to_nanoseconds(now_abs - startTime, &delay_ns);
+    setProperty("NVRAMRestoreTimeUS", delay_ns / 1000, 64);
+}
+
+void AsusFnKeys::removeNVRAMNotifyGated()
+{
+    if (_nvramNotify)
+    {
+        _nvramNotify->remove();
+        _nvramNotify = NULL;
+    }
+}
+
+bool AsusFnKeys::nvramPublished(void * refCon, IOService * newService, IONotifier * notifier)
+{
+    restoreFromNVRAM(newService);
+    return true;
+}
+
+bool AsusFnKeys::prepareWMICall(WMICall *call, const UInt8 * guid, UInt32 methodId, UInt8 shape)
+{
+    bzero(call, sizeof(WMICall));
     
-    snprintf(method, 5, "WM%s", str->getCStringNoCopy());
+    const struct guid_block *block = findGuidBlock(guid);
+    if (NULL == block || !(block->flags & ACPI_WMI_METHOD))
+        return false;
     
-    params[0] = OSNumber::withNumber(0x00D,32);
-    params[1] = OSNumber::withNumber(methodId,32);
-    params[2] = OSNumber::withNumber(deviceId,32);
+    call->method[0] = 'W';
+    call->method[1] = 'M';
+    call->method[2] = block->object_id[0];
+    call->method[3] = block->object_id[1];
+    call->method[4] = 0;
+    call->shape = shape;
     
-    WMIDevice->evaluateInteger(method, status, params, 3);
+    call->symbol = OSSymbol::withCString(call->method);
+    call->present = call->symbol && WMIDevice->validateObject(call->symbol) == kIOReturnSuccess;
     
-    params[0]->release();
-    params[1]->release();
-    params[2]->release();
+    call->params[0] = OSNumber::withNumber(0x00D,32);
+    call->params[1] = OSNumber::withNumber(methodId,32);
+    if (shape == kWMICallArgNumber)
+        call->params[2] = OSNumber::withNumber(0ULL,32);
+    else
+        call->params[2] = OSData::withBytesNoCopy(call->buffer, shape == kWMICallArgDevice ? 8 : 4);
     
-    return;
+    if (!call->present || !call->params[0] || !call->params[1] || !call->params[2])
+    {
+        releaseWMICall(call);
+        return false;
+    }
+    
+    DEBUG_LOG("%s::Prepared %s method %x\n", getName(), call->method, (unsigned int)methodId);
+    return true;
 }
 
-void AsusFnKeys::setDeviceStatus(const char * guid, UInt32 methodId, UInt32 deviceId, UInt32 *status)
+void AsusFnKeys::releaseWMICall(WMICall *call)
 {
-    DEBUG_LOG("%s::setDeviceStatus()\n", getName());
-    
-    char method[5];
-    char buffer[8];
-    OSObject * params[3];
-    OSString *str;
-    OSDictionary *dict = getDictByUUID(guid);
-    if (NULL == dict)
-        return;
-    
-    str = OSDynamicCast(OSString, dict->getObject("object_id"));
-    if (NULL == str)
-        return;
+    OSSafeReleaseNULL(call->params[0]);
+    OSSafeReleaseNULL(call->params[1]);
+    OSSafeReleaseNULL(call->params[2]);
+    OSSafeReleaseNULL(call->symbol);
+    call->present = false;
+    call->method[0] = 0;
+}
+
+IOReturn AsusFnKeys::evaluateWMICall(WMICall *call, UInt32 arg0, UInt32 arg1, UInt32 *result)
+{
+    if (!call->present)
+        return kIOReturnUnsupported;
     
-    snprintf(method, 5, "WM%s", str->getCStringNoCopy());
+    if (call->shape == kWMICallArgNumber)
+        ((OSNumber *) call->params[2])->setValue(arg0);
+    else
+    {
+        call->buffer[0] = arg0;
+        call->buffer[1] = arg1;
+    }
     
-    memcpy(buffer, &deviceId, 4);
-    memcpy(buffer+4, status, 4);
+    return acpiEvaluateInteger(kACPIMethodWMxx, result, call->params, 3, call->symbol);
+}
+
+void AsusFnKeys::getDeviceStatus(UInt32 deviceId, UInt32 *status)
+{
+    DEBUG_LOG("%s::getDeviceStatus()\n", getName());
     
-    params[0] = OSNumber::withNumber(0x00D,32);
-    params[1] = OSNumber::withNumber(methodId,32);
-    params[2] = OSData::withBytes(buffer, 8);
+    evaluateWMICall(&wmiDSTS, deviceId, 0, status);
+}
+
+void AsusFnKeys::setDeviceStatus(UInt32 deviceId, UInt32 *status)
+{
+    DEBUG_LOG("%s::setDeviceStatus()\n", getName());
     
+    UInt32 value = *status;
     *status = ~0;
-    WMIDevice->evaluateInteger(method, status, params, 3);
+    evaluateWMICall(&wmiDEVS, deviceId, value, status);
     
     DEBUG_LOG("%s::setDeviceStatus Res = %x\n", getName(), (unsigned int)*status);
-    
-    params[0]->release();
-    params[1]->release();
-    params[2]->release();
-    
-    return;
 }
 
-void AsusFnKeys::setDevice(const char * guid, UInt32 methodId, UInt32 *status)
+void AsusFnKeys::setDevice(WMICall *call, UInt32 *status)
 {
     DEBUG_LOG("%s::setDevice(%d)\n", getName(), (int)*status);
     
-    char method[5];
-    char buffer[4];
-    OSObject * params[3];
-    OSString *str;
-    OSDictionary *dict = getDictByUUID(guid);
-    if (NULL == dict)
-        return;
-    
-    str = OSDynamicCast(OSString, dict->getObject("object_id"));
-    if (NULL == str)
-        return;
-    
-    snprintf(method, 5, "WM%s", str->getCStringNoCopy());
-    
-    memcpy(buffer, status, 4);
-    
-    params[0] = OSNumber::withNumber(0x00D,32);
-    params[1] = OSNumber::withNumber(methodId,32);
-    params[2] = OSData::withBytes(buffer, 8);
-    
+    UInt32 value = *status;
     *status = ~0;
-    WMIDevice->evaluateInteger(method, status, params, 3);
+    evaluateWMICall(call, value, 0, status);
     
     DEBUG_LOG("%s::setDevice Res = %x\n", getName(), (unsigned int)*status);
-    
-    params[0]->release();
-    params[1]->release();
-    params[2]->release();
-    
-    return;
 }
 
 
-OSDictionary* AsusFnKeys::getDictByUUID(const char * guid)
+const struct guid_block * AsusFnKeys::findGuidBlock(const UInt8 * guid)
 {
-    UInt32 i;
-    OSDictionary *dict = NULL;
-    OSString *uuid;
-    OSArray *array = OSDynamicCast(OSArray, properties->getObject("WDG"));
-    if (NULL == array)
-        return NULL;
-    for (i=0; i<array->getCount(); i++) {
-        dict = OSDynamicCast(OSDictionary, array->getObject(i));
-        uuid = OSDynamicCast(OSString, dict->getObject("UUID"));
-        if (uuid->isEqualTo(guid)){
-            break;
-        }
-        
+    UInt8 slot = wmi_guid_hash(guid);
+    UInt8 idx;
+    
+    while ((idx = wdgHash[slot]) != 0) {
+        if (!memcmp(wdgBlocks[idx - 1].guid, guid, 16))
+            return &wdgBlocks[idx - 1];
+        slot++;
     }
-    return dict;
+    return NULL;
 }
 
 
-IOReturn AsusFnKeys::enableFnKeyEvents(const char * guid, UInt32 methodId)
+IOReturn AsusFnKeys::enableFnKeyEvents(const UInt8 * guid, UInt32 methodId)
 {
     //Asus WMI Specific Method Inside the DSDT
     //Calling the Asus Method INIT from the DSDT to enable the Hotkey Events
-    WMIDevice->evaluateObject("INIT", NULL, NULL, NULL);
+    if (acpiCaps & ACPI_CAP(kACPIMethodINIT))
+        acpiEvaluate(kACPIMethodINIT, NULL);
     
     return kIOReturnSuccess;
 }
@@ -1254,7 +2485,7 @@ IOReturn AsusFnKeys::enableFnKeyEvents(const char * guid, UInt32 methodId)
 
 void AsusFnKeys::enableEvent()
 {
-    if (enableFnKeyEvents(ASUS_WMI_MGMT_GUID, ASUS_WMI_METHODID_INIT) != kIOReturnSuccess)
+    if (enableFnKeyEvents(ASUS_WMI_MGMT_GUID_BIN, ASUS_WMI_METHODID_INIT) != kIOReturnSuccess)
         IOLog("Unable to enable events!!!\n");
     else
     {
@@ -1273,25 +2504,37 @@ void AsusFnKeys::enableEvent()
             _keyboardDevice->registerService();
             
             // Setting Touchpad state on startup
-            setProperty("TouchpadEnabled", true);
-            
-            // Load keyboard backlight level from NVRAM
-            UInt8 tmp = readKBBacklightFromNVRAM();
-            if(tmp != 100)
-                keybrdBLightLvl = tmp;
+            applyTouchpadState();
             
             if(!keybrdBLight16 && keybrdBLightLvl>3) keybrdBLightLvl=3;
             
-            // Calling the keyboardBacklight Event for Setting the Backlight
+            // Calling the keyboardBacklight Event for Setting the Backlight,
+            // NVRAM is only written once the stored level has been restored
             if(hasKeybrdBLight)
-                setKeyboardBackLight(keybrdBLightLvl);
+                setKeyboardBackLight(keybrdBLightLvl, false);
             
-            curKeybrdBlvl = keybrdBLightLvl;
+            // Load keyboard backlight level from NVRAM, now or once it shows up
+            if (OSDictionary* matching = serviceMatching("IODTNVRAM"))
+            {
+                if (IOService* nvram = copyMatchingService(matching))
+                {
+                    restoreFromNVRAM(nvram);
+                    nvram->release();
+                }
+                else
+                {
+                    IOLog("%s::NVRAM not available yet\n", getName());
+                    _nvramNotify = addMatchingNotification(gIOFirstPublishNotification, matching,
+                                                           OSMemberFunctionCast(IOServiceMatchingNotificationHandler, this, &AsusFnKeys::nvramPublished),
+                                                           this);
+                }
+                matching->release();
+            }
             
             if(hasALSensor)
             {
                 isALSenabled = true;
-                enableALS(isALSenabled);
+                reconcileState(kKeyTouchesALS, false);
                 IOLog("%s::ALS turned on at boot\n", getName());
             }
             
@@ -27,6 +27,7 @@
 #include <IOKit/pwr_mgt/IOPMPowerSource.h>
 #include <IOKit/acpi/IOACPIPlatformDevice.h>
 #include <IOKit/IOTimerEventSource.h>
+#include <IOKit/IOInterruptEventSource.h>
 #include <IOKit/IOCommandGate.h>
 #include <IOKit/IOService.h>
 #include <IOKit/IONVRAM.h>
@@ -38,6 +39,7 @@
 
 #include "FnKeysHIKeyboardDevice.h"
 #include "KernEventServer.h"
+#include "FnKeysTrace.h"
 
 struct guid_block {
     char guid[16];
@@ -64,6 +66,23 @@ struct guid_block {
 #define ASUS_WMI_MGMT_GUID      "97845ED0-4E6D-11DE-8A39-0800200C9A66"
 #define ASUS_NB_WMI_EVENT_GUID  "0B3CBB35-E3C2-45ED-91C2-4C5A6D195D1C"
 
+/*
+ * Binary form of the GUIDs above, laid out the same way as guid_block::guid
+ * in _WDG (first three fields little endian), so lookups are a plain memcmp.
+ */
+static const UInt8 ASUS_WMI_MGMT_GUID_BIN[16] = {
+    0xD0, 0x5E, 0x84, 0x97, 0x6D, 0x4E, 0xDE, 0x11,
+    0x8A, 0x39, 0x08, 0x00, 0x20, 0x0C, 0x9A, 0x66
+};
+static const UInt8 ASUS_NB_WMI_EVENT_GUID_BIN[16] = {
+    0x35, 0xBB, 0x3C, 0x0B, 0xC2, 0xE3, 0xED, 0x45,
+    0x91, 0xC2, 0x4C, 0x5A, 0x6D, 0x19, 0x5D, 0x1C
+};
+
+/* GUID index built from _WDG: open addressing, slot holds block index + 1 */
+#define WMI_GUID_HASH_SIZE      256
+#define WMI_GUID_MAX_BLOCKS     (WMI_GUID_HASH_SIZE - 1)
+
 /* WMI Methods */
 #define ASUS_WMI_METHODID_SPEC          0x43455053 /* BIOS SPECification */
 #define ASUS_WMI_METHODID_SFBD          0x44424653 /* Set First Boot Device */
@@ -163,6 +182,142 @@ struct guid_block {
 #define EEEPC_WMI_DEVID_WIRELESS    0x00010011
 #define EEEPC_WMI_DEVID_TRACKPAD    0x00100011
 
+/*
+ * Prepared WMxx call: method name and argument objects are resolved once,
+ * a call only writes the device ID / value into the reusable arguments.
+ */
+enum
+{
+    kWMICallArgNumber = 0,  // WMxx(0x0D, method, UInt32), e.g. DSTS
+    kWMICallArgDevice,      // WMxx(0x0D, method, { UInt32 devId, UInt32 value }), e.g. DEVS
+    kWMICallArgValue,       // WMxx(0x0D, method, { UInt32 value })
+};
+
+struct WMICall {
+    char method[5];
+    const OSSymbol * symbol;    // method resolved on the WMI device
+    bool present;               // symbol validated, the call's capability bit
+    UInt8 shape;
+    UInt32 buffer[2];
+    OSObject * params[3];
+};
+
+/*
+ * ACPI methods used by the driver, probed once in parseConfig().
+ * Bit n of acpiCaps is set when method n exists on the WMI device.
+ */
+enum
+{
+    kACPIMethodSKBL = 0,
+    kACPIMethodGKBL,
+    kACPIMethodKBPW,
+    kACPIMethodALSC,
+    kACPIMethodALSS,
+    kACPIMethodINIT,
+    kACPIMethodWED,
+    kACPIMethodWMxx,
+    kACPIMethodCount
+};
+
+#define ACPI_CAP(method) (1U << (method))
+
+/*
+ * Per-method statistics kept by acpiEvaluate()/acpiEvaluateInteger()
+ */
+#define kACPIStatSamples        128     // latest latencies kept for the p99
+#define kACPISlowCallDefault    20      // ms, 0 disables the slow call log
+#define kACPISlowLogInterval    10      // s between two slow call log lines
+
+struct ACPIMethodStats {
+    UInt32 calls, errors;
+    UInt64 totalUS;
+    UInt32 minUS, maxUS;
+    UInt32 samples[kACPIStatSamples];
+};
+
+/*
+ * Reusable single argument for the ACPI methods evaluated on the hotkey path,
+ * one slot per method. A slot is rewritten before each evaluation, so after
+ * start() it is only used on the work loop (its event sources or command_gate).
+ */
+enum
+{
+    kACPIArgSKBL = 0,
+    kACPIArgGKBL,
+    kACPIArgALSC,
+    kACPIArgWED,
+    kACPIArgPoolSize
+};
+
+/*
+ * Owns an object returned by evaluateObject and releases it on scope exit.
+ */
+class ACPIResult
+{
+public:
+    ACPIResult() : obj(NULL) {}
+    ~ACPIResult() { OSSafeReleaseNULL(obj); }
+    OSObject ** out() { OSSafeReleaseNULL(obj); return &obj; }
+    OSObject * get() const { return obj; }
+    
+private:
+    ACPIResult(const ACPIResult &);
+    ACPIResult &operator=(const ACPIResult &);
+    OSObject * obj;
+};
+
+/*
+ * ACPI notification captured by message() and handled later on the work loop
+ */
+struct NotifyEvent {
+    UInt32 event;
+    UInt64 time;    // mach absolute time
+};
+
+/*
+ * Shapes firmware returns _WED results in, learnt from the first event
+ */
+enum
+{
+    kWEDShapeUnknown = 0,
+    kWEDShapeNumber,
+    kWEDShapePackage,
+    kWEDShapeBuffer,
+    kWEDShapeCount
+};
+
+#define kWEDStatCacheHits       kWEDShapeCount
+#define kWEDStatShapeChanges    (kWEDShapeCount + 1)
+#define kWEDStatCount           (kWEDShapeCount + 2)
+
+// Recent _WED result per notify value, trusted once it proved constant
+struct WEDCacheEntry {
+    UInt32 code;
+    UInt64 time;    // mach absolute time of the evaluation
+    UInt8 seen;     // evaluations so far, saturating
+    bool variable;  // returned different codes, never cached
+};
+
+#define kWEDCacheSize           256
+#define kWEDCacheConfirm        4       // identical results before the cache is used
+
+/*
+ * Hotkey pipeline stages, each histogram holds the time since the previous stage
+ */
+enum
+{
+    kLatencyQueue = 0,      // message() to the work loop
+    kLatencyWED,            // _WED evaluation and decode
+    kLatencyDecision,       // handleMessage action
+    kLatencyState,          // backlight, NVRAM, ALS and touchpad writes
+    kLatencyKeyPressed,     // until the keys are sent to FnKeysHIKeyboardDevice
+    kLatencyStageCount
+};
+
+#define kNotifyRingDefaultSize  64
+#define kNotifyRingMinSize      8
+#define kNotifyRingMaxSize      4096
+
 #define kIOPMPowerOff                       0
 #define kAsusFnKeysIOPMNumberPowerStates     2
 static IOPMPowerState powerStateArray[kAsusFnKeysIOPMNumberPowerStates] =
@@ -179,9 +334,28 @@ const UInt8 NOTIFY_BRIGHTNESS_UP_MAX = 0x1F;
 const UInt8 NOTIFY_BRIGHTNESS_DOWN_MIN = 0x20;
 const UInt8 NOTIFY_BRIGHTNESS_DOWN_MAX = 0x2F;
 
+/* Firmware encodes the new panel level (0-15) in the low nibble of the
+ * brightness notifications, macOS uses 16 steps of 64 brightness units */
+#define NOTIFY_BRIGHTNESS_LEVEL(code)   (((code) & 0x0F) * 16 / 15)
+#define kPanelBrightnessLevels          16
+#define kPanelBrightnessStep            64
+
+#define kKeyRepeatDelayDefault          500
+#define kKeyRepeatIntervalDefault       100
+#define kKeyReleaseTimeoutDefault       90      // kept below the repeat interval
+
 #define MS_TO_NS(ms) (1000ULL * 1000ULL * (ms))
 #define kAsusKeyboardBacklight "asus-keyboard-backlight"
 
+/* NVRAM keys persisted through the write-behind cache */
+enum
+{
+    kNVRAMKeyboardBacklight = 0,
+    kNVRAMKeyCount
+};
+
+#define kNVRAMFlushDelayDefault 2000    // ms
+
 #define kDeliverNotifications "ASUSFN,deliverNotifications"
 enum
 {
@@ -199,6 +373,56 @@ enum
     kevTouchpad = 4,
 };
 
+/*
+ * Event code dispatch: every code indexes a handler and the side effects it
+ * has, so handleMessage() only runs the work a key actually needs
+ */
+enum
+{
+    kKeyResetsIdle       = 1 << 0,  // restarts the keyboard backlight auto-off timeout
+    kKeyTouchesBacklight = 1 << 1,  // may change the keyboard backlight level
+    kKeyTouchesALS       = 1 << 2,  // may change the ALS state
+    kKeyForwardHID       = 1 << 3,  // sends the (possibly rewritten) code to FnKeysHIKeyboard
+    kKeyTouchesTouchpad  = 1 << 4,  // may change the touchpad state
+};
+
+/*
+ * Firmware and NVRAM state written by reconcileState(), counted apart:
+ * a write is issued when it reaches ACPI or NVRAM, avoided when the
+ * value asked for was already applied or a pending NVRAM value is replaced
+ */
+enum
+{
+    kStateKeyboardBacklight = 0,    // SKBL
+    kStateALS,                      // ALSC
+    kStateNVRAM,                    // one item per NVRAM key from here
+    kStateItemCount = kStateNVRAM + kNVRAMKeyCount
+};
+
+#define kKeyActionCount 256
+
+struct FnKeyEvent {
+    int code;
+    int loopCount;      // key presses to send, 0 for one
+    bool show;          // display the keyboard backlight level
+    bool forward;       // cleared by handlers that already did the work
+};
+
+class AsusFnKeys;
+typedef void (AsusFnKeys::*FnKeyHandler)(FnKeyEvent *event);
+
+struct FnKeyAction {
+    FnKeyHandler handler;
+    UInt8 flags;
+};
+
+struct FnKeyActionDesc {
+    const char *name;   // used by the KeyActions override in Preferences
+    UInt8 first, last;  // event code range
+    FnKeyHandler handler;
+    UInt8 flags;
+};
+
 class AsusFnKeys : public IOService
 {
     OSDeclareDefaultStructors(AsusFnKeys)
@@ -211,6 +435,8 @@ protected:
     OSDictionary * properties;
     
 public:
+    virtual bool serializeProperties(OSSerialize * s) const;
+    virtual IOReturn setProperties(OSObject * properties);
     virtual IOReturn message(UInt32 type, IOService * provider, void * argument);
     
     // standard IOKit methods
@@ -223,35 +449,166 @@ public:
     //power management events
     virtual IOReturn    setPowerState(unsigned long powerStateOrdinal, IOService *policyMaker);
     
+    // Capture records, oldest first, for AsusFnKeysUserClient
+    UInt32 drainCapture(FnKeysTraceRecord *out, UInt32 max);
+    UInt32 captureDropped() const { return capture.dropped(); }
+    
 protected:
-    OSDictionary* getDictByUUID(const char * guid);
-    IOReturn enableFnKeyEvents(const char * guid, UInt32 methodID);
+    void setPowerStateGated(unsigned long *powerStateOrdinal);
+    void drainCaptureGated(FnKeysTraceRecord *out, UInt32 *max, UInt32 *count);
+
+    const struct guid_block * findGuidBlock(const UInt8 * guid);
+    IOReturn enableFnKeyEvents(const UInt8 * guid, UInt32 methodID);
     
     void parseConfig();
+    
+    UInt32 acpiCaps;
+    const OSSymbol * acpiMethods[kACPIMethodCount];
+    void probeACPIMethods();
+    void releaseACPIMethods();
+    
+    // Every evaluation of acpiMethods goes through these to be counted and timed
+    ACPIMethodStats acpiStats[kACPIMethodCount];
+    UInt32 acpiSlowCallMS, acpiSlowCalls, acpiSlowCallsLogged;
+    uint64_t acpiSlowLogTime;
+    IOReturn acpiEvaluate(UInt8 method, OSObject **result, OSObject **params = NULL, IOItemCount count = 0);
+    IOReturn acpiEvaluateInteger(UInt8 method, UInt32 *result, OSObject **params = NULL, IOItemCount count = 0, const OSSymbol *symbol = NULL);
+    UInt32 acpiCallDone(UInt8 method, uint64_t start, IOReturn ret);
+    void captureACPIResult(UInt8 method, IOReturn ret, OSObject *result, UInt32 us);
+    void publishACPIStats(OSDictionary *dict) const;
+    void resetACPIStats();
     void enableEvent();
     void disableEvent();
     
+    // Single producer (ACPI notify thread), single consumer (work loop)
+    IOInterruptEventSource *_notifySource;
+    NotifyEvent *notifyRing;
+    UInt32 notifyRingSize;
+    UInt32 notifyHead, notifyTail;
+    UInt32 notifyDrops, notifyDropsPublished;
+    bool allocNotifyRing();
+    void freeNotifyRing();
+    bool queueNotification(UInt32 event);
+    void drainNotifications(IOInterruptEventSource *sender, int count);
+    bool decodeWED(UInt32 event, UInt64 time, UInt32 *code);
+    bool decodeWEDShape(OSObject *wed, UInt8 shape, UInt32 *code);
+    void countWED(UInt8 counter);
+    UInt8 wedShape;
+    UInt32 wedCacheTime;    // ms, 0 disables the cache
+    WEDCacheEntry wedCache[kWEDCacheSize];
+    // decodes per shape (kWEDShapeUnknown counts failures), cache hits, shape changes
+    UInt32 wedStats[kWEDStatCount];
+    OSNumber *wedStatsNum[kWEDStatCount];
+    
     void handleMessage(int code);
+    
+    FnKeysTrace trace;
+    FnKeysTrace capture;    // firmware inputs, see kCapture* in FnKeysTrace.h
+    FnKeysLatency latency[kLatencyStageCount];
+    uint64_t latencyStamp;
+    void latencyMark(UInt8 stage);
+    
+    static const FnKeyActionDesc keyActionDescs[];
+    FnKeyAction keyActions[kKeyActionCount];
+    void buildKeyActions();
+    void overrideKeyActions(OSDictionary *overrides);
+    
+    void keyNone(FnKeyEvent *event);
+    void keyPanelToggle(FnKeyEvent *event);
+    void keyTouchpad(FnKeyEvent *event);
+    void keySleep(FnKeyEvent *event);
+    void keyALSToggle(FnKeyEvent *event);
+    void keyAirplaneMode(FnKeyEvent *event);
+    void keyALSNotify(FnKeyEvent *event);
+    
+    // ALS notifications of one drain share a single ALSS evaluation
+    UInt32 alsNotifies, alsCoalesced;
+    OSNumber *alsCoalescedNum;
+    void readALS();
+    void keyBacklightDown(FnKeyEvent *event);
+    void keyBacklightUp(FnKeyEvent *event);
+    void keyBrightnessDown(FnKeyEvent *event);
+    void keyBrightnessUp(FnKeyEvent *event);
+    
+    // Press-and-hold: firmware repeats are absorbed, the timer generates repeats instead
+    IOTimerEventSource *_repeatTimer;
+    UInt32 heldKey, heldCode, heldRepeats;   // heldKey is the repeat class, 0 if none
+    uint64_t heldLastSeen;                   // uptime of the last firmware event for heldKey
+    uint64_t heldPeriodNS;                   // measured firmware repeat period, 0 until known
+    UInt32 keyRepeatDelay, keyRepeatInterval, keyReleaseTimeout;   // ms
+    UInt32 repeatsAbsorbed;
+    OSNumber *repeatsAbsorbedNum;
+    static UInt32 repeatKeyClass(UInt32 code);
+    bool absorbRepeat(UInt32 code, uint64_t time);
+    uint64_t heldReleaseNS() const;
+    void repeatTimer();
+    
+    // Applied (firmware/NVRAM/registry) state, written only when the desired state differs
+    SInt8 appliedALS, appliedTouchpad;
+    UInt32 stateWrites[kStateItemCount][2];         // avoided, issued
+    OSNumber *stateWritesNum[kStateItemCount][2];
+    OSNumber *keyboardBLightLevelNum, *panelToggleTimeNum;
+    void reconcileState(UInt8 flags, bool show);
+    void countStateWrite(UInt8 item, bool issued);
+    OSNumber * publishCounter(const char * name, int bits = 32);
+    void applyTouchpadState();
+    
     void processFnKeyEvents(int code, int bLoopCount);
     
     void enableALS(bool state);
     
+    OSNumber * acpiArgPool[kACPIArgPoolSize];
+    UInt32 acpiArgAllocs;
+    OSObject ** acpiArg(UInt8 slot, UInt64 value);
+    void releaseACPIArgs();
+    
     bool keybrdBLight16;
-    UInt8 keybrdBLightLvl, curKeybrdBlvl;
-    void saveKBBacklightToNVRAM(UInt8 level);
-    UInt8 readKBBacklightFromNVRAM();
+    UInt8 keybrdBLightLvl, curKeybrdBlvl;  // desired, applied (0xFF unknown)
+    // Write-behind NVRAM: latest values live here until the flush timer commits them
+    IOTimerEventSource *_nvramTimer;
+    UInt8 nvramValues[kNVRAMKeyCount];     // 0xFF unknown
+    UInt32 nvramDirty;
+    UInt32 nvramFlushDelay;
+    bool nvramReadsBroken;                 // IODTNVRAM versions whose property reads return nothing
+    UInt32 nvramCoalesced, nvramCommitted;
+    OSNumber *nvramCoalescedNum, *nvramCommittedNum;
+    bool persistToNVRAM(UInt8 key, UInt8 value);
+    void persistToNVRAMGated(UInt8 *key, UInt8 *value, bool *queued);
+    void flushNVRAM();
+    void flushNVRAMGated();
+    void writeNVRAM(const char *key, UInt8 value);
+    UInt8 readKBBacklightFromNVRAM(IORegistryEntry *nvram);
+    OSObject * copyNVRAMPropertySerialized(IORegistryEntry *nvram, const char *key);
+    void restoreFromNVRAM(IORegistryEntry *nvram);
+    void restoreFromNVRAMGated(IORegistryEntry *nvram);
+    void removeNVRAMNotifyGated();
+    bool nvramPublished(void * refCon, IOService * newService, IONotifier * notifier);
+    IONotifier *_nvramNotify;
+    uint64_t startTime;
     UInt8 getKeyboardBackLight();
     void setKeyboardBackLight(UInt8 level, bool nvram = true, bool display = false);
     
     UInt32 panelBrightnessLevel;
-    char backlightEntry[1000];
-    int checkBacklightEntry();
-    int findBacklightEntry();
+    UInt32 panelRestoreLevel;   // level before the panel was toggled off, only keyPanelToggle writes it
+    // AppleBacklightDisplay, found through matching notifications and kept retained
+    IOService *_backlightDisplay;
+    IONotifier *_displayPublishNotify, *_displayTerminateNotify, *_displayInterest;
+    bool displayNotificationHandler(void * refCon, IOService * newService, IONotifier * notifier);
+    void displayNotificationGated(IOService * display, void * published);
+    IOReturn displayInterestHandler(void * refCon, UInt32 messageType, IOService * provider, void * messageArgument, vm_size_t argSize);
+    void displayBrightnessChangedGated();
+    void releaseBacklightDisplay();
     void readPanelBrightnessValue();
+    bool setPanelBrightness(UInt32 level);
+    
+    WMICall wmiDSTS, wmiDEVS;
+    bool prepareWMICall(WMICall *call, const UInt8 * guid, UInt32 methodId, UInt8 shape);
+    void releaseWMICall(WMICall *call);
+    IOReturn evaluateWMICall(WMICall *call, UInt32 arg0, UInt32 arg1, UInt32 *result);
     
-    void getDeviceStatus(const char * guid, UInt32 methodId, UInt32 deviceId, UInt32 *status);
-    void setDeviceStatus(const char * guid, UInt32 methodId, UInt32 deviceId, UInt32 *status);
-    void setDevice(const char * guid, UInt32 methodId, UInt32 *status);
+    void getDeviceStatus(UInt32 deviceId, UInt32 *status);
+    void setDeviceStatus(UInt32 deviceId, UInt32 *status);
+    void setDevice(WMICall *call, UInt32 *status);
     
     void notificationHandlerGated(IOService * newService, IONotifier * notifier);
     bool notificationHandler(void * refCon, IOService * newService, IONotifier * notifier);
@@ -264,35 +621,44 @@ protected:
     bool   hasALSensor, isALSenabled;
     bool   isPanelBackLightOn;
     bool   hasMediaButtons, hasKeybrdBLight;
-    int    loopCount;
     
     IOWorkLoop *_workLoop;
     IOTimerEventSource *_autoOffTimer;
     IOCommandGate* command_gate;
     
     void autoOffTimer();
+    void armAutoOffTimer();
     void resetTimer();
+    UInt32 autoOffWakeups;
+    OSNumber *autoOffWakeupsNum;
     bool isautoOff, autoOffEnable;
-    uint64_t keytime = 0;
+    uint64_t keytime = 0;   // written lock-free by keyboard drivers, see message()
+    bool wakeRequest;
     uint64_t autoOffTimeout = 10000000000; // 10 seconds
     
     IONotifier* _publishNotify;
     IONotifier* _terminateNotify;
     OSSet* _notificationServices;
     
-private:
+protected:
+    struct guid_block * wdgBlocks;
+    UInt32 wdgCount;
+    UInt8 wdgHash[WMI_GUID_HASH_SIZE];
+    static UInt8 wmi_guid_hash(const UInt8 *guid);
+    void wmi_index_wdg(const struct guid_block *blocks, UInt32 total);
+    
     int parse_wdg(OSDictionary *dict);
     OSString *flagsToStr(UInt8 flags);
     void wmi_wdg2reg(struct guid_block *g, OSArray *array, OSArray *dataArray);
     OSDictionary * readDataBlock(char *str);
     
-    //utilities
-    int wmi_data2Str(const char *in, char *out);
+    // utilities, static ones do not depend on IOKit state
+    static int wmi_data2Str(const char *in, char *out);
 #ifdef DEBUG
-    bool wmi_parse_guid(const UInt8 *src, UInt8 *dest);
+    static bool wmi_parse_guid(const UInt8 *src, UInt8 *dest);
     void wmi_dump_wdg(struct guid_block *g);
-    int wmi_parse_hexbyte(const UInt8 *src);
-    void wmi_swap_bytes(UInt8 *src, UInt8 *dest);
+    static int wmi_parse_hexbyte(const UInt8 *src);
+    static void wmi_swap_bytes(UInt8 *src, UInt8 *dest);
 #endif
     
 };
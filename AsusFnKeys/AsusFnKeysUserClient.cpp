@@ -0,0 +1,101 @@
+/*
+ *  Copyright (c) 2018 hieplpvip
+ *
+ *
+ *  AsusFnKeysUserClient.cpp
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "AsusFnKeysUserClient.h"
+
+#if DEBUG
+#define DEBUG_LOG(fmt, args...) IOLog(fmt, ## args)
+#else
+#define DEBUG_LOG(fmt, args...)
+#endif
+
+#define kCaptureReadMax (4096 / sizeof(FnKeysTraceRecord))    // records of an inband structure output
+
+#define super IOUserClient
+OSDefineMetaClassAndStructors(AsusFnKeysUserClient, IOUserClient)
+
+const IOExternalMethodDispatch AsusFnKeysUserClient::methods[kAsusFnKeysMethodCount] = {
+    // kAsusFnKeysReadCapture: no input, dropped records out, records out
+    { (IOExternalMethodAction) &AsusFnKeysUserClient::sReadCapture, 0, 0, 1, kIOUCVariableStructureSize },
+};
+
+/*
+ * Capture records tell when every key was pressed, only root may read them
+ */
+bool AsusFnKeysUserClient::initWithTask(task_t owningTask, void *securityToken, UInt32 type, OSDictionary *properties)
+{
+    if (clientHasPrivilege(owningTask, kIOClientPrivilegeAdministrator) != kIOReturnSuccess)
+    {
+        DEBUG_LOG("%s::Denied to a non administrator\n", getName());
+        return false;
+    }
+    
+    fnKeys = NULL;
+    return super::initWithTask(owningTask, securityToken, type, properties);
+}
+
+bool AsusFnKeysUserClient::start(IOService *provider)
+{
+    fnKeys = OSDynamicCast(AsusFnKeys, provider);
+    if (!fnKeys || !super::start(provider))
+        return false;
+    
+    return true;
+}
+
+void AsusFnKeysUserClient::stop(IOService *provider)
+{
+    fnKeys = NULL;
+    super::stop(provider);
+}
+
+IOReturn AsusFnKeysUserClient::clientClose(void)
+{
+    terminate();
+    return kIOReturnSuccess;
+}
+
+IOReturn AsusFnKeysUserClient::externalMethod(uint32_t selector, IOExternalMethodArguments *arguments,
+                                              IOExternalMethodDispatch *dispatch, OSObject *target, void *reference)
+{
+    if (selector >= kAsusFnKeysMethodCount)
+        return kIOReturnBadArgument;
+    
+    dispatch = (IOExternalMethodDispatch *) &methods[selector];
+    return super::externalMethod(selector, arguments, dispatch, this, reference);
+}
+
+IOReturn AsusFnKeysUserClient::sReadCapture(AsusFnKeysUserClient *target, void *reference, IOExternalMethodArguments *arguments)
+{
+    // Larger buffers come as a memory descriptor, not supported
+    if (!target->fnKeys || !arguments->structureOutput)
+        return kIOReturnBadArgument;
+    
+    UInt32 max = arguments->structureOutputSize / sizeof(FnKeysTraceRecord);
+    if (max > kCaptureReadMax)
+        max = kCaptureReadMax;
+    
+    UInt32 count = target->fnKeys->drainCapture((FnKeysTraceRecord *) arguments->structureOutput, max);
+    arguments->structureOutputSize = count * sizeof(FnKeysTraceRecord);
+    arguments->scalarOutput[0] = target->fnKeys->captureDropped();
+    return kIOReturnSuccess;
+}
@@ -0,0 +1,63 @@
+/*
+ *  Copyright (c) 2018 hieplpvip
+ *
+ *
+ *  AsusFnKeysUserClient.h
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _AsusFnKeysUserClient_h
+#define _AsusFnKeysUserClient_h
+
+#include <IOKit/IOUserClient.h>
+#include "AsusFnKeys.h"
+
+/*
+ * Administrator only connection to AsusFnKeys, opened with IOServiceOpen().
+ *
+ * kAsusFnKeysReadCapture moves capture records (FnKeysTraceRecord, see
+ * kCapture* in FnKeysTrace.h) out of the driver, oldest first, into the
+ * structure output, at most 4096 bytes a call, and returns the records
+ * dropped so far as its scalar output. Call it until it returns no records.
+ */
+enum
+{
+    kAsusFnKeysReadCapture = 0,
+    kAsusFnKeysMethodCount
+};
+
+class AsusFnKeysUserClient : public IOUserClient
+{
+    OSDeclareDefaultStructors(AsusFnKeysUserClient)
+    
+private:
+    AsusFnKeys *fnKeys;
+    
+    static const IOExternalMethodDispatch methods[kAsusFnKeysMethodCount];
+    static IOReturn sReadCapture(AsusFnKeysUserClient *target, void *reference, IOExternalMethodArguments *arguments);
+    
+public:
+    virtual bool initWithTask(task_t owningTask, void *securityToken, UInt32 type, OSDictionary *properties);
+    virtual bool start(IOService *provider);
+    virtual void stop(IOService *provider);
+    virtual IOReturn clientClose(void);
+    
+    virtual IOReturn externalMethod(uint32_t selector, IOExternalMethodArguments *arguments,
+                                    IOExternalMethodDispatch *dispatch = 0, OSObject *target = 0, void *reference = 0);
+};
+
+#endif //_AsusFnKeysUserClient_h
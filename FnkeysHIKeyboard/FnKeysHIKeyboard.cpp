@@ -24,6 +24,7 @@
 #include <IOKit/acpi/IOACPIPlatformDevice.h>
 #include <IOKit/hidsystem/ev_keymap.h>
 #include "FnKeysHIKeyboard.h"
+#include "FnKeysHIKeyboardDevice.h"
 
 #if DEBUG
 #define DEBUG_LOG(fmt, args...) IOLog(fmt, ## args)
@@ -41,6 +42,15 @@ OSDefineMetaClassAndStructors(FnKeysHIKeyboard, IOHIKeyboard)
 
 bool FnKeysHIKeyboard::init(OSDictionary *dictionary)
 {
+    _workLoop = NULL;
+    _commandGate = NULL;
+    _backlogTimer = NULL;
+    keyRate = kKeyRateLimitDefault;
+    keyBurst = kKeyRateBurstDefault;
+    memset(buckets, 0, sizeof(buckets));
+    eventsPosted = eventsCoalesced = eventsDropped = 0;
+    eventsPostedNum = eventsCoalescedNum = eventsDroppedNum = NULL;
+    latencyReset(&hidLatency);
     return super::init(dictionary);
 }
 
@@ -53,45 +63,103 @@ bool FnKeysHIKeyboard::start(IOService *provider)
     }
     
     Device = (FnKeysHIKeyboardDevice *) provider;
-    clock_get_system_microtime(&lastEventSecs,&lastEventMicrosecs);
     
     setProperty("Product", "Fn Keys Keyboard Driver for Asus");
     
+    // Rate limit from the personality in Info.plist
+    if (OSNumber *rate = OSDynamicCast(OSNumber, getProperty("KeyRateLimit")))
+        keyRate = rate->unsigned32BitValue();
+    if (OSNumber *burst = OSDynamicCast(OSNumber, getProperty("KeyRateBurst")))
+        keyBurst = burst->unsigned32BitValue();
+    if (!keyBurst)
+        keyBurst = 1;
+    IOLog("%s::Key rate limit %u/s, burst %u\n", getName(), (unsigned int)keyRate, (unsigned int)keyBurst);
+    
+    _workLoop = getWorkLoop();
+    if (!_workLoop)
+        return false;
+    _workLoop->retain();
+    
+    _commandGate = IOCommandGate::commandGate(this);
+    if (!_commandGate)
+        return false;
+    _workLoop->addEventSource(_commandGate);
+    
+    _backlogTimer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &FnKeysHIKeyboard::backlogTimer));
+    if (!_backlogTimer)
+        return false;
+    _workLoop->addEventSource(_backlogTimer);
+    
+    eventsPostedNum = OSNumber::withNumber(0ULL, 32);
+    eventsCoalescedNum = OSNumber::withNumber(0ULL, 32);
+    eventsDroppedNum = OSNumber::withNumber(0ULL, 32);
+    if (eventsPostedNum)
+        setProperty("KeyEventsPosted", eventsPostedNum);
+    if (eventsCoalescedNum)
+        setProperty("KeyEventsCoalesced", eventsCoalescedNum);
+    if (eventsDroppedNum)
+        setProperty("KeyEventsDropped", eventsDroppedNum);
+    
     return true;
 }
 
 void FnKeysHIKeyboard::stop(IOService *provider)
 {
+    if (_backlogTimer)
+    {
+        _backlogTimer->cancelTimeout();
+        _workLoop->removeEventSource(_backlogTimer);
+    }
+    OSSafeReleaseNULL(_backlogTimer);
+    
+    if (_commandGate)
+        _workLoop->removeEventSource(_commandGate);
+    OSSafeReleaseNULL(_commandGate);
+    OSSafeReleaseNULL(_workLoop);
+    
+    OSSafeReleaseNULL(eventsPostedNum);
+    OSSafeReleaseNULL(eventsCoalescedNum);
+    OSSafeReleaseNULL(eventsDroppedNum);
+    
     super::stop(provider);
 }
 
 
 void FnKeysHIKeyboard::free(void)
 {
+    trace.free();
     super::free();
 }
 
 /*
- * Receive hotkey event (only down) and send keyboard down and up event
+ * Receive hotkey events (only down) and send keyboard down and up events
  * Limits the rate of event send to HID stack, otherwise the system slow down and the sound/sun bezel lags.
  */
 IOReturn FnKeysHIKeyboard::message(UInt32 type, IOService * provider, void * argument)
 {
-    if (type == kIOACPIMessageDeviceNotification)
+    AbsoluteTime now;
+    
+    if (type == kFnKeysMessageKeyBatch)
     {
-        UInt32 code = *((UInt32 *) argument);
-        
+        const FnKeysKeyBatch *batch = (const FnKeysKeyBatch *) argument;
         
-        AbsoluteTime now;
+        // One timestamp base for the whole batch, records keep their own queue time
         clock_get_uptime((uint64_t *)(&now));
-        dispatchKeyboardEvent(code,
-                              /*direction*/ true,
-                              /*timeStamp*/ now);
+        for (UInt32 i = 0; i < batch->count && i < kFnKeysKeyBatchMax; i++)
+        {
+            const FnKeysKeyEvent *event = &batch->events[i];
+            AbsoluteTime time = now;
+            if (event->time)
+                *((uint64_t *)(&time)) = event->time;
+            postKey(event->key, event->repeat, time);
+        }
+    }
+    else if (type == kIOACPIMessageDeviceNotification)
+    {
+        UInt32 code = *((UInt32 *) argument);
         
         clock_get_uptime((uint64_t *)(&now));
-        dispatchKeyboardEvent(code,
-                              /*direction*/ false,
-                              /*timeStamp*/ now);
+        postKey(code, 1, now);
     }
     else
     {
@@ -100,6 +168,169 @@ IOReturn FnKeysHIKeyboard::message(UInt32 type, IOService * provider, void * arg
     return kIOReturnSuccess;
 }
 
+void FnKeysHIKeyboard::postKey(unsigned int code, unsigned int repeat, AbsoluteTime time)
+{
+    if (!keyRate || !_commandGate)
+    {
+        dispatchKey(code, repeat, time);
+        eventsPosted += repeat;
+        publishStats();
+        return;
+    }
+    
+    _commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &FnKeysHIKeyboard::postKeyGated),
+                            (void *)(uintptr_t) code, (void *)(uintptr_t) repeat, &time);
+}
+
+/*
+ * Token bucket per keycode. Events beyond the burst are not thrown away but
+ * coalesced into a backlog count, which backlogTimer() releases at keyRate
+ * so the final state (volume, brightness) still matches every key pressed.
+ */
+void FnKeysHIKeyboard::postKeyGated(void * code, void * repeat, void * time)
+{
+    unsigned int key = (unsigned int)(uintptr_t) code;
+    KeyBucket *bucket = &buckets[key & 0xFF];
+    UInt32 wanted = bucket->backlog + (UInt32)(uintptr_t) repeat;
+    
+    UInt32 allowed = takeTokens(bucket, wanted, *((uint64_t *) time));
+    if (allowed)
+        dispatchKey(key, allowed, *((AbsoluteTime *) time));
+    
+    wanted -= allowed;
+    if (wanted > kKeyBacklogMax)
+    {
+        trace.record(kTraceKeyDropped, key, wanted - kKeyBacklogMax);
+        eventsDropped += wanted - kKeyBacklogMax;
+        wanted = kKeyBacklogMax;
+    }
+    if (wanted > bucket->backlog)
+    {
+        trace.record(kTraceKeyCoalesced, key, wanted);
+        eventsCoalesced += wanted - bucket->backlog;
+    }
+    bucket->backlog = wanted;
+    eventsPosted += allowed;
+    
+    if (bucket->backlog)
+        _backlogTimer->setTimeoutUS((1000000 + keyRate - 1) / keyRate);
+    
+    publishStats();
+}
+
+UInt32 FnKeysHIKeyboard::takeTokens(KeyBucket * bucket, UInt32 wanted, UInt64 now)
+{
+    UInt32 cap = keyBurst * 1000;
+    
+    if (!bucket->last)
+        bucket->tokens = cap;
+    else if (now > bucket->last)
+    {
+        uint64_t elapsed_ns;
+        absolutetime_to_nanoseconds(now - bucket->last, &elapsed_ns);
+        uint64_t refill = elapsed_ns * keyRate / 1000000;
+        bucket->tokens = refill >= cap - bucket->tokens ? cap : bucket->tokens + (UInt32) refill;
+    }
+    if (now > bucket->last)
+        bucket->last = now;
+    
+    UInt32 allowed = bucket->tokens / 1000;
+    if (allowed > wanted)
+        allowed = wanted;
+    bucket->tokens -= allowed * 1000;
+    return allowed;
+}
+
+void FnKeysHIKeyboard::backlogTimer(IOTimerEventSource * timer)
+{
+    AbsoluteTime now;
+    clock_get_uptime((uint64_t *)(&now));
+    
+    bool pending = false;
+    for (unsigned int key = 0; key < 256; key++)
+    {
+        KeyBucket *bucket = &buckets[key];
+        if (!bucket->backlog)
+            continue;
+        
+        UInt32 allowed = takeTokens(bucket, bucket->backlog, *((uint64_t *)(&now)));
+        if (allowed)
+        {
+            dispatchKey(key, allowed, now);
+            bucket->backlog -= allowed;
+            eventsPosted += allowed;
+        }
+        pending |= bucket->backlog != 0;
+    }
+    
+    if (pending)
+        timer->setTimeoutUS((1000000 + keyRate - 1) / keyRate);
+    
+    publishStats();
+}
+
+void FnKeysHIKeyboard::dispatchKey(unsigned int code, unsigned int repeat, AbsoluteTime time)
+{
+    uint64_t now;
+    clock_get_uptime(&now);
+    if (now > *((uint64_t *)(&time)))
+        latencyRecord(&hidLatency, now - *((uint64_t *)(&time)));
+    trace.record(kTraceKeyDispatch, code, repeat);
+    
+    for (unsigned int j = 0; j < repeat; j++)
+    {
+        dispatchKeyboardEvent(code,
+                              /*direction*/ true,
+                              /*timeStamp*/ time);
+        dispatchKeyboardEvent(code,
+                              /*direction*/ false,
+                              /*timeStamp*/ time);
+    }
+}
+
+void FnKeysHIKeyboard::publishStats()
+{
+    if (eventsPostedNum)
+        eventsPostedNum->setValue(eventsPosted);
+    if (eventsCoalescedNum)
+        eventsCoalescedNum->setValue(eventsCoalesced);
+    if (eventsDroppedNum)
+        eventsDroppedNum->setValue(eventsDropped);
+}
+
+/*
+ * Histograms are refreshed when the registry is read, not on the hot path
+ */
+bool FnKeysHIKeyboard::serializeProperties(OSSerialize * s) const
+{
+    if (OSDictionary *dict = OSDictionary::withCapacity(1))
+    {
+        latencyPublish(dict, "HID", &hidLatency);
+        const_cast<FnKeysHIKeyboard *>(this)->setProperty("LatencyHistograms", dict);
+        dict->release();
+    }
+    trace.publish(const_cast<FnKeysHIKeyboard *>(this));
+    return super::serializeProperties(s);
+}
+
+IOReturn FnKeysHIKeyboard::setProperties(OSObject * properties)
+{
+    static const char * const instrumentationKeys[] = { "TraceEnabled", "ResetLatency", NULL };
+    
+    OSDictionary *dict = OSDynamicCast(OSDictionary, properties);
+    if (instrumentationDenied(dict, instrumentationKeys))
+        return kIOReturnNotPrivileged;
+    
+    bool handled = trace.setProperties(dict);
+    
+    if (dict && dict->getObject("ResetLatency"))
+    {
+        latencyReset(&hidLatency);
+        handled = true;
+    }
+    return handled ? kIOReturnSuccess : super::setProperties(properties);
+}
+
 #pragma mark -
 #pragma mark IOHIKeyboard override
 #pragma mark -
@@ -25,6 +25,20 @@
 #define _FnKeysHIDKeyboard_h
 
 #include <IOKit/hidsystem/IOHIKeyboard.h>
+#include <IOKit/IOCommandGate.h>
+#include <IOKit/IOTimerEventSource.h>
+#include "FnKeysHIKeyboardDevice.h"
+
+#define kKeyRateLimitDefault 40     // events per second and key, 0 disables limiting
+#define kKeyRateBurstDefault 16     // events a key may send back to back
+#define kKeyBacklogMax       64     // coalesced events kept per key before dropping
+
+// Token bucket of one keycode, tokens are in thousandths of an event
+typedef struct {
+    UInt32 tokens;
+    UInt32 backlog;
+    UInt64 last;
+} KeyBucket;
 
 class FnKeysHIKeyboardDevice;
 
@@ -34,8 +48,18 @@ class FnKeysHIKeyboard : public IOHIKeyboard
     
 private:
     FnKeysHIKeyboardDevice *Device;
-    clock_sec_t  lastEventSecs;
-    clock_usec_t lastEventMicrosecs;
+    
+    IOWorkLoop *_workLoop;
+    IOCommandGate *_commandGate;
+    IOTimerEventSource *_backlogTimer;
+    
+    UInt32 keyRate, keyBurst;
+    KeyBucket buckets[256];
+    UInt32 eventsPosted, eventsCoalesced, eventsDropped;
+    OSNumber *eventsPostedNum, *eventsCoalescedNum, *eventsDroppedNum;
+    
+    FnKeysTrace trace;
+    FnKeysLatency hidLatency;   // key queued on FnKeysHIKeyboardDevice to dispatchKeyboardEvent
     
 public:
     // standard IOKit methods
@@ -46,6 +70,19 @@ public:
     
     IOReturn message( UInt32 type, IOService * provider, void * argument);
     
+    virtual bool serializeProperties(OSSerialize * s) const;
+    virtual IOReturn setProperties(OSObject * properties);
+    
+private:
+    void postKey(unsigned int code, unsigned int repeat, AbsoluteTime time);
+    void postKeyGated(void * code, void * repeat, void * time);
+    UInt32 takeTokens(KeyBucket * bucket, UInt32 wanted, UInt64 now);
+    void dispatchKey(unsigned int code, unsigned int repeat, AbsoluteTime time);
+    void backlogTimer(IOTimerEventSource * timer);
+    void publishStats();
+    
+public:
+    
     // IOHIKeyboard specific methods
     virtual const unsigned char * defaultKeymapOfLength(UInt32 * length);
 };
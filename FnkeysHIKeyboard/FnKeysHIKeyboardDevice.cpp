@@ -35,6 +35,14 @@
 OSDefineMetaClassAndStructors(FnKeysHIKeyboardDevice, IOService);
 
 
+bool FnKeysHIKeyboardDevice::init(OSDictionary * dictionary)
+{
+    keyMap = NULL;
+    memset(keyTable, kFnKeysKeyUnmapped, sizeof(keyTable));
+    pending.count = 0;
+    return super::init(dictionary);
+}
+
 bool FnKeysHIKeyboardDevice::attach(IOService * provider )
 {
     if (!super::attach(provider))  return false;
@@ -54,26 +62,106 @@ void FnKeysHIKeyboardDevice::detach(IOService * provider )
     super::detach(provider);
 }
 
+void FnKeysHIKeyboardDevice::free(void)
+{
+    trace.free();
+    super::free();
+}
+
+bool FnKeysHIKeyboardDevice::serializeProperties(OSSerialize * s) const
+{
+    trace.publish(const_cast<FnKeysHIKeyboardDevice *>(this));
+    return super::serializeProperties(s);
+}
+
+IOReturn FnKeysHIKeyboardDevice::setProperties(OSObject * properties)
+{
+    static const char * const instrumentationKeys[] = { "TraceEnabled", NULL };
+    
+    OSDictionary *dict = OSDynamicCast(OSDictionary, properties);
+    if (instrumentationDenied(dict, instrumentationKeys))
+        return kIOReturnNotPrivileged;
+    
+    if (trace.setProperties(dict))
+        return kIOReturnSuccess;
+    return super::setProperties(properties);
+}
+
+bool FnKeysHIKeyboardDevice::mapKey(int code, UInt8 *out)
+{
+    if ((unsigned int) code >= kFnKeysKeyTableSize || keyTable[code] == kFnKeysKeyUnmapped)
+    {
+        DEBUG_LOG("%s::Unknown key %02X\n", getName(), code);
+        return false;
+    }
+    
+    *out = keyTable[code];
+    return true;
+}
+
+/*
+ * Send a single key right away, without touching the pending batch
+ */
 void FnKeysHIKeyboardDevice::keyPressed(int code)
 {
-    int i = 0, out;
-    do
+    FnKeysKeyBatch batch;
+    
+    if (!mapKey(code, &batch.events[0].key))
+        return;
+    
+    DEBUG_LOG("%s::Key Pressed %02X\n", getName(), code);
+    batch.count = 1;
+    batch.events[0].repeat = 1;
+    clock_get_uptime(&batch.events[0].time);
+    trace.record(kTraceKeyBatch, batch.count);
+    messageClients(kFnKeysMessageKeyBatch, &batch, sizeof(batch));
+}
+
+void FnKeysHIKeyboardDevice::queueKey(int code, int repeat)
+{
+    UInt8 out;
+    
+    if (repeat <= 0 || !mapKey(code, &out))
+        return;
+    
+    DEBUG_LOG("%s::Key Queued %02X x%d\n", getName(), code, repeat);
+    trace.record(kTraceKeyQueued, out, repeat);
+    
+    uint64_t now;
+    clock_get_uptime(&now);
+    
+    while (repeat > 0)
     {
-	    if (keyMap[i].description == NULL && keyMap[i].in == 0 && keyMap[i].out == 0xFF)
-	    {
-            DEBUG_LOG("%s::Unknown key %02X i=%d\n", getName(), code, i);
-    	    break;
-	    }
-	    if (keyMap[i].in == code)
-	    {
-            DEBUG_LOG("%s::Key Pressed %02X i=%d\n", getName(), code, i);
-    	    out = keyMap[i].out;
-    	    messageClients(kIOACPIMessageDeviceNotification, &out);
-    	    break;
-	    }
-	    i++;
+        FnKeysKeyEvent *last = pending.count ? &pending.events[pending.count - 1] : NULL;
+        
+        // Same key as the previous record, fold it into its repeat count
+        if (last && last->key == out && last->repeat < 0xFF)
+        {
+            int n = repeat < 0xFF - last->repeat ? repeat : 0xFF - last->repeat;
+            last->repeat += n;
+            repeat -= n;
+            continue;
+        }
+        
+        if (pending.count == kFnKeysKeyBatchMax)
+            flushKeys();
+        
+        FnKeysKeyEvent *event = &pending.events[pending.count++];
+        event->key = out;
+        event->repeat = repeat < 0xFF ? repeat : 0xFF;
+        event->time = now;
+        repeat -= event->repeat;
     }
-    while (true);    
+}
+
+void FnKeysHIKeyboardDevice::flushKeys()
+{
+    if (!pending.count)
+        return;
+    
+    trace.record(kTraceKeyBatch, pending.count);
+    messageClients(kFnKeysMessageKeyBatch, &pending, sizeof(pending));
+    pending.count = 0;
 }
 
 
@@ -81,6 +169,7 @@ void FnKeysHIKeyboardDevice::setKeyMap(const FnKeysKeyMap *_keyMap)
 {
     int i = 0;
     keyMap = _keyMap;
+    memset(keyTable, kFnKeysKeyUnmapped, sizeof(keyTable));
     OSDictionary *dict = OSDictionary::withCapacity(10);
     DEBUG_LOG("%s::Setting key %02X i=%d\n", getName(), keyMap[i].in, i);
     do
@@ -88,10 +177,18 @@ void FnKeysHIKeyboardDevice::setKeyMap(const FnKeysKeyMap *_keyMap)
 	    if (keyMap[i].description == NULL && keyMap[i].in == 0 && keyMap[i].out == 0xFF)
     	    break;
         DEBUG_LOG("%s::Setting key %02X i=%d\n", getName(), keyMap[i].in, i);
-	    dict->setObject(keyMap[i].description, OSNumber::withNumber(keyMap[i].in,8));
+        // first entry wins, as with the former linear scan
+        if (keyMap[i].in < kFnKeysKeyTableSize && keyTable[keyMap[i].in] == kFnKeysKeyUnmapped)
+            keyTable[keyMap[i].in] = keyMap[i].out;
+        if (OSNumber *number = OSNumber::withNumber(keyMap[i].in,8))
+        {
+            dict->setObject(keyMap[i].description, number);
+            number->release();
+        }
 	    i++;
     }
     while (true);
     
     setProperty("KeyMap", dict);
+    dict->release();
 }
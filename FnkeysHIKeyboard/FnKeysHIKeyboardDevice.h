@@ -25,6 +25,7 @@
 #define _FnKeysHIKeyboardDevice_h
 
 #include <IOKit/IOService.h>
+#include "FnKeysTrace.h"
 
 typedef struct  {
     UInt16 in;
@@ -32,6 +33,24 @@ typedef struct  {
     const char *description;
 } FnKeysKeyMap;
 
+#define kFnKeysKeyTableSize 256
+#define kFnKeysKeyUnmapped  0xFF
+
+// Key events sent to FnKeysHIKeyboard in one message (data is FnKeysKeyBatch*)
+#define kFnKeysMessageKeyBatch iokit_vendor_specific_msg(200)
+#define kFnKeysKeyBatchMax     32
+
+typedef struct {
+    UInt8 key;       // scancode from the key map
+    UInt8 repeat;    // number of down/up pairs to post
+    UInt64 time;     // uptime the key was queued
+} FnKeysKeyEvent;
+
+typedef struct {
+    UInt32 count;
+    FnKeysKeyEvent events[kFnKeysKeyBatchMax];
+} FnKeysKeyBatch;
+
 class AsusFnKeys;
 
 class FnKeysHIKeyboardDevice : public IOService
@@ -42,14 +61,31 @@ private:
     AsusFnKeys *FnKeys;
     
 public:
+    virtual bool init(OSDictionary * dictionary = 0);
     virtual bool attach(IOService * provider);
     virtual void detach(IOService * provider);
+    virtual void free(void);
+    
+    virtual bool serializeProperties(OSSerialize * s) const;
+    virtual IOReturn setProperties(OSObject * properties);
     
     void keyPressed(int code);
     
+    // Queue keys and send them to the keyboard with one message on flushKeys()
+    void queueKey(int code, int repeat = 1);
+    void flushKeys();
+    
     const FnKeysKeyMap * keyMap;
     void setKeyMap(const FnKeysKeyMap * _keyMap);
     
+private:
+    // keyMap compiled into a direct lookup, kFnKeysKeyUnmapped for unknown codes
+    UInt8 keyTable[kFnKeysKeyTableSize];
+    
+    FnKeysKeyBatch pending;
+    FnKeysTrace trace;
+    bool mapKey(int code, UInt8 *out);
+    
 };
 
 #endif //_FnKeysHIKeyboardDevice_h
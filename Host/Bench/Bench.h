@@ -0,0 +1,85 @@
+/*
+ *  Copyright (c) 2018 hieplpvip
+ *
+ *
+ *  Bench.h
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _Bench_h
+#define _Bench_h
+
+#include "FnKeysHost.h"
+
+/*
+ * Microbenchmarks of the driver's hot functions. A benchmark sets up what it
+ * needs, then times run.iterations operations between run.start() and
+ * run.stop(). The runner grows the iteration count until a run lasts the
+ * minimum time, and reports wall clock ns/op and heap allocations/op.
+ *
+ * Allocations made by the mock firmware for its results are not the
+ * driver's and are left out, set run.firmware to the device in use.
+ */
+
+struct BenchRun {
+    UInt64 iterations;
+    MockACPIDevice *firmware;
+
+    void start();
+    void stop();
+
+    UInt64 elapsedNS, allocations;
+    UInt64 startNS, startAllocations;
+};
+
+typedef void (*BenchFunction)(BenchRun &run);
+
+struct BenchCase {
+    const char *name;
+    BenchFunction function;
+    BenchCase *next;
+};
+
+struct BenchRegistrar {
+    BenchRegistrar(BenchCase *bench);
+};
+
+#define HOST_BENCH(symbol, name) \
+    static void symbol(BenchRun &run); \
+    static BenchCase symbol##_case = { name, symbol, NULL }; \
+    static BenchRegistrar symbol##_registrar(&symbol##_case); \
+    static void symbol(BenchRun &run)
+
+// Keeps the compiler from dropping a result
+template <typename T> inline void benchKeep(const T &value)
+{
+    __asm__ __volatile__("" : : "g"(&value) : "memory");
+}
+
+// Deterministic xorshift, the same event mixes on every run
+struct BenchRandom {
+    UInt64 state;
+    explicit BenchRandom(UInt64 seed = 0x9E3779B97F4A7C15ULL) : state(seed) {}
+    UInt32 next()
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return (UInt32)(state >> 32);
+    }
+};
+
+#endif //_Bench_h
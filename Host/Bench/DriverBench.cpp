@@ -0,0 +1,530 @@
+/*
+ *  Copyright (c) 2018 hieplpvip
+ *
+ *
+ *  DriverBench.cpp
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "Bench.h"
+
+/*
+ * AsusFnKeys with the functions under test reachable, loaded in its place
+ */
+class BenchAsusFnKeys : public AsusFnKeys
+{
+    OSDeclareDefaultStructors(BenchAsusFnKeys)
+
+public:
+    using AsusFnKeys::handleMessage;
+    using AsusFnKeys::decodeWED;
+    using AsusFnKeys::findGuidBlock;
+    using AsusFnKeys::flagsToStr;
+    using AsusFnKeys::wmi_data2Str;
+    using AsusFnKeys::getDeviceStatus;
+    using AsusFnKeys::setDeviceStatus;
+
+    FnKeysHIKeyboardDevice *keyboardDevice() const { return _keyboardDevice; }
+
+    // DSTS/DEVS as they were before the prepared WMICall handles
+    void oldGetDeviceStatus(const char * guid, UInt32 methodId, UInt32 deviceId, UInt32 *status);
+    void oldSetDeviceStatus(const char * guid, UInt32 methodId, UInt32 deviceId, UInt32 *status);
+};
+
+OSDefineMetaClassAndStructors(BenchAsusFnKeys, AsusFnKeys)
+
+static BenchAsusFnKeys *startDriver(FnKeysHost &host)
+{
+    host.setDriverClass("BenchAsusFnKeys");
+    host.publishNVRAM();
+    if (!host.start())
+    {
+        fprintf(stderr, "AsusFnKeys did not start\n");
+        abort();
+    }
+    return OSDynamicCast(BenchAsusFnKeys, host.fnKeys());
+}
+
+#pragma mark -
+#pragma mark Event mixes
+#pragma mark -
+
+/*
+ * What a unit sends over a session, by weight: volume and brightness keys,
+ * the ALS notifications that arrive in bursts while the light flickers,
+ * keyboard backlight steps and a few rarer keys
+ */
+static const struct { UInt8 first, last; UInt8 weight; } mixDesktop[] = {
+    { 0x30, 0x31, 30 },     // volume up/down
+    { 0x32, 0x32, 4 },      // mute
+    { 0x10, 0x1F, 12 },     // brightness up, level in the low nibble
+    { 0x20, 0x2F, 12 },     // brightness down
+    { 0xC6, 0xC7, 30 },     // ALS notifications
+    { 0xC4, 0xC5, 8 },      // keyboard backlight
+    { 0x6B, 0x6B, 2 },      // touchpad
+    { 0x57, 0x58, 2 },      // AC plug, ignored
+};
+
+#define kMixSize 4096
+
+static void buildMix(UInt8 *codes, UInt32 count)
+{
+    UInt32 total = 0;
+    for (size_t i = 0; i < sizeof(mixDesktop) / sizeof(mixDesktop[0]); i++)
+        total += mixDesktop[i].weight;
+
+    BenchRandom random;
+    for (UInt32 n = 0; n < count; n++)
+    {
+        UInt32 pick = random.next() % total;
+        size_t i = 0;
+        while (pick >= mixDesktop[i].weight)
+            pick -= mixDesktop[i++].weight;
+        codes[n] = mixDesktop[i].first + random.next() % (mixDesktop[i].last - mixDesktop[i].first + 1);
+    }
+}
+
+#pragma mark -
+#pragma mark _WDG tables
+#pragma mark -
+
+/*
+ * The ATK table of the mock, the same table behind a run of other vendors'
+ * blocks (a WMI device exposing many GUIDs), or a raw _WDG buffer extracted
+ * from a machine's DSDT and named by FNKEYS_BENCH_WDG
+ */
+static OSData *wdgTable(UInt32 extraBlocks)
+{
+    OSData *table = OSData::withCapacity((extraBlocks + 3) * sizeof(struct guid_block));
+
+    const char *path = getenv("FNKEYS_BENCH_WDG");
+    if (FILE *file = path ? fopen(path, "rb") : NULL)
+    {
+        UInt8 buffer[sizeof(struct guid_block)];
+        while (fread(buffer, 1, sizeof(buffer), file) == sizeof(buffer))
+            table->appendBytes(buffer, sizeof(buffer));
+        fclose(file);
+        return table;
+    }
+
+    BenchRandom random(extraBlocks);
+    for (UInt32 i = 0; i < extraBlocks; i++)
+    {
+        struct guid_block block;
+        for (int j = 0; j < 16; j += 4)
+        {
+            UInt32 word = random.next();
+            memcpy(&block.guid[j], &word, 4);
+        }
+        block.object_id[0] = 'A' + i / 26 % 26;
+        block.object_id[1] = 'A' + i % 26;
+        block.instance_count = 1;
+        block.flags = i & 1 ? ACPI_WMI_METHOD : ACPI_WMI_EXPENSIVE;
+        table->appendBytes(&block, sizeof(block));
+    }
+    table->appendBytes(MockACPIDevice::asusWDG, sizeof(MockACPIDevice::asusWDG));
+    return table;
+}
+
+// GUIDs of every block of the table in turn, or GUIDs that are not there
+static std::vector<UInt8> wdgGuids(OSData *table, bool hit)
+{
+    UInt32 count = table->getLength() / sizeof(struct guid_block);
+    std::vector<UInt8> guids(count * 16);
+    for (UInt32 i = 0; i < count; i++)
+        memcpy(&guids[i * 16], (const UInt8 *) table->getBytesNoCopy() + i * sizeof(struct guid_block), 16);
+    if (!hit)
+        for (UInt32 i = 0; i < count; i++)
+            guids[i * 16 + 15] ^= 0x5A;
+    return guids;
+}
+
+static void benchFindGuidBlock(BenchRun &run, UInt32 extraBlocks, bool hit)
+{
+    FnKeysHost host;
+    OSData *table = wdgTable(extraBlocks);
+    host.acpi()->setResult("_WDG", table);
+    BenchAsusFnKeys *driver = startDriver(host);
+
+    std::vector<UInt8> guids = wdgGuids(table, hit);
+    UInt32 count = (UInt32) guids.size() / 16;
+    table->release();
+
+    run.start();
+    for (UInt64 i = 0; i < run.iterations; i++)
+        benchKeep(driver->findGuidBlock(&guids[(i % count) * 16]));
+    run.stop();
+}
+
+/*
+ * The lookup findGuidBlock replaced: a walk of the "WDG" property, one
+ * dictionary per block, comparing GUID strings
+ */
+static OSDictionary *getDictByUUID(OSArray *array, const char *guid)
+{
+    for (UInt32 i = 0; i < array->getCount(); i++)
+    {
+        OSDictionary *dict = OSDynamicCast(OSDictionary, array->getObject(i));
+        OSString *uuid = OSDynamicCast(OSString, dict->getObject("UUID"));
+        if (uuid->isEqualTo(guid))
+            return dict;
+    }
+    return NULL;
+}
+
+static void benchGetDictByUUID(BenchRun &run, UInt32 extraBlocks, bool hit)
+{
+    FnKeysHost host;
+    OSData *table = wdgTable(extraBlocks);
+    host.acpi()->setResult("_WDG", table);
+    BenchAsusFnKeys *driver = startDriver(host);
+    OSArray *array = OSDynamicCast(OSArray, driver->getProperty("WDG"));
+
+    // Callers passed the GUID as a string constant
+    std::vector<UInt8> guids = wdgGuids(table, hit);
+    UInt32 count = (UInt32) guids.size() / 16;
+    std::vector<char> strings(count * 37);
+    for (UInt32 i = 0; i < count; i++)
+        BenchAsusFnKeys::wmi_data2Str((const char *) &guids[i * 16], &strings[i * 37]);
+    table->release();
+
+    run.start();
+    for (UInt64 i = 0; i < run.iterations; i++)
+        benchKeep(getDictByUUID(array, &strings[(i % count) * 37]));
+    run.stop();
+}
+
+#define kATKBlocks (sizeof(MockACPIDevice::asusWDG) / sizeof(struct guid_block))
+
+HOST_BENCH(findGuidBlockATK, "findGuidBlock/atk")
+{
+    benchFindGuidBlock(run, 0, true);
+}
+
+HOST_BENCH(getDictByUUIDATK, "getDictByUUID/atk")
+{
+    benchGetDictByUUID(run, 0, true);
+}
+
+// Index against the old scan on _WDG tables of 10 to 200 blocks
+#define WDG_SWEEP(blocks) \
+    HOST_BENCH(findGuidBlock##blocks, "findGuidBlock/" #blocks) \
+    { \
+        benchFindGuidBlock(run, blocks - kATKBlocks, true); \
+    } \
+    HOST_BENCH(getDictByUUID##blocks, "getDictByUUID/" #blocks) \
+    { \
+        benchGetDictByUUID(run, blocks - kATKBlocks, true); \
+    }
+
+WDG_SWEEP(10)
+WDG_SWEEP(25)
+WDG_SWEEP(50)
+WDG_SWEEP(100)
+WDG_SWEEP(200)
+
+HOST_BENCH(findGuidBlockMiss, "findGuidBlock/miss")
+{
+    benchFindGuidBlock(run, 200 - kATKBlocks, false);
+}
+
+HOST_BENCH(getDictByUUIDMiss, "getDictByUUID/miss")
+{
+    benchGetDictByUUID(run, 200 - kATKBlocks, false);
+}
+
+#pragma mark -
+#pragma mark WMI calls
+#pragma mark -
+
+void BenchAsusFnKeys::oldGetDeviceStatus(const char * guid, UInt32 methodId, UInt32 deviceId, UInt32 *status)
+{
+    char method[5];
+    OSObject * params[3];
+    OSString *str;
+    OSDictionary *dict = getDictByUUID(OSDynamicCast(OSArray, getProperty("WDG")), guid);
+    if (NULL == dict)
+        return;
+    
+    str = OSDynamicCast(OSString, dict->getObject("object_id"));
+    if (NULL == str)
+        return;
+    
+    snprintf(method, 5, "WM%s", str->getCStringNoCopy());
+    
+    params[0] = OSNumber::withNumber(0x00D,32);
+    params[1] = OSNumber::withNumber(methodId,32);
+    params[2] = OSNumber::withNumber(deviceId,32);
+    
+    WMIDevice->evaluateInteger(method, status, params, 3);
+    
+    params[0]->release();
+    params[1]->release();
+    params[2]->release();
+}
+
+void BenchAsusFnKeys::oldSetDeviceStatus(const char * guid, UInt32 methodId, UInt32 deviceId, UInt32 *status)
+{
+    char method[5];
+    char buffer[8];
+    OSObject * params[3];
+    OSString *str;
+    OSDictionary *dict = getDictByUUID(OSDynamicCast(OSArray, getProperty("WDG")), guid);
+    if (NULL == dict)
+        return;
+    
+    str = OSDynamicCast(OSString, dict->getObject("object_id"));
+    if (NULL == str)
+        return;
+    
+    snprintf(method, 5, "WM%s", str->getCStringNoCopy());
+    
+    memcpy(buffer, &deviceId, 4);
+    memcpy(buffer+4, status, 4);
+    
+    params[0] = OSNumber::withNumber(0x00D,32);
+    params[1] = OSNumber::withNumber(methodId,32);
+    params[2] = OSData::withBytes(buffer, 8);
+    
+    *status = ~0;
+    WMIDevice->evaluateInteger(method, status, params, 3);
+    
+    params[0]->release();
+    params[1]->release();
+    params[2]->release();
+}
+
+// Both paths end in the same WMNB evaluation, the difference is what it takes to get there
+static void benchWMICall(BenchRun &run, bool set, bool old)
+{
+    FnKeysHost host;
+    BenchAsusFnKeys *driver = startDriver(host);
+    run.firmware = host.acpi();
+
+    run.start();
+    for (UInt64 i = 0; i < run.iterations; i++)
+    {
+        UInt32 status = i & 1;
+        if (set && old)
+            driver->oldSetDeviceStatus(ASUS_WMI_MGMT_GUID, ASUS_WMI_METHODID_DEVS, ASUS_WMI_DEVID_BACKLIGHT, &status);
+        else if (set)
+            driver->setDeviceStatus(ASUS_WMI_DEVID_BACKLIGHT, &status);
+        else if (old)
+            driver->oldGetDeviceStatus(ASUS_WMI_MGMT_GUID, ASUS_WMI_METHODID_DSTS, ASUS_WMI_DEVID_BACKLIGHT, &status);
+        else
+            driver->getDeviceStatus(ASUS_WMI_DEVID_BACKLIGHT, &status);
+        benchKeep(status);
+    }
+    run.stop();
+}
+
+HOST_BENCH(wmiCallDSTS, "evaluateWMICall/DSTS")
+{
+    benchWMICall(run, false, false);
+}
+
+HOST_BENCH(wmiCallDSTSOld, "evaluateWMICall/DSTS-old")
+{
+    benchWMICall(run, false, true);
+}
+
+HOST_BENCH(wmiCallDEVS, "evaluateWMICall/DEVS")
+{
+    benchWMICall(run, true, false);
+}
+
+HOST_BENCH(wmiCallDEVSOld, "evaluateWMICall/DEVS-old")
+{
+    benchWMICall(run, true, true);
+}
+
+HOST_BENCH(wmiData2Str, "wmi_data2Str")
+{
+    OSData *table = wdgTable(61);
+    UInt32 count = table->getLength() / sizeof(struct guid_block);
+    const struct guid_block *blocks = (const struct guid_block *) table->getBytesNoCopy();
+    char out[37];
+
+    run.start();
+    for (UInt64 i = 0; i < run.iterations; i++)
+    {
+        BenchAsusFnKeys::wmi_data2Str(blocks[i % count].guid, out);
+        benchKeep(out);
+    }
+    run.stop();
+    table->release();
+}
+
+HOST_BENCH(flagsToStr, "flagsToStr")
+{
+    FnKeysHost host;
+    BenchAsusFnKeys *driver = startDriver(host);
+
+    run.start();
+    for (UInt64 i = 0; i < run.iterations; i++)
+    {
+        OSString *flags = driver->flagsToStr(i & 0x0F);
+        benchKeep(flags);
+        flags->release();
+    }
+    run.stop();
+}
+
+#pragma mark -
+#pragma mark Hotkey path
+#pragma mark -
+
+HOST_BENCH(keyPressedMapped, "keyPressed/mapped")
+{
+    FnKeysHost host;
+    BenchAsusFnKeys *driver = startDriver(host);
+    FnKeysHIKeyboardDevice *device = driver->keyboardDevice();
+    static const UInt8 keys[] = { 0x30, 0x31, 0x32, 0x10, 0x20 };
+
+    run.start();
+    for (UInt64 i = 0; i < run.iterations; i++)
+    {
+        // 25 ms apart, within the keyboard's rate limit
+        hostClockAdvance(MS_TO_NS(25));
+        device->keyPressed(keys[i % sizeof(keys)]);
+    }
+    run.stop();
+}
+
+HOST_BENCH(keyPressedUnmapped, "keyPressed/unmapped")
+{
+    FnKeysHost host;
+    BenchAsusFnKeys *driver = startDriver(host);
+    FnKeysHIKeyboardDevice *device = driver->keyboardDevice();
+
+    run.start();
+    for (UInt64 i = 0; i < run.iterations; i++)
+        device->keyPressed(0xC6 + (i & 1));
+    run.stop();
+}
+
+static void benchHandleMessage(BenchRun &run, const UInt8 *codes, UInt32 count)
+{
+    FnKeysHost host;
+    BenchAsusFnKeys *driver = startDriver(host);
+    FnKeysHIKeyboardDevice *device = driver->keyboardDevice();
+    run.firmware = host.acpi();
+
+    run.start();
+    for (UInt64 i = 0; i < run.iterations; i++)
+    {
+        hostClockAdvance(MS_TO_NS(25));
+        driver->handleMessage(codes[i % count]);
+        // Sent once per drain of the notification ring
+        if ((i & 7) == 7)
+            device->flushKeys();
+    }
+    run.stop();
+}
+
+HOST_BENCH(handleMessageMix, "handleMessage/mix")
+{
+    static UInt8 codes[kMixSize];
+    buildMix(codes, kMixSize);
+    benchHandleMessage(run, codes, kMixSize);
+}
+
+HOST_BENCH(handleMessageVolume, "handleMessage/volume")
+{
+    static const UInt8 codes[] = { 0x30, 0x31 };
+    benchHandleMessage(run, codes, sizeof(codes));
+}
+
+HOST_BENCH(handleMessageBacklight, "handleMessage/kbd-backlight")
+{
+    static const UInt8 codes[] = { 0xC4, 0xC4, 0xC5, 0xC5 };
+    benchHandleMessage(run, codes, sizeof(codes));
+}
+
+static void benchDecodeWED(BenchRun &run, UInt8 shape, UInt32 cacheTime)
+{
+    MockASUSNotebook config;
+    config.wedShape = shape;
+    FnKeysHost host(config);
+    host.setPreference("WEDCacheTime", (UInt64) cacheTime);
+    BenchAsusFnKeys *driver = startDriver(host);
+    run.firmware = host.acpi();
+
+    static UInt8 codes[kMixSize];
+    buildMix(codes, kMixSize);
+
+    run.start();
+    for (UInt64 i = 0; i < run.iterations; i++)
+    {
+        UInt32 code;
+        driver->decodeWED(codes[i % kMixSize], hostClockNow(), &code);
+        benchKeep(code);
+    }
+    run.stop();
+}
+
+HOST_BENCH(decodeWEDNumber, "decodeWED/number")
+{
+    benchDecodeWED(run, kMockWEDNumber, 0);
+}
+
+HOST_BENCH(decodeWEDPackage, "decodeWED/package")
+{
+    benchDecodeWED(run, kMockWEDPackage, 0);
+}
+
+HOST_BENCH(decodeWEDBuffer, "decodeWED/buffer")
+{
+    benchDecodeWED(run, kMockWEDBuffer, 0);
+}
+
+HOST_BENCH(decodeWEDCached, "decodeWED/cached")
+{
+    benchDecodeWED(run, kMockWEDNumber, 1000);
+}
+
+// message() to HID: ring, work loop drain, _WED, action and key batch
+HOST_BENCH(messageToHID, "message/mix")
+{
+    FnKeysHost host;
+    BenchAsusFnKeys *driver = startDriver(host);
+    run.firmware = host.acpi();
+
+    static UInt8 codes[kMixSize];
+    buildMix(codes, kMixSize);
+
+    run.start();
+    for (UInt64 i = 0; i < run.iterations; i++)
+    {
+        UInt32 event = codes[i % kMixSize];
+        hostClockAdvance(MS_TO_NS(25));
+        driver->message(kIOACPIMessageDeviceNotification, host.acpi(), &event);
+        hostRunPending();
+    }
+    run.stop();
+}
+
+HOST_BENCH(kernEventSend, "KernEventServer::sendMessage")
+{
+    KernEventServer server;
+    server.setVendorID("com.hieplpvip");
+    server.setEventCode(AsusFnKeysEventCode);
+
+    run.start();
+    for (UInt64 i = 0; i < run.iterations; i++)
+        server.sendMessage(kevKeyboardBacklight, i & 3, 3);
+    run.stop();
+}
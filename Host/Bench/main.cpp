@@ -0,0 +1,208 @@
+/*
+ *  Copyright (c) 2018 hieplpvip
+ *
+ *
+ *  main.cpp
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * fnkeys_bench [filter] [--min-time ms] [--json file] [--label text] [--compare file]
+ *
+ *   filter      only the benchmarks whose name contains it
+ *   --min-time  shortest timed run, 200 ms by default
+ *   --json      writes the results, one benchmark per line
+ *   --label     stored in the JSON, e.g. the commit measured
+ *   --compare   prints the change against a JSON file of an earlier run
+ */
+
+#include <math.h>
+#include <time.h>
+#include <string>
+#include "Bench.h"
+
+static BenchCase *gBenches;
+static BenchCase **gBenchesTail = &gBenches;
+
+BenchRegistrar::BenchRegistrar(BenchCase *bench)
+{
+    *gBenchesTail = bench;
+    gBenchesTail = &bench->next;
+}
+
+static UInt64 wallClockNS()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (UInt64) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static UInt64 driverAllocations(MockACPIDevice *firmware)
+{
+    return hostAllocations() - (firmware ? firmware->allocations() : 0);
+}
+
+void BenchRun::start()
+{
+    startAllocations = driverAllocations(firmware);
+    startNS = wallClockNS();
+}
+
+void BenchRun::stop()
+{
+    elapsedNS = wallClockNS() - startNS;
+    allocations = driverAllocations(firmware) - startAllocations;
+}
+
+struct BenchResult {
+    std::string name;
+    UInt64 iterations;
+    double nsPerOp, allocsPerOp;
+};
+
+static BenchResult runBench(BenchCase *bench, UInt64 minTimeNS)
+{
+    BenchRun run;
+    UInt64 iterations = 1;
+
+    for (;;)
+    {
+        bzero(&run, sizeof(run));
+        run.iterations = iterations;
+        bench->function(run);
+        hostReset();
+
+        if (run.elapsedNS >= minTimeNS || iterations >= (1ULL << 32))
+            break;
+
+        // Aim a bit past the minimum from the rate measured so far
+        UInt64 next = run.elapsedNS ? iterations * minTimeNS * 5 / 4 / run.elapsedNS : iterations * 100;
+        if (next > iterations * 100)
+            next = iterations * 100;
+        iterations = next > iterations ? next : iterations * 2;
+    }
+
+    BenchResult result;
+    result.name = bench->name;
+    result.iterations = run.iterations;
+    result.nsPerOp = (double) run.elapsedNS / run.iterations;
+    result.allocsPerOp = (double) run.allocations / run.iterations;
+    return result;
+}
+
+static bool loadResults(const char *path, std::vector<BenchResult> *results)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return false;
+
+    char line[512], name[256];
+    while (fgets(line, sizeof(line), file))
+    {
+        BenchResult result;
+        unsigned long long iterations;
+        if (sscanf(line, " {\"name\": \"%255[^\"]\", \"iterations\": %llu, \"ns_per_op\": %lf, \"allocs_per_op\": %lf}",
+                   name, &iterations, &result.nsPerOp, &result.allocsPerOp) == 4)
+        {
+            result.name = name;
+            result.iterations = iterations;
+            results->push_back(result);
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+static bool saveResults(const char *path, const char *label, const std::vector<BenchResult> &results)
+{
+    FILE *file = fopen(path, "w");
+    if (!file)
+        return false;
+
+    fprintf(file, "{\n  \"label\": \"%s\",\n  \"benchmarks\": [\n", label ? label : "");
+    for (size_t i = 0; i < results.size(); i++)
+        fprintf(file, "    {\"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.2f, \"allocs_per_op\": %.4f}%s\n",
+                results[i].name.c_str(), (unsigned long long) results[i].iterations,
+                results[i].nsPerOp, results[i].allocsPerOp, i + 1 < results.size() ? "," : "");
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    const char *filter = NULL, *jsonPath = NULL, *label = NULL, *comparePath = NULL;
+    UInt64 minTimeNS = MS_TO_NS(200);
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--min-time") && i + 1 < argc)
+            minTimeNS = MS_TO_NS(strtoull(argv[++i], NULL, 0));
+        else if (!strcmp(argv[i], "--json") && i + 1 < argc)
+            jsonPath = argv[++i];
+        else if (!strcmp(argv[i], "--label") && i + 1 < argc)
+            label = argv[++i];
+        else if (!strcmp(argv[i], "--compare") && i + 1 < argc)
+            comparePath = argv[++i];
+        else if (argv[i][0] != '-')
+            filter = argv[i];
+        else
+        {
+            fprintf(stderr, "usage: %s [filter] [--min-time ms] [--json file] [--label text] [--compare file]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    std::vector<BenchResult> baseline;
+    if (comparePath && !loadResults(comparePath, &baseline))
+    {
+        fprintf(stderr, "Can't read %s\n", comparePath);
+        return 2;
+    }
+
+    std::vector<BenchResult> results;
+    printf("%-36s %12s %12s %12s%s\n", "benchmark", "iterations", "ns/op", "allocs/op", baseline.empty() ? "" : "   ns/op change");
+    for (BenchCase *bench = gBenches; bench; bench = bench->next)
+    {
+        if (filter && !strstr(bench->name, filter))
+            continue;
+
+        BenchResult result = runBench(bench, minTimeNS);
+        results.push_back(result);
+        printf("%-36s %12llu %12.1f %12.3f", result.name.c_str(), (unsigned long long) result.iterations,
+               result.nsPerOp, result.allocsPerOp);
+
+        for (size_t i = 0; i < baseline.size(); i++)
+        {
+            if (baseline[i].name == result.name && baseline[i].nsPerOp > 0)
+            {
+                printf("   %+13.1f%%", (result.nsPerOp / baseline[i].nsPerOp - 1) * 100);
+                if (fabs(baseline[i].allocsPerOp - result.allocsPerOp) >= 0.0005)
+                    printf(" (allocs/op was %.3f)", baseline[i].allocsPerOp);
+                break;
+            }
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+
+    if (jsonPath && !saveResults(jsonPath, label, results))
+    {
+        fprintf(stderr, "Can't write %s\n", jsonPath);
+        return 1;
+    }
+    return 0;
+}
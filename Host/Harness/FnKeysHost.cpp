@@ -0,0 +1,500 @@
+/*
+ *  Copyright (c) 2018 hieplpvip
+ *
+ *
+ *  FnKeysHost.cpp
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "FnKeysHost.h"
+#include "AsusFnKeysUserClient.h"
+
+#ifndef FNKEYS_INFO_PLIST
+#define FNKEYS_INFO_PLIST "../AsusFnKeys/Info.plist"
+#endif
+
+struct ScheduledNotify {
+    FnKeysHost *host;
+    UInt32 event;
+};
+
+struct ScheduledKeyTime {
+    FnKeysHost *host;
+    UInt32 type;
+    UInt64 time;
+};
+
+static OSDictionary *loadPersonalities()
+{
+    FILE *file = fopen(FNKEYS_INFO_PLIST, "rb");
+    if (!file)
+    {
+        fprintf(stderr, "FnKeysHost::Can't open %s\n", FNKEYS_INFO_PLIST);
+        abort();
+    }
+
+    std::vector<char> text;
+    char buffer[4096];
+    size_t length;
+    while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        text.insert(text.end(), buffer, buffer + length);
+    text.push_back(0);
+    fclose(file);
+
+    OSString *error = NULL;
+    OSObject *plist = OSUnserializeXML(&text[0], &error);
+    OSDictionary *info = OSDynamicCast(OSDictionary, plist);
+    OSDictionary *personalities = info ? OSDynamicCast(OSDictionary, info->getObject("IOKitPersonalities")) : NULL;
+    if (!personalities)
+    {
+        fprintf(stderr, "FnKeysHost::No IOKitPersonalities in %s: %s\n", FNKEYS_INFO_PLIST,
+                error ? error->getCStringNoCopy() : "not a dictionary");
+        abort();
+    }
+
+    personalities->retain();
+    OSSafeReleaseNULL(plist);
+    OSSafeReleaseNULL(error);
+    return personalities;
+}
+
+FnKeysHost::FnKeysHost(const MockASUSNotebook &config)
+{
+    hostReset();
+
+    personalities = loadPersonalities();
+    nvram = NULL;
+    display = NULL;
+    trackpad = NULL;
+    started = false;
+    origin = captureStart = 0;
+    misses = 0;
+
+    device = MockACPIDevice::withName("PNP0C14");
+    device->loadASUSNotebook(config);
+}
+
+FnKeysHost::~FnKeysHost()
+{
+    // Terminates whatever is still registered, drivers stop like on unload
+    hostReset();
+
+    OSSafeReleaseNULL(trackpad);
+    OSSafeReleaseNULL(display);
+    OSSafeReleaseNULL(nvram);
+    OSSafeReleaseNULL(device);
+    OSSafeReleaseNULL(personalities);
+}
+
+#pragma mark -
+#pragma mark Configuration
+#pragma mark -
+
+OSDictionary *FnKeysHost::personality(const char *name)
+{
+    return OSDynamicCast(OSDictionary, personalities->getObject(name));
+}
+
+OSDictionary *FnKeysHost::preferences()
+{
+    return OSDynamicCast(OSDictionary, personality("AsusFnKeys")->getObject("Preferences"));
+}
+
+void FnKeysHost::setPreference(const char *key, UInt64 value)
+{
+    OSNumber *number = OSNumber::withNumber(value, 32);
+    preferences()->setObject(key, number);
+    number->release();
+}
+
+void FnKeysHost::setPreference(const char *key, bool value)
+{
+    preferences()->setObject(key, value ? kOSBooleanTrue : kOSBooleanFalse);
+}
+
+void FnKeysHost::setDriverClass(const char *className)
+{
+    OSString *name = OSString::withCString(className);
+    personality("AsusFnKeys")->setObject("IOClass", name);
+    name->release();
+}
+
+IODTNVRAM *FnKeysHost::publishNVRAM(bool brokenReads)
+{
+    if (!nvram)
+    {
+        nvram = new IODTNVRAM;
+        nvram->init();
+        nvram->breakPropertyReads(brokenReads);
+        hostRegisterPath("/options", nvram);
+        nvram->registerService();
+    }
+    return nvram;
+}
+
+AppleBacklightDisplay *FnKeysHost::publishDisplay(UInt32 brightness)
+{
+    if (!display)
+    {
+        display = AppleBacklightDisplay::withBrightness(brightness);
+        display->registerService();
+    }
+    return display;
+}
+
+MockTrackpad *FnKeysHost::publishTrackpad()
+{
+    if (!trackpad)
+    {
+        trackpad = MockTrackpad::trackpad();
+        trackpad->registerService();
+    }
+    return trackpad;
+}
+
+#pragma mark -
+#pragma mark Driver
+#pragma mark -
+
+bool FnKeysHost::start()
+{
+    if (started)
+        return fnKeys() != NULL;
+
+    started = true;
+    hostAddPersonalities(personalities);
+    device->registerService();
+    hostRunPending();
+    return fnKeys() != NULL;
+}
+
+void FnKeysHost::stop()
+{
+    device->terminate();
+}
+
+AsusFnKeys *FnKeysHost::fnKeys()
+{
+    return OSDynamicCast(AsusFnKeys, device->getClient());
+}
+
+IOService *FnKeysHost::keyboardDevice()
+{
+    AsusFnKeys *driver = fnKeys();
+    return driver ? OSDynamicCast(FnKeysHIKeyboardDevice, driver->getClient()) : NULL;
+}
+
+IOService *FnKeysHost::keyboard()
+{
+    IOService *provider = keyboardDevice();
+    return provider ? provider->getClient() : NULL;
+}
+
+void FnKeysHost::notify(UInt32 event)
+{
+    device->messageClients(kIOACPIMessageDeviceNotification, &event);
+}
+
+void FnKeysHost::scheduledNotify(void *ref)
+{
+    ScheduledNotify *notify = (ScheduledNotify *) ref;
+    notify->host->notify(notify->event);
+    delete notify;
+}
+
+void FnKeysHost::notifyAt(UInt64 when, UInt32 event)
+{
+    ScheduledNotify *notify = new ScheduledNotify;
+    notify->host = this;
+    notify->event = event;
+    hostSchedule(when, scheduledNotify, notify);
+}
+
+void FnKeysHost::scheduledKeyTime(void *ref)
+{
+    ScheduledKeyTime *keyTime = (ScheduledKeyTime *) ref;
+    if (AsusFnKeys *driver = keyTime->host->fnKeys())
+        driver->message(keyTime->type, keyTime->host->device, &keyTime->time);
+    delete keyTime;
+}
+
+void FnKeysHost::keyTimeAt(UInt64 when, UInt64 time, UInt32 type)
+{
+    ScheduledKeyTime *keyTime = new ScheduledKeyTime;
+    keyTime->host = this;
+    keyTime->type = type;
+    keyTime->time = time;
+    hostSchedule(when, scheduledKeyTime, keyTime);
+}
+
+void FnKeysHost::run(UInt64 ns)
+{
+    hostRunUntil(hostClockNow() + ns);
+}
+
+UInt64 FnKeysHost::counter(IORegistryEntry *entry, const char *name)
+{
+    OSNumber *number = entry ? OSDynamicCast(OSNumber, entry->getProperty(name)) : NULL;
+    return number ? number->unsigned64BitValue() : 0;
+}
+
+#pragma mark -
+#pragma mark Capture and replay
+#pragma mark -
+
+IOReturn FnKeysHost::readCapture(std::vector<FnKeysTraceRecord> *records, UInt32 *dropped)
+{
+    AsusFnKeys *driver = fnKeys();
+    if (!driver)
+        return kIOReturnNotReady;
+
+    IOUserClient *client = NULL;
+    IOReturn ret = driver->newUserClient(current_task(), current_task(), 0, NULL, &client);
+    if (ret != kIOReturnSuccess)
+        return ret;
+
+    // One inband structure output a call, until the ring is empty
+    FnKeysTraceRecord buffer[4096 / sizeof(FnKeysTraceRecord)];
+    uint64_t lost = 0;
+    UInt32 count;
+    do
+    {
+        IOExternalMethodArguments arguments;
+        bzero(&arguments, sizeof(arguments));
+        arguments.selector = kAsusFnKeysReadCapture;
+        arguments.scalarOutput = &lost;
+        arguments.scalarOutputCount = 1;
+        arguments.structureOutput = buffer;
+        arguments.structureOutputSize = sizeof(buffer);
+        ret = client->externalMethod(kAsusFnKeysReadCapture, &arguments);
+        count = ret == kIOReturnSuccess ? arguments.structureOutputSize / sizeof(FnKeysTraceRecord) : 0;
+        records->insert(records->end(), buffer, buffer + count);
+    } while (count);
+
+    client->clientClose();
+    client->release();
+
+    if (!origin && !records->empty())
+        origin = records->front().time;
+    if (dropped)
+        *dropped = (UInt32) lost;
+    return ret;
+}
+
+bool FnKeysHost::replay(const std::vector<FnKeysTraceRecord> &records)
+{
+    // acpiMethods of the driver on the ATK device
+    static const char * const names[kACPIMethodCount] = {
+        "SKBL", "GKBL", "KBPW", "ALSC", "ALSS", "INIT", "_WED", "WMNB"
+    };
+
+    // The driver's state at boot is the only one a replay can start from
+    if (started || records.empty() || records[0].event != kCaptureACPI)
+        return false;
+
+    captureStart = records[0].time;
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        const FnKeysTraceRecord &record = records[i];
+        if (record.event == kCaptureACPI && (record.arg0 & 0xFF) < kACPIMethodCount)
+            replayResults[record.arg0 & 0xFF].push_back(record);
+        else if (record.event == kCaptureNotify || record.event == kCaptureKeyTime)
+            replayInputs.push_back(record);
+    }
+
+    // Every method the firmware has answers from the capture, none from the model
+    for (UInt8 i = 0; i < kACPIMethodCount; i++)
+    {
+        if (device->validateObject(names[i]) != kIOReturnSuccess)
+            continue;
+        device->setMethod(names[i], [this, i](OSObject *params[], IOItemCount count, OSObject **result) {
+            return replayCall(i, result);
+        });
+    }
+    return true;
+}
+
+IOReturn FnKeysHost::replayCall(UInt8 method, OSObject **result)
+{
+    std::deque<FnKeysTraceRecord> &queue = replayResults[method];
+    if (queue.empty())
+    {
+        misses++;
+        return kIOReturnNotReady;
+    }
+    FnKeysTraceRecord record = queue.front();
+    queue.pop_front();
+
+    // The firmware takes the captured time, notifications can arrive meanwhile
+    hostClockAdvance((record.arg1 >> 32) * 1000);
+    if (!origin && record.time == captureStart)
+    {
+        origin = hostClockNow();
+        scheduleReplay();
+    }
+
+    UInt32 length = record.arg0 >> 16;
+    UInt32 value = (UInt32) record.arg1;
+    switch ((record.arg0 >> 8) & 0xFF)
+    {
+        case kCaptureObjectNone:
+            return length ? (IOReturn) (0xe0000000 | length) : kIOReturnSuccess;
+
+        case kCaptureObjectNumber:
+            *result = OSNumber::withNumber(value, 32);
+            break;
+
+        case kCaptureObjectPackage:
+        {
+            OSArray *package = OSArray::withCapacity(length);
+            for (UInt32 i = 0; i < length; i++)
+            {
+                OSNumber *number = OSNumber::withNumber(i ? 0 : value, 32);
+                package->setObject(number);
+                number->release();
+            }
+            *result = package;
+            break;
+        }
+
+        case kCaptureObjectBuffer:
+        {
+            std::vector<UInt8> bytes(length + sizeof(value));
+            memcpy(&bytes[0], &value, sizeof(value));
+            *result = OSData::withBytes(&bytes[0], length);
+            break;
+        }
+
+        default:
+            *result = OSString::withCString("");
+            break;
+    }
+    return kIOReturnSuccess;
+}
+
+void FnKeysHost::scheduleReplay()
+{
+    for (size_t i = 0; i < replayInputs.size(); i++)
+    {
+        const FnKeysTraceRecord &record = replayInputs[i];
+        UInt64 when = origin + (record.time - captureStart);
+        if (record.event == kCaptureNotify)
+            notifyAt(when, record.arg0);
+        else
+            keyTimeAt(when, record.arg1 - captureStart + origin, record.arg0);
+    }
+}
+
+std::vector<FnKeysOutput> FnKeysHost::outputs() const
+{
+    std::vector<FnKeysOutput> list;
+
+    UInt32 count = hostHIDEventCount();
+    for (UInt32 i = count > kHostLogSize ? count - kHostLogSize : 0; i < count; i++)
+    {
+        const HostHIDEvent *event = hostHIDEvent(i);
+        FnKeysOutput output = { (SInt64) (event->dispatchTime - origin), kOutputHID, event->key, event->down };
+        list.push_back(output);
+    }
+
+    // Reads (GKBL, ALSS, _WED, DSTS, ...) are inputs, replayed from the capture
+    const std::vector<MockACPICall> &calls = device->callLog();
+    for (size_t i = 0; i < calls.size(); i++)
+    {
+        const MockACPICall &call = calls[i];
+        FnKeysOutput output = { (SInt64) (call.time - origin), kOutputACPIWrite, 0, call.args[0] };
+        if (!strcmp(call.name, "WMNB") && call.args[1] != ASUS_WMI_METHODID_DSTS)
+        {
+            output.code = (UInt32) call.args[1];
+            output.value = call.args[2];
+        }
+        else if (!strcmp(call.name, "SKBL") || !strcmp(call.name, "ALSC") || !strcmp(call.name, "INIT"))
+            memcpy(&output.code, call.name, sizeof(output.code));
+        else
+            continue;
+        list.push_back(output);
+    }
+
+    count = hostKernEventCount();
+    for (UInt32 i = count > kHostLogSize ? count - kHostLogSize : 0; i < count; i++)
+    {
+        const HostKernEvent *event = hostKernEvent(i);
+        SInt32 data[3];
+        memcpy(data, event->data, sizeof(data));
+        FnKeysOutput output = { (SInt64) (event->postTime - origin), kOutputKernEvent, (UInt32) data[0],
+                                ((UInt64) (UInt32) data[1] << 32) | (UInt32) data[2] };
+        list.push_back(output);
+    }
+    return list;
+}
+
+static void printOutput(const char *label, const FnKeysOutput *output)
+{
+    static const char * const kinds[kOutputKindCount] = { "HID", "ACPI", "kev" };
+
+    if (!output)
+    {
+        printf("    %-9s nothing\n", label);
+        return;
+    }
+    if (output->kind == kOutputACPIWrite)
+    {
+        char name[5] = { 0 };
+        memcpy(name, &output->code, 4);
+        printf("    %-9s %s %s 0x%llx at %.3f ms\n", label, kinds[output->kind], name,
+               (unsigned long long) output->value, output->time / 1e6);
+    }
+    else
+        printf("    %-9s %s 0x%x 0x%llx at %.3f ms\n", label, kinds[output->kind], (unsigned int) output->code,
+               (unsigned long long) output->value, output->time / 1e6);
+}
+
+/*
+ * Outputs of one kind are compared in order, different kinds only keep
+ * their order within tolerance of each other
+ */
+UInt32 FnKeysHost::diff(const std::vector<FnKeysOutput> &expected, const std::vector<FnKeysOutput> &actual,
+                        UInt64 tolerance)
+{
+    UInt32 differences = 0;
+
+    for (UInt8 kind = 0; kind < kOutputKindCount; kind++)
+    {
+        std::vector<const FnKeysOutput *> a, b;
+        for (size_t i = 0; i < expected.size(); i++)
+            if (expected[i].kind == kind)
+                a.push_back(&expected[i]);
+        for (size_t i = 0; i < actual.size(); i++)
+            if (actual[i].kind == kind)
+                b.push_back(&actual[i]);
+
+        for (size_t i = 0; i < a.size() || i < b.size(); i++)
+        {
+            const FnKeysOutput *x = i < a.size() ? a[i] : NULL;
+            const FnKeysOutput *y = i < b.size() ? b[i] : NULL;
+            if (x && y && x->code == y->code && x->value == y->value &&
+                (UInt64) (x->time > y->time ? x->time - y->time : y->time - x->time) <= tolerance)
+                continue;
+
+            if (differences++ < 8)
+            {
+                printOutput("expected", x);
+                printOutput("got", y);
+            }
+        }
+    }
+    return differences;
+}
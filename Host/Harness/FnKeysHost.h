@@ -0,0 +1,141 @@
+/*
+ *  Copyright (c) 2018 hieplpvip
+ *
+ *
+ *  FnKeysHost.h
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _FnKeysHost_h
+#define _FnKeysHost_h
+
+#include <deque>
+#include "AsusFnKeys.h"
+#include "MockACPIDevice.h"
+#include "MockServices.h"
+
+enum
+{
+    kOutputHID,             // code keycode, value key down
+    kOutputACPIWrite,       // code method, or the WMNB method ID, value first argument
+    kOutputKernEvent,       // code type, value x << 32 | y
+    kOutputKindCount
+};
+
+// What the driver did, compared between a session and its replay
+struct FnKeysOutput
+{
+    SInt64 time;            // ns since the first capture record
+    UInt8 kind;
+    UInt32 code;
+    UInt64 value;
+};
+
+/*
+ * One loaded copy of the kext: the personalities from Info.plist, an ATK
+ * device to match on and the optional NVRAM, panel and trackpad services.
+ * Everything is torn down, and the host reset, when it goes out of scope.
+ *
+ *     FnKeysHost host;
+ *     host.preferences()->setObject("NVRAMFlushDelay", ...);
+ *     host.publishNVRAM();
+ *     host.start();
+ *     host.notify(0x30);
+ *     host.run(MS_TO_NS(10));
+ *
+ * A session captured with CaptureEnabled from boot can be replayed on a
+ * fresh host: replay() answers the ACPI calls with the captured results,
+ * taking the captured time, and sends the captured notifications and
+ * keypress times at their captured times. diff() then compares the
+ * outputs() of both.
+ */
+class FnKeysHost
+{
+public:
+    FnKeysHost(const MockASUSNotebook &config = MockASUSNotebook());
+    ~FnKeysHost();
+
+    // Editable until start()
+    OSDictionary *personality(const char *name);
+    OSDictionary *preferences();
+    void setPreference(const char *key, UInt64 value);
+    void setPreference(const char *key, bool value);
+    // Loads the AsusFnKeys personality with another IOClass, e.g. a subclass
+    void setDriverClass(const char *className);
+
+    IODTNVRAM *publishNVRAM(bool brokenReads = false);
+    AppleBacklightDisplay *publishDisplay(UInt32 brightness);
+    MockTrackpad *publishTrackpad();
+
+    // Publishes the ATK device, AsusFnKeys and FnKeysHIKeyboard start on it
+    bool start();
+    // Terminates the ATK device and the drivers on it
+    void stop();
+
+    MockACPIDevice *acpi() { return device; }
+    AsusFnKeys *fnKeys();
+    IOService *keyboardDevice();    // FnKeysHIKeyboardDevice
+    IOService *keyboard();          // FnKeysHIKeyboard
+
+    // ACPI notification, delivered now or from interrupt context at when
+    void notify(UInt32 event);
+    void notifyAt(UInt64 when, UInt32 event);
+    // Keypress-time message of a keyboard driver, sent from its thread at when
+    void keyTimeAt(UInt64 when, UInt64 time, UInt32 type = kKeyboardKeyPressTime);
+
+    // Runs the work loop and the scheduled events for ns
+    void run(UInt64 ns);
+
+    // Number property of a driver, 0 if absent
+    static UInt64 counter(IORegistryEntry *entry, const char *name);
+    UInt64 counter(const char *name) { return counter(fnKeys(), name); }
+
+    // Reads the capture through AsusFnKeysUserClient, like a process of the
+    // current user (see hostSetAdministrator()) would
+    IOReturn readCapture(std::vector<FnKeysTraceRecord> *records, UInt32 *dropped = NULL);
+    // Before start(), false if the capture did not start at boot
+    bool replay(const std::vector<FnKeysTraceRecord> &records);
+    // ACPI calls the replay had no captured result for
+    UInt32 replayMisses() const { return misses; }
+
+    // HID events, ACPI writes and kernel events so far, by kind and time
+    std::vector<FnKeysOutput> outputs() const;
+    // Differences between two outputs() beyond tolerance ns, the first ones are printed
+    static UInt32 diff(const std::vector<FnKeysOutput> &expected, const std::vector<FnKeysOutput> &actual,
+                       UInt64 tolerance);
+
+private:
+    OSDictionary *personalities;
+    MockACPIDevice *device;
+    IODTNVRAM *nvram;
+    AppleBacklightDisplay *display;
+    MockTrackpad *trackpad;
+    bool started;
+
+    // Time of the first capture record, as read or as replayed
+    UInt64 origin;
+    UInt64 captureStart;
+    std::deque<FnKeysTraceRecord> replayResults[kACPIMethodCount];
+    std::vector<FnKeysTraceRecord> replayInputs;
+    UInt32 misses;
+
+    static void scheduledNotify(void *ref);
+    static void scheduledKeyTime(void *ref);
+    IOReturn replayCall(UInt8 method, OSObject **result);
+    void scheduleReplay();
+};
+
+#endif //_FnKeysHost_h
@@ -0,0 +1,405 @@
+/*
+ *  Copyright (c) 2018 hieplpvip
+ *
+ *
+ *  MockACPIDevice.cpp
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <memory>
+#include "MockACPIDevice.h"
+
+// ASUS WMI interface, as implemented by the ATK device's WMNB
+#define kASUSMethodDSTS         0x53544344
+#define kASUSMethodDEVS         0x53564544
+#define kASUSMethodINIT         0x54494E49
+#define kASUSDeviceKbdBacklight 0x00050021
+#define kASUSDeviceLightSensor  0x00050022
+#define kASUSDeviceTouchpad     0x00100011
+#define kASUSStatusPresent      0x00010000
+#define kASUSUnsupported        0xFFFFFFFE
+
+#define super IOACPIPlatformDevice
+OSDefineMetaClassAndStructors(MockACPIDevice, IOACPIPlatformDevice)
+
+const UInt8 MockACPIDevice::asusWDG[60] = {
+    // 97845ED0-4E6D-11DE-8A39-0800200C9A66, "NB", 1 instance, method
+    0xD0, 0x5E, 0x84, 0x97, 0x6D, 0x4E, 0xDE, 0x11,
+    0x8A, 0x39, 0x08, 0x00, 0x20, 0x0C, 0x9A, 0x66,
+    0x4E, 0x42, 0x01, 0x02,
+    // 0B3CBB35-E3C2-45ED-91C2-4C5A6D195D1C, notify 0xFF, 1 instance, event
+    0x35, 0xBB, 0x3C, 0x0B, 0xC2, 0xE3, 0xED, 0x45,
+    0x91, 0xC2, 0x4C, 0x5A, 0x6D, 0x19, 0x5D, 0x1C,
+    0xFF, 0x00, 0x01, 0x08,
+    // 05901221-D566-11D1-B2F0-00A0C9062910, "MO", 1 instance, data block
+    0x21, 0x12, 0x90, 0x05, 0x66, 0xD5, 0xD1, 0x11,
+    0xB2, 0xF0, 0x00, 0xA0, 0xC9, 0x06, 0x29, 0x10,
+    0x4D, 0x4F, 0x01, 0x00,
+};
+
+UInt64 mockArgument(OSObject *params[], IOItemCount count, unsigned int index)
+{
+    if (!params || index >= count)
+        return 0;
+    if (OSNumber *number = OSDynamicCast(OSNumber, params[index]))
+        return number->unsigned64BitValue();
+    return 0;
+}
+
+MockACPIDevice *MockACPIDevice::withName(const char *name)
+{
+    MockACPIDevice *me = new MockACPIDevice;
+    if (!me->init())
+    {
+        me->release();
+        return NULL;
+    }
+    me->setName(name);
+    return me;
+}
+
+void MockACPIDevice::free()
+{
+    for (size_t i = 0; i < methods.size(); i++)
+        for (size_t j = 0; j < methods[i].queued.size(); j++)
+            methods[i].queued[j]->release();
+    methods.clear();
+    log.clear();
+    super::free();
+}
+
+MockACPIDevice::Method *MockACPIDevice::find(const char *name)
+{
+    for (size_t i = 0; i < methods.size(); i++)
+        if (!strncmp(methods[i].name, name, 4))
+            return &methods[i];
+    return NULL;
+}
+
+const MockACPIDevice::Method *MockACPIDevice::find(const char *name) const
+{
+    return const_cast<MockACPIDevice *>(this)->find(name);
+}
+
+MockACPIDevice::Method *MockACPIDevice::define(const char *name)
+{
+    Method *method = find(name);
+    if (method)
+        return method;
+
+    methods.push_back(Method());
+    method = &methods.back();
+    snprintf(method->name, sizeof(method->name), "%s", name);
+    method->latency = 0;
+    method->hasLatency = false;
+    method->failure = kIOReturnSuccess;
+    method->calls = 0;
+    bzero(method->args, sizeof(method->args));
+    return method;
+}
+
+IOReturn MockACPIDevice::validateObject(const OSSymbol *objectName)
+{
+    return objectName && find(objectName->getCStringNoCopy()) ? kIOReturnSuccess : kIOReturnNotFound;
+}
+
+IOReturn MockACPIDevice::evaluateObject(const OSSymbol *objectName, OSObject **result,
+                                        OSObject *params[], IOItemCount paramCount, IOOptionBits options)
+{
+    if (result)
+        *result = NULL;
+
+    Method *method = objectName ? find(objectName->getCStringNoCopy()) : NULL;
+    if (!method)
+        return kIOReturnNotFound;
+
+    method->calls++;
+    for (unsigned int i = 0; i < paramCount && i < 4; i++)
+        method->args[i] = mockArgument(params, paramCount, i);
+
+    MockACPICall call;
+    bzero(&call, sizeof(call));
+    call.time = hostClockNow();
+    memcpy(call.name, method->name, sizeof(call.name));
+    for (unsigned int i = 0; i < paramCount && i < 4; i++)
+    {
+        if (OSData *data = OSDynamicCast(OSData, params[i]))
+            memcpy(&call.args[i], data->getBytesNoCopy(), data->getLength() < sizeof(call.args[i]) ? data->getLength() : sizeof(call.args[i]));
+        else
+            call.args[i] = method->args[i];
+    }
+    // Growing the log is the mock's, not the driver's
+    UInt64 allocations = hostAllocations();
+    log.push_back(call);
+    resultAllocations += hostAllocations() - allocations;
+
+    // The firmware runs while the clock moves, notifications can arrive meanwhile
+    UInt64 latency = method->hasLatency ? method->latency : defaultLatency;
+    if (latency)
+        hostClockAdvance(latency);
+
+    if (method->failure != kIOReturnSuccess)
+        return method->failure;
+
+    OSObject *object = NULL;
+    IOReturn ret = kIOReturnSuccess;
+    if (!method->queued.empty())
+    {
+        object = method->queued.front();
+        method->queued.pop_front();
+    }
+    else if (method->handler)
+    {
+        // Copied, a handler may redefine its own method
+        Handler handler = method->handler;
+        UInt64 allocations = hostAllocations();
+        ret = handler(params, paramCount, &object);
+        resultAllocations += hostAllocations() - allocations;
+    }
+
+    if (result)
+        *result = object;
+    else
+        OSSafeReleaseNULL(object);
+    return ret;
+}
+
+void MockACPIDevice::setMethod(const char *name, Handler handler)
+{
+    define(name)->handler = handler;
+}
+
+void MockACPIDevice::setResult(const char *name, OSObject *result)
+{
+    // The handler owns a reference, dropped with the handler
+    result->retain();
+    std::shared_ptr<OSObject> owned(result, [](OSObject *object) { object->release(); });
+    setMethod(name, [owned](OSObject *params[], IOItemCount count, OSObject **out) {
+        owned->retain();
+        *out = owned.get();
+        return kIOReturnSuccess;
+    });
+}
+
+void MockACPIDevice::setInteger(const char *name, UInt64 value)
+{
+    setMethod(name, [value](OSObject *params[], IOItemCount count, OSObject **out) {
+        *out = OSNumber::withNumber(value, 32);
+        return kIOReturnSuccess;
+    });
+}
+
+void MockACPIDevice::removeMethod(const char *name)
+{
+    for (size_t i = 0; i < methods.size(); i++)
+    {
+        if (!strncmp(methods[i].name, name, 4))
+        {
+            for (size_t j = 0; j < methods[i].queued.size(); j++)
+                methods[i].queued[j]->release();
+            methods.erase(methods.begin() + i);
+            return;
+        }
+    }
+}
+
+void MockACPIDevice::queueResult(const char *name, OSObject *result)
+{
+    result->retain();
+    define(name)->queued.push_back(result);
+}
+
+void MockACPIDevice::setLatency(const char *name, UInt64 ns)
+{
+    if (!strcmp(name, "*"))
+    {
+        defaultLatency = ns;
+        return;
+    }
+    Method *method = define(name);
+    method->latency = ns;
+    method->hasLatency = true;
+}
+
+void MockACPIDevice::failMethod(const char *name, IOReturn ret)
+{
+    define(name)->failure = ret;
+}
+
+UInt32 MockACPIDevice::calls(const char *name) const
+{
+    const Method *method = find(name);
+    return method ? method->calls : 0;
+}
+
+UInt32 MockACPIDevice::totalCalls() const
+{
+    UInt32 total = 0;
+    for (size_t i = 0; i < methods.size(); i++)
+        total += methods[i].calls;
+    return total;
+}
+
+UInt64 MockACPIDevice::argument(const char *name, unsigned int index) const
+{
+    const Method *method = find(name);
+    return method && index < 4 ? method->args[index] : 0;
+}
+
+void MockACPIDevice::resetCalls()
+{
+    for (size_t i = 0; i < methods.size(); i++)
+    {
+        methods[i].calls = 0;
+        bzero(methods[i].args, sizeof(methods[i].args));
+    }
+    log.clear();
+}
+
+#pragma mark -
+#pragma mark ASUS notebook
+#pragma mark -
+
+void MockACPIDevice::loadASUSNotebook(const MockASUSNotebook &config)
+{
+    bzero(&state, sizeof(state));
+    state.wedShape = config.wedShape;
+    state.alsLux = 300;
+    state.touchpad = 1;
+    for (int i = 0; i < 256; i++)
+        state.wedCodes[i] = (UInt8) i;
+
+    OSString *uid = OSString::withCString("ATK");
+    setResult("_UID", uid);
+    uid->release();
+
+    OSData *wdg = OSData::withBytes(asusWDG, sizeof(asusWDG));
+    setResult("_WDG", wdg);
+    wdg->release();
+
+    static const UInt8 mof[16] = { 'F', 'O', 'M', 'B', 0x01, 0x00, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+    OSData *wqmo = OSData::withBytes(mof, sizeof(mof));
+    setResult("WQMO", wqmo);
+    wqmo->release();
+
+    setMethod("WMNB", [this](OSObject *params[], IOItemCount count, OSObject **result) {
+        return asusWMNB(params, count, result);
+    });
+    setMethod("_WED", [this](OSObject *params[], IOItemCount count, OSObject **result) {
+        return asusWED(params, count, result);
+    });
+
+    if (config.init)
+        setInteger("INIT", 1);
+
+    if (config.keyboardBacklight)
+    {
+        setMethod("SKBL", [this](OSObject *params[], IOItemCount count, OSObject **result) {
+            state.keyboardBacklight = (UInt32) mockArgument(params, count, 0);
+            return kIOReturnSuccess;
+        });
+        setMethod("GKBL", [this](OSObject *params[], IOItemCount count, OSObject **result) {
+            *result = OSNumber::withNumber(state.keyboardBacklight, 32);
+            return kIOReturnSuccess;
+        });
+        if (config.keyboardBacklight16)
+            setInteger("KBPW", 1);
+    }
+
+    if (config.ambientLightSensor)
+    {
+        setMethod("ALSC", [this](OSObject *params[], IOItemCount count, OSObject **result) {
+            state.alsEnabled = mockArgument(params, count, 0) != 0;
+            *result = OSNumber::withNumber(1, 32);
+            return kIOReturnSuccess;
+        });
+        // A sensor that drifts a little on every read
+        setMethod("ALSS", [this](OSObject *params[], IOItemCount count, OSObject **result) {
+            state.alsLux = (state.alsLux * 7 + 13) % 1000;
+            *result = OSNumber::withNumber(state.alsLux, 32);
+            return kIOReturnSuccess;
+        });
+    }
+}
+
+IOReturn MockACPIDevice::asusWMNB(OSObject *params[], IOItemCount count, OSObject **result)
+{
+    UInt32 methodId = (UInt32) mockArgument(params, count, 1);
+    UInt32 args[2] = { 0, 0 };
+    UInt32 ret = kASUSUnsupported;
+
+    if (count > 2)
+    {
+        if (OSNumber *number = OSDynamicCast(OSNumber, params[2]))
+            args[0] = number->unsigned32BitValue();
+        else if (OSData *data = OSDynamicCast(OSData, params[2]))
+            memcpy(args, data->getBytesNoCopy(), data->getLength() < sizeof(args) ? data->getLength() : sizeof(args));
+    }
+
+    switch (methodId)
+    {
+        case kASUSMethodINIT:
+            ret = 1;
+            break;
+
+        case kASUSMethodDSTS:
+            if (args[0] == kASUSDeviceTouchpad)
+                ret = kASUSStatusPresent | state.touchpad;
+            else if (args[0] == kASUSDeviceKbdBacklight && find("SKBL"))
+                ret = kASUSStatusPresent | state.keyboardBacklight;
+            else if (args[0] == kASUSDeviceLightSensor && find("ALSC"))
+                ret = kASUSStatusPresent | state.alsEnabled;
+            break;
+
+        case kASUSMethodDEVS:
+            if (args[0] == kASUSDeviceTouchpad)
+            {
+                state.touchpad = args[1];
+                ret = 1;
+            }
+            break;
+    }
+
+    *result = OSNumber::withNumber(ret, 32);
+    return kIOReturnSuccess;
+}
+
+IOReturn MockACPIDevice::asusWED(OSObject *params[], IOItemCount count, OSObject **result)
+{
+    UInt8 code = state.wedCodes[mockArgument(params, count, 0) & 0xFF];
+
+    switch (state.wedShape)
+    {
+        case kMockWEDPackage:
+        {
+            OSArray *package = OSArray::withCapacity(1);
+            OSNumber *number = OSNumber::withNumber(code, 32);
+            package->setObject(number);
+            number->release();
+            *result = package;
+            break;
+        }
+
+        case kMockWEDBuffer:
+            *result = OSData::withBytes(&code, 1);
+            break;
+
+        default:
+            *result = OSNumber::withNumber(code, 32);
+            break;
+    }
+    return kIOReturnSuccess;
+}
@@ -0,0 +1,148 @@
+/*
+ *  Copyright (c) 2018 hieplpvip
+ *
+ *
+ *  MockACPIDevice.h
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _MockACPIDevice_h
+#define _MockACPIDevice_h
+
+#include <functional>
+#include <deque>
+#include <IOKit/acpi/IOACPIPlatformDevice.h>
+
+/*
+ * Scriptable stand-in for the ATK WMI device. Every method is a handler,
+ * a constant result or a queue of results returned once each, and can be
+ * given a latency (the clock moves while it runs) or a forced failure.
+ * Calls and their last integer arguments are counted per method and logged
+ * in order. The allocations handlers make for their results, and the log's,
+ * are counted apart from the driver's.
+ *
+ * loadASUSNotebook() installs a model of the firmware the driver expects,
+ * see MockASUSNotebook.
+ */
+
+enum
+{
+    kMockWEDNumber,     // _WED returns Integer
+    kMockWEDPackage,    // Package { Integer }
+    kMockWEDBuffer,     // Buffer, code in the first byte
+};
+
+struct MockASUSNotebook
+{
+    bool keyboardBacklight  = true;     // SKBL, GKBL
+    bool keyboardBacklight16 = false;   // KBPW
+    bool ambientLightSensor = true;     // ALSC, ALSS
+    bool init               = true;     // INIT
+    UInt8 wedShape          = kMockWEDNumber;
+};
+
+// Firmware side state of the ASUS model, readable by the tests
+struct MockASUSState
+{
+    UInt32 keyboardBacklight;
+    bool alsEnabled;
+    UInt32 alsLux;
+    UInt8 wedShape;
+    UInt8 wedCodes[256];        // _WED result for each notify value
+    UInt32 touchpad;            // DSTS value of ASUS_WMI_DEVID_TOUCHPAD
+};
+
+// One evaluation, see MockACPIDevice::callLog()
+struct MockACPICall
+{
+    UInt64 time;                // clock when it was made
+    char name[5];
+    UInt64 args[4];             // numbers, the first 8 bytes of buffers (little endian)
+};
+
+class MockACPIDevice : public IOACPIPlatformDevice
+{
+    OSDeclareDefaultStructors(MockACPIDevice)
+
+public:
+    // Returns a retained result in *result, or leaves it NULL
+    typedef std::function<IOReturn (OSObject *params[], IOItemCount count, OSObject **result)> Handler;
+
+    static MockACPIDevice *withName(const char *name);
+    virtual void free();
+
+    using IOACPIPlatformDevice::validateObject;
+    using IOACPIPlatformDevice::evaluateObject;
+    virtual IOReturn validateObject(const OSSymbol *objectName);
+    virtual IOReturn evaluateObject(const OSSymbol *objectName, OSObject **result = 0,
+                                    OSObject *params[] = 0, IOItemCount paramCount = 0, IOOptionBits options = 0);
+
+    void setMethod(const char *name, Handler handler);
+    void setResult(const char *name, OSObject *result);
+    void setInteger(const char *name, UInt64 value);
+    void removeMethod(const char *name);
+    void queueResult(const char *name, OSObject *result);
+
+    // ns the clock moves during each call, name "*" sets the default
+    void setLatency(const char *name, UInt64 ns);
+    // Calls return ret instead of running, kIOReturnSuccess to stop
+    void failMethod(const char *name, IOReturn ret);
+
+    UInt32 calls(const char *name) const;
+    UInt32 totalCalls() const;
+    UInt64 allocations() const { return resultAllocations; }
+    UInt64 argument(const char *name, unsigned int index = 0) const;
+    // Every call since the last resetCalls(), oldest first
+    const std::vector<MockACPICall> &callLog() const { return log; }
+    void resetCalls();
+
+    void loadASUSNotebook(const MockASUSNotebook &config = MockASUSNotebook());
+    MockASUSState &asus() { return state; }
+
+    // _WDG of an ATK device: the management methods (WMNB), the
+    // event GUID (notify 0xFF) and the MOF data block (WQMO)
+    static const UInt8 asusWDG[60];
+
+private:
+    struct Method {
+        char name[5];
+        Handler handler;
+        std::deque<OSObject *> queued;
+        UInt64 latency;
+        bool hasLatency;
+        IOReturn failure;
+        UInt32 calls;
+        UInt64 args[4];
+    };
+
+    std::vector<Method> methods;
+    std::vector<MockACPICall> log;
+    UInt64 defaultLatency;
+    UInt64 resultAllocations;
+    MockASUSState state;
+
+    Method *find(const char *name);
+    const Method *find(const char *name) const;
+    Method *define(const char *name);
+
+    IOReturn asusWMNB(OSObject *params[], IOItemCount count, OSObject **result);
+    IOReturn asusWED(OSObject *params[], IOItemCount count, OSObject **result);
+};
+
+// Integer argument index of a method call, 0 if absent or not a number
+UInt64 mockArgument(OSObject *params[], IOItemCount count, unsigned int index);
+
+#endif //_MockACPIDevice_h
@@ -0,0 +1,127 @@
+/*
+ *  Copyright (c) 2018 hieplpvip
+ *
+ *
+ *  MockServices.cpp
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "MockServices.h"
+#include "AsusFnKeys.h"
+
+#pragma mark -
+#pragma mark AppleBacklightDisplay
+#pragma mark -
+
+OSDefineMetaClassAndStructors(AppleBacklightDisplay, IOService)
+
+AppleBacklightDisplay *AppleBacklightDisplay::withBrightness(UInt32 value)
+{
+    AppleBacklightDisplay *me = new AppleBacklightDisplay;
+    if (!me->init())
+    {
+        me->release();
+        return NULL;
+    }
+    me->setBrightness(value);
+    return me;
+}
+
+void AppleBacklightDisplay::setBrightness(UInt32 value)
+{
+    OSDictionary *parameters = OSDictionary::withCapacity(1);
+    OSDictionary *brightness = OSDictionary::withCapacity(3);
+    OSNumber *number;
+
+    number = OSNumber::withNumber(value, 32);
+    brightness->setObject("value", number);
+    number->release();
+    number = OSNumber::withNumber(0ULL, 32);
+    brightness->setObject("min", number);
+    number->release();
+    number = OSNumber::withNumber(kPanelBrightnessLevels * kPanelBrightnessStep, 32);
+    brightness->setObject("max", number);
+    number->release();
+
+    parameters->setObject("brightness", brightness);
+    brightness->release();
+    setProperty("IODisplayParameters", parameters);
+    parameters->release();
+
+    messageClients(kIOMessageServicePropertyChange);
+}
+
+UInt32 AppleBacklightDisplay::brightness() const
+{
+    OSDictionary *parameters = OSDynamicCast(OSDictionary, getProperty("IODisplayParameters"));
+    OSDictionary *brightness = parameters ? OSDynamicCast(OSDictionary, parameters->getObject("brightness")) : NULL;
+    OSNumber *value = brightness ? OSDynamicCast(OSNumber, brightness->getObject("value")) : NULL;
+    return value ? value->unsigned32BitValue() : 0;
+}
+
+IOReturn AppleBacklightDisplay::setProperties(OSObject *properties)
+{
+    OSDictionary *dict = OSDynamicCast(OSDictionary, properties);
+    OSNumber *value = dict ? OSDynamicCast(OSNumber, dict->getObject("brightness")) : NULL;
+    if (!value)
+        return kIOReturnBadArgument;
+
+    writes++;
+    setBrightness(value->unsigned32BitValue());
+    return kIOReturnSuccess;
+}
+
+#pragma mark -
+#pragma mark MockTrackpad
+#pragma mark -
+
+OSDefineMetaClassAndStructors(MockTrackpad, IOService)
+
+MockTrackpad *MockTrackpad::trackpad()
+{
+    MockTrackpad *me = new MockTrackpad;
+    if (!me->init())
+    {
+        me->release();
+        return NULL;
+    }
+    me->enabled = true;
+    me->setProperty(kDeliverNotifications, true);
+    return me;
+}
+
+IOReturn MockTrackpad::message(UInt32 type, IOService *provider, void *argument)
+{
+    received.push_back(type);
+    if (type == kKeyboardSetTouchStatus && argument)
+        enabled = *((bool *) argument);
+    return kIOReturnSuccess;
+}
+
+void MockTrackpad::keyPressed(IOService *fnKeys, UInt64 time)
+{
+    uint64_t stamp = time;
+    fnKeys->message(kKeyboardKeyPressTime, this, &stamp);
+}
+
+UInt32 MockTrackpad::messages(UInt32 type) const
+{
+    UInt32 count = 0;
+    for (size_t i = 0; i < received.size(); i++)
+        if (received[i] == type)
+            count++;
+    return count;
+}
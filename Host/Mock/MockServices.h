@@ -0,0 +1,72 @@
+/*
+ *  Copyright (c) 2018 hieplpvip
+ *
+ *
+ *  MockServices.h
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _MockServices_h
+#define _MockServices_h
+
+#include <IOKit/IOService.h>
+
+/*
+ * The other drivers AsusFnKeys talks to, reduced to what it uses of them
+ */
+
+// The panel, named like the real class so serviceMatching() finds it
+class AppleBacklightDisplay : public IOService
+{
+    OSDeclareDefaultStructors(AppleBacklightDisplay)
+
+public:
+    static AppleBacklightDisplay *withBrightness(UInt32 value);
+
+    // { brightness: value } updates IODisplayParameters and tells the interested
+    virtual IOReturn setProperties(OSObject *properties);
+
+    // Brightness changed by the system, like the brightness slider
+    void setBrightness(UInt32 value);
+    UInt32 brightness() const;
+    UInt32 brightnessWrites() const { return writes; }
+
+private:
+    UInt32 writes;
+};
+
+// A trackpad driver asking for ASUSFN,deliverNotifications
+class MockTrackpad : public IOService
+{
+    OSDeclareDefaultStructors(MockTrackpad)
+
+public:
+    static MockTrackpad *trackpad();
+
+    virtual IOReturn message(UInt32 type, IOService *provider, void *argument);
+
+    // kKeyboardKeyPressTime, as sent for every keystroke
+    void keyPressed(IOService *fnKeys, UInt64 time);
+
+    UInt32 messages(UInt32 type) const;
+    bool touchpadEnabled() const { return enabled; }
+
+private:
+    std::vector<UInt32> received;
+    bool enabled;
+};
+
+#endif //_MockServices_h
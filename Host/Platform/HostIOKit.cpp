@@ -0,0 +1,1498 @@
+/*
+ *  Copyright (c) 2018 hieplpvip
+ *
+ *
+ *  HostIOKit.cpp
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <queue>
+#include "HostIOKit.h"
+
+#pragma mark -
+#pragma mark Logging
+#pragma mark -
+
+static int gLogging = -1;
+
+void hostSetLogging(bool enabled)
+{
+    gLogging = enabled;
+}
+
+void IOLog(const char *format, ...)
+{
+    if (gLogging < 0)
+        gLogging = getenv("FNKEYS_HOST_LOG") != NULL;
+    if (!gLogging)
+        return;
+
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+#pragma mark -
+#pragma mark Clock and schedule
+#pragma mark -
+
+struct HostScheduled
+{
+    UInt64 when;
+    UInt64 sequence;
+    HostCallback callback;
+    void *ref;
+
+    // Earliest first, then in the order they were scheduled
+    bool operator<(const HostScheduled &other) const
+    {
+        return when != other.when ? when > other.when : sequence > other.sequence;
+    }
+};
+
+static UInt64 gClock = kHostClockStart;
+static UInt64 gSequence;
+static std::priority_queue<HostScheduled> *gSchedule;
+
+static std::priority_queue<HostScheduled> &schedule()
+{
+    if (!gSchedule)
+        gSchedule = new std::priority_queue<HostScheduled>;
+    return *gSchedule;
+}
+
+UInt64 hostClockNow()
+{
+    return gClock;
+}
+
+void hostSchedule(UInt64 when, HostCallback callback, void *ref)
+{
+    HostScheduled item = { when, gSequence++, callback, ref };
+    schedule().push(item);
+}
+
+bool hostNextScheduled(UInt64 *when)
+{
+    if (schedule().empty())
+        return false;
+    *when = schedule().top().when;
+    return true;
+}
+
+void hostClockAdvance(UInt64 ns)
+{
+    UInt64 target = gClock + ns;
+
+    while (!schedule().empty() && schedule().top().when <= target)
+    {
+        HostScheduled item = schedule().top();
+        schedule().pop();
+        if (item.when > gClock)
+            gClock = item.when;
+        item.callback(item.ref);
+    }
+
+    // A callback may have moved the clock further already
+    if (target > gClock)
+        gClock = target;
+}
+
+void clock_get_uptime(uint64_t *result)
+{
+    *result = gClock;
+}
+
+void clock_get_system_microtime(clock_sec_t *secs, clock_usec_t *microsecs)
+{
+    *secs = (clock_sec_t)(gClock / 1000000000ULL);
+    *microsecs = (clock_usec_t)((gClock / 1000) % 1000000);
+}
+
+void absolutetime_to_nanoseconds(uint64_t abstime, uint64_t *result)
+{
+    *result = abstime;
+}
+
+void nanoseconds_to_absolutetime(uint64_t nanoseconds, uint64_t *result)
+{
+    *result = nanoseconds;
+}
+
+uint64_t mach_absolute_time(void)
+{
+    return gClock;
+}
+
+void IOSleep(unsigned milliseconds)
+{
+    hostClockAdvance(milliseconds * 1000000ULL);
+}
+
+void IODelay(unsigned microseconds)
+{
+    hostClockAdvance(microseconds * 1000ULL);
+}
+
+#pragma mark -
+#pragma mark Event logs
+#pragma mark -
+
+static HostHIDEvent gHIDLog[kHostLogSize];
+static UInt32 gHIDCount;
+static HostHIDHook gHIDHook;
+static void *gHIDHookRef;
+
+void hostSetHIDHook(HostHIDHook hook, void *ref)
+{
+    gHIDHook = hook;
+    gHIDHookRef = ref;
+}
+
+UInt32 hostHIDEventCount()
+{
+    return gHIDCount;
+}
+
+const HostHIDEvent *hostHIDEvent(UInt32 index)
+{
+    if (index >= gHIDCount || gHIDCount - index > kHostLogSize)
+        return NULL;
+    return &gHIDLog[index % kHostLogSize];
+}
+
+static HostKernEvent gKernLog[kHostLogSize];
+static UInt32 gKernCount;
+
+UInt32 hostKernEventCount()
+{
+    return gKernCount;
+}
+
+const HostKernEvent *hostKernEvent(UInt32 index)
+{
+    if (index >= gKernCount || gKernCount - index > kHostLogSize)
+        return NULL;
+    return &gKernLog[index % kHostLogSize];
+}
+
+static const char *gVendors[8];
+
+int kev_vendor_code_find(const char *vendor_string, u_int32_t *vendor_code)
+{
+    for (u_int32_t i = 0; i < sizeof(gVendors) / sizeof(gVendors[0]); i++)
+    {
+        if (!gVendors[i])
+            gVendors[i] = vendor_string;
+        if (!strcmp(gVendors[i], vendor_string))
+        {
+            *vendor_code = 1000 + i;
+            return 0;
+        }
+    }
+    return ENOBUFS;
+}
+
+int kev_msg_post(struct kev_msg *event_msg)
+{
+    HostKernEvent *event = &gKernLog[gKernCount++ % kHostLogSize];
+    event->vendor_code = event_msg->vendor_code;
+    event->kev_class = event_msg->kev_class;
+    event->kev_subclass = event_msg->kev_subclass;
+    event->event_code = event_msg->event_code;
+    event->length = 0;
+    event->postTime = hostClockNow();
+
+    for (int i = 0; i < N_KEV_VECTORS && event_msg->dv[i].data_length; i++)
+    {
+        u_int32_t length = event_msg->dv[i].data_length;
+        if (event->length + length > sizeof(event->data))
+            return EMSGSIZE;
+        memcpy(event->data + event->length, event_msg->dv[i].data_ptr, length);
+        event->length += length;
+    }
+    return 0;
+}
+
+#pragma mark -
+#pragma mark Registry
+#pragma mark -
+
+class IORegistryPlane {};
+static const IORegistryPlane gServicePlane, gDTPlane;
+const IORegistryPlane *gIOServicePlane = &gServicePlane;
+const IORegistryPlane *gIODTPlane = &gDTPlane;
+
+const OSSymbol *gIOPublishNotification = OSSymbol::withCString("IOServicePublish");
+const OSSymbol *gIOFirstPublishNotification = OSSymbol::withCString("IOServiceFirstPublish");
+const OSSymbol *gIOMatchedNotification = OSSymbol::withCString("IOServiceMatched");
+const OSSymbol *gIOFirstMatchNotification = OSSymbol::withCString("IOServiceFirstMatch");
+const OSSymbol *gIOTerminatedNotification = OSSymbol::withCString("IOServiceTerminate");
+const OSSymbol *gIOGeneralInterest = OSSymbol::withCString("IOGeneralInterest");
+
+struct HostPath
+{
+    char path[64];
+    IORegistryEntry *entry;
+};
+
+static std::vector<HostPath> *gPaths;
+static std::vector<OSDictionary *> *gPersonalities;
+static std::vector<IOService *> *gServices;
+
+template <typename T> static std::vector<T> &hostList(std::vector<T> *&list)
+{
+    if (!list)
+        list = new std::vector<T>;
+    return *list;
+}
+
+void hostRegisterPath(const char *path, IORegistryEntry *entry)
+{
+    std::vector<HostPath> &paths = hostList(gPaths);
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+        if (!strcmp(paths[i].path, path))
+        {
+            if (entry)
+                entry->retain();
+            paths[i].entry->release();
+            if (entry)
+                paths[i].entry = entry;
+            else
+                paths.erase(paths.begin() + i);
+            return;
+        }
+    }
+
+    if (!entry)
+        return;
+
+    HostPath item;
+    snprintf(item.path, sizeof(item.path), "%s", path);
+    item.entry = entry;
+    entry->retain();
+    paths.push_back(item);
+}
+
+void hostAddPersonality(OSDictionary *personality)
+{
+    personality->retain();
+    hostList(gPersonalities).push_back(personality);
+}
+
+void hostAddPersonalities(OSDictionary *personalities)
+{
+    OSCollectionIterator *i = OSCollectionIterator::withCollection(personalities);
+    if (!i)
+        return;
+    while (const OSSymbol *key = OSDynamicCast(OSSymbol, i->getNextObject()))
+        if (OSDictionary *personality = OSDynamicCast(OSDictionary, personalities->getObject(key)))
+            hostAddPersonality(personality);
+    i->release();
+}
+
+OSDefineMetaClassAndStructors(IORegistryEntry, OSObject)
+
+bool IORegistryEntry::init(OSDictionary *dictionary)
+{
+    if (!OSObject::init())
+        return false;
+
+    if (fPropertyTable)
+        fPropertyTable->release();
+    if (dictionary)
+    {
+        dictionary->retain();
+        fPropertyTable = dictionary;
+    }
+    else
+        fPropertyTable = OSDictionary::withCapacity(16);
+    return true;
+}
+
+void IORegistryEntry::free()
+{
+    OSSafeReleaseNULL(fPropertyTable);
+    OSObject::free();
+}
+
+IORegistryEntry *IORegistryEntry::fromPath(const char *path, const IORegistryPlane *plane,
+                                           char *residualPath, int *residualLength,
+                                           IORegistryEntry *fromEntry)
+{
+    std::vector<HostPath> &paths = hostList(gPaths);
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+        if (!strcmp(paths[i].path, path))
+        {
+            paths[i].entry->retain();
+            return paths[i].entry;
+        }
+    }
+    return NULL;
+}
+
+OSObject *IORegistryEntry::getProperty(const OSSymbol *aKey) const
+{
+    return aKey ? getProperty(aKey->getCStringNoCopy()) : NULL;
+}
+
+OSObject *IORegistryEntry::getProperty(const OSString *aKey) const
+{
+    return aKey ? getProperty(aKey->getCStringNoCopy()) : NULL;
+}
+
+OSObject *IORegistryEntry::getProperty(const char *aKey) const
+{
+    return fPropertyTable ? fPropertyTable->getObject(aKey) : NULL;
+}
+
+OSObject *IORegistryEntry::copyProperty(const OSSymbol *aKey) const
+{
+    OSObject *object = getProperty(aKey);
+    if (object)
+        object->retain();
+    return object;
+}
+
+OSObject *IORegistryEntry::copyProperty(const char *aKey) const
+{
+    OSObject *object = getProperty(aKey);
+    if (object)
+        object->retain();
+    return object;
+}
+
+bool IORegistryEntry::setProperty(const OSSymbol *aKey, OSObject *anObject)
+{
+    if (!fPropertyTable)
+        fPropertyTable = OSDictionary::withCapacity(16);
+    return fPropertyTable->setObject(aKey, anObject);
+}
+
+bool IORegistryEntry::setProperty(const OSString *aKey, OSObject *anObject)
+{
+    const OSSymbol *sym = aKey ? OSSymbol::withString(aKey) : NULL;
+    if (!sym)
+        return false;
+    bool ret = setProperty(sym, anObject);
+    sym->release();
+    return ret;
+}
+
+bool IORegistryEntry::setProperty(const char *aKey, OSObject *anObject)
+{
+    const OSSymbol *sym = OSSymbol::withCString(aKey);
+    if (!sym)
+        return false;
+    bool ret = setProperty(sym, anObject);
+    sym->release();
+    return ret;
+}
+
+bool IORegistryEntry::setProperty(const char *aKey, const char *aString)
+{
+    OSString *str = OSString::withCString(aString);
+    if (!str)
+        return false;
+    bool ret = setProperty(aKey, str);
+    str->release();
+    return ret;
+}
+
+bool IORegistryEntry::setProperty(const char *aKey, bool aBoolean)
+{
+    return setProperty(aKey, OSBoolean::withBoolean(aBoolean));
+}
+
+bool IORegistryEntry::setProperty(const char *aKey, unsigned long long aValue, unsigned int aNumberOfBits)
+{
+    OSNumber *num = OSNumber::withNumber(aValue, aNumberOfBits);
+    if (!num)
+        return false;
+    bool ret = setProperty(aKey, num);
+    num->release();
+    return ret;
+}
+
+bool IORegistryEntry::setProperty(const char *aKey, void *bytes, unsigned int length)
+{
+    OSData *data = OSData::withBytes(bytes, length);
+    if (!data)
+        return false;
+    bool ret = setProperty(aKey, data);
+    data->release();
+    return ret;
+}
+
+void IORegistryEntry::removeProperty(const OSSymbol *aKey)
+{
+    if (fPropertyTable)
+        fPropertyTable->removeObject(aKey);
+}
+
+void IORegistryEntry::removeProperty(const char *aKey)
+{
+    if (fPropertyTable)
+        fPropertyTable->removeObject(aKey);
+}
+
+bool IORegistryEntry::serializeProperties(OSSerialize *s) const
+{
+    return fPropertyTable && fPropertyTable->serialize(s);
+}
+
+IOReturn IORegistryEntry::setProperties(OSObject *properties)
+{
+    return kIOReturnUnsupported;
+}
+
+const char *IORegistryEntry::getName(const IORegistryPlane *plane) const
+{
+    return fName[0] ? fName : getMetaClass()->getClassName();
+}
+
+void IORegistryEntry::setName(const char *name, const IORegistryPlane *plane)
+{
+    snprintf(fName, sizeof(fName), "%s", name);
+}
+
+#pragma mark -
+#pragma mark Notifiers
+#pragma mark -
+
+OSDefineMetaClassAndAbstractStructors(IONotifier, OSObject)
+
+/*
+ * Drivers both remove() and release notifiers, which the kernel tolerates.
+ * Here they are owned by the platform: retain and release do nothing and
+ * removed notifiers are freed by hostReset().
+ */
+static std::vector<IONotifier *> *gRemovedNotifiers;
+
+class _IOServiceNotifier : public IONotifier
+{
+    OSDeclareDefaultStructors(_IOServiceNotifier)
+
+public:
+    const OSSymbol *type;
+    OSDictionary *matching;
+    IOServiceMatchingNotificationHandler handler;
+    void *target, *ref;
+    bool enabled;
+
+    virtual void retain() const {}
+    virtual void release() const {}
+    virtual void remove();
+    virtual bool disable() { bool was = enabled; enabled = false; return was; }
+    virtual void enable(bool was) { enabled = was; }
+    void destroy() { OSSafeReleaseNULL(matching); OSObject::release(); }
+};
+
+OSDefineMetaClassAndStructors(_IOServiceNotifier, IONotifier)
+
+static std::vector<_IOServiceNotifier *> *gNotifiers;
+
+void _IOServiceNotifier::remove()
+{
+    enabled = false;
+    std::vector<_IOServiceNotifier *> &notifiers = hostList(gNotifiers);
+    for (size_t i = 0; i < notifiers.size(); i++)
+    {
+        if (notifiers[i] == this)
+        {
+            notifiers.erase(notifiers.begin() + i);
+            hostList(gRemovedNotifiers).push_back(this);
+            break;
+        }
+    }
+}
+
+class _IOServiceInterestNotifier : public IONotifier
+{
+    OSDeclareDefaultStructors(_IOServiceInterestNotifier)
+
+public:
+    IOService *owner;
+    IOServiceInterestHandler handler;
+    void *target, *ref;
+    bool enabled;
+
+    virtual void retain() const {}
+    virtual void release() const {}
+    virtual void remove();
+    virtual bool disable() { bool was = enabled; enabled = false; return was; }
+    virtual void enable(bool was) { enabled = was; }
+    void destroy() { OSObject::release(); }
+};
+
+OSDefineMetaClassAndStructors(_IOServiceInterestNotifier, IONotifier)
+
+void _IOServiceInterestNotifier::remove()
+{
+    enabled = false;
+    if (owner)
+    {
+        std::vector<IONotifier *> &interest = owner->fInterest;
+        for (size_t i = 0; i < interest.size(); i++)
+        {
+            if (interest[i] == this)
+            {
+                interest.erase(interest.begin() + i);
+                break;
+            }
+        }
+        owner = NULL;
+        hostList(gRemovedNotifiers).push_back(this);
+    }
+}
+
+static void deliverNotification(const OSSymbol *type, IOService *service)
+{
+    // Handlers may add or remove notifiers, walk a copy
+    std::vector<_IOServiceNotifier *> notifiers = hostList(gNotifiers);
+    for (size_t i = 0; i < notifiers.size(); i++)
+    {
+        _IOServiceNotifier *notifier = notifiers[i];
+        std::vector<_IOServiceNotifier *> &live = hostList(gNotifiers);
+        bool present = false;
+        for (size_t j = 0; j < live.size() && !present; j++)
+            present = live[j] == notifier;
+
+        if (present && notifier->enabled && notifier->type == type && service->matchesTable(notifier->matching))
+            notifier->handler(notifier->target, notifier->ref, service, notifier);
+    }
+}
+
+#pragma mark -
+#pragma mark IOService
+#pragma mark -
+
+OSDefineMetaClassAndStructors(IOService, IORegistryEntry)
+
+bool IOService::init(OSDictionary *dictionary)
+{
+    return IORegistryEntry::init(dictionary);
+}
+
+void IOService::free()
+{
+    // Interest notifiers not removed yet are freed with the removed ones
+    for (size_t i = 0; i < fInterest.size(); i++)
+    {
+        ((_IOServiceInterestNotifier *) fInterest[i])->owner = NULL;
+        hostList(gRemovedNotifiers).push_back(fInterest[i]);
+    }
+    fInterest.clear();
+    OSSafeReleaseNULL(fClients);
+    IORegistryEntry::free();
+}
+
+IOService *IOService::probe(IOService *provider, SInt32 *score)
+{
+    return this;
+}
+
+bool IOService::start(IOService *provider)
+{
+    return true;
+}
+
+void IOService::stop(IOService *provider)
+{
+}
+
+bool IOService::attach(IOService *provider)
+{
+    if (!provider || fProvider)
+        return false;
+
+    provider->retain();
+    fProvider = provider;
+    if (!provider->fClients)
+        provider->fClients = OSArray::withCapacity(2);
+    provider->fClients->setObject(this);
+    return true;
+}
+
+void IOService::detach(IOService *provider)
+{
+    if (!provider || provider != fProvider)
+        return;
+
+    // Dropping the client reference may free this
+    fProvider = NULL;
+    if (OSArray *clients = provider->fClients)
+    {
+        for (unsigned int i = 0; i < clients->getCount(); i++)
+        {
+            if (clients->getObject(i) == this)
+            {
+                clients->removeObject(i);
+                break;
+            }
+        }
+    }
+    provider->release();
+}
+
+IOService *IOService::getClient() const
+{
+    return fClients ? OSDynamicCast(IOService, fClients->getObject(0)) : NULL;
+}
+
+void IOService::registerService(IOOptionBits options)
+{
+    if (fRegistered || fInactive)
+        return;
+
+    retain();
+    fRegistered = true;
+    hostList(gServices).push_back(this);
+
+    deliverNotification(gIOPublishNotification, this);
+    deliverNotification(gIOFirstPublishNotification, this);
+
+    // Start the drivers whose personality matches, in load order
+    std::vector<OSDictionary *> personalities = hostList(gPersonalities);
+    for (size_t i = 0; i < personalities.size() && !fInactive; i++)
+    {
+        OSDictionary *personality = personalities[i];
+        OSString *className = OSDynamicCast(OSString, personality->getObject("IOClass"));
+        if (!className || !matchesTable(personality))
+            continue;
+
+        OSObject *object = OSMetaClass::allocClassWithName(className->getCStringNoCopy());
+        IOService *driver = OSDynamicCast(IOService, object);
+        if (!driver)
+        {
+            IOLog("IOService::No driver class %s\n", className->getCStringNoCopy());
+            OSSafeReleaseNULL(object);
+            continue;
+        }
+
+        OSDictionary *properties = OSDictionary::withDictionary(personality);
+        bool ok = driver->init(properties) && driver->attach(this);
+        properties->release();
+
+        SInt32 score = 0;
+        if (OSNumber *probeScore = OSDynamicCast(OSNumber, personality->getObject("IOProbeScore")))
+            score = (SInt32) probeScore->unsigned32BitValue();
+        ok = ok && driver->probe(this, &score) && driver->start(this);
+        if (ok)
+            driver->fStarted = true;
+        else if (driver->getProvider() == this)
+            driver->detach(this);
+        driver->release();
+    }
+
+    deliverNotification(gIOMatchedNotification, this);
+    deliverNotification(gIOFirstMatchNotification, this);
+}
+
+bool IOService::terminate(IOOptionBits options)
+{
+    if (fInactive)
+        return true;
+
+    retain();
+    fInactive = true;
+
+    // Clients go first, the last attached first
+    while (fClients && fClients->getCount())
+    {
+        IOService *client = OSDynamicCast(IOService, fClients->getObject(fClients->getCount() - 1));
+        client->retain();
+        client->terminate(options);
+        if (client->getProvider() == this)
+            client->detach(this);
+        client->release();
+    }
+
+    if (fRegistered)
+        deliverNotification(gIOTerminatedNotification, this);
+
+    if (fStarted && fProvider)
+    {
+        fStarted = false;
+        stop(fProvider);
+    }
+    if (fProvider)
+        detach(fProvider);
+
+    if (fRegistered)
+    {
+        std::vector<IOService *> &services = hostList(gServices);
+        for (size_t i = 0; i < services.size(); i++)
+        {
+            if (services[i] == this)
+            {
+                services.erase(services.begin() + i);
+                break;
+            }
+        }
+        fRegistered = false;
+        release();
+    }
+
+    release();
+    return true;
+}
+
+static IOWorkLoop *gMainWorkLoop;
+
+IOWorkLoop *IOService::getWorkLoop() const
+{
+    if (!gMainWorkLoop)
+        gMainWorkLoop = IOWorkLoop::workLoop();
+    return gMainWorkLoop;
+}
+
+IOReturn IOService::message(UInt32 type, IOService *provider, void *argument)
+{
+    return kIOReturnUnsupported;
+}
+
+IOReturn IOService::messageClient(UInt32 messageType, OSObject *client, void *messageArgument, vm_size_t argSize)
+{
+    if (IOService *service = OSDynamicCast(IOService, client))
+        return service->message(messageType, this, messageArgument);
+    if (_IOServiceInterestNotifier *notifier = OSDynamicCast(_IOServiceInterestNotifier, client))
+    {
+        if (notifier->enabled)
+            return notifier->handler(notifier->target, notifier->ref, messageType, this, messageArgument, argSize);
+        return kIOReturnSuccess;
+    }
+    return kIOReturnBadArgument;
+}
+
+IOReturn IOService::messageClients(UInt32 type, void *argument, vm_size_t argSize)
+{
+    // Walks the live lists so delivering a message never allocates, a client
+    // detached by its handler only shifts the ones after it
+    for (unsigned int i = 0; fClients && i < fClients->getCount(); i++)
+    {
+        OSObject *client = fClients->getObject(i);
+        client->retain();
+        messageClient(type, client, argument, argSize);
+        client->release();
+    }
+
+    for (size_t i = 0; i < fInterest.size(); i++)
+        if (((_IOServiceInterestNotifier *) fInterest[i])->owner == this)
+            messageClient(type, fInterest[i], argument, argSize);
+
+    return kIOReturnSuccess;
+}
+
+IONotifier *IOService::registerInterest(const OSSymbol *typeOfInterest, IOServiceInterestHandler handler,
+                                        void *target, void *ref)
+{
+    if (typeOfInterest != gIOGeneralInterest || !handler)
+        return NULL;
+
+    _IOServiceInterestNotifier *notifier = new _IOServiceInterestNotifier;
+    notifier->owner = this;
+    notifier->handler = handler;
+    notifier->target = target;
+    notifier->ref = ref;
+    notifier->enabled = true;
+    fInterest.push_back(notifier);
+    return notifier;
+}
+
+IOReturn IOService::setPowerState(unsigned long powerStateOrdinal, IOService *whatDevice)
+{
+    return IOPMAckImplied;
+}
+
+void IOService::PMinit()
+{
+}
+
+void IOService::PMstop()
+{
+}
+
+IOReturn IOService::registerPowerDriver(IOService *controllingDriver, IOPMPowerState *powerStates, unsigned long numberOfStates)
+{
+    return kIOReturnSuccess;
+}
+
+void IOService::joinPMtree(IOService *driver)
+{
+}
+
+OSDictionary *IOService::serviceMatching(const char *className, OSDictionary *table)
+{
+    if (!table)
+        table = OSDictionary::withCapacity(2);
+    OSString *str = OSString::withCString(className);
+    table->setObject("IOProviderClass", str);
+    str->release();
+    return table;
+}
+
+OSDictionary *IOService::nameMatching(const char *name, OSDictionary *table)
+{
+    if (!table)
+        table = OSDictionary::withCapacity(2);
+    OSString *str = OSString::withCString(name);
+    table->setObject("IONameMatch", str);
+    str->release();
+    return table;
+}
+
+OSDictionary *IOService::propertyMatching(const OSSymbol *key, const OSObject *value, OSDictionary *table)
+{
+    if (!key || !value)
+        return NULL;
+    if (!table)
+        table = OSDictionary::withCapacity(2);
+    OSDictionary *properties = OSDictionary::withCapacity(2);
+    properties->setObject(key, value);
+    table->setObject("IOPropertyMatch", properties);
+    properties->release();
+    return table;
+}
+
+bool IOService::matchesTable(OSDictionary *table) const
+{
+    if (!table)
+        return false;
+
+    if (OSString *providerClass = OSDynamicCast(OSString, table->getObject("IOProviderClass")))
+        if (!getMetaClass()->isSubclassOf(providerClass->getCStringNoCopy()))
+            return false;
+
+    if (OSObject *names = table->getObject("IONameMatch"))
+    {
+        bool found = false;
+        if (OSString *name = OSDynamicCast(OSString, names))
+            found = name->isEqualTo(getName());
+        else if (OSArray *array = OSDynamicCast(OSArray, names))
+            for (unsigned int i = 0; i < array->getCount() && !found; i++)
+                if (OSString *name = OSDynamicCast(OSString, array->getObject(i)))
+                    found = name->isEqualTo(getName());
+        if (!found)
+            return false;
+    }
+
+    if (OSDictionary *properties = OSDynamicCast(OSDictionary, table->getObject("IOPropertyMatch")))
+    {
+        OSCollectionIterator *i = OSCollectionIterator::withCollection(properties);
+        bool found = true;
+        while (const OSSymbol *key = OSDynamicCast(OSSymbol, i->getNextObject()))
+        {
+            OSObject *value = getProperty(key);
+            if (!value || !value->isEqualTo(properties->getObject(key)))
+            {
+                found = false;
+                break;
+            }
+        }
+        i->release();
+        if (!found)
+            return false;
+    }
+
+    return true;
+}
+
+IONotifier *IOService::addMatchingNotification(const OSSymbol *type, OSDictionary *matching,
+                                               IOServiceMatchingNotificationHandler handler,
+                                               void *target, void *ref, SInt32 priority)
+{
+    if (!type || !matching || !handler)
+        return NULL;
+
+    _IOServiceNotifier *notifier = new _IOServiceNotifier;
+    notifier->type = type;
+    notifier->matching = matching;
+    matching->retain();
+    notifier->handler = handler;
+    notifier->target = target;
+    notifier->ref = ref;
+    notifier->enabled = true;
+    hostList(gNotifiers).push_back(notifier);
+
+    // Publish and match notifications also cover what is already registered
+    if (type != gIOTerminatedNotification)
+    {
+        std::vector<IOService *> services = hostList(gServices);
+        for (size_t i = 0; i < services.size(); i++)
+            if (notifier->enabled && !services[i]->isInactive() && services[i]->matchesTable(matching))
+                handler(target, ref, services[i], notifier);
+    }
+    return notifier;
+}
+
+IOService *IOService::copyMatchingService(OSDictionary *matching)
+{
+    std::vector<IOService *> &services = hostList(gServices);
+    for (size_t i = 0; i < services.size(); i++)
+    {
+        if (!services[i]->isInactive() && services[i]->matchesTable(matching))
+        {
+            services[i]->retain();
+            return services[i];
+        }
+    }
+    return NULL;
+}
+
+#pragma mark -
+#pragma mark IOUserClient
+#pragma mark -
+
+static bool gAdministrator = true;
+
+void hostSetAdministrator(bool administrator)
+{
+    gAdministrator = administrator;
+}
+
+task_t current_task()
+{
+    static int task;
+    return (task_t) &task;
+}
+
+OSDefineMetaClassAndStructors(IOUserClient, IOService)
+
+IOReturn IOUserClient::clientHasPrivilege(void *securityToken, const char *privilegeName)
+{
+    if (securityToken != current_task() || strcmp(privilegeName, kIOClientPrivilegeAdministrator))
+        return kIOReturnUnsupported;
+    return gAdministrator ? kIOReturnSuccess : kIOReturnNotPrivileged;
+}
+
+bool IOUserClient::initWithTask(task_t owningTask, void *securityToken, UInt32 type, OSDictionary *properties)
+{
+    return init(properties);
+}
+
+IOReturn IOUserClient::clientClose()
+{
+    return kIOReturnUnsupported;
+}
+
+IOReturn IOUserClient::externalMethod(uint32_t selector, IOExternalMethodArguments *arguments,
+                                      IOExternalMethodDispatch *dispatch, OSObject *target, void *reference)
+{
+    if (!dispatch || !dispatch->function)
+        return kIOReturnUnsupported;
+
+    if ((dispatch->checkScalarInputCount != kIOUCVariableStructureSize &&
+         dispatch->checkScalarInputCount != arguments->scalarInputCount) ||
+        (dispatch->checkStructureInputSize != kIOUCVariableStructureSize &&
+         dispatch->checkStructureInputSize != arguments->structureInputSize) ||
+        (dispatch->checkScalarOutputCount != kIOUCVariableStructureSize &&
+         dispatch->checkScalarOutputCount != arguments->scalarOutputCount) ||
+        (dispatch->checkStructureOutputSize != kIOUCVariableStructureSize &&
+         dispatch->checkStructureOutputSize != arguments->structureOutputSize))
+        return kIOReturnBadArgument;
+
+    return dispatch->function(target ? target : this, reference, arguments);
+}
+
+IOReturn IOService::newUserClient(task_t owningTask, void *securityID, UInt32 type,
+                                  OSDictionary *properties, IOUserClient **handler)
+{
+    OSString *className = OSDynamicCast(OSString, getProperty("IOUserClientClass"));
+    if (!className)
+        return kIOReturnUnsupported;
+
+    OSObject *object = OSMetaClass::allocClassWithName(className->getCStringNoCopy());
+    IOUserClient *client = OSDynamicCast(IOUserClient, object);
+    if (!client)
+    {
+        OSSafeReleaseNULL(object);
+        return kIOReturnUnsupported;
+    }
+
+    if (!client->initWithTask(owningTask, securityID, type, properties))
+    {
+        client->release();
+        return kIOReturnBadArgument;
+    }
+    if (!client->attach(this) || !client->start(this))
+    {
+        if (client->getProvider() == this)
+            client->detach(this);
+        client->release();
+        return kIOReturnUnsupported;
+    }
+
+    client->fStarted = true;
+    *handler = client;
+    return kIOReturnSuccess;
+}
+
+#pragma mark -
+#pragma mark Work loop
+#pragma mark -
+
+OSDefineMetaClassAndAbstractStructors(IOEventSource, OSObject)
+
+bool IOEventSource::init(OSObject *owner, Action action)
+{
+    if (!owner || !OSObject::init())
+        return false;
+
+    this->owner = owner;
+    this->action = action;
+    enabled = true;
+    return true;
+}
+
+static std::vector<IOWorkLoop *> *gWorkLoops;
+
+OSDefineMetaClassAndStructors(IOWorkLoop, OSObject)
+
+IOWorkLoop *IOWorkLoop::workLoop()
+{
+    IOWorkLoop *me = new IOWorkLoop;
+    hostList(gWorkLoops).push_back(me);
+    return me;
+}
+
+void IOWorkLoop::free()
+{
+    while (!sources.empty())
+        removeEventSource(sources.back());
+
+    std::vector<IOWorkLoop *> &loops = hostList(gWorkLoops);
+    for (size_t i = 0; i < loops.size(); i++)
+    {
+        if (loops[i] == this)
+        {
+            loops.erase(loops.begin() + i);
+            break;
+        }
+    }
+    if (gMainWorkLoop == this)
+        gMainWorkLoop = NULL;
+    OSObject::free();
+}
+
+IOReturn IOWorkLoop::addEventSource(IOEventSource *newEvent)
+{
+    if (!newEvent)
+        return kIOReturnBadArgument;
+
+    newEvent->retain();
+    sources.push_back(newEvent);
+    newEvent->setWorkLoop(this);
+    return kIOReturnSuccess;
+}
+
+IOReturn IOWorkLoop::removeEventSource(IOEventSource *toRemove)
+{
+    for (size_t i = 0; i < sources.size(); i++)
+    {
+        if (sources[i] == toRemove)
+        {
+            sources.erase(sources.begin() + i);
+            toRemove->setWorkLoop(NULL);
+            toRemove->release();
+            return kIOReturnSuccess;
+        }
+    }
+    return kIOReturnBadArgument;
+}
+
+static UInt32 gWorkLoopHeld;
+
+bool hostOnWorkLoop()
+{
+    return gWorkLoopHeld != 0;
+}
+
+bool IOWorkLoop::runPending()
+{
+    bool any = false, ran;
+
+    do
+    {
+        ran = false;
+        // Actions can add and remove sources, index into the live list
+        for (size_t i = 0; i < sources.size(); i++)
+        {
+            IOEventSource *source = sources[i];
+            if (!source->isEnabled())
+                continue;
+            source->retain();
+            gWorkLoopHeld++;
+            if (source->checkForWork())
+                ran = any = true;
+            gWorkLoopHeld--;
+            source->release();
+        }
+    } while (ran);
+
+    return any;
+}
+
+bool IOWorkLoop::nextDeadline(UInt64 *deadline) const
+{
+    bool found = false;
+    for (size_t i = 0; i < sources.size(); i++)
+    {
+        UInt64 next;
+        if (sources[i]->isEnabled() && sources[i]->nextDeadline(&next) && (!found || next < *deadline))
+        {
+            *deadline = next;
+            found = true;
+        }
+    }
+    return found;
+}
+
+void hostRunPending()
+{
+    bool ran;
+    do
+    {
+        ran = false;
+        hostClockAdvance(0);
+        std::vector<IOWorkLoop *> &loops = hostList(gWorkLoops);
+        for (size_t i = 0; i < loops.size(); i++)
+            ran |= loops[i]->runPending();
+    } while (ran);
+}
+
+void hostRunUntil(UInt64 when)
+{
+    for (;;)
+    {
+        hostRunPending();
+        if (gClock >= when)
+            break;
+
+        UInt64 next = when, deadline;
+        std::vector<IOWorkLoop *> &loops = hostList(gWorkLoops);
+        for (size_t i = 0; i < loops.size(); i++)
+            if (loops[i]->nextDeadline(&deadline) && deadline < next)
+                next = deadline;
+        if (hostNextScheduled(&deadline) && deadline < next)
+            next = deadline;
+
+        hostClockAdvance(next > gClock ? next - gClock : 0);
+    }
+}
+
+OSDefineMetaClassAndStructors(IOTimerEventSource, IOEventSource)
+
+IOTimerEventSource *IOTimerEventSource::timerEventSource(OSObject *owner, Action action)
+{
+    IOTimerEventSource *me = new IOTimerEventSource;
+    if (!me->init(owner, action))
+    {
+        me->release();
+        return NULL;
+    }
+    return me;
+}
+
+bool IOTimerEventSource::init(OSObject *owner, Action action)
+{
+    return IOEventSource::init(owner, (IOEventSource::Action) action);
+}
+
+IOReturn IOTimerEventSource::setTimeoutMS(UInt32 ms)
+{
+    return setTimeout(ms, kMillisecondScale);
+}
+
+IOReturn IOTimerEventSource::setTimeoutUS(UInt32 us)
+{
+    return setTimeout(us, kMicrosecondScale);
+}
+
+IOReturn IOTimerEventSource::setTimeout(UInt32 interval, UInt32 scaleFactor)
+{
+    return wakeAtTime(gClock + (UInt64) interval * scaleFactor);
+}
+
+IOReturn IOTimerEventSource::wakeAtTime(UInt64 abstime)
+{
+    if (!action)
+        return kIOReturnNoResources;
+    deadline = abstime;
+    armed = true;
+    return kIOReturnSuccess;
+}
+
+void IOTimerEventSource::cancelTimeout()
+{
+    armed = false;
+}
+
+bool IOTimerEventSource::checkForWork()
+{
+    if (!armed || deadline > gClock)
+        return false;
+
+    armed = false;
+    ((Action) action)(owner, this);
+    return true;
+}
+
+bool IOTimerEventSource::nextDeadline(UInt64 *deadline) const
+{
+    if (armed)
+        *deadline = this->deadline;
+    return armed;
+}
+
+OSDefineMetaClassAndStructors(IOInterruptEventSource, IOEventSource)
+
+IOInterruptEventSource *IOInterruptEventSource::interruptEventSource(OSObject *owner, Action action,
+                                                                     IOService *provider, int intIndex)
+{
+    IOInterruptEventSource *me = new IOInterruptEventSource;
+    if (!me->init(owner, action, provider, intIndex))
+    {
+        me->release();
+        return NULL;
+    }
+    return me;
+}
+
+bool IOInterruptEventSource::init(OSObject *owner, Action action, IOService *provider, int intIndex)
+{
+    return IOEventSource::init(owner, (IOEventSource::Action) action);
+}
+
+// Drivers call this from their own threads, like a real interrupt
+void IOInterruptEventSource::interruptOccurred(void *refcon, IOService *nub, int ind)
+{
+    __atomic_fetch_add(&producerCount, 1, __ATOMIC_RELEASE);
+}
+
+bool IOInterruptEventSource::checkForWork()
+{
+    UInt32 produced = __atomic_load_n(&producerCount, __ATOMIC_ACQUIRE);
+    if (produced == consumerCount)
+        return false;
+
+    int count = (int)(produced - consumerCount);
+    consumerCount = produced;
+    if (action)
+        ((Action) action)(owner, this, count);
+    return true;
+}
+
+bool IOInterruptEventSource::nextDeadline(UInt64 *deadline) const
+{
+    if (__atomic_load_n(&producerCount, __ATOMIC_ACQUIRE) == consumerCount)
+        return false;
+    *deadline = gClock;
+    return true;
+}
+
+OSDefineMetaClassAndStructors(IOCommandGate, IOEventSource)
+
+IOCommandGate *IOCommandGate::commandGate(OSObject *owner, Action action)
+{
+    IOCommandGate *me = new IOCommandGate;
+    if (!me->init(owner, action))
+    {
+        me->release();
+        return NULL;
+    }
+    return me;
+}
+
+bool IOCommandGate::init(OSObject *owner, Action action)
+{
+    return IOEventSource::init(owner, (IOEventSource::Action) action);
+}
+
+IOReturn IOCommandGate::runAction(Action action, void *arg0, void *arg1, void *arg2, void *arg3)
+{
+    if (!action)
+        return kIOReturnBadArgument;
+    gWorkLoopHeld++;
+    IOReturn ret = action(owner, arg0, arg1, arg2, arg3);
+    gWorkLoopHeld--;
+    return ret;
+}
+
+IOReturn IOCommandGate::attemptAction(Action action, void *arg0, void *arg1, void *arg2, void *arg3)
+{
+    return runAction(action, arg0, arg1, arg2, arg3);
+}
+
+#pragma mark -
+#pragma mark Families
+#pragma mark -
+
+OSDefineMetaClassAndStructors(IOACPIPlatformDevice, IOService)
+
+IOReturn IOACPIPlatformDevice::validateObject(const OSSymbol *objectName)
+{
+    return kIOReturnNotFound;
+}
+
+IOReturn IOACPIPlatformDevice::validateObject(const char *objectName)
+{
+    const OSSymbol *sym = OSSymbol::withCString(objectName);
+    if (!sym)
+        return kIOReturnNoMemory;
+    IOReturn ret = validateObject(sym);
+    sym->release();
+    return ret;
+}
+
+IOReturn IOACPIPlatformDevice::evaluateObject(const OSSymbol *objectName, OSObject **result,
+                                              OSObject *params[], IOItemCount paramCount, IOOptionBits options)
+{
+    return kIOReturnUnsupported;
+}
+
+IOReturn IOACPIPlatformDevice::evaluateObject(const char *objectName, OSObject **result,
+                                              OSObject *params[], IOItemCount paramCount, IOOptionBits options)
+{
+    const OSSymbol *sym = OSSymbol::withCString(objectName);
+    if (!sym)
+        return kIOReturnNoMemory;
+    IOReturn ret = evaluateObject(sym, result, params, paramCount, options);
+    sym->release();
+    return ret;
+}
+
+IOReturn IOACPIPlatformDevice::evaluateInteger(const OSSymbol *objectName, UInt32 *resultInt32,
+                                               OSObject *params[], IOItemCount paramCount, IOOptionBits options)
+{
+    OSObject *result = NULL;
+    IOReturn ret = evaluateObject(objectName, &result, params, paramCount, options);
+    if (ret == kIOReturnSuccess)
+    {
+        if (OSNumber *number = OSDynamicCast(OSNumber, result))
+            *resultInt32 = number->unsigned32BitValue();
+        else
+            ret = kIOReturnBadArgument;
+    }
+    OSSafeReleaseNULL(result);
+    return ret;
+}
+
+IOReturn IOACPIPlatformDevice::evaluateInteger(const char *objectName, UInt32 *resultInt32,
+                                               OSObject *params[], IOItemCount paramCount, IOOptionBits options)
+{
+    const OSSymbol *sym = OSSymbol::withCString(objectName);
+    if (!sym)
+        return kIOReturnNoMemory;
+    IOReturn ret = evaluateInteger(sym, resultInt32, params, paramCount, options);
+    sym->release();
+    return ret;
+}
+
+OSDefineMetaClassAndStructors(IOHIKeyboard, IOService)
+
+bool IOHIKeyboard::start(IOService *provider)
+{
+    UInt32 length = 0;
+    if (!defaultKeymapOfLength(&length) || !length)
+        return false;
+    return IOService::start(provider);
+}
+
+const unsigned char *IOHIKeyboard::defaultKeymapOfLength(UInt32 *length)
+{
+    *length = 0;
+    return NULL;
+}
+
+void IOHIKeyboard::dispatchKeyboardEvent(unsigned int keyCode, bool goingDown, AbsoluteTime time)
+{
+    HostHIDEvent *event = &gHIDLog[gHIDCount++ % kHostLogSize];
+    event->key = keyCode;
+    event->down = goingDown;
+    event->eventTime = time;
+    event->dispatchTime = gClock;
+    if (gHIDHook)
+        gHIDHook(event, gHIDHookRef);
+}
+
+OSDefineMetaClassAndStructors(IODTNVRAM, IOService)
+
+OSObject *IODTNVRAM::getProperty(const char *aKey) const
+{
+    return readsBroken ? NULL : IOService::getProperty(aKey);
+}
+
+bool IODTNVRAM::setProperty(const OSSymbol *aKey, OSObject *anObject)
+{
+    writeCount++;
+    return IOService::setProperty(aKey, anObject);
+}
+
+bool IODTNVRAM::serializeProperties(OSSerialize *s) const
+{
+    serializeCount++;
+    return IOService::serializeProperties(s);
+}
+
+#pragma mark -
+#pragma mark Reset
+#pragma mark -
+
+void hostReset()
+{
+    // Whatever is still registered goes away like on a driver unload
+    while (!hostList(gServices).empty())
+        hostList(gServices).front()->terminate();
+
+    std::vector<HostPath> &paths = hostList(gPaths);
+    for (size_t i = 0; i < paths.size(); i++)
+        paths[i].entry->release();
+    paths.clear();
+
+    std::vector<OSDictionary *> &personalities = hostList(gPersonalities);
+    for (size_t i = 0; i < personalities.size(); i++)
+        personalities[i]->release();
+    personalities.clear();
+
+    std::vector<_IOServiceNotifier *> &notifiers = hostList(gNotifiers);
+    for (size_t i = 0; i < notifiers.size(); i++)
+        notifiers[i]->destroy();
+    notifiers.clear();
+
+    std::vector<IONotifier *> &removed = hostList(gRemovedNotifiers);
+    for (size_t i = 0; i < removed.size(); i++)
+    {
+        if (_IOServiceNotifier *notifier = OSDynamicCast(_IOServiceNotifier, removed[i]))
+            notifier->destroy();
+        else if (_IOServiceInterestNotifier *notifier = OSDynamicCast(_IOServiceInterestNotifier, removed[i]))
+            notifier->destroy();
+    }
+    removed.clear();
+
+    while (!schedule().empty())
+        schedule().pop();
+    gClock = kHostClockStart;
+    gHIDCount = gKernCount = 0;
+    gHIDHook = NULL;
+    gHIDHookRef = NULL;
+    gAdministrator = true;
+}
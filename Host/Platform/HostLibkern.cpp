@@ -0,0 +1,1146 @@
+/*
+ *  Copyright (c) 2018 hieplpvip
+ *
+ *
+ *  HostLibkern.cpp
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <new>
+#include "HostIOKit.h"
+
+#pragma mark -
+#pragma mark Allocations
+#pragma mark -
+
+// Relaxed atomics, tests also allocate on their own threads
+static UInt64 gAllocations, gFrees;
+
+static inline void hostCountAllocation()
+{
+    __atomic_fetch_add(&gAllocations, 1, __ATOMIC_RELAXED);
+}
+
+UInt64 hostAllocations()
+{
+    return __atomic_load_n(&gAllocations, __ATOMIC_RELAXED);
+}
+
+UInt64 hostLiveAllocations()
+{
+    return hostAllocations() - __atomic_load_n(&gFrees, __ATOMIC_RELAXED);
+}
+
+static void hostFree(void *mem)
+{
+    if (mem)
+        __atomic_fetch_add(&gFrees, 1, __ATOMIC_RELAXED);
+    free(mem);
+}
+
+void *operator new(size_t size)
+{
+    hostCountAllocation();
+    void *mem = malloc(size ? size : 1);
+    if (!mem)
+        throw std::bad_alloc();
+    return mem;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *mem) noexcept
+{
+    hostFree(mem);
+}
+
+void operator delete[](void *mem) noexcept
+{
+    hostFree(mem);
+}
+
+void operator delete(void *mem, size_t) noexcept
+{
+    hostFree(mem);
+}
+
+void operator delete[](void *mem, size_t) noexcept
+{
+    hostFree(mem);
+}
+
+void *IOMalloc(vm_size_t size)
+{
+    hostCountAllocation();
+    return malloc(size ? size : 1);
+}
+
+void IOFree(void *address, vm_size_t size)
+{
+    hostFree(address);
+}
+
+#pragma mark -
+#pragma mark OSMetaClass
+#pragma mark -
+
+const OSMetaClass *OSMetaClass::classList;
+
+OSMetaClass::OSMetaClass(const char *name, const OSMetaClass *superClass, AllocFunction alloc)
+    : className(name), superClass(superClass), allocFunction(alloc), next(classList)
+{
+    classList = this;
+}
+
+bool OSMetaClass::isSubclassOf(const char *name) const
+{
+    for (const OSMetaClass *meta = this; meta; meta = meta->superClass)
+        if (!strcmp(meta->className, name))
+            return true;
+    return false;
+}
+
+OSObject *OSMetaClass::allocClassWithName(const char *name)
+{
+    for (const OSMetaClass *meta = classList; meta; meta = meta->next)
+        if (!strcmp(meta->className, name))
+            return meta->allocFunction ? meta->allocFunction() : NULL;
+    return NULL;
+}
+
+#pragma mark -
+#pragma mark OSObject
+#pragma mark -
+
+const OSMetaClass OSObject::gMetaClass("OSObject", NULL, NULL);
+
+OSObject::OSObject() : retainCount(1)
+{
+}
+
+OSObject::~OSObject()
+{
+}
+
+void *OSObject::operator new(size_t size)
+{
+    hostCountAllocation();
+    void *mem = calloc(1, size);
+    if (!mem)
+        throw std::bad_alloc();
+    return mem;
+}
+
+void OSObject::operator delete(void *mem, size_t size)
+{
+    hostFree(mem);
+}
+
+bool OSObject::init()
+{
+    return true;
+}
+
+void OSObject::free()
+{
+    delete this;
+}
+
+void OSObject::retain() const
+{
+    retainCount++;
+}
+
+void OSObject::release() const
+{
+    if (--retainCount == 0)
+        const_cast<OSObject *>(this)->free();
+}
+
+int OSObject::getRetainCount() const
+{
+    return retainCount;
+}
+
+bool OSObject::serialize(OSSerialize *s) const
+{
+    char tmp[96];
+    snprintf(tmp, sizeof(tmp), "<string>%s</string>", getMetaClass()->getClassName());
+    return s->addString(tmp);
+}
+
+#pragma mark -
+#pragma mark OSString, OSSymbol
+#pragma mark -
+
+OSDefineMetaClassAndStructors(OSString, OSObject)
+
+OSString *OSString::withCString(const char *cString)
+{
+    OSString *me = new OSString;
+    if (!me->initWithCString(cString))
+    {
+        me->release();
+        return NULL;
+    }
+    return me;
+}
+
+OSString *OSString::withCStringNoCopy(const char *cString)
+{
+    return withCString(cString);
+}
+
+bool OSString::initWithCString(const char *cString)
+{
+    if (!cString || !OSObject::init())
+        return false;
+
+    length = (unsigned int) strlen(cString);
+    string = (char *) IOMalloc(length + 1);
+    memcpy(string, cString, length + 1);
+    return true;
+}
+
+void OSString::free()
+{
+    if (string)
+        IOFree(string, length + 1);
+    OSObject::free();
+}
+
+bool OSString::isEqualTo(const OSMetaClassBase *anObject) const
+{
+    OSString *str = OSDynamicCast(OSString, anObject);
+    return str && isEqualTo(str->getCStringNoCopy());
+}
+
+bool OSString::isEqualTo(const char *aCString) const
+{
+    return aCString && !strcmp(string, aCString);
+}
+
+bool OSString::serialize(OSSerialize *s) const
+{
+    return s->addString("<string>") && s->addXMLEscaped(string) && s->addString("</string>");
+}
+
+OSDefineMetaClassAndStructors(OSSymbol, OSString)
+
+// Never destroyed, symbols can outlive static destruction
+static std::vector<OSSymbol *> &symbolPool()
+{
+    static std::vector<OSSymbol *> *pool = new std::vector<OSSymbol *>;
+    return *pool;
+}
+
+const OSSymbol *OSSymbol::withCString(const char *cString)
+{
+    if (!cString)
+        return NULL;
+
+    std::vector<OSSymbol *> &pool = symbolPool();
+    for (size_t i = 0; i < pool.size(); i++)
+    {
+        if (!strcmp(pool[i]->getCStringNoCopy(), cString))
+        {
+            pool[i]->retain();
+            return pool[i];
+        }
+    }
+
+    OSSymbol *me = new OSSymbol;
+    if (!me->initWithCString(cString))
+    {
+        me->release();
+        return NULL;
+    }
+    pool.push_back(me);
+    return me;
+}
+
+void OSSymbol::free()
+{
+    std::vector<OSSymbol *> &pool = symbolPool();
+    for (size_t i = 0; i < pool.size(); i++)
+    {
+        if (pool[i] == this)
+        {
+            pool.erase(pool.begin() + i);
+            break;
+        }
+    }
+    OSString::free();
+}
+
+#pragma mark -
+#pragma mark OSNumber, OSData, OSBoolean
+#pragma mark -
+
+OSDefineMetaClassAndStructors(OSNumber, OSObject)
+
+static unsigned long long maskBits(unsigned long long value, unsigned int bits)
+{
+    return bits >= 64 ? value : value & ((1ULL << bits) - 1);
+}
+
+OSNumber *OSNumber::withNumber(unsigned long long value, unsigned int numberOfBits)
+{
+    OSNumber *me = new OSNumber;
+    if (!me->init(value, numberOfBits))
+    {
+        me->release();
+        return NULL;
+    }
+    return me;
+}
+
+bool OSNumber::init(unsigned long long value, unsigned int numberOfBits)
+{
+    if (!numberOfBits || numberOfBits > 64 || !OSObject::init())
+        return false;
+
+    size = numberOfBits;
+    this->value = maskBits(value, size);
+    return true;
+}
+
+void OSNumber::setValue(unsigned long long value)
+{
+    this->value = maskBits(value, size);
+}
+
+bool OSNumber::isEqualTo(const OSMetaClassBase *anObject) const
+{
+    OSNumber *num = OSDynamicCast(OSNumber, anObject);
+    return num && num->unsigned64BitValue() == value;
+}
+
+bool OSNumber::serialize(OSSerialize *s) const
+{
+    char tmp[64];
+    snprintf(tmp, sizeof(tmp), "<integer size=\"%u\">0x%llx</integer>", size, value);
+    return s->addString(tmp);
+}
+
+OSDefineMetaClassAndStructors(OSData, OSObject)
+
+OSData *OSData::withCapacity(unsigned int capacity)
+{
+    OSData *me = new OSData;
+    if (capacity)
+    {
+        me->data = (UInt8 *) IOMalloc(capacity);
+        me->capacity = capacity;
+    }
+    return me;
+}
+
+OSData *OSData::withBytes(const void *bytes, unsigned int numBytes)
+{
+    OSData *me = withCapacity(numBytes);
+    if (numBytes && !me->appendBytes(bytes, numBytes))
+    {
+        me->release();
+        return NULL;
+    }
+    return me;
+}
+
+OSData *OSData::withBytesNoCopy(void *bytes, unsigned int numBytes)
+{
+    OSData *me = new OSData;
+    me->data = (UInt8 *) bytes;
+    me->length = numBytes;
+    return me;
+}
+
+void OSData::free()
+{
+    if (capacity)
+        IOFree(data, capacity);
+    OSObject::free();
+}
+
+const void *OSData::getBytesNoCopy(unsigned int start, unsigned int numBytes) const
+{
+    if (!length || start + numBytes > length || start + numBytes < start)
+        return NULL;
+    return data + start;
+}
+
+bool OSData::appendBytes(const void *bytes, unsigned int numBytes)
+{
+    if (data && !capacity)
+        return false;
+
+    if (length + numBytes > capacity)
+    {
+        unsigned int newCapacity = capacity ? capacity : 16;
+        while (newCapacity < length + numBytes)
+            newCapacity *= 2;
+        UInt8 *newData = (UInt8 *) IOMalloc(newCapacity);
+        if (length)
+            memcpy(newData, data, length);
+        if (capacity)
+            IOFree(data, capacity);
+        data = newData;
+        capacity = newCapacity;
+    }
+
+    if (bytes)
+        memcpy(data + length, bytes, numBytes);
+    else
+        bzero(data + length, numBytes);
+    length += numBytes;
+    return true;
+}
+
+bool OSData::isEqualTo(const OSMetaClassBase *anObject) const
+{
+    OSData *other = OSDynamicCast(OSData, anObject);
+    return other && isEqualTo(other->getBytesNoCopy(), other->getLength());
+}
+
+bool OSData::isEqualTo(const void *bytes, unsigned int numBytes) const
+{
+    return numBytes == length && (!length || !memcmp(bytes, data, length));
+}
+
+static const char base64Chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+bool OSData::serialize(OSSerialize *s) const
+{
+    if (!s->addString("<data>"))
+        return false;
+
+    for (unsigned int i = 0; i < length; i += 3)
+    {
+        UInt32 chunk = data[i] << 16;
+        if (i + 1 < length)
+            chunk |= data[i + 1] << 8;
+        if (i + 2 < length)
+            chunk |= data[i + 2];
+        s->addChar(base64Chars[(chunk >> 18) & 0x3f]);
+        s->addChar(base64Chars[(chunk >> 12) & 0x3f]);
+        s->addChar(i + 1 < length ? base64Chars[(chunk >> 6) & 0x3f] : '=');
+        s->addChar(i + 2 < length ? base64Chars[chunk & 0x3f] : '=');
+    }
+    return s->addString("</data>");
+}
+
+OSDefineMetaClassAndStructors(OSBoolean, OSObject)
+
+struct OSBooleanInstances
+{
+    static OSBoolean *make(bool value)
+    {
+        OSBoolean *me = new OSBoolean;
+        me->value = value;
+        return me;
+    }
+};
+
+OSBoolean *kOSBooleanTrue = OSBooleanInstances::make(true);
+OSBoolean *kOSBooleanFalse = OSBooleanInstances::make(false);
+
+OSBoolean *OSBoolean::withBoolean(bool value)
+{
+    return value ? kOSBooleanTrue : kOSBooleanFalse;
+}
+
+bool OSBoolean::isEqualTo(const OSMetaClassBase *anObject) const
+{
+    OSBoolean *other = OSDynamicCast(OSBoolean, anObject);
+    return other && other->value == value;
+}
+
+bool OSBoolean::serialize(OSSerialize *s) const
+{
+    return s->addString(value ? "<true/>" : "<false/>");
+}
+
+#pragma mark -
+#pragma mark Collections
+#pragma mark -
+
+OSDefineMetaClassAndAbstractStructors(OSCollection, OSObject)
+
+OSDefineMetaClassAndStructors(OSArray, OSCollection)
+
+OSArray *OSArray::withCapacity(unsigned int capacity)
+{
+    OSArray *me = new OSArray;
+    me->array.reserve(capacity);
+    return me;
+}
+
+void OSArray::free()
+{
+    flushCollection();
+    OSCollection::free();
+}
+
+void OSArray::flushCollection()
+{
+    for (size_t i = 0; i < array.size(); i++)
+        array[i]->release();
+    array.clear();
+}
+
+bool OSArray::setObject(const OSMetaClassBase *anObject)
+{
+    if (!anObject)
+        return false;
+    anObject->retain();
+    array.push_back(anObject);
+    return true;
+}
+
+OSObject *OSArray::getObject(unsigned int index) const
+{
+    return index < array.size() ? (OSObject *) array[index] : NULL;
+}
+
+void OSArray::removeObject(unsigned int index)
+{
+    if (index >= array.size())
+        return;
+    const OSMetaClassBase *object = array[index];
+    array.erase(array.begin() + index);
+    object->release();
+}
+
+bool OSArray::isEqualTo(const OSMetaClassBase *anObject) const
+{
+    OSArray *other = OSDynamicCast(OSArray, anObject);
+    if (!other || other->getCount() != getCount())
+        return false;
+    for (unsigned int i = 0; i < getCount(); i++)
+        if (!array[i]->isEqualTo(other->getObject(i)))
+            return false;
+    return true;
+}
+
+bool OSArray::serialize(OSSerialize *s) const
+{
+    if (!s->addString("<array>"))
+        return false;
+    for (size_t i = 0; i < array.size(); i++)
+        if (!((OSObject *) array[i])->serialize(s))
+            return false;
+    return s->addString("</array>");
+}
+
+OSDefineMetaClassAndStructors(OSSet, OSCollection)
+
+OSSet *OSSet::withCapacity(unsigned int capacity)
+{
+    OSSet *me = new OSSet;
+    me->members.reserve(capacity);
+    return me;
+}
+
+void OSSet::free()
+{
+    flushCollection();
+    OSCollection::free();
+}
+
+void OSSet::flushCollection()
+{
+    for (size_t i = 0; i < members.size(); i++)
+        members[i]->release();
+    members.clear();
+}
+
+OSObject *OSSet::iteratorObject(unsigned int index) const
+{
+    return index < members.size() ? (OSObject *) members[index] : NULL;
+}
+
+bool OSSet::setObject(const OSMetaClassBase *anObject)
+{
+    if (!anObject)
+        return false;
+    if (!containsObject(anObject))
+    {
+        anObject->retain();
+        members.push_back(anObject);
+    }
+    return true;
+}
+
+void OSSet::removeObject(const OSMetaClassBase *anObject)
+{
+    for (size_t i = 0; i < members.size(); i++)
+    {
+        if (members[i] == anObject)
+        {
+            members.erase(members.begin() + i);
+            anObject->release();
+            return;
+        }
+    }
+}
+
+bool OSSet::containsObject(const OSMetaClassBase *anObject) const
+{
+    for (size_t i = 0; i < members.size(); i++)
+        if (members[i] == anObject)
+            return true;
+    return false;
+}
+
+OSDefineMetaClassAndStructors(OSDictionary, OSCollection)
+
+OSDictionary *OSDictionary::withCapacity(unsigned int capacity)
+{
+    OSDictionary *me = new OSDictionary;
+    me->entries.reserve(capacity);
+    return me;
+}
+
+OSDictionary *OSDictionary::withDictionary(const OSDictionary *dict, unsigned int capacity)
+{
+    if (!dict)
+        return NULL;
+
+    OSDictionary *me = withCapacity(capacity > dict->getCount() ? capacity : dict->getCount());
+    for (size_t i = 0; i < dict->entries.size(); i++)
+        me->setObject(dict->entries[i].key, dict->entries[i].value);
+    return me;
+}
+
+void OSDictionary::free()
+{
+    flushCollection();
+    OSCollection::free();
+}
+
+void OSDictionary::flushCollection()
+{
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        entries[i].key->release();
+        entries[i].value->release();
+    }
+    entries.clear();
+}
+
+OSObject *OSDictionary::iteratorObject(unsigned int index) const
+{
+    return index < entries.size() ? (OSObject *) entries[index].key : NULL;
+}
+
+int OSDictionary::find(const char *aKey) const
+{
+    if (!aKey)
+        return -1;
+    for (size_t i = 0; i < entries.size(); i++)
+        if (!strcmp(entries[i].key->getCStringNoCopy(), aKey))
+            return (int) i;
+    return -1;
+}
+
+bool OSDictionary::setObject(const OSSymbol *aKey, const OSMetaClassBase *anObject)
+{
+    if (!aKey || !anObject)
+        return false;
+
+    anObject->retain();
+    int index = find(aKey->getCStringNoCopy());
+    if (index >= 0)
+    {
+        entries[index].value->release();
+        entries[index].value = anObject;
+        return true;
+    }
+
+    aKey->retain();
+    Entry entry = { aKey, anObject };
+    entries.push_back(entry);
+    return true;
+}
+
+bool OSDictionary::setObject(const OSString *aKey, const OSMetaClassBase *anObject)
+{
+    if (!aKey)
+        return false;
+    const OSSymbol *sym = OSSymbol::withString(aKey);
+    bool ret = setObject(sym, anObject);
+    sym->release();
+    return ret;
+}
+
+bool OSDictionary::setObject(const char *aKey, const OSMetaClassBase *anObject)
+{
+    const OSSymbol *sym = OSSymbol::withCString(aKey);
+    if (!sym)
+        return false;
+    bool ret = setObject(sym, anObject);
+    sym->release();
+    return ret;
+}
+
+OSObject *OSDictionary::getObject(const OSSymbol *aKey) const
+{
+    return aKey ? getObject(aKey->getCStringNoCopy()) : NULL;
+}
+
+OSObject *OSDictionary::getObject(const OSString *aKey) const
+{
+    return aKey ? getObject(aKey->getCStringNoCopy()) : NULL;
+}
+
+OSObject *OSDictionary::getObject(const char *aKey) const
+{
+    int index = find(aKey);
+    return index >= 0 ? (OSObject *) entries[index].value : NULL;
+}
+
+void OSDictionary::removeObject(const OSSymbol *aKey)
+{
+    if (aKey)
+        removeObject(aKey->getCStringNoCopy());
+}
+
+void OSDictionary::removeObject(const char *aKey)
+{
+    int index = find(aKey);
+    if (index < 0)
+        return;
+
+    Entry entry = entries[index];
+    entries.erase(entries.begin() + index);
+    entry.key->release();
+    entry.value->release();
+}
+
+bool OSDictionary::isEqualTo(const OSMetaClassBase *anObject) const
+{
+    OSDictionary *other = OSDynamicCast(OSDictionary, anObject);
+    if (!other || other->getCount() != getCount())
+        return false;
+    for (size_t i = 0; i < entries.size(); i++)
+        if (!entries[i].value->isEqualTo(other->getObject(entries[i].key)))
+            return false;
+    return true;
+}
+
+bool OSDictionary::serialize(OSSerialize *s) const
+{
+    if (!s->addString("<dict>"))
+        return false;
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        if (!s->addString("<key>") || !s->addXMLEscaped(entries[i].key->getCStringNoCopy()) ||
+            !s->addString("</key>") || !((OSObject *) entries[i].value)->serialize(s))
+            return false;
+    }
+    return s->addString("</dict>");
+}
+
+OSDefineMetaClassAndAbstractStructors(OSIterator, OSObject)
+
+OSDefineMetaClassAndStructors(OSCollectionIterator, OSIterator)
+
+OSCollectionIterator *OSCollectionIterator::withCollection(const OSCollection *inColl)
+{
+    if (!inColl)
+        return NULL;
+
+    OSCollectionIterator *me = new OSCollectionIterator;
+    inColl->retain();
+    me->collection = inColl;
+    return me;
+}
+
+void OSCollectionIterator::free()
+{
+    OSSafeReleaseNULL(collection);
+    OSIterator::free();
+}
+
+OSObject *OSCollectionIterator::getNextObject()
+{
+    if (index >= collection->getCount())
+        return NULL;
+    return collection->iteratorObject(index++);
+}
+
+#pragma mark -
+#pragma mark Serialization
+#pragma mark -
+
+OSDefineMetaClassAndStructors(OSSerialize, OSObject)
+
+OSSerialize *OSSerialize::withCapacity(unsigned int capacity)
+{
+    OSSerialize *me = new OSSerialize;
+    me->capacity = capacity ? capacity : 256;
+    me->buffer = (char *) IOMalloc(me->capacity);
+    me->buffer[0] = 0;
+    return me;
+}
+
+void OSSerialize::free()
+{
+    if (buffer)
+        IOFree(buffer, capacity);
+    OSObject::free();
+}
+
+bool OSSerialize::addChar(char aChar)
+{
+    if (length + 2 > capacity)
+    {
+        unsigned int newCapacity = capacity * 2;
+        char *newBuffer = (char *) IOMalloc(newCapacity);
+        memcpy(newBuffer, buffer, length + 1);
+        IOFree(buffer, capacity);
+        buffer = newBuffer;
+        capacity = newCapacity;
+    }
+    buffer[length++] = aChar;
+    buffer[length] = 0;
+    return true;
+}
+
+bool OSSerialize::addString(const char *cString)
+{
+    while (*cString)
+        addChar(*cString++);
+    return true;
+}
+
+bool OSSerialize::addXMLEscaped(const char *cString)
+{
+    for (; *cString; cString++)
+    {
+        switch (*cString)
+        {
+            case '<':
+                addString("&lt;");
+                break;
+            case '>':
+                addString("&gt;");
+                break;
+            case '&':
+                addString("&amp;");
+                break;
+            default:
+                addChar(*cString);
+                break;
+        }
+    }
+    return true;
+}
+
+/*
+ * Property list reader: dict, array, string, integer, data, true, false and
+ * real (truncated), with or without the <plist> wrapper. IDs are ignored.
+ */
+class XMLReader
+{
+public:
+    XMLReader(const char *text) : error(NULL), p(text) {}
+
+    OSObject *parseDocument()
+    {
+        Tag tag;
+        if (!nextTag(&tag))
+            return fail("no element");
+        if (!strcmp(tag.name, "plist") && !tag.closing)
+        {
+            if (!nextTag(&tag))
+                return fail("empty plist");
+            OSObject *object = parseObject(tag);
+            Tag end;
+            if (object && (!nextTag(&end) || !end.closing || strcmp(end.name, "plist")))
+            {
+                object->release();
+                return fail("missing </plist>");
+            }
+            return object;
+        }
+        return parseObject(tag);
+    }
+
+    const char *error;
+
+private:
+    struct Tag {
+        char name[16];
+        bool closing, empty;
+        unsigned int size;
+    };
+
+    const char *p;
+
+    OSObject *fail(const char *message)
+    {
+        if (!error)
+            error = message;
+        return NULL;
+    }
+
+    // Skips space, comments, <?...?> and <!DOCTYPE ...>, reads the next tag
+    bool nextTag(Tag *tag)
+    {
+        for (;;)
+        {
+            while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+                p++;
+            if (!strncmp(p, "<!--", 4))
+            {
+                const char *end = strstr(p, "-->");
+                if (!end)
+                    return false;
+                p = end + 3;
+            }
+            else if (!strncmp(p, "<?", 2) || !strncmp(p, "<!", 2))
+            {
+                const char *end = strchr(p, '>');
+                if (!end)
+                    return false;
+                p = end + 1;
+            }
+            else
+                break;
+        }
+
+        if (*p != '<')
+            return false;
+        p++;
+
+        bzero(tag, sizeof(*tag));
+        if (*p == '/')
+        {
+            tag->closing = true;
+            p++;
+        }
+
+        unsigned int n = 0;
+        while (*p && *p != '>' && *p != '/' && *p != ' ')
+        {
+            if (n + 1 < sizeof(tag->name))
+                tag->name[n++] = *p;
+            p++;
+        }
+
+        for (; *p && *p != '>'; p++)
+        {
+            if (!strncmp(p, "size=\"", 6))
+                tag->size = (unsigned int) strtoul(p + 6, NULL, 10);
+            else if (*p == '/')
+                tag->empty = true;
+        }
+        if (*p != '>')
+            return false;
+        p++;
+        return true;
+    }
+
+    // Character data up to the closing tag, entities decoded
+    bool readText(const char *name, char **out, unsigned int *outLength)
+    {
+        char endTag[24];
+        snprintf(endTag, sizeof(endTag), "</%s>", name);
+        const char *end = strstr(p, endTag);
+        if (!end)
+            return false;
+
+        char *text = (char *) IOMalloc(end - p + 1);
+        unsigned int n = 0;
+        while (p < end)
+        {
+            static const struct { const char *entity; char c; } entities[] = {
+                { "&lt;", '<' }, { "&gt;", '>' }, { "&amp;", '&' }, { "&quot;", '"' }, { "&apos;", '\'' },
+            };
+            bool matched = false;
+            for (size_t i = 0; i < sizeof(entities) / sizeof(entities[0]); i++)
+            {
+                size_t len = strlen(entities[i].entity);
+                if (!strncmp(p, entities[i].entity, len))
+                {
+                    text[n++] = entities[i].c;
+                    p += len;
+                    matched = true;
+                    break;
+                }
+            }
+            if (!matched)
+                text[n++] = *p++;
+        }
+        text[n] = 0;
+        p = end + strlen(endTag);
+        *out = text;
+        *outLength = n;
+        return true;
+    }
+
+    OSObject *parseObject(const Tag &tag)
+    {
+        if (tag.closing)
+            return fail("unexpected closing tag");
+
+        if (!strcmp(tag.name, "dict"))
+        {
+            OSDictionary *dict = OSDictionary::withCapacity(8);
+            if (tag.empty)
+                return dict;
+            for (;;)
+            {
+                Tag key;
+                if (!nextTag(&key))
+                    break;
+                if (key.closing && !strcmp(key.name, "dict"))
+                    return dict;
+                if (strcmp(key.name, "key") || key.closing)
+                    break;
+
+                char *name = NULL;
+                unsigned int length = 0;
+                if (key.empty)
+                {
+                    name = (char *) IOMalloc(1);
+                    name[0] = 0;
+                }
+                else if (!readText("key", &name, &length))
+                    break;
+
+                Tag valueTag;
+                OSObject *value = nextTag(&valueTag) ? parseObject(valueTag) : NULL;
+                if (value)
+                {
+                    dict->setObject(name, value);
+                    value->release();
+                }
+                IOFree(name, 0);
+                if (!value)
+                    break;
+            }
+            dict->release();
+            return fail("bad dict");
+        }
+
+        if (!strcmp(tag.name, "array"))
+        {
+            OSArray *array = OSArray::withCapacity(8);
+            if (tag.empty)
+                return array;
+            for (;;)
+            {
+                Tag item;
+                if (!nextTag(&item))
+                    break;
+                if (item.closing && !strcmp(item.name, "array"))
+                    return array;
+                OSObject *value = parseObject(item);
+                if (!value)
+                    break;
+                array->setObject(value);
+                value->release();
+            }
+            array->release();
+            return fail("bad array");
+        }
+
+        if (!strcmp(tag.name, "true") || !strcmp(tag.name, "false"))
+        {
+            Tag end;
+            if (!tag.empty && (!nextTag(&end) || !end.closing))
+                return fail("bad boolean");
+            return tag.name[0] == 't' ? kOSBooleanTrue : kOSBooleanFalse;
+        }
+
+        if (tag.empty)
+        {
+            if (!strcmp(tag.name, "string"))
+                return OSString::withCString("");
+            if (!strcmp(tag.name, "data"))
+                return OSData::withCapacity(0);
+            return fail("bad empty element");
+        }
+
+        char *text = NULL;
+        unsigned int length = 0;
+        if (!readText(tag.name, &text, &length))
+            return fail("unterminated element");
+
+        OSObject *object = NULL;
+        if (!strcmp(tag.name, "string"))
+            object = OSString::withCString(text);
+        else if (!strcmp(tag.name, "integer"))
+        {
+            const char *digits = text;
+            while (*digits == ' ' || *digits == '\n' || *digits == '\t')
+                digits++;
+            unsigned long long value = *digits == '-' ? (unsigned long long) strtoll(digits, NULL, 0)
+                                                      : strtoull(digits, NULL, 0);
+            object = OSNumber::withNumber(value, tag.size ? tag.size : 64);
+        }
+        else if (!strcmp(tag.name, "real"))
+            object = OSNumber::withNumber((unsigned long long)(long long) strtod(text, NULL), 64);
+        else if (!strcmp(tag.name, "data"))
+            object = decodeBase64(text);
+        else
+            fail("unknown element");
+
+        IOFree(text, length + 1);
+        return object;
+    }
+
+    static OSData *decodeBase64(const char *text)
+    {
+        OSData *data = OSData::withCapacity((unsigned int) strlen(text));
+        UInt32 chunk = 0;
+        int bits = 0;
+        for (; *text && *text != '='; text++)
+        {
+            const char *pos = strchr(base64Chars, *text);
+            if (!pos || !*text)
+                continue;
+            chunk = (chunk << 6) | (UInt32)(pos - base64Chars);
+            bits += 6;
+            if (bits >= 8)
+            {
+                bits -= 8;
+                UInt8 byte = (UInt8)(chunk >> bits);
+                data->appendBytes(&byte, 1);
+            }
+        }
+        return data;
+    }
+};
+
+OSObject *OSUnserializeXML(const char *buffer, OSString **errorString)
+{
+    if (errorString)
+        *errorString = NULL;
+    if (!buffer)
+        return NULL;
+
+    XMLReader reader(buffer);
+    OSObject *object = reader.parseDocument();
+    if (!object && errorString)
+        *errorString = OSString::withCString(reader.error ? reader.error : "parse error");
+    return object;
+}
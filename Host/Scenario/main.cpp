@@ -0,0 +1,409 @@
+/*
+ *  Copyright (c) 2018 hieplpvip
+ *
+ *
+ *  main.cpp
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * fnkeys_scenario [filter] [--rates r,...] [--duration ms] [--drain ms]
+ *                 [--latency METHOD=us,...] [--json file] [--label text]
+ *
+ *   filter      only the scenarios whose name contains it
+ *   --rates     events per second, 1,10,100,1000,10000 by default
+ *   --duration  simulated time events are sent for, 5000 ms by default
+ *   --drain     simulated time left after the last event, 3000 ms by default,
+ *               long enough for the NVRAM flush
+ *   --latency   time each firmware call takes, e.g. _WED=2000,ALSS=500,
+ *               "*" for every method, 200 us by default (*=0 for none)
+ *   --json      writes the results, one scenario and rate per line
+ *   --label     stored in the JSON, e.g. the commit measured
+ *
+ * Each scenario loads the kext on a fresh host, sends its events from
+ * interrupt context at a fixed rate through AsusFnKeys::message, and reports
+ * per rate:
+ *
+ *   hid        key downs dispatched by FnKeysHIKeyboard
+ *   repeats    of those, driver repeats with no notification left to answer
+ *   p50/p99/max  notification to the first HID dispatch of its key
+ *   unanswered key notifications without a dispatch by the end
+ *   lost       NotifyDrops + KeyEventsDropped + WEDDecodeFailures
+ *   acpi       firmware calls, _WED and ALSS apart
+ *   nvram      NVRAM writes
+ *
+ * All times are on the simulated clock, so results only move with the
+ * driver's behaviour and the --latency given, not with the machine.
+ */
+
+#include <algorithm>
+#include <string>
+#include "Bench.h"
+
+// Not an ACPI event: the trackpad driver reporting a key press
+#define kTrackpadKeyPress   0x100
+
+#pragma mark -
+#pragma mark Scenarios
+#pragma mark -
+
+typedef UInt32 (*ScenarioEvent)(UInt64 index, UInt32 rate, BenchRandom &random);
+
+struct Scenario {
+    const char *name;
+    ScenarioEvent event;
+};
+
+// Up through the 16 levels, then back down
+static UInt32 brightnessSweep(UInt64 index, UInt32 rate, BenchRandom &random)
+{
+    UInt32 step = index % 32;
+    return step < 16 ? 0x10 + step : 0x2F - (step - 16);
+}
+
+// Volume up held for a second of firmware repeats, then volume down
+static UInt32 volumeHold(UInt64 index, UInt32 rate, BenchRandom &random)
+{
+    return (index / rate) & 1 ? 0x31 : 0x30;
+}
+
+// The sensor notifications a flickering light produces
+static UInt32 alsStorm(UInt64 index, UInt32 rate, BenchRandom &random)
+{
+    return random.next() & 1 ? 0xC7 : 0xC6;
+}
+
+// Typing on the keyboard, with a mute press now and then
+static UInt32 typing(UInt64 index, UInt32 rate, BenchRandom &random)
+{
+    return random.next() % 32 ? kTrackpadKeyPress : 0x32;
+}
+
+static UInt32 mixed(UInt64 index, UInt32 rate, BenchRandom &random)
+{
+    UInt32 pick = random.next() % 100;
+    if (pick < 40)
+        return alsStorm(index, rate, random);
+    if (pick < 70)
+        return kTrackpadKeyPress;
+    if (pick < 80)
+        return random.next() & 1 ? 0x31 : 0x30;
+    if (pick < 90)
+        return random.next() & 1 ? 0x10 + random.next() % 16 : 0x20 + random.next() % 16;
+    return random.next() & 1 ? 0xC5 : 0xC4;
+}
+
+static const Scenario scenarios[] = {
+    { "brightness-sweep", brightnessSweep },
+    { "volume-hold", volumeHold },
+    { "als-storm", alsStorm },
+    { "typing", typing },
+    { "mixed", mixed },
+};
+
+#pragma mark -
+#pragma mark Running
+#pragma mark -
+
+struct ScenarioOptions {
+    UInt64 durationNS, drainNS;
+    std::vector<std::pair<std::string, UInt64> > latencies;
+};
+
+struct ScenarioResult {
+    std::string name;
+    UInt32 rate;
+    UInt64 events, hidPresses, repeats, unanswered;
+    UInt64 p50NS, p99NS, maxNS;
+    UInt64 lost;
+    UInt32 acpiCalls, wedCalls, alssCalls;
+    UInt32 nvramWrites;
+};
+
+#define kNXKeyCount 64
+
+struct ScenarioRun {
+    FnKeysHost *host;
+    MockTrackpad *trackpad;
+    const Scenario *scenario;
+    UInt32 rate;
+    UInt64 startTime, count, index;
+    BenchRandom random;
+
+    // Send times of the notifications meant to become each key
+    std::vector<UInt64> sends[kNXKeyCount];
+    size_t answered[kNXKeyCount];
+    std::vector<UInt64> latencies;
+    UInt64 hidPresses, repeats;
+};
+
+static int hidKey(UInt32 event)
+{
+    if (event >= 0x10 && event <= 0x1F)
+        return NX_KEYTYPE_BRIGHTNESS_UP;
+    if (event >= 0x20 && event <= 0x2F)
+        return NX_KEYTYPE_BRIGHTNESS_DOWN;
+
+    switch (event) {
+        case 0x30:
+            return NX_KEYTYPE_SOUND_UP;
+        case 0x31:
+            return NX_KEYTYPE_SOUND_DOWN;
+        case 0x32:
+            return NX_KEYTYPE_MUTE;
+    }
+    return -1;
+}
+
+static void sendNext(void *ref)
+{
+    ScenarioRun *run = (ScenarioRun *) ref;
+    UInt32 event = run->scenario->event(run->index, run->rate, run->random);
+    UInt64 now = hostClockNow();
+
+    int key = hidKey(event);
+    if (key >= 0)
+        run->sends[key].push_back(now);
+
+    if (event == kTrackpadKeyPress)
+        run->trackpad->keyPressed(run->host->fnKeys(), now);
+    else
+        run->host->notify(event);
+
+    if (++run->index < run->count)
+        hostSchedule(run->startTime + run->index * 1000000000ULL / run->rate, sendNext, run);
+}
+
+/*
+ * A key down answers every notification of its key sent before the driver
+ * queued it and not answered yet. A firmware repeat absorbed into a hold is
+ * answered by the next repeat the driver makes. A down with nothing to
+ * answer is a driver repeat.
+ */
+static void hidDispatched(const HostHIDEvent *event, void *ref)
+{
+    ScenarioRun *run = (ScenarioRun *) ref;
+    if (!event->down || event->key >= kNXKeyCount)
+        return;
+
+    run->hidPresses++;
+    std::vector<UInt64> &sends = run->sends[event->key];
+    size_t latest = std::upper_bound(sends.begin(), sends.end(), event->eventTime) - sends.begin();
+    if (latest == run->answered[event->key])
+    {
+        run->repeats++;
+        return;
+    }
+    for (size_t i = run->answered[event->key]; i < latest; i++)
+        run->latencies.push_back(event->dispatchTime - sends[i]);
+    run->answered[event->key] = latest;
+}
+
+static UInt64 percentile(const std::vector<UInt64> &sorted, UInt32 percent)
+{
+    if (sorted.empty())
+        return 0;
+    return sorted[std::min(sorted.size() - 1, sorted.size() * percent / 100)];
+}
+
+static ScenarioResult runScenario(const Scenario *scenario, UInt32 rate, const ScenarioOptions &options)
+{
+    FnKeysHost host;
+    IODTNVRAM *nvram = host.publishNVRAM();
+    if (!host.start())
+    {
+        fprintf(stderr, "AsusFnKeys did not start\n");
+        exit(1);
+    }
+
+    ScenarioRun *run = new ScenarioRun();
+    run->host = &host;
+    run->trackpad = host.publishTrackpad();
+    run->scenario = scenario;
+    run->rate = rate;
+    run->count = std::max<UInt64>(1, options.durationNS * rate / 1000000000ULL);
+
+    // Firmware latency applies to the scenario, not to loading the driver
+    for (size_t i = 0; i < options.latencies.size(); i++)
+        host.acpi()->setLatency(options.latencies[i].first.c_str(), options.latencies[i].second);
+    host.acpi()->resetCalls();
+    UInt32 nvramWrites = nvram->writes();
+
+    hostSetHIDHook(hidDispatched, run);
+    run->startTime = hostClockNow();
+    hostSchedule(run->startTime, sendNext, run);
+    host.run(options.durationNS);
+    // A slow firmware can hold the sending back past the duration
+    while (run->index < run->count)
+        host.run(MS_TO_NS(100));
+    host.run(options.drainNS);
+    hostSetHIDHook(NULL, NULL);
+
+    ScenarioResult result;
+    result.name = scenario->name;
+    result.rate = rate;
+    result.events = run->index;
+    result.hidPresses = run->hidPresses;
+    result.repeats = run->repeats;
+    result.unanswered = 0;
+    for (int key = 0; key < kNXKeyCount; key++)
+        result.unanswered += run->sends[key].size() - run->answered[key];
+
+    std::sort(run->latencies.begin(), run->latencies.end());
+    result.p50NS = percentile(run->latencies, 50);
+    result.p99NS = percentile(run->latencies, 99);
+    result.maxNS = run->latencies.empty() ? 0 : run->latencies.back();
+
+    result.lost = host.counter("NotifyDrops") + host.counter("WEDDecodeFailures") +
+                  FnKeysHost::counter(host.keyboard(), "KeyEventsDropped");
+    result.acpiCalls = host.acpi()->totalCalls();
+    result.wedCalls = host.acpi()->calls("_WED");
+    result.alssCalls = host.acpi()->calls("ALSS");
+    result.nvramWrites = nvram->writes() - nvramWrites;
+
+    delete run;
+    return result;
+}
+
+#pragma mark -
+#pragma mark Output
+#pragma mark -
+
+static void printResult(const ScenarioResult &result)
+{
+    printf("%-18s %6u %7llu %7llu %7llu %9.3f %9.3f %9.3f %10llu %6llu %7u %7u %7u %5u\n",
+           result.name.c_str(), result.rate, (unsigned long long) result.events,
+           (unsigned long long) result.hidPresses, (unsigned long long) result.repeats,
+           result.p50NS / 1000000.0, result.p99NS / 1000000.0, result.maxNS / 1000000.0,
+           (unsigned long long) result.unanswered, (unsigned long long) result.lost, result.acpiCalls, result.wedCalls, result.alssCalls,
+           result.nvramWrites);
+    fflush(stdout);
+}
+
+static bool saveResults(const char *path, const char *label, const std::vector<ScenarioResult> &results)
+{
+    FILE *file = fopen(path, "w");
+    if (!file)
+        return false;
+
+    fprintf(file, "{\n  \"label\": \"%s\",\n  \"scenarios\": [\n", label ? label : "");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const ScenarioResult &result = results[i];
+        fprintf(file, "    {\"name\": \"%s\", \"rate\": %u, \"events\": %llu, \"hid_presses\": %llu, "
+                "\"repeats\": %llu, \"latency_ns\": {\"p50\": %llu, \"p99\": %llu, \"max\": %llu}, "
+                "\"unanswered\": %llu, \"lost\": %llu, \"acpi_calls\": {\"total\": %u, \"_WED\": %u, \"ALSS\": %u}, "
+                "\"nvram_writes\": %u}%s\n",
+                result.name.c_str(), result.rate, (unsigned long long) result.events,
+                (unsigned long long) result.hidPresses, (unsigned long long) result.repeats,
+                (unsigned long long) result.p50NS, (unsigned long long) result.p99NS,
+                (unsigned long long) result.maxNS, (unsigned long long) result.unanswered,
+                (unsigned long long) result.lost,
+                result.acpiCalls, result.wedCalls, result.alssCalls, result.nvramWrites,
+                i + 1 < results.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+    return true;
+}
+
+static bool parseLatencies(char *list, ScenarioOptions *options)
+{
+    for (char *item = strtok(list, ","); item; item = strtok(NULL, ","))
+    {
+        char *value = strchr(item, '=');
+        if (!value || value == item || value - item > 4)
+            return false;
+        *value++ = '\0';
+        options->latencies.push_back(std::make_pair(std::string(item), 1000 * strtoull(value, NULL, 0)));
+    }
+    return true;
+}
+
+static bool parseRates(char *list, std::vector<UInt32> *rates)
+{
+    rates->clear();
+    for (char *item = strtok(list, ","); item; item = strtok(NULL, ","))
+    {
+        UInt32 rate = (UInt32) strtoul(item, NULL, 0);
+        if (rate == 0)
+            return false;
+        rates->push_back(rate);
+    }
+    return !rates->empty();
+}
+
+int main(int argc, char **argv)
+{
+    const char *filter = NULL, *jsonPath = NULL, *label = NULL;
+    std::vector<UInt32> rates = { 1, 10, 100, 1000, 10000 };
+    ScenarioOptions options;
+    options.durationNS = MS_TO_NS(5000);
+    options.drainNS = MS_TO_NS(3000);
+    // ATK methods go through the embedded controller, none is instant, and
+    // notifications arriving during a call queue up for the next drain
+    options.latencies.push_back(std::make_pair(std::string("*"), 200000ULL));
+
+    for (int i = 1; i < argc; i++)
+    {
+        bool valid = true;
+        if (!strcmp(argv[i], "--rates") && i + 1 < argc)
+            valid = parseRates(argv[++i], &rates);
+        else if (!strcmp(argv[i], "--duration") && i + 1 < argc)
+            options.durationNS = MS_TO_NS(strtoull(argv[++i], NULL, 0));
+        else if (!strcmp(argv[i], "--drain") && i + 1 < argc)
+            options.drainNS = MS_TO_NS(strtoull(argv[++i], NULL, 0));
+        else if (!strcmp(argv[i], "--latency") && i + 1 < argc)
+            valid = parseLatencies(argv[++i], &options);
+        else if (!strcmp(argv[i], "--json") && i + 1 < argc)
+            jsonPath = argv[++i];
+        else if (!strcmp(argv[i], "--label") && i + 1 < argc)
+            label = argv[++i];
+        else if (argv[i][0] != '-')
+            filter = argv[i];
+        else
+            valid = false;
+
+        if (!valid)
+        {
+            fprintf(stderr, "usage: %s [filter] [--rates r,...] [--duration ms] [--drain ms] "
+                    "[--latency METHOD=us,...] [--json file] [--label text]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    std::vector<ScenarioResult> results;
+    printf("%-18s %6s %7s %7s %7s %9s %9s %9s %10s %6s %7s %7s %7s %5s\n", "scenario", "rate", "events",
+           "hid", "repeats", "p50 ms", "p99 ms", "max ms", "unanswered", "lost", "acpi", "_WED", "ALSS", "nvram");
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++)
+    {
+        if (filter && !strstr(scenarios[i].name, filter))
+            continue;
+
+        for (size_t j = 0; j < rates.size(); j++)
+        {
+            results.push_back(runScenario(&scenarios[i], rates[j], options));
+            printResult(results.back());
+        }
+    }
+
+    if (jsonPath && !saveResults(jsonPath, label, results))
+    {
+        fprintf(stderr, "Can't write %s\n", jsonPath);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,194 @@
+/*
+ *  Copyright (c) 2018 hieplpvip
+ *
+ *
+ *  CaptureTests.cpp
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include "HostTest.h"
+
+// A few minutes of use compressed: keys, the touchpad and ALS toggles, ALS
+// notifications, the backlight going dark when idle and back on a keypress
+static const struct {
+    UInt32 delayMS;
+    UInt32 code;        // notify value, 0 for a keypress-time message
+} session[] = {
+    { 100, 0xC4 }, { 50, 0xC4 }, { 200, 0x32 }, { 150, 0x30 }, { 150, 0x30 },
+    { 300, 0x6B }, { 200, 0x7A }, { 100, 0xC6 }, { 5, 0xC7 }, { 100, 0x10 },
+    { 2000, 0 }, { 300, 0xC5 }, { 100, 0x6B }, { 400, 0 },
+};
+
+static void configure(FnKeysHost &host)
+{
+    host.publishTrackpad();
+    host.setPreference("CaptureEnabled", true);
+    host.setPreference("IdleKBacklightAutoOff", true);
+    host.setPreference("IdleKBacklightAutoOffTimeout", (UInt64) 1000);
+}
+
+// Runs session on a host configured and started for capture, returns the ns it took
+static UInt64 playSession(FnKeysHost &host)
+{
+    UInt64 start = hostClockNow(), when = start;
+    for (size_t i = 0; i < sizeof(session) / sizeof(session[0]); i++)
+    {
+        when += MS_TO_NS(session[i].delayMS);
+        if (session[i].code)
+            host.notifyAt(when, session[i].code);
+        else
+            host.keyTimeAt(when, when);
+    }
+    host.run(when - start + MS_TO_NS(100));
+    return hostClockNow() - start;
+}
+
+static UInt32 countOutputs(const std::vector<FnKeysOutput> &outputs, UInt8 kind)
+{
+    UInt32 count = 0;
+    for (size_t i = 0; i < outputs.size(); i++)
+        if (outputs[i].kind == kind)
+            count++;
+    return count;
+}
+
+static void captureSession(std::vector<FnKeysTraceRecord> *records, std::vector<FnKeysOutput> *outputs, UInt64 *length)
+{
+    FnKeysHost host;
+    configure(host);
+    CHECK(host.start());
+    host.acpi()->setLatency("*", 200000);
+    host.acpi()->setLatency("ALSS", 3000000);
+    *length = playSession(host);
+
+    UInt32 dropped = 0;
+    CHECK_EQ(host.readCapture(records, &dropped), kIOReturnSuccess);
+    CHECK_EQ(dropped, 0);
+    *outputs = host.outputs();
+}
+
+HOST_TEST(replayReproducesACapturedSession)
+{
+    std::vector<FnKeysTraceRecord> records;
+    std::vector<FnKeysOutput> recorded;
+    UInt64 length;
+    captureSession(&records, &recorded, &length);
+    CHECK(countOutputs(recorded, kOutputHID) >= 8);
+    CHECK(countOutputs(recorded, kOutputACPIWrite) >= 6);
+    CHECK(countOutputs(recorded, kOutputKernEvent) >= 2);
+
+    FnKeysHost host;
+    configure(host);
+    CHECK(host.replay(records));
+    CHECK(host.start());
+    host.run(length);
+
+    CHECK_EQ(host.replayMisses(), 0);
+    CHECK_EQ(FnKeysHost::diff(recorded, host.outputs(), MS_TO_NS(1)), 0);
+}
+
+HOST_TEST(replayDetectsADifferentResult)
+{
+    std::vector<FnKeysTraceRecord> records;
+    std::vector<FnKeysOutput> recorded;
+    UInt64 length;
+    captureSession(&records, &recorded, &length);
+
+    // The firmware decodes the mute as volume up this time
+    bool changed = false;
+    for (size_t i = 0; i < records.size() && !changed; i++)
+    {
+        if (records[i].event == kCaptureACPI && (records[i].arg0 & 0xFF) == kACPIMethodWED &&
+            (UInt32) records[i].arg1 == 0x32)
+        {
+            records[i].arg1 = (records[i].arg1 & ~0xFFFFFFFFULL) | 0x30;
+            changed = true;
+        }
+    }
+    CHECK(changed);
+
+    FnKeysHost host;
+    configure(host);
+    CHECK(host.replay(records));
+    CHECK(host.start());
+    host.run(length);
+
+    printf("    (differences expected)\n");
+    CHECK(FnKeysHost::diff(recorded, host.outputs(), MS_TO_NS(1)) > 0);
+}
+
+HOST_TEST(captureIsDrainedWhileItRuns)
+{
+    FnKeysHost host;
+    host.setPreference("CaptureEnabled", true);
+    CHECK(host.start());
+
+    // Four times the ring, read every 256 notifications
+    std::vector<FnKeysTraceRecord> records;
+    UInt32 notifies = 0, dropped = 0;
+    for (int i = 0; i < 4 * kTraceRingSize; i++)
+    {
+        host.notify(0x32);
+        host.run(MS_TO_NS(1));
+        if (i % 256 == 255)
+            CHECK_EQ(host.readCapture(&records, &dropped), kIOReturnSuccess);
+    }
+    CHECK_EQ(dropped, 0);
+    for (size_t i = 0; i < records.size(); i++)
+        if (records[i].event == kCaptureNotify)
+            notifies++;
+    CHECK_EQ(notifies, 4 * kTraceRingSize);
+
+    // Unread, the ring keeps its oldest records and counts the rest
+    for (int i = 0; i < 2 * kTraceRingSize; i++)
+        host.notify(0x32);
+    host.run(MS_TO_NS(100));
+    records.clear();
+    CHECK_EQ(host.readCapture(&records, &dropped), kIOReturnSuccess);
+    CHECK_EQ(records.size(), kTraceRingSize);
+    CHECK(dropped >= kTraceRingSize);
+    CHECK_EQ(records[0].event, kCaptureNotify);
+}
+
+HOST_TEST(captureNeedsAnAdministrator)
+{
+    FnKeysHost host;
+    CHECK(host.start());
+    host.notify(0x32);
+    host.run(MS_TO_NS(10));
+
+    hostSetAdministrator(false);
+    OSDictionary *dict = OSDictionary::withCapacity(1);
+    dict->setObject("CaptureEnabled", kOSBooleanTrue);
+    CHECK_EQ(host.fnKeys()->setProperties(dict), kIOReturnNotPrivileged);
+    std::vector<FnKeysTraceRecord> records;
+    CHECK_EQ(host.readCapture(&records), kIOReturnBadArgument);
+
+    hostSetAdministrator(true);
+    CHECK_EQ(host.fnKeys()->setProperties(dict), kIOReturnSuccess);
+    dict->release();
+    host.notify(0x32);
+    host.run(MS_TO_NS(10));
+    CHECK_EQ(host.readCapture(&records), kIOReturnSuccess);
+    CHECK(records.size() > 0);
+
+    // Keystroke timing stays out of the registry
+    OSSerialize *s = OSSerialize::withCapacity(0);
+    host.fnKeys()->serializeProperties(s);
+    s->release();
+    CHECK(host.fnKeys()->getProperty("CaptureRecords") == NULL);
+}
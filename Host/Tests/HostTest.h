@@ -0,0 +1,64 @@
+/*
+ *  Copyright (c) 2018 hieplpvip
+ *
+ *
+ *  HostTest.h
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _HostTest_h
+#define _HostTest_h
+
+#include "FnKeysHost.h"
+
+/*
+ * Minimal test registry: HOST_TEST(name) { ... } defines a test, CHECK and
+ * CHECK_EQ report a failure and keep going. fnkeys_tests [filter] runs the
+ * tests whose name contains filter.
+ */
+
+struct HostTestCase {
+    const char *name;
+    void (*run)();
+    HostTestCase *next;
+};
+
+struct HostTestRegistrar {
+    HostTestRegistrar(HostTestCase *test);
+};
+
+void hostTestFail(const char *file, int line, const char *expr);
+void hostTestFailEqual(const char *file, int line, const char *expr, unsigned long long actual, unsigned long long expected);
+
+#define HOST_TEST(name) \
+    static void name(); \
+    static HostTestCase name##_case = { #name, name, NULL }; \
+    static HostTestRegistrar name##_registrar(&name##_case); \
+    static void name()
+
+#define CHECK(expr) \
+    do { if (!(expr)) hostTestFail(__FILE__, __LINE__, #expr); } while (0)
+
+#define CHECK_EQ(actual, expected) \
+    do { \
+        unsigned long long _a = (unsigned long long)(actual), _e = (unsigned long long)(expected); \
+        if (_a != _e) hostTestFailEqual(__FILE__, __LINE__, #actual, _a, _e); \
+    } while (0)
+
+// Key presses (down events) of key in the HID log
+UInt32 hidPresses(UInt32 key);
+
+#endif //_HostTest_h
@@ -0,0 +1,116 @@
+/*
+ *  Copyright (c) 2018 hieplpvip
+ *
+ *
+ *  InstrumentationTests.cpp
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "HostTest.h"
+
+static IOReturn setBoolean(IORegistryEntry *entry, const char *key, bool value)
+{
+    OSDictionary *dict = OSDictionary::withCapacity(1);
+    dict->setObject(key, value ? kOSBooleanTrue : kOSBooleanFalse);
+    IOReturn ret = entry->setProperties(dict);
+    dict->release();
+    return ret;
+}
+
+// Samples in the LatencyHistograms of entry, refreshed like ioreg does
+static UInt64 latencySamples(IORegistryEntry *entry)
+{
+    OSSerialize *s = OSSerialize::withCapacity(0);
+    entry->serializeProperties(s);
+    s->release();
+
+    UInt64 samples = 0;
+    OSDictionary *histograms = OSDynamicCast(OSDictionary, entry->getProperty("LatencyHistograms"));
+    OSCollectionIterator *iter = histograms ? OSCollectionIterator::withCollection(histograms) : NULL;
+    if (!iter)
+        return 0;
+    while (const OSSymbol *name = (const OSSymbol *) iter->getNextObject())
+    {
+        OSArray *buckets = OSDynamicCast(OSArray, histograms->getObject(name));
+        for (unsigned int i = 0; buckets && i < buckets->getCount(); i++)
+            samples += OSDynamicCast(OSNumber, buckets->getObject(i))->unsigned64BitValue();
+    }
+    iter->release();
+    return samples;
+}
+
+HOST_TEST(resetLatencyNeedsAnAdministrator)
+{
+    FnKeysHost host;
+    CHECK(host.start());
+    // Some firmware time, so that the histograms see the keys
+    host.acpi()->setLatency("*", 200000);
+
+    // Beyond KeyRateBurst, the rest waits in the HID backlog
+    for (int i = 0; i < 20; i++)
+        host.notify(0x32);
+    host.run(MS_TO_NS(1000));
+    UInt64 samples = latencySamples(host.fnKeys());
+    UInt64 hidSamples = latencySamples(host.keyboard());
+    CHECK(samples > 0);
+    CHECK(hidSamples > 0);
+
+    // Any process may write properties, only root may reset
+    hostSetAdministrator(false);
+    CHECK_EQ(setBoolean(host.fnKeys(), "ResetLatency", true), kIOReturnNotPrivileged);
+    CHECK_EQ(setBoolean(host.keyboard(), "ResetLatency", true), kIOReturnNotPrivileged);
+    CHECK_EQ(latencySamples(host.fnKeys()), samples);
+    CHECK_EQ(latencySamples(host.keyboard()), hidSamples);
+
+    hostSetAdministrator(true);
+    CHECK_EQ(setBoolean(host.fnKeys(), "ResetLatency", true), kIOReturnSuccess);
+    CHECK_EQ(setBoolean(host.keyboard(), "ResetLatency", true), kIOReturnSuccess);
+    CHECK_EQ(latencySamples(host.fnKeys()), 0);
+    CHECK_EQ(latencySamples(host.keyboard()), 0);
+}
+
+static bool tracing(IORegistryEntry *entry)
+{
+    OSSerialize *s = OSSerialize::withCapacity(0);
+    entry->serializeProperties(s);
+    s->release();
+    return entry->getProperty("TraceRecords") != NULL;
+}
+
+HOST_TEST(traceEnabledNeedsAnAdministrator)
+{
+    FnKeysHost host;
+    CHECK(host.start());
+    IORegistryEntry *drivers[] = { host.fnKeys(), host.keyboard(), host.keyboardDevice() };
+
+    hostSetAdministrator(false);
+    for (int i = 0; i < 3; i++)
+    {
+        CHECK_EQ(setBoolean(drivers[i], "TraceEnabled", true), kIOReturnNotPrivileged);
+        host.notify(0x30);
+        host.run(MS_TO_NS(1));
+        CHECK(!tracing(drivers[i]));
+    }
+
+    hostSetAdministrator(true);
+    for (int i = 0; i < 3; i++)
+    {
+        CHECK_EQ(setBoolean(drivers[i], "TraceEnabled", true), kIOReturnSuccess);
+        host.notify(0x30);
+        host.run(MS_TO_NS(1));
+        CHECK(tracing(drivers[i]));
+    }
+}
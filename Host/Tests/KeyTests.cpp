@@ -0,0 +1,150 @@
+/*
+ *  Copyright (c) 2018 hieplpvip
+ *
+ *
+ *  KeyTests.cpp
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "HostTest.h"
+
+HOST_TEST(volumeKeyReachesHID)
+{
+    FnKeysHost host;
+    CHECK(host.start());
+
+    UInt64 sent = hostClockNow();
+    host.notify(0x30);
+    host.run(MS_TO_NS(1));
+
+    CHECK_EQ(hostHIDEventCount(), 2);
+    CHECK_EQ(hostHIDEvent(0)->key, NX_KEYTYPE_SOUND_UP);
+    CHECK(hostHIDEvent(0)->down);
+    CHECK_EQ(hostHIDEvent(1)->key, NX_KEYTYPE_SOUND_UP);
+    CHECK(!hostHIDEvent(1)->down);
+    CHECK_EQ(hostHIDEvent(0)->eventTime, sent);
+    CHECK_EQ(host.acpi()->argument("_WED"), 0x30);
+}
+
+HOST_TEST(decodesEveryWEDShape)
+{
+    static const struct { UInt8 shape; const char *counter; } shapes[] = {
+        { kMockWEDNumber, "WEDDecodedNumber" },
+        { kMockWEDPackage, "WEDDecodedPackage" },
+        { kMockWEDBuffer, "WEDDecodedBuffer" },
+    };
+
+    for (size_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++)
+    {
+        MockASUSNotebook config;
+        config.wedShape = shapes[i].shape;
+
+        FnKeysHost host(config);
+        CHECK(host.start());
+        // Firmware that reports every key through notify 0xFF
+        host.acpi()->asus().wedCodes[0xFF] = 0x32;
+        host.notify(0xFF);
+        host.notify(0xFF);
+        host.run(MS_TO_NS(1));
+
+        CHECK_EQ(hidPresses(NX_KEYTYPE_MUTE), 2);
+        CHECK_EQ(host.counter(shapes[i].counter), 2);
+        CHECK_EQ(host.counter("WEDDecodeFailures"), 0);
+    }
+}
+
+HOST_TEST(rejectsUnknownWEDResults)
+{
+    FnKeysHost host;
+    CHECK(host.start());
+
+    OSString *garbage = OSString::withCString("?");
+    host.acpi()->queueResult("_WED", garbage);
+    garbage->release();
+    host.notify(0x30);
+    host.run(MS_TO_NS(1));
+
+    CHECK_EQ(host.counter("WEDDecodeFailures"), 1);
+    CHECK_EQ(hostHIDEventCount(), 0);
+}
+
+HOST_TEST(tapSendsOneKey)
+{
+    FnKeysHost host;
+    CHECK(host.start());
+
+    host.notify(0x31);
+    host.run(MS_TO_NS(2000));
+    CHECK_EQ(hidPresses(NX_KEYTYPE_SOUND_DOWN), 1);
+}
+
+HOST_TEST(holdRepeatsUntilReleased)
+{
+    FnKeysHost host;
+    CHECK(host.start());
+
+    // Firmware repeats every 30 ms for 1.5 s
+    UInt64 start = hostClockNow();
+    for (int i = 0; i < 50; i++)
+        host.notifyAt(start + MS_TO_NS(30) * i, 0x30);
+    host.run(MS_TO_NS(1500));
+    UInt32 held = hidPresses(NX_KEYTYPE_SOUND_UP);
+
+    // First press, then one every KeyRepeatInterval from KeyRepeatDelay on
+    CHECK(held >= 11 && held <= 12);
+    CHECK(host.counter("FirmwareRepeatsAbsorbed") >= 40);
+
+    host.run(MS_TO_NS(2000));
+    CHECK(hidPresses(NX_KEYTYPE_SOUND_UP) - held <= 1);
+}
+
+HOST_TEST(brightnessKeysFollowTheDisplay)
+{
+    FnKeysHost host;
+    AppleBacklightDisplay *display = host.publishDisplay(8 * kPanelBrightnessStep);
+    CHECK(host.start());
+
+    // Any code of the range is sent as the one brightness key
+    host.notify(0x1A);
+    host.notify(0x25);
+    host.run(MS_TO_NS(1));
+    CHECK_EQ(hidPresses(NX_KEYTYPE_BRIGHTNESS_UP), 1);
+    CHECK_EQ(hidPresses(NX_KEYTYPE_BRIGHTNESS_DOWN), 1);
+    CHECK_EQ(display->brightnessWrites(), 0);
+}
+
+HOST_TEST(sleepAndAirplaneGoToUserSpace)
+{
+    FnKeysHost host;
+    CHECK(host.start());
+
+    host.notify(0x5E);
+    host.notify(0x7D);
+    host.run(MS_TO_NS(1));
+
+    CHECK_EQ(hostHIDEventCount(), 0);
+    CHECK_EQ(hostKernEventCount(), 2);
+
+    int payload[3];
+    const HostKernEvent *sleep = hostKernEvent(0);
+    CHECK_EQ(sleep->event_code, AsusFnKeysEventCode);
+    CHECK_EQ(sleep->length, sizeof(payload));
+    memcpy(payload, sleep->data, sizeof(payload));
+    CHECK_EQ(payload[0], kevSleep);
+
+    memcpy(payload, hostKernEvent(1)->data, sizeof(payload));
+    CHECK_EQ(payload[0], kevAirplaneMode);
+}
@@ -0,0 +1,404 @@
+/*
+ *  Copyright (c) 2018 hieplpvip
+ *
+ *
+ *  NotifyTests.cpp
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "FnKeysHIKeyboard.h"
+#include "HostTest.h"
+
+// Reads keytime the way the work loop does
+class KeyTimeAsusFnKeys : public AsusFnKeys
+{
+    OSDeclareDefaultStructors(KeyTimeAsusFnKeys)
+
+public:
+    uint64_t keyTime() const { return __atomic_load_n(&keytime, __ATOMIC_ACQUIRE); }
+};
+
+OSDefineMetaClassAndStructors(KeyTimeAsusFnKeys, AsusFnKeys)
+
+HOST_TEST(fullRingDropsAndCounts)
+{
+    FnKeysHost host;
+    host.setPreference("NotifyRingSize", (UInt64) 8);
+    CHECK(host.start());
+    CHECK_EQ(host.counter("NotifyRingSize"), 8);
+
+    for (int i = 0; i < 20; i++)
+        host.notify(0x32);
+    host.run(MS_TO_NS(1));
+
+    CHECK_EQ(host.counter("NotifyDrops"), 12);
+    CHECK_EQ(hidPresses(NX_KEYTYPE_MUTE), 8);
+}
+
+HOST_TEST(ringRoundsToPowerOfTwo)
+{
+    FnKeysHost host;
+    host.setPreference("NotifyRingSize", (UInt64) 100);
+    CHECK(host.start());
+    CHECK_EQ(host.counter("NotifyRingSize"), 128);
+}
+
+HOST_TEST(eventsDuringSlowFirmwareAreKept)
+{
+    FnKeysHost host;
+    CHECK(host.start());
+    host.acpi()->setLatency("_WED", MS_TO_NS(5));
+
+    // Arrive while the work loop is busy in _WED
+    UInt64 start = hostClockNow();
+    for (int i = 0; i < 10; i++)
+        host.notifyAt(start + MS_TO_NS(1) * i, 0x32);
+    host.run(MS_TO_NS(100));
+
+    CHECK_EQ(host.acpi()->calls("_WED"), 10);
+    CHECK_EQ(hidPresses(NX_KEYTYPE_MUTE), 10);
+    CHECK_EQ(host.counter("NotifyDrops"), 0);
+}
+
+HOST_TEST(burstBeyondRateLimitIsDelayed)
+{
+    FnKeysHost host;
+    CHECK(host.start());
+    IOService *keyboard = host.keyboard();
+
+    for (int i = 0; i < 40; i++)
+        host.notify(0x32);
+    host.run(MS_TO_NS(1));
+    // KeyRateBurst of Info.plist goes through at once
+    CHECK_EQ(hidPresses(NX_KEYTYPE_MUTE), 16);
+    CHECK_EQ(FnKeysHost::counter(keyboard, "KeyEventsCoalesced"), 24);
+
+    // The rest at KeyRateLimit, nothing lost
+    host.run(MS_TO_NS(1000));
+    CHECK_EQ(hidPresses(NX_KEYTYPE_MUTE), 40);
+    CHECK_EQ(FnKeysHost::counter(keyboard, "KeyEventsDropped"), 0);
+}
+
+// Dispatch times of the key presses, the HID log only keeps the latest events
+struct PressTimes {
+    UInt32 key;
+    std::vector<UInt64> times;
+    UInt32 releases;
+};
+
+static void recordPress(const HostHIDEvent *event, void *ref)
+{
+    PressTimes *presses = (PressTimes *) ref;
+    if (event->key != presses->key)
+        return;
+    if (event->down)
+        presses->times.push_back(event->dispatchTime);
+    else
+        presses->releases++;
+}
+
+HOST_TEST(floodAtTenThousandPerSecondKeepsTheRate)
+{
+    FnKeysHost host;
+    CHECK(host.start());
+    IOService *keyboard = host.keyboard();
+    PressTimes presses = { NX_KEYTYPE_MUTE, {}, 0 };
+    hostSetHIDHook(recordPress, &presses);
+
+    // One second of a key every 100 us
+    const UInt32 sent = 10000;
+    UInt64 begin = hostClockNow();
+    for (UInt32 i = 0; i < sent; i++)
+    {
+        host.notify(0x32);
+        host.run(MS_TO_NS(1) / 10);
+    }
+    UInt64 end = hostClockNow();
+
+    // Burst, then KeyRateLimit (40/s) in any window while flooded
+    UInt32 during = 0;
+    for (size_t i = 0; i < presses.times.size(); i++)
+    {
+        if (presses.times[i] > end)
+            break;
+        during++;
+        for (size_t j = i; j < presses.times.size() && presses.times[j] <= end; j++)
+        {
+            UInt64 window = presses.times[j] - presses.times[i];
+            CHECK(j - i + 1 <= 16 + window * 40 / MS_TO_NS(1000) + 1);
+        }
+    }
+    CHECK(during >= 16 + 40 * (end - begin) / MS_TO_NS(1000) - 1);
+    CHECK(during <= 16 + 40 * (end - begin) / MS_TO_NS(1000) + 1);
+
+    // The backlog drains at the same rate once the flood stops
+    host.run(MS_TO_NS(1000));
+    UInt32 draining = (UInt32) presses.times.size() - during;
+    CHECK(draining >= 39 && draining <= 41);
+    host.run(MS_TO_NS(2000));
+
+    // Final state: nothing pending, every event posted or counted as dropped
+    UInt64 posted = FnKeysHost::counter(keyboard, "KeyEventsPosted");
+    UInt64 dropped = FnKeysHost::counter(keyboard, "KeyEventsDropped");
+    CHECK_EQ(presses.times.size(), during + kKeyBacklogMax);
+    CHECK_EQ(presses.times.size(), posted);
+    CHECK_EQ(presses.releases, posted);
+    CHECK_EQ(posted + dropped, sent);
+    CHECK_EQ(host.counter("NotifyDrops"), 0);
+
+    UInt32 settled = (UInt32) presses.times.size();
+    host.run(MS_TO_NS(1000));
+    CHECK_EQ(presses.times.size(), settled);
+    hostSetHIDHook(NULL, NULL);
+}
+
+HOST_TEST(failingFirmwareIsCounted)
+{
+    FnKeysHost host;
+    CHECK(host.start());
+    host.acpi()->failMethod("_WED", kIOReturnError);
+
+    host.notify(0x30);
+    host.run(MS_TO_NS(1));
+    CHECK_EQ(hostHIDEventCount(), 0);
+    CHECK_EQ(host.counter("WEDDecodeFailures"), 1);
+
+    host.acpi()->failMethod("_WED", kIOReturnSuccess);
+    host.notify(0x30);
+    host.run(MS_TO_NS(1));
+    CHECK_EQ(hidPresses(NX_KEYTYPE_SOUND_UP), 1);
+}
+
+HOST_TEST(hotkeyPathDoesNotAllocate)
+{
+    FnKeysHost host;
+    host.publishNVRAM();
+    CHECK(host.start());
+
+    // Warm up: first key of each kind, NVRAM timer armed
+    static const UInt32 keys[] = { 0x30, 0x31, 0x32, 0xC6, 0x5E };
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+        host.notify(keys[i]);
+    host.run(MS_TO_NS(3000));
+
+    // Result objects are the firmware's, like the ones ACPICA creates
+    UInt64 allocations = hostAllocations() - host.acpi()->allocations();
+    for (int round = 0; round < 10; round++)
+    {
+        for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+            host.notify(keys[i]);
+        host.run(MS_TO_NS(1000));
+    }
+    CHECK_EQ(hostAllocations() - host.acpi()->allocations() - allocations, 0);
+}
+
+/*
+ * A million events of every kind the driver handles, with the timers they
+ * arm firing in between: the heap must stay where it was after warm up
+ */
+HOST_TEST(millionEventSoakKeepsMemoryFlat)
+{
+    FnKeysHost host;
+    host.publishNVRAM();
+    host.publishDisplay(0x400);
+    host.setPreference("IdleKBacklightAutoOff", true);
+    host.setPreference("IdleKBacklightAutoOffTimeout", (UInt64) 2000);
+    CHECK(host.start());
+    MockTrackpad *trackpad = host.publishTrackpad();
+
+    // Volume, mute, brightness, ALS, keyboard backlight, touchpad, ALS toggle, panel, AC
+    static const UInt32 keys[] = { 0x30, 0x31, 0x32, 0x10, 0x20, 0xC6, 0xC7, 0xC4, 0xC5, 0x6B, 0x7A, 0x33, 0x57 };
+    const UInt32 count = sizeof(keys) / sizeof(keys[0]);
+    UInt64 state = 0x9E3779B97F4A7C15ULL;
+    UInt64 live = 0;
+
+    for (UInt32 i = 0; i < 1100000; i++)
+    {
+        // The first 100k warm up, then the heap is sampled every 100k
+        if (i % 100000 == 0)
+        {
+            host.run(MS_TO_NS(3000));
+            if (i == 100000)
+                live = hostLiveAllocations();
+            else if (i > 100000)
+                CHECK_EQ(hostLiveAllocations(), live);
+        }
+
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        if ((state & 15) == 0)
+            trackpad->keyPressed(host.fnKeys(), hostClockNow());
+        else
+            host.notify(keys[(state >> 8) % count]);
+        hostRunPending();
+
+        // Bursts of 8 events on average, then up to 4 s idle so the auto-off and NVRAM timers fire
+        if ((state >> 40 & 7) == 0)
+            host.run(MS_TO_NS(state >> 48 & 4095));
+    }
+    host.run(MS_TO_NS(3000));
+    CHECK_EQ(hostLiveAllocations(), live);
+    CHECK_EQ(host.counter("NotifyDrops"), 0);
+}
+
+/*
+ * The ACPI and keyboard drivers deliver on their own threads until the
+ * driver is detached, stop() must not free what message() writes to
+ */
+HOST_TEST(messagesDuringStopAreHarmless)
+{
+    FnKeysHost host;
+    host.setPreference("IdleKBacklightAutoOff", true);
+    host.setPreference("IdleKBacklightAutoOffTimeout", (UInt64) 1000);
+    CHECK(host.start());
+    host.run(MS_TO_NS(1500));
+
+    AsusFnKeys *driver = host.fnKeys();
+    driver->retain();
+    std::atomic<UInt32> sent(0);
+    std::atomic<bool> stopped(false);
+    std::thread producer([&]() {
+        UInt32 event = 0x30;
+        uint64_t time = kHostClockStart;
+        while (!stopped)
+        {
+            driver->message(kIOACPIMessageDeviceNotification, host.acpi(), &event);
+            driver->message(kKeyboardKeyPressTime, host.acpi(), &time);
+            sent++;
+        }
+    });
+
+    while (sent < 1000)
+        std::this_thread::yield();
+    host.stop();
+    UInt32 hid = hostHIDEventCount();
+    host.run(MS_TO_NS(10));
+    UInt32 during = sent;
+    while (sent < during + 1000)
+        std::this_thread::yield();
+    stopped = true;
+    producer.join();
+
+    // Nothing queued after stop reaches HID
+    CHECK_EQ(hostHIDEventCount(), hid);
+    driver->release();
+}
+
+/*
+ * Keyboard drivers send the keypress time from their own threads on every
+ * keystroke. Each stamp carries its low half inverted in the high half, so
+ * a torn 64-bit store or load shows up as a mismatch.
+ */
+#define kKeyTimeThreads     4
+#define kKeyTimeMessages    200000
+
+static inline uint64_t keyTimeStamp(UInt32 thread, UInt32 seq)
+{
+    UInt32 low = thread << 24 | seq;
+    return (uint64_t) ~low << 32 | low;
+}
+
+static inline bool keyTimeTorn(uint64_t stamp)
+{
+    return (UInt32) (stamp >> 32) != (UInt32) ~stamp;
+}
+
+HOST_TEST(keyTimeMessagesFromManyThreads)
+{
+    FnKeysHost host;
+    host.setDriverClass("KeyTimeAsusFnKeys");
+    host.setPreference("IdleKBacklightAutoOff", true);
+    host.setPreference("IdleKBacklightAutoOffTimeout", (UInt64) 1000);
+    CHECK(host.start());
+    host.run(MS_TO_NS(1500));
+    CHECK_EQ(host.acpi()->asus().keyboardBacklight, 0);
+
+    // ACPI only ever runs on this thread, the work loop
+    std::thread::id workLoop = std::this_thread::get_id();
+    std::atomic<UInt32> foreignSKBL(0);
+    host.acpi()->setMethod("SKBL", [&](OSObject *params[], IOItemCount count, OSObject **result) {
+        if (std::this_thread::get_id() != workLoop)
+            foreignSKBL++;
+        host.acpi()->asus().keyboardBacklight = (UInt32) mockArgument(params, count, 0);
+        return kIOReturnSuccess;
+    });
+
+    KeyTimeAsusFnKeys *driver = OSDynamicCast(KeyTimeAsusFnKeys, host.fnKeys());
+    CHECK(driver != NULL);
+    if (!driver)
+        return;
+    uint64_t boot = driver->keyTime();
+
+    std::vector<UInt64> latencies[kKeyTimeThreads];
+    std::atomic<UInt32> running(kKeyTimeThreads);
+    std::vector<std::thread> senders;
+    for (UInt32 t = 0; t < kKeyTimeThreads; t++)
+    {
+        latencies[t].reserve(kKeyTimeMessages);
+        senders.emplace_back([&, t]() {
+            for (UInt32 i = 0; i < kKeyTimeMessages; i++)
+            {
+                uint64_t stamp = keyTimeStamp(t, i);
+                UInt32 type = i & 1 ? kKeyboardModifierKeyPressTime : kKeyboardKeyPressTime;
+                auto begin = std::chrono::steady_clock::now();
+                driver->message(type, host.acpi(), &stamp);
+                auto end = std::chrono::steady_clock::now();
+                latencies[t].push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count());
+            }
+            running--;
+        });
+    }
+
+    // Meanwhile the work loop handles the wake requests and reads keytime
+    UInt64 reads = 0, torn = 0;
+    while (running)
+    {
+        host.run(MS_TO_NS(1));
+        for (int i = 0; i < 1000; i++, reads++)
+        {
+            uint64_t stamp = driver->keyTime();
+            if (stamp != boot && keyTimeTorn(stamp))
+                torn++;
+        }
+    }
+    for (std::thread &sender : senders)
+        sender.join();
+    host.run(MS_TO_NS(1));
+
+    std::vector<UInt64> all;
+    for (UInt32 t = 0; t < kKeyTimeThreads; t++)
+        all.insert(all.end(), latencies[t].begin(), latencies[t].end());
+    std::sort(all.begin(), all.end());
+    printf("    %u threads x %u messages: p50 %llu ns, p99 %llu ns, %llu reads\n",
+           kKeyTimeThreads, kKeyTimeMessages,
+           (unsigned long long) all[all.size() / 2], (unsigned long long) all[all.size() * 99 / 100],
+           (unsigned long long) reads);
+
+    CHECK_EQ(torn, 0);
+    // The last store wins, it is some sender's last stamp
+    uint64_t last = driver->keyTime();
+    CHECK(!keyTimeTorn(last));
+    CHECK_EQ((UInt32) last & 0xFFFFFF, kKeyTimeMessages - 1);
+    // The wake request restored the backlight on the work loop only
+    CHECK_EQ(host.acpi()->asus().keyboardBacklight, 1);
+    CHECK_EQ(foreignSKBL, 0);
+}
@@ -0,0 +1,101 @@
+/*
+ *  Copyright (c) 2018 hieplpvip
+ *
+ *
+ *  StartTests.cpp
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "HostTest.h"
+
+HOST_TEST(startsOnATKDevice)
+{
+    FnKeysHost host;
+    CHECK(host.start());
+    CHECK(host.keyboardDevice() != NULL);
+    CHECK(host.keyboard() != NULL);
+
+    UInt64 caps = host.counter("ACPICapabilities");
+    CHECK(caps & ACPI_CAP(kACPIMethodSKBL));
+    CHECK(caps & ACPI_CAP(kACPIMethodGKBL));
+    CHECK(!(caps & ACPI_CAP(kACPIMethodKBPW)));
+    CHECK(caps & ACPI_CAP(kACPIMethodALSS));
+    CHECK(caps & ACPI_CAP(kACPIMethodWED));
+    CHECK(caps & ACPI_CAP(kACPIMethodWMxx));
+
+    // Hotkeys enabled, ALS on and the boot backlight level from Info.plist
+    CHECK_EQ(host.acpi()->calls("INIT"), 1);
+    CHECK(host.acpi()->asus().alsEnabled);
+    CHECK_EQ(host.acpi()->asus().keyboardBacklight, 1);
+    CHECK_EQ(host.counter("KeyboardBLightLevel"), 1);
+}
+
+HOST_TEST(startsWithoutOptionalMethods)
+{
+    MockASUSNotebook config;
+    config.keyboardBacklight = false;
+    config.ambientLightSensor = false;
+    config.init = false;
+
+    FnKeysHost host(config);
+    CHECK(host.start());
+    CHECK(host.fnKeys()->getProperty("KeyboardBLightLevel") == NULL);
+    CHECK(host.fnKeys()->getProperty("ALSNotifiesCoalesced") == NULL);
+
+    host.notify(0xC4);
+    host.notify(0xC6);
+    host.run(MS_TO_NS(10));
+    CHECK_EQ(host.acpi()->calls("_WED"), 2);
+    CHECK_EQ(host.acpi()->calls("SKBL") + host.acpi()->calls("ALSS"), 0);
+}
+
+HOST_TEST(ignoresOtherDevices)
+{
+    FnKeysHost host;
+    OSString *uid = OSString::withCString("PNP");
+    host.acpi()->setResult("_UID", uid);
+    uid->release();
+
+    CHECK(!host.start());
+    CHECK_EQ(host.acpi()->calls("_UID"), 1);
+    CHECK_EQ(host.acpi()->calls("INIT"), 0);
+}
+
+HOST_TEST(stopsCleanly)
+{
+    FnKeysHost host;
+    IODTNVRAM *nvram = host.publishNVRAM();
+    MockTrackpad *trackpad = host.publishTrackpad();
+    host.publishDisplay(8 * kPanelBrightnessStep);
+    CHECK(host.start());
+
+    // A pending NVRAM write is committed on the way out
+    host.notify(0xC4);
+    host.run(MS_TO_NS(10));
+    CHECK_EQ(nvram->writes(), 0);
+
+    host.stop();
+    CHECK(host.fnKeys() == NULL);
+    CHECK_EQ(nvram->writes(), 1);
+
+    // Nothing is left to react to notifications
+    UInt32 wed = host.acpi()->calls("_WED");
+    host.notify(0x30);
+    trackpad->keyPressed(host.acpi(), hostClockNow());
+    host.run(MS_TO_NS(1000));
+    CHECK_EQ(host.acpi()->calls("_WED"), wed);
+    CHECK_EQ(hostHIDEventCount(), 0);
+}
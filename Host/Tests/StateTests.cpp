@@ -0,0 +1,366 @@
+/*
+ *  Copyright (c) 2018 hieplpvip
+ *
+ *
+ *  StateTests.cpp
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "HostTest.h"
+
+static void setNVRAMBacklight(IODTNVRAM *nvram, UInt8 level)
+{
+    const OSSymbol *key = OSSymbol::withCString(kAsusKeyboardBacklight);
+    OSData *data = OSData::withBytes(&level, sizeof(level));
+    nvram->setProperty(key, data);
+    data->release();
+    key->release();
+}
+
+// Registered only once the level is stored, like an NVRAM that shows up late
+static void publishNVRAMBacklight(UInt8 level)
+{
+    IODTNVRAM *nvram = new IODTNVRAM;
+    nvram->init();
+    setNVRAMBacklight(nvram, level);
+    hostRegisterPath("/options", nvram);
+    nvram->registerService();
+    nvram->release();
+}
+
+static UInt8 nvramBacklight(IODTNVRAM *nvram)
+{
+    OSData *data = OSDynamicCast(OSData, nvram->IORegistryEntry::getProperty(kAsusKeyboardBacklight));
+    return data && data->getLength() ? *((const UInt8 *) data->getBytesNoCopy()) : 0xFF;
+}
+
+HOST_TEST(backlightStepsShareOneNVRAMWrite)
+{
+    FnKeysHost host;
+    IODTNVRAM *nvram = host.publishNVRAM();
+    CHECK(host.start());
+
+    // 1 -> 3 -> 2 within the flush delay
+    host.notify(0xC4);
+    host.run(MS_TO_NS(200));
+    host.notify(0xC4);
+    host.run(MS_TO_NS(200));
+    host.notify(0xC5);
+    host.run(MS_TO_NS(200));
+
+    CHECK_EQ(host.acpi()->asus().keyboardBacklight, 2);
+    CHECK_EQ(host.acpi()->calls("SKBL"), 4);
+    CHECK_EQ(nvram->writes(), 0);
+    CHECK_EQ(host.counter("NVRAMWritesCoalesced"), 2);
+
+    host.run(MS_TO_NS(2000));
+    CHECK_EQ(nvram->writes(), 1);
+    CHECK_EQ(nvramBacklight(nvram), 2);
+    CHECK_EQ(host.counter("NVRAMWritesCommitted"), 1);
+
+    // The level is shown by the user space daemon
+    CHECK_EQ(hostKernEventCount(), 3);
+    int payload[3];
+    memcpy(payload, hostKernEvent(2)->data, sizeof(payload));
+    CHECK_EQ(payload[0], kevKeyboardBacklight);
+    CHECK_EQ(payload[1], 2);
+    CHECK_EQ(payload[2], 3);
+}
+
+HOST_TEST(backlightAtLimitWritesNothing)
+{
+    FnKeysHost host;
+    // Already stored, so neither ACPI nor NVRAM has anything to change
+    setNVRAMBacklight(host.publishNVRAM(), 0);
+    CHECK(host.start());
+    host.run(MS_TO_NS(3000));
+    UInt32 skbl = host.acpi()->calls("SKBL");
+    UInt64 nvramIssued = host.counter("NVRAMBacklightWritesIssued");
+
+    host.notify(0xC5);
+    host.run(MS_TO_NS(3000));
+    CHECK_EQ(host.acpi()->calls("SKBL"), skbl);
+    CHECK(host.counter("KeyboardBacklightWritesAvoided") > 0);
+    CHECK_EQ(host.counter("NVRAMBacklightWritesIssued"), nvramIssued);
+}
+
+// A recorded session: backlight taps, touchpad and ALS toggles, brightness
+// and volume keys. Every key used to write SKBL and NVRAM; now only the
+// changes reach ACPI and the flush writes NVRAM once per pause.
+static const struct {
+    UInt32 delayMS;
+    UInt32 code;
+} stateSession[] = {
+    {   0, 0xC4 }, { 120, 0xC4 }, { 110, 0xC4 }, { 100, 0xC4 }, {  90, 0xC4 },
+    { 300, 0x20 }, {  80, 0x20 }, {  80, 0x20 }, { 400, 0x6B }, { 900, 0x6B },
+    { 200, 0xC5 }, { 130, 0xC5 }, { 100, 0xC5 }, { 100, 0xC5 }, { 100, 0xC5 },
+    {3000, 0x7A }, { 700, 0x7A }, { 200, 0x6B }, {  50, 0x10 }, {  50, 0x10 },
+    { 150, 0xC4 }, { 150, 0xC5 }, { 150, 0xC4 }, { 150, 0xC5 }, {2500, 0xC4 },
+    { 100, 0x6B }, { 100, 0x7A }, { 100, 0x7A }, { 100, 0x6B }, {3000, 0xC5 },
+};
+
+HOST_TEST(sessionTraceWritesOnlyChanges)
+{
+    FnKeysHost host;
+    IODTNVRAM *nvram = host.publishNVRAM();
+    host.publishTrackpad();
+    CHECK(host.start());
+    host.run(MS_TO_NS(3000));
+
+    host.acpi()->resetCalls();
+    UInt32 nvramWrites = nvram->writes();
+    UInt32 skblIssued = (UInt32) host.counter("KeyboardBacklightWritesIssued");
+    UInt32 alscIssued = (UInt32) host.counter("ALSWritesIssued");
+    UInt32 nvramIssued = (UInt32) host.counter("NVRAMBacklightWritesIssued");
+    UInt32 stateKeys = 0;
+
+    for (size_t i = 0; i < sizeof(stateSession) / sizeof(stateSession[0]); i++)
+    {
+        host.run(MS_TO_NS(stateSession[i].delayMS));
+        host.notify(stateSession[i].code);
+        if (stateSession[i].code == 0xC4 || stateSession[i].code == 0xC5 || stateSession[i].code == 0x7A)
+            stateKeys++;
+    }
+    host.run(MS_TO_NS(3000));
+
+    // The counters match what actually reached ACPI and NVRAM
+    CHECK_EQ(host.acpi()->calls("SKBL"), host.counter("KeyboardBacklightWritesIssued") - skblIssued);
+    CHECK_EQ(host.acpi()->calls("ALSC"), host.counter("ALSWritesIssued") - alscIssued);
+    CHECK_EQ(nvram->writes() - nvramWrites, host.counter("NVRAMBacklightWritesIssued") - nvramIssued);
+
+    // Taps past the limits write nothing, the toggles always do
+    CHECK(host.acpi()->calls("SKBL") < stateKeys);
+    CHECK_EQ(host.acpi()->calls("ALSC"), 4);
+    // One NVRAM write per pause instead of one per key
+    CHECK(nvram->writes() - nvramWrites <= 5);
+    CHECK(host.counter("NVRAMBacklightWritesAvoided") > 0);
+    CHECK(host.counter("KeyboardBacklightWritesAvoided") > 0);
+    // Touchpad toggles are not ALS writes
+    CHECK_EQ(host.counter("ALSWritesAvoided"), 0);
+}
+
+HOST_TEST(restoresBacklightFromNVRAM)
+{
+    // Also with the IODTNVRAM versions whose property reads return nothing
+    for (int broken = 0; broken < 2; broken++)
+    {
+        FnKeysHost host;
+        IODTNVRAM *nvram = host.publishNVRAM(broken);
+        setNVRAMBacklight(nvram, 3);
+        host.setPreference("NVRAMReadsBroken", (bool) broken);
+
+        CHECK(host.start());
+        CHECK_EQ(host.acpi()->asus().keyboardBacklight, 3);
+        CHECK_EQ(host.counter("KeyboardBLightLevel"), 3);
+        // Restoring is not a change to persist
+        host.run(MS_TO_NS(3000));
+        CHECK_EQ(nvram->writes(), 1);
+    }
+}
+
+HOST_TEST(firstBootDoesNotSerializeNVRAM)
+{
+    FnKeysHost host;
+    IODTNVRAM *nvram = host.publishNVRAM();
+    CHECK(host.start());
+
+    // Nothing stored yet, the level from Preferences stays
+    CHECK_EQ(host.acpi()->asus().keyboardBacklight, 1);
+    CHECK_EQ(nvram->serializations(), 0);
+}
+
+HOST_TEST(restoreKeepsAutoOffBacklightDark)
+{
+    FnKeysHost host;
+    MockTrackpad *trackpad = host.publishTrackpad();
+    host.setPreference("IdleKBacklightAutoOff", true);
+    host.setPreference("IdleKBacklightAutoOffTimeout", (UInt64) 1000);
+    CHECK(host.start());
+    host.run(MS_TO_NS(1500));
+    CHECK_EQ(host.acpi()->asus().keyboardBacklight, 0);
+
+    host.acpi()->resetCalls();
+    publishNVRAMBacklight(2);
+    host.run(MS_TO_NS(10));
+    CHECK_EQ(host.acpi()->calls("SKBL"), 0);
+    CHECK_EQ(host.acpi()->asus().keyboardBacklight, 0);
+
+    // The next key brings the restored level back
+    trackpad->keyPressed(host.fnKeys(), hostClockNow());
+    host.run(MS_TO_NS(1));
+    CHECK_EQ(host.acpi()->asus().keyboardBacklight, 2);
+}
+
+HOST_TEST(restoreFromDarkArmsAutoOff)
+{
+    FnKeysHost host;
+    host.setPreference("IdleKBacklightAutoOff", true);
+    host.setPreference("IdleKBacklightAutoOffTimeout", (UInt64) 1000);
+    host.setPreference("KeyboardBLightLevelAtBoot", (UInt64) 0);
+    CHECK(host.start());
+    CHECK_EQ(host.acpi()->asus().keyboardBacklight, 0);
+
+    publishNVRAMBacklight(2);
+    host.run(MS_TO_NS(10));
+    CHECK_EQ(host.acpi()->asus().keyboardBacklight, 2);
+
+    host.run(MS_TO_NS(1500));
+    CHECK_EQ(host.acpi()->asus().keyboardBacklight, 0);
+}
+
+HOST_TEST(restoresBacklightWhenNVRAMShowsUpLate)
+{
+    FnKeysHost host;
+    CHECK(host.start());
+    CHECK_EQ(host.acpi()->asus().keyboardBacklight, 1);
+
+    publishNVRAMBacklight(2);
+    host.run(MS_TO_NS(10));
+
+    CHECK_EQ(host.acpi()->asus().keyboardBacklight, 2);
+}
+
+HOST_TEST(panelToggleRestoresTheLevel)
+{
+    FnKeysHost host;
+    AppleBacklightDisplay *display = host.publishDisplay(10 * kPanelBrightnessStep);
+    CHECK(host.start());
+
+    host.notify(0x35);
+    host.run(MS_TO_NS(1));
+    CHECK_EQ(display->brightness(), 0);
+
+    host.notify(0x35);
+    host.run(MS_TO_NS(1));
+    CHECK_EQ(display->brightness(), 10 * kPanelBrightnessStep);
+
+    // Set absolutely, no synthetic brightness keys
+    CHECK_EQ(display->brightnessWrites(), 2);
+    CHECK_EQ(hostHIDEventCount(), 0);
+}
+
+HOST_TEST(panelToggleFollowsSystemChanges)
+{
+    FnKeysHost host;
+    AppleBacklightDisplay *display = host.publishDisplay(10 * kPanelBrightnessStep);
+    CHECK(host.start());
+
+    display->setBrightness(4 * kPanelBrightnessStep);
+    host.notify(0x35);
+    host.notify(0x35);
+    host.run(MS_TO_NS(1));
+    CHECK_EQ(display->brightness(), 4 * kPanelBrightnessStep);
+}
+
+HOST_TEST(panelToggleWithoutDisplaySendsKeys)
+{
+    FnKeysHost host;
+    CHECK(host.start());
+
+    host.notify(0x35);
+    host.run(MS_TO_NS(2000));
+    CHECK_EQ(hidPresses(NX_KEYTYPE_BRIGHTNESS_DOWN), kPanelBrightnessLevels);
+}
+
+HOST_TEST(touchpadToggleReachesTheTrackpad)
+{
+    FnKeysHost host;
+    CHECK(host.start());
+    // Consumers are picked up as they are published
+    MockTrackpad *trackpad = host.publishTrackpad();
+
+    host.notify(0x6B);
+    host.run(MS_TO_NS(1));
+    CHECK(!trackpad->touchpadEnabled());
+    CHECK(host.fnKeys()->getProperty("TouchpadDisabled") != NULL);
+
+    host.notify(0x6B);
+    host.run(MS_TO_NS(1));
+    CHECK(trackpad->touchpadEnabled());
+    CHECK_EQ(trackpad->messages(kKeyboardSetTouchStatus), 2);
+}
+
+HOST_TEST(alsStormReadsTheSensorOnce)
+{
+    FnKeysHost host;
+    CHECK(host.start());
+    UInt32 alss = host.acpi()->calls("ALSS");
+
+    for (int i = 0; i < 10; i++)
+        host.notify(i & 1 ? 0xC7 : 0xC6);
+    host.run(MS_TO_NS(1));
+
+    CHECK_EQ(host.acpi()->calls("ALSS") - alss, 1);
+    CHECK_EQ(host.counter("ALSNotifiesCoalesced"), 9);
+}
+
+HOST_TEST(alsToggleWritesALSC)
+{
+    FnKeysHost host;
+    CHECK(host.start());
+
+    host.notify(0x7A);
+    host.run(MS_TO_NS(1));
+    CHECK(!host.acpi()->asus().alsEnabled);
+    CHECK_EQ(host.acpi()->argument("ALSC"), 0);
+
+    host.notify(0x7A);
+    host.run(MS_TO_NS(1));
+    CHECK(host.acpi()->asus().alsEnabled);
+}
+
+HOST_TEST(keyPressWakesAutoOffBacklight)
+{
+    FnKeysHost host;
+    MockTrackpad *trackpad = host.publishTrackpad();
+    host.setPreference("IdleKBacklightAutoOff", true);
+    host.setPreference("IdleKBacklightAutoOffTimeout", (UInt64) 1000);
+    CHECK(host.start());
+    CHECK_EQ(host.acpi()->asus().keyboardBacklight, 1);
+
+    host.run(MS_TO_NS(1500));
+    CHECK_EQ(host.acpi()->asus().keyboardBacklight, 0);
+
+    trackpad->keyPressed(host.fnKeys(), hostClockNow());
+    host.run(MS_TO_NS(1));
+    CHECK_EQ(host.acpi()->asus().keyboardBacklight, 1);
+}
+
+HOST_TEST(wakeRestoresBacklightOnTheWorkLoop)
+{
+    FnKeysHost host;
+    host.publishNVRAM();
+    CHECK(host.start());
+    CHECK_EQ(host.acpi()->asus().keyboardBacklight, 1);
+
+    // setPowerState comes on the power management thread, SKBL must not
+    bool outside = false;
+    host.acpi()->setMethod("SKBL", [&](OSObject *params[], IOItemCount count, OSObject **result) {
+        outside |= !hostOnWorkLoop();
+        host.acpi()->asus().keyboardBacklight = (UInt32) mockArgument(params, count, 0);
+        return kIOReturnSuccess;
+    });
+
+    host.acpi()->resetCalls();
+    host.fnKeys()->setPowerState(0, host.fnKeys());
+    host.acpi()->asus().keyboardBacklight = 0;
+    host.fnKeys()->setPowerState(1, host.fnKeys());
+    host.run(MS_TO_NS(1));
+
+    CHECK_EQ(host.acpi()->asus().keyboardBacklight, 1);
+    CHECK_EQ(host.acpi()->calls("SKBL"), 1);
+    CHECK(!outside);
+}
@@ -0,0 +1,80 @@
+/*
+ *  Copyright (c) 2018 hieplpvip
+ *
+ *
+ *  main.cpp
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "HostTest.h"
+
+static HostTestCase *gTests;
+static HostTestCase **gTestsTail = &gTests;
+static unsigned int gFailures;
+
+HostTestRegistrar::HostTestRegistrar(HostTestCase *test)
+{
+    *gTestsTail = test;
+    gTestsTail = &test->next;
+}
+
+void hostTestFail(const char *file, int line, const char *expr)
+{
+    printf("    %s:%d: CHECK(%s) failed\n", file, line, expr);
+    gFailures++;
+}
+
+void hostTestFailEqual(const char *file, int line, const char *expr, unsigned long long actual, unsigned long long expected)
+{
+    printf("    %s:%d: %s is %llu (0x%llx), expected %llu (0x%llx)\n", file, line, expr, actual, actual, expected, expected);
+    gFailures++;
+}
+
+UInt32 hidPresses(UInt32 key)
+{
+    UInt32 count = hostHIDEventCount(), presses = 0;
+    for (UInt32 i = count > kHostLogSize ? count - kHostLogSize : 0; i < count; i++)
+    {
+        const HostHIDEvent *event = hostHIDEvent(i);
+        if (event->key == key && event->down)
+            presses++;
+    }
+    return presses;
+}
+
+int main(int argc, char **argv)
+{
+    const char *filter = argc > 1 ? argv[1] : NULL;
+    unsigned int run = 0, failed = 0;
+
+    for (HostTestCase *test = gTests; test; test = test->next)
+    {
+        if (filter && !strstr(test->name, filter))
+            continue;
+
+        unsigned int failures = gFailures;
+        test->run();
+        hostReset();
+        run++;
+
+        bool ok = failures == gFailures;
+        failed += !ok;
+        printf("%s %s\n", ok ? "PASS" : "FAIL", test->name);
+    }
+
+    printf("%u tests, %u failed\n", run, failed);
+    return failed ? 1 : 0;
+}
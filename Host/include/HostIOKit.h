@@ -0,0 +1,969 @@
+/*
+ *  Copyright (c) 2018 hieplpvip
+ *
+ *
+ *  HostIOKit.h
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _HostIOKit_h
+#define _HostIOKit_h
+
+/*
+ * The part of libkern and IOKit the drivers use, implemented for a plain user
+ * space process so the hotkey engine builds and runs off a Mac. The kext
+ * sources compile unchanged against it, the <IOKit/...>, <libkern/...>,
+ * <mach/...> and <sys/...> headers next to this one all forward here.
+ *
+ * Everything runs on one thread:
+ *  - there is a single work loop, getWorkLoop() returns it for every service
+ *    and it only runs when the host pumps it with hostRunUntil()
+ *  - command gates call their action directly
+ *  - time is a simulated clock in nanoseconds (absolute time is 1:1), moved by
+ *    hostRunUntil(), hostClockAdvance(), IOSleep() and the mocks' latencies
+ *  - callbacks queued with hostSchedule() run when the clock passes their
+ *    time, even in the middle of a work loop action, which is how interrupt
+ *    context (ACPI notifications, other drivers' messages) is simulated
+ *
+ * Registry matching is synchronous: registerService() starts the drivers of
+ * the personalities loaded with hostAddPersonalities() and calls the matching
+ * notifications before it returns.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <vector>
+
+#pragma mark -
+#pragma mark Types
+#pragma mark -
+
+typedef uint8_t     UInt8;
+typedef uint16_t    UInt16;
+typedef uint32_t    UInt32;
+typedef uint64_t    UInt64;
+typedef int8_t      SInt8;
+typedef int16_t     SInt16;
+typedef int32_t     SInt32;
+typedef int64_t     SInt64;
+typedef UInt64      AbsoluteTime;
+
+typedef int             kern_return_t;
+typedef kern_return_t   IOReturn;
+typedef UInt32          IOOptionBits;
+typedef UInt32          IOItemCount;
+typedef UInt32          IOByteCount;
+typedef unsigned long   vm_size_t;
+typedef unsigned long   clock_sec_t;
+typedef unsigned int    clock_usec_t;
+typedef struct task *   task_t;
+
+#ifndef FALSE
+#define FALSE   0
+#define TRUE    1
+#endif
+
+#define KERN_SUCCESS            0
+#define KERN_FAILURE            5
+
+#define kIOReturnSuccess        KERN_SUCCESS
+#define kIOReturnError          ((IOReturn) 0xe00002bc)
+#define kIOReturnNoMemory       ((IOReturn) 0xe00002bd)
+#define kIOReturnNoResources    ((IOReturn) 0xe00002be)
+#define kIOReturnNotPrivileged  ((IOReturn) 0xe00002c1)
+#define kIOReturnBadArgument    ((IOReturn) 0xe00002c2)
+#define kIOReturnUnsupported    ((IOReturn) 0xe00002c7)
+#define kIOReturnTimeout        ((IOReturn) 0xe00002d6)
+#define kIOReturnNotReady       ((IOReturn) 0xe00002d8)
+#define kIOReturnNotFound       ((IOReturn) 0xe00002f0)
+
+#define sys_iokit                   0xe0000000U
+#define sub_iokit_common            0
+#define sub_iokit_acpi              (0x00a << 14)
+#define sub_iokit_vendor_specific   (0xffe << 14)
+#define iokit_common_msg(message)           ((UInt32)(sys_iokit | sub_iokit_common | (message)))
+#define iokit_family_msg(sub, message)      ((UInt32)(sys_iokit | (sub) | (message)))
+#define iokit_vendor_specific_msg(message)  ((UInt32)(sys_iokit | sub_iokit_vendor_specific | (message)))
+
+#define kIOMessageServicePropertyChange     iokit_common_msg(0x050)
+#define kIOACPIMessageDeviceNotification    iokit_family_msg(sub_iokit_acpi, 0x10)
+
+enum
+{
+    kNanosecondScale  = 1,
+    kMicrosecondScale = 1000,
+    kMillisecondScale = 1000 * 1000,
+    kSecondScale      = 1000 * 1000 * 1000,
+};
+
+#pragma mark -
+#pragma mark IOLib
+#pragma mark -
+
+void IOLog(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void IOSleep(unsigned milliseconds);
+void IODelay(unsigned microseconds);
+void *IOMalloc(vm_size_t size);
+void IOFree(void *address, vm_size_t size);
+
+void clock_get_uptime(uint64_t *result);
+void clock_get_system_microtime(clock_sec_t *secs, clock_usec_t *microsecs);
+void absolutetime_to_nanoseconds(uint64_t abstime, uint64_t *result);
+void nanoseconds_to_absolutetime(uint64_t nanoseconds, uint64_t *result);
+uint64_t mach_absolute_time(void);
+
+#define OSSafeReleaseNULL(inst)     do { if (inst) (inst)->release(); (inst) = NULL; } while (0)
+
+#pragma mark -
+#pragma mark Kernel events
+#pragma mark -
+
+#define KEV_ANY_VENDOR      0
+#define KEV_ANY_CLASS       0
+#define KEV_ANY_SUBCLASS    0
+#define N_KEV_VECTORS       5
+
+struct kev_d_vectors {
+    u_int32_t data_length;
+    void *data_ptr;
+};
+
+struct kev_msg {
+    u_int32_t vendor_code;
+    u_int32_t kev_class;
+    u_int32_t kev_subclass;
+    u_int32_t event_code;
+    struct kev_d_vectors dv[N_KEV_VECTORS];
+};
+
+extern "C" {
+int kev_vendor_code_find(const char *vendor_string, u_int32_t *vendor_code);
+int kev_msg_post(struct kev_msg *event_msg);
+}
+
+#pragma mark -
+#pragma mark libkern
+#pragma mark -
+
+class OSObject;
+class OSMetaClassBase;
+class OSSerialize;
+class OSString;
+class OSSymbol;
+class OSDictionary;
+
+/*
+ * Class name, superclass and allocator of a class declared with the
+ * OSDeclare / OSDefine macros below, enough for matching and IOClass.
+ */
+class OSMetaClass
+{
+public:
+    typedef OSObject *(*AllocFunction)(void);
+
+    OSMetaClass(const char *name, const OSMetaClass *superClass, AllocFunction alloc);
+
+    const char *getClassName() const { return className; }
+    const OSMetaClass *getSuperClass() const { return superClass; }
+    bool isSubclassOf(const char *name) const;
+
+    static OSObject *allocClassWithName(const char *name);
+
+private:
+    const char *className;
+    const OSMetaClass *superClass;
+    AllocFunction allocFunction;
+    const OSMetaClass *next;
+    static const OSMetaClass *classList;
+};
+
+#define OSDeclareCommonStructors(className) \
+    public: \
+        static const OSMetaClass gMetaClass; \
+        virtual const OSMetaClass *getMetaClass() const { return &gMetaClass; } \
+        static OSObject *MetaClassAlloc(void);
+
+#define OSDeclareDefaultStructors(className) \
+    OSDeclareCommonStructors(className) \
+    public: \
+        className(); \
+        virtual ~className(); \
+    private:
+
+#define OSDeclareAbstractStructors(className) OSDeclareDefaultStructors(className)
+
+#define OSDefineMetaClassAndStructors(className, superclassName) \
+    const OSMetaClass className::gMetaClass(#className, &superclassName::gMetaClass, &className::MetaClassAlloc); \
+    OSObject *className::MetaClassAlloc(void) { return new className; } \
+    className::className() : superclassName() {} \
+    className::~className() {}
+
+#define OSDefineMetaClassAndAbstractStructors(className, superclassName) \
+    const OSMetaClass className::gMetaClass(#className, &superclassName::gMetaClass, NULL); \
+    OSObject *className::MetaClassAlloc(void) { return NULL; } \
+    className::className() : superclassName() {} \
+    className::~className() {}
+
+#define OSDynamicCast(type, inst)   (dynamic_cast<type *>((OSMetaClassBase *)(inst)))
+
+/*
+ * Member function to plain function pointer, same trick as libkern for the
+ * Itanium C++ ABI: a member pointer is { function or 1 + vtable offset, this
+ * adjustment }, the function then takes the object as its first argument.
+ */
+#define OSMemberFunctionCast(cptrtype, self, func) \
+    (cptrtype) OSMetaClassBase::_ptmf2ptf(self, (void (OSMetaClassBase::*)(void)) func)
+
+class OSMetaClassBase
+{
+public:
+    virtual ~OSMetaClassBase() {}
+    virtual void retain() const = 0;
+    virtual void release() const = 0;
+    virtual int getRetainCount() const = 0;
+    virtual const OSMetaClass *getMetaClass() const = 0;
+    virtual bool isEqualTo(const OSMetaClassBase *anObject) const { return this == anObject; }
+
+    typedef void (*_ptf_t)(void);
+    static _ptf_t _ptmf2ptf(const OSMetaClassBase *self, void (OSMetaClassBase::*func)(void))
+    {
+        union {
+            void (OSMetaClassBase::*fIn)(void);
+            struct { uintptr_t ptr; ptrdiff_t adj; } pmf;
+        } map;
+
+        map.fIn = func;
+        if (map.pmf.ptr & 1)
+        {
+            const char *object = (const char *) self + map.pmf.adj;
+            const char *vtable = *(const char * const *) object;
+            return *(const _ptf_t *)(vtable + map.pmf.ptr - 1);
+        }
+        return (_ptf_t) map.pmf.ptr;
+    }
+};
+
+class OSObject : public OSMetaClassBase
+{
+public:
+    static const OSMetaClass gMetaClass;
+    virtual const OSMetaClass *getMetaClass() const { return &gMetaClass; }
+
+    OSObject();
+    virtual bool init();
+    virtual void free();
+
+    virtual void retain() const;
+    virtual void release() const;
+    virtual int getRetainCount() const;
+    virtual bool serialize(OSSerialize *s) const;
+
+    // Zero filled like the kernel allocator, drivers rely on it
+    static void *operator new(size_t size);
+    static void operator delete(void *mem, size_t size);
+
+protected:
+    virtual ~OSObject();
+
+private:
+    mutable int retainCount;
+};
+
+class OSString : public OSObject
+{
+    OSDeclareDefaultStructors(OSString)
+
+public:
+    static OSString *withCString(const char *cString);
+    static OSString *withCStringNoCopy(const char *cString);
+    virtual bool initWithCString(const char *cString);
+    virtual void free();
+
+    unsigned int getLength() const { return length; }
+    const char *getCStringNoCopy() const { return string; }
+
+    virtual bool isEqualTo(const OSMetaClassBase *anObject) const;
+    virtual bool isEqualTo(const char *aCString) const;
+    virtual bool serialize(OSSerialize *s) const;
+
+protected:
+    char *string;
+    unsigned int length;
+};
+
+// Interned: withCString() of a known string retains the existing symbol
+class OSSymbol : public OSString
+{
+    OSDeclareDefaultStructors(OSSymbol)
+
+public:
+    static const OSSymbol *withCString(const char *cString);
+    static const OSSymbol *withCStringNoCopy(const char *cString) { return withCString(cString); }
+    static const OSSymbol *withString(const OSString *aString) { return withCString(aString->getCStringNoCopy()); }
+    virtual void free();
+};
+
+class OSNumber : public OSObject
+{
+    OSDeclareDefaultStructors(OSNumber)
+
+public:
+    static OSNumber *withNumber(unsigned long long value, unsigned int numberOfBits);
+    virtual bool init(unsigned long long value, unsigned int numberOfBits);
+
+    unsigned int numberOfBits() const { return size; }
+    unsigned int numberOfBytes() const { return (size + 7) / 8; }
+    unsigned char unsigned8BitValue() const { return (unsigned char) value; }
+    unsigned short unsigned16BitValue() const { return (unsigned short) value; }
+    unsigned int unsigned32BitValue() const { return (unsigned int) value; }
+    unsigned long long unsigned64BitValue() const { return value; }
+    void setValue(unsigned long long value);
+
+    virtual bool isEqualTo(const OSMetaClassBase *anObject) const;
+    virtual bool serialize(OSSerialize *s) const;
+
+private:
+    unsigned long long value;
+    unsigned int size;
+};
+
+class OSData : public OSObject
+{
+    OSDeclareDefaultStructors(OSData)
+
+public:
+    static OSData *withCapacity(unsigned int capacity);
+    static OSData *withBytes(const void *bytes, unsigned int numBytes);
+    static OSData *withBytesNoCopy(void *bytes, unsigned int numBytes);
+    virtual void free();
+
+    unsigned int getLength() const { return length; }
+    const void *getBytesNoCopy() const { return length ? data : NULL; }
+    const void *getBytesNoCopy(unsigned int start, unsigned int numBytes) const;
+    bool appendBytes(const void *bytes, unsigned int numBytes);
+
+    virtual bool isEqualTo(const OSMetaClassBase *anObject) const;
+    bool isEqualTo(const void *bytes, unsigned int numBytes) const;
+    virtual bool serialize(OSSerialize *s) const;
+
+private:
+    UInt8 *data;
+    unsigned int length, capacity;  // capacity 0 for data not owned
+};
+
+// Two immortal instances, retain and release do nothing
+class OSBoolean : public OSObject
+{
+    OSDeclareDefaultStructors(OSBoolean)
+
+public:
+    static OSBoolean *withBoolean(bool value);
+    bool isTrue() const { return value; }
+    bool isFalse() const { return !value; }
+    bool getValue() const { return value; }
+
+    virtual void retain() const {}
+    virtual void release() const {}
+    virtual bool isEqualTo(const OSMetaClassBase *anObject) const;
+    virtual bool serialize(OSSerialize *s) const;
+
+private:
+    friend struct OSBooleanInstances;
+    bool value;
+};
+
+extern OSBoolean *kOSBooleanTrue;
+extern OSBoolean *kOSBooleanFalse;
+
+class OSCollection : public OSObject
+{
+    OSDeclareAbstractStructors(OSCollection)
+
+public:
+    virtual unsigned int getCount() const = 0;
+    virtual void flushCollection() = 0;
+    // What an iterator returns at index, the key for dictionaries
+    virtual OSObject *iteratorObject(unsigned int index) const = 0;
+};
+
+class OSArray : public OSCollection
+{
+    OSDeclareDefaultStructors(OSArray)
+
+public:
+    static OSArray *withCapacity(unsigned int capacity);
+    virtual void free();
+
+    virtual unsigned int getCount() const { return (unsigned int) array.size(); }
+    virtual void flushCollection();
+    virtual OSObject *iteratorObject(unsigned int index) const { return getObject(index); }
+
+    virtual bool setObject(const OSMetaClassBase *anObject);
+    virtual OSObject *getObject(unsigned int index) const;
+    virtual void removeObject(unsigned int index);
+
+    virtual bool isEqualTo(const OSMetaClassBase *anObject) const;
+    virtual bool serialize(OSSerialize *s) const;
+
+private:
+    std::vector<const OSMetaClassBase *> array;
+};
+
+class OSSet : public OSCollection
+{
+    OSDeclareDefaultStructors(OSSet)
+
+public:
+    static OSSet *withCapacity(unsigned int capacity);
+    virtual void free();
+
+    virtual unsigned int getCount() const { return (unsigned int) members.size(); }
+    virtual void flushCollection();
+    virtual OSObject *iteratorObject(unsigned int index) const;
+
+    virtual bool setObject(const OSMetaClassBase *anObject);
+    virtual void removeObject(const OSMetaClassBase *anObject);
+    virtual bool containsObject(const OSMetaClassBase *anObject) const;
+
+private:
+    std::vector<const OSMetaClassBase *> members;
+};
+
+class OSDictionary : public OSCollection
+{
+    OSDeclareDefaultStructors(OSDictionary)
+
+public:
+    static OSDictionary *withCapacity(unsigned int capacity);
+    static OSDictionary *withDictionary(const OSDictionary *dict, unsigned int capacity = 0);
+    virtual void free();
+
+    virtual unsigned int getCount() const { return (unsigned int) entries.size(); }
+    virtual void flushCollection();
+    virtual OSObject *iteratorObject(unsigned int index) const;
+
+    virtual bool setObject(const OSSymbol *aKey, const OSMetaClassBase *anObject);
+    virtual bool setObject(const OSString *aKey, const OSMetaClassBase *anObject);
+    virtual bool setObject(const char *aKey, const OSMetaClassBase *anObject);
+    virtual OSObject *getObject(const OSSymbol *aKey) const;
+    virtual OSObject *getObject(const OSString *aKey) const;
+    virtual OSObject *getObject(const char *aKey) const;
+    virtual void removeObject(const OSSymbol *aKey);
+    virtual void removeObject(const char *aKey);
+
+    virtual bool isEqualTo(const OSMetaClassBase *anObject) const;
+    virtual bool serialize(OSSerialize *s) const;
+
+private:
+    struct Entry {
+        const OSSymbol *key;
+        const OSMetaClassBase *value;
+    };
+    std::vector<Entry> entries;
+    int find(const char *aKey) const;
+};
+
+class OSIterator : public OSObject
+{
+    OSDeclareAbstractStructors(OSIterator)
+
+public:
+    virtual void reset() = 0;
+    virtual bool isValid() = 0;
+    virtual OSObject *getNextObject() = 0;
+};
+
+class OSCollectionIterator : public OSIterator
+{
+    OSDeclareDefaultStructors(OSCollectionIterator)
+
+public:
+    static OSCollectionIterator *withCollection(const OSCollection *inColl);
+    virtual void free();
+
+    virtual void reset() { index = 0; }
+    virtual bool isValid() { return true; }
+    virtual OSObject *getNextObject();
+
+private:
+    const OSCollection *collection;
+    unsigned int index;
+};
+
+// XML property list text, the format IORegistryEntry::serializeProperties writes
+class OSSerialize : public OSObject
+{
+    OSDeclareDefaultStructors(OSSerialize)
+
+public:
+    static OSSerialize *withCapacity(unsigned int capacity);
+    virtual void free();
+
+    char *text() const { return buffer; }
+    unsigned int getLength() const { return length; }
+    void clearText() { length = 0; if (buffer) buffer[0] = 0; }
+    bool addString(const char *cString);
+    bool addChar(char aChar);
+    bool addXMLEscaped(const char *cString);
+
+private:
+    char *buffer;
+    unsigned int length, capacity;
+};
+
+OSObject *OSUnserializeXML(const char *buffer, OSString **errorString = 0);
+
+#pragma mark -
+#pragma mark IOKit
+#pragma mark -
+
+class IOService;
+class IOUserClient;
+class IONotifier;
+class IOWorkLoop;
+class IORegistryPlane;
+
+extern const IORegistryPlane *gIOServicePlane;
+extern const IORegistryPlane *gIODTPlane;
+
+extern const OSSymbol *gIOPublishNotification;
+extern const OSSymbol *gIOFirstPublishNotification;
+extern const OSSymbol *gIOMatchedNotification;
+extern const OSSymbol *gIOFirstMatchNotification;
+extern const OSSymbol *gIOTerminatedNotification;
+extern const OSSymbol *gIOGeneralInterest;
+
+typedef bool (*IOServiceMatchingNotificationHandler)(void *target, void *refCon, IOService *newService, IONotifier *notifier);
+typedef IOReturn (*IOServiceInterestHandler)(void *target, void *refCon, UInt32 messageType, IOService *provider, void *messageArgument, vm_size_t argSize);
+
+class IORegistryEntry : public OSObject
+{
+    OSDeclareDefaultStructors(IORegistryEntry)
+
+public:
+    virtual bool init(OSDictionary *dictionary = 0);
+    virtual void free();
+
+    // Entries are found by the paths registered with hostRegisterPath()
+    static IORegistryEntry *fromPath(const char *path, const IORegistryPlane *plane = 0,
+                                     char *residualPath = 0, int *residualLength = 0,
+                                     IORegistryEntry *fromEntry = 0);
+
+    // Every read goes through getProperty(const char *), every object write
+    // through setProperty(const OSSymbol *, OSObject *)
+    virtual OSObject *getProperty(const OSSymbol *aKey) const;
+    virtual OSObject *getProperty(const OSString *aKey) const;
+    virtual OSObject *getProperty(const char *aKey) const;
+    virtual OSObject *copyProperty(const OSSymbol *aKey) const;
+    virtual OSObject *copyProperty(const char *aKey) const;
+
+    virtual bool setProperty(const OSSymbol *aKey, OSObject *anObject);
+    virtual bool setProperty(const OSString *aKey, OSObject *anObject);
+    virtual bool setProperty(const char *aKey, OSObject *anObject);
+    virtual bool setProperty(const char *aKey, const char *aString);
+    virtual bool setProperty(const char *aKey, bool aBoolean);
+    virtual bool setProperty(const char *aKey, unsigned long long aValue, unsigned int aNumberOfBits);
+    virtual bool setProperty(const char *aKey, void *bytes, unsigned int length);
+    virtual void removeProperty(const OSSymbol *aKey);
+    virtual void removeProperty(const char *aKey);
+
+    virtual bool serializeProperties(OSSerialize *s) const;
+    virtual IOReturn setProperties(OSObject *properties);
+
+    virtual const char *getName(const IORegistryPlane *plane = 0) const;
+    virtual void setName(const char *name, const IORegistryPlane *plane = 0);
+
+protected:
+    OSDictionary *fPropertyTable;
+    char fName[64];
+};
+
+class IONotifier : public OSObject
+{
+    OSDeclareAbstractStructors(IONotifier)
+
+public:
+    virtual void remove() = 0;
+    virtual bool disable() = 0;
+    virtual void enable(bool was) = 0;
+};
+
+#define kIOPMPowerOn        0x00000002
+#define IOPMPowerOn         kIOPMPowerOn
+#define IOPMAckImplied      0
+
+typedef unsigned long IOPMPowerFlags;
+
+struct IOPMPowerState
+{
+    unsigned long version;
+    IOPMPowerFlags capabilityFlags;
+    IOPMPowerFlags outputPowerCharacter;
+    IOPMPowerFlags inputPowerRequirement;
+    unsigned long staticPower;
+    unsigned long unbudgetedPower;
+    unsigned long powerToAttain;
+    unsigned long timeToAttain;
+    unsigned long settleUpTime;
+    unsigned long timeToLower;
+    unsigned long settleDownTime;
+    unsigned long powerDomainBudget;
+};
+
+class IOService : public IORegistryEntry
+{
+    OSDeclareDefaultStructors(IOService)
+
+public:
+    virtual bool init(OSDictionary *dictionary = 0);
+    virtual void free();
+
+    virtual IOService *probe(IOService *provider, SInt32 *score);
+    virtual bool start(IOService *provider);
+    virtual void stop(IOService *provider);
+    virtual bool attach(IOService *provider);
+    virtual void detach(IOService *provider);
+    virtual void registerService(IOOptionBits options = 0);
+    virtual bool terminate(IOOptionBits options = 0);
+    bool isInactive() const { return fInactive; }
+
+    IOService *getProvider() const { return fProvider; }
+    IOService *getClient() const;
+    virtual IOWorkLoop *getWorkLoop() const;
+
+    virtual IOReturn message(UInt32 type, IOService *provider, void *argument = 0);
+    virtual IOReturn messageClient(UInt32 messageType, OSObject *client, void *messageArgument = 0, vm_size_t argSize = 0);
+    // Clients and the general interest notifiers
+    virtual IOReturn messageClients(UInt32 type, void *argument = 0, vm_size_t argSize = 0);
+
+    virtual IOReturn setPowerState(unsigned long powerStateOrdinal, IOService *whatDevice);
+    void PMinit();
+    void PMstop();
+    IOReturn registerPowerDriver(IOService *controllingDriver, IOPMPowerState *powerStates, unsigned long numberOfStates);
+    void joinPMtree(IOService *driver);
+
+    static OSDictionary *serviceMatching(const char *className, OSDictionary *table = 0);
+    static OSDictionary *nameMatching(const char *name, OSDictionary *table = 0);
+    static OSDictionary *propertyMatching(const OSSymbol *key, const OSObject *value, OSDictionary *table = 0);
+    static IONotifier *addMatchingNotification(const OSSymbol *type, OSDictionary *matching,
+                                               IOServiceMatchingNotificationHandler handler,
+                                               void *target, void *ref = 0, SInt32 priority = 0);
+    static IOService *copyMatchingService(OSDictionary *matching);
+    virtual IONotifier *registerInterest(const OSSymbol *typeOfInterest, IOServiceInterestHandler handler,
+                                         void *target, void *ref = 0);
+
+    // IOServiceOpen(): an instance of the IOUserClientClass property, started on this
+    virtual IOReturn newUserClient(task_t owningTask, void *securityID, UInt32 type,
+                                   OSDictionary *properties, IOUserClient **handler);
+
+    // IOProviderClass, IONameMatch and IOPropertyMatch of a matching dictionary
+    bool matchesTable(OSDictionary *table) const;
+
+private:
+    friend class _IOServiceInterestNotifier;
+    IOService *fProvider;
+    OSArray *fClients;
+    std::vector<IONotifier *> fInterest;
+    bool fRegistered, fInactive, fStarted;
+};
+
+// The task calling into the driver, see hostSetAdministrator()
+task_t current_task();
+
+#define kIOClientPrivilegeAdministrator "root"
+
+#define kIOUCVariableStructureSize 0xffffffff
+
+// IOConnectCallMethod() arguments, the inband part
+struct IOExternalMethodArguments {
+    uint32_t version;
+    uint32_t selector;
+    const uint64_t *scalarInput;
+    uint32_t scalarInputCount;
+    const void *structureInput;
+    uint32_t structureInputSize;
+    uint64_t *scalarOutput;
+    uint32_t scalarOutputCount;
+    void *structureOutput;
+    uint32_t structureOutputSize;
+};
+
+typedef IOReturn (*IOExternalMethodAction)(OSObject *target, void *reference, IOExternalMethodArguments *arguments);
+
+struct IOExternalMethodDispatch {
+    IOExternalMethodAction function;
+    uint32_t checkScalarInputCount;
+    uint32_t checkStructureInputSize;
+    uint32_t checkScalarOutputCount;
+    uint32_t checkStructureOutputSize;
+};
+
+class IOUserClient : public IOService
+{
+    OSDeclareDefaultStructors(IOUserClient)
+
+public:
+    static IOReturn clientHasPrivilege(void *securityToken, const char *privilegeName);
+
+    virtual bool initWithTask(task_t owningTask, void *securityToken, UInt32 type, OSDictionary *properties);
+    // IOServiceClose()
+    virtual IOReturn clientClose();
+    // Checks the argument counts against dispatch and runs it
+    virtual IOReturn externalMethod(uint32_t selector, IOExternalMethodArguments *arguments,
+                                    IOExternalMethodDispatch *dispatch = 0, OSObject *target = 0, void *reference = 0);
+};
+
+#pragma mark -
+#pragma mark Work loop
+#pragma mark -
+
+class IOEventSource : public OSObject
+{
+    OSDeclareAbstractStructors(IOEventSource)
+
+public:
+    typedef void (*Action)(OSObject *owner, ...);
+
+    virtual bool init(OSObject *owner, Action action = 0);
+    virtual void enable() { enabled = true; }
+    virtual void disable() { enabled = false; }
+    virtual bool isEnabled() const { return enabled; }
+    virtual void setWorkLoop(IOWorkLoop *workLoop) { this->workLoop = workLoop; }
+    IOWorkLoop *getWorkLoop() const { return workLoop; }
+
+    // Runs the source's work if it has some at the current time
+    virtual bool checkForWork() = 0;
+    // Time the source next has work, false if none is planned
+    virtual bool nextDeadline(UInt64 *deadline) const { return false; }
+
+protected:
+    OSObject *owner;
+    Action action;
+    IOWorkLoop *workLoop;
+    bool enabled;
+};
+
+class IOWorkLoop : public OSObject
+{
+    OSDeclareDefaultStructors(IOWorkLoop)
+
+public:
+    static IOWorkLoop *workLoop();
+    virtual void free();
+
+    virtual IOReturn addEventSource(IOEventSource *newEvent);
+    virtual IOReturn removeEventSource(IOEventSource *toRemove);
+    bool inGate() const { return true; }
+
+    // Runs every source with work due until none has any, true if one ran
+    bool runPending();
+    bool nextDeadline(UInt64 *deadline) const;
+
+private:
+    std::vector<IOEventSource *> sources;
+};
+
+class IOTimerEventSource : public IOEventSource
+{
+    OSDeclareDefaultStructors(IOTimerEventSource)
+
+public:
+    typedef void (*Action)(OSObject *owner, IOTimerEventSource *sender);
+
+    static IOTimerEventSource *timerEventSource(OSObject *owner, Action action = 0);
+    virtual bool init(OSObject *owner, Action action = 0);
+
+    virtual IOReturn setTimeoutMS(UInt32 ms);
+    virtual IOReturn setTimeoutUS(UInt32 us);
+    virtual IOReturn setTimeout(UInt32 interval, UInt32 scaleFactor = kNanosecondScale);
+    virtual IOReturn wakeAtTime(UInt64 abstime);
+    virtual void cancelTimeout();
+
+    virtual bool checkForWork();
+    virtual bool nextDeadline(UInt64 *deadline) const;
+
+private:
+    UInt64 deadline;
+    bool armed;
+};
+
+class IOInterruptEventSource : public IOEventSource
+{
+    OSDeclareDefaultStructors(IOInterruptEventSource)
+
+public:
+    typedef void (*Action)(OSObject *owner, IOInterruptEventSource *sender, int count);
+
+    static IOInterruptEventSource *interruptEventSource(OSObject *owner, Action action,
+                                                        IOService *provider = 0, int intIndex = 0);
+    virtual bool init(OSObject *owner, Action action, IOService *provider = 0, int intIndex = 0);
+
+    // Interrupt context, the action runs the next time the work loop does
+    virtual void interruptOccurred(void *refcon, IOService *nub, int ind);
+
+    virtual bool checkForWork();
+    virtual bool nextDeadline(UInt64 *deadline) const;
+
+private:
+    UInt32 producerCount, consumerCount;
+};
+
+class IOCommandGate : public IOEventSource
+{
+    OSDeclareDefaultStructors(IOCommandGate)
+
+public:
+    typedef IOReturn (*Action)(OSObject *owner, void *arg0, void *arg1, void *arg2, void *arg3);
+
+    static IOCommandGate *commandGate(OSObject *owner, Action action = 0);
+    virtual bool init(OSObject *owner, Action action = 0);
+
+    virtual IOReturn runAction(Action action, void *arg0 = 0, void *arg1 = 0, void *arg2 = 0, void *arg3 = 0);
+    virtual IOReturn attemptAction(Action action, void *arg0 = 0, void *arg1 = 0, void *arg2 = 0, void *arg3 = 0);
+
+    virtual bool checkForWork() { return false; }
+};
+
+#pragma mark -
+#pragma mark Families
+#pragma mark -
+
+class IOACPIPlatformDevice : public IOService
+{
+    OSDeclareDefaultStructors(IOACPIPlatformDevice)
+
+public:
+    virtual IOReturn validateObject(const OSSymbol *objectName);
+    virtual IOReturn validateObject(const char *objectName);
+    virtual IOReturn evaluateObject(const OSSymbol *objectName, OSObject **result = 0,
+                                    OSObject *params[] = 0, IOItemCount paramCount = 0, IOOptionBits options = 0);
+    virtual IOReturn evaluateObject(const char *objectName, OSObject **result = 0,
+                                    OSObject *params[] = 0, IOItemCount paramCount = 0, IOOptionBits options = 0);
+    virtual IOReturn evaluateInteger(const OSSymbol *objectName, UInt32 *resultInt32,
+                                     OSObject *params[] = 0, IOItemCount paramCount = 0, IOOptionBits options = 0);
+    virtual IOReturn evaluateInteger(const char *objectName, UInt32 *resultInt32,
+                                     OSObject *params[] = 0, IOItemCount paramCount = 0, IOOptionBits options = 0);
+};
+
+class IOHIKeyboard : public IOService
+{
+    OSDeclareDefaultStructors(IOHIKeyboard)
+
+public:
+    virtual bool start(IOService *provider);
+    virtual const unsigned char *defaultKeymapOfLength(UInt32 *length);
+
+protected:
+    // Recorded, see hostHIDEvent()
+    virtual void dispatchKeyboardEvent(unsigned int keyCode, bool goingDown, AbsoluteTime time);
+};
+
+// The /options entry, property reads can be broken like on some macOS versions
+class IODTNVRAM : public IOService
+{
+    OSDeclareDefaultStructors(IODTNVRAM)
+
+public:
+    using IORegistryEntry::getProperty;
+    using IORegistryEntry::copyProperty;
+    using IORegistryEntry::setProperty;
+
+    virtual OSObject *getProperty(const char *aKey) const;
+    virtual bool setProperty(const OSSymbol *aKey, OSObject *anObject);
+    virtual bool serializeProperties(OSSerialize *s) const;
+
+    void breakPropertyReads(bool broken) { readsBroken = broken; }
+    UInt32 writes() const { return writeCount; }
+    UInt32 serializations() const { return serializeCount; }
+
+private:
+    bool readsBroken;
+    UInt32 writeCount;
+    mutable UInt32 serializeCount;
+};
+
+#pragma mark -
+#pragma mark Host control
+#pragma mark -
+
+#define kHostClockStart     1000000000ULL   // uptime when a run starts, 1 s
+
+// Simulated clock, in nanoseconds
+UInt64 hostClockNow();
+// Moves the clock forward, running the scheduled callbacks it passes
+void hostClockAdvance(UInt64 ns);
+
+// Interrupt context callback run once the clock reaches when
+typedef void (*HostCallback)(void *ref);
+void hostSchedule(UInt64 when, HostCallback callback, void *ref);
+bool hostNextScheduled(UInt64 *when);
+
+// Runs the work loop, its timers and the scheduled callbacks until the clock reaches when
+void hostRunUntil(UInt64 when);
+// Runs what is due now
+void hostRunPending();
+// True inside an event source action or a command gate action, i.e. where the work loop is held
+bool hostOnWorkLoop();
+
+// Drivers started by registerService(), from an IOKitPersonalities dictionary
+void hostAddPersonalities(OSDictionary *personalities);
+void hostAddPersonality(OSDictionary *personality);
+void hostRegisterPath(const char *path, IORegistryEntry *entry);
+
+// Clock, schedule, personalities, paths and logs back to a fresh process
+void hostReset();
+
+// Whether the process calling setProperties() and user clients runs as root, the default
+void hostSetAdministrator(bool administrator);
+
+// IOLog output, off unless FNKEYS_HOST_LOG is set in the environment
+void hostSetLogging(bool enabled);
+
+// Heap allocations made by the process so far (operator new and IOMalloc)
+UInt64 hostAllocations();
+// Of those, the ones not freed yet
+UInt64 hostLiveAllocations();
+
+// Events dispatched by IOHIKeyboard::dispatchKeyboardEvent
+struct HostHIDEvent {
+    UInt32 key;
+    bool down;
+    UInt64 eventTime;       // time stamp passed by the driver
+    UInt64 dispatchTime;    // clock when it was dispatched
+};
+typedef void (*HostHIDHook)(const HostHIDEvent *event, void *ref);
+void hostSetHIDHook(HostHIDHook hook, void *ref);
+UInt32 hostHIDEventCount();
+const HostHIDEvent *hostHIDEvent(UInt32 index);     // latest kHostLogSize only
+
+// Messages posted with kev_msg_post, payload is the data vectors back to back
+struct HostKernEvent {
+    u_int32_t vendor_code, kev_class, kev_subclass, event_code;
+    UInt32 length;
+    UInt8 data[64];
+    UInt64 postTime;        // clock when it was posted
+};
+UInt32 hostKernEventCount();
+const HostKernEvent *hostKernEvent(UInt32 index);   // latest kHostLogSize only
+
+#define kHostLogSize    1024
+
+#endif //_HostIOKit_h
@@ -0,0 +1,2 @@
+// Host build, see HostIOKit.h
+#include <HostIOKit.h>
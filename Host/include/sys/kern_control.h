@@ -0,0 +1,4 @@
+// Host build, see HostIOKit.h. Included from extern "C" blocks.
+extern "C++" {
+#include <HostIOKit.h>
+}
@@ -7,6 +7,7 @@
 //
 
 #include "KernEventServer.h"
+#include "FnKeysTrace.h"
 
 #if DEBUG
 #define DEBUG_LOG(fmt, args...) IOLog(fmt, ## args)
@@ -29,6 +30,12 @@ bool KernEventServer::setVendorID(const char *vendorCode)
     return true;
 }
 
+// Owner's trace ring, sent events are recorded there
+void KernEventServer::setTrace(FnKeysTrace *ring)
+{
+    trace = ring;
+}
+
 void KernEventServer::setEventCode(u_int32_t code)
 {
     eventCode = code;
@@ -36,6 +43,9 @@ void KernEventServer::setEventCode(u_int32_t code)
 
 bool KernEventServer::sendMessage(int type, int x, int y)
 {
+    if (trace)
+        trace->record(kTraceKernEvent, type, ((UInt64)(UInt32) x << 32) | (UInt32) y);
+    
     //kernel event message
     struct kev_msg kEventMsg = {0};
     
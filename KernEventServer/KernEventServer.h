@@ -14,14 +14,18 @@ extern "C" {
 }
 #include <IOKit/IOLib.h>
 
+class FnKeysTrace;
+
 class KernEventServer
 {
 public:
     bool setVendorID(const char *vendorCode);
     void setEventCode(u_int32_t code);
     bool sendMessage(int type, int x, int y);
+    void setTrace(FnKeysTrace *ring);
 private:
     const char * getName();
     u_int32_t vendorID = 0, eventCode = 0;
+    FnKeysTrace *trace = NULL;
 };
 #endif /* KernEventServer_h */
@@ -0,0 +1,323 @@
+/*
+ *  Copyright (c) 2018 hieplpvip
+ *
+ *
+ *  FnKeysTrace.h
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _FnKeysTrace_h
+#define _FnKeysTrace_h
+
+#include <IOKit/IOService.h>
+#include <IOKit/IOUserClient.h>
+#include <IOKit/IOLib.h>
+#include <kern/task.h>
+
+/*
+ * Instrumentation shared by the drivers of the kext: a binary trace and the
+ * latency histograms of the hotkey pipeline (at the end of this file).
+ *
+ * Trace records are fixed size and written lock-free into a per-driver ring,
+ * which is allocated the first time tracing is enabled. The ring is published
+ * oldest first as the TraceRecords property (an array of FnKeysTraceRecord)
+ * and decoded offline.
+ *
+ * Tracing is switched at runtime by writing TraceEnabled through
+ * setProperties; while disabled a trace point costs one branch.
+ *
+ * In drain mode the same ring is a capture buffer: a single consumer takes
+ * the records out in order with drain(), and records that find it full are
+ * counted as dropped instead of overwriting what was not read yet.
+ */
+
+#define kTraceRingSize  1024    // records, power of 2
+
+typedef struct {
+    UInt64 time;        // mach absolute time
+    UInt32 event;       // kTrace* below
+    UInt32 arg0;
+    UInt64 arg1;
+} FnKeysTraceRecord;
+
+enum
+{
+    // AsusFnKeys
+    kTraceNotify = 0x0100,          // arg0 notify value
+    kTraceWED,                      // arg0 notify value, arg1 event code
+    kTraceKeyAction,                // arg0 event code, arg1 action flags
+    kTraceKeyRepeat,                // arg0 event code, arg1 firmware repeats absorbed
+    kTraceKeyboardBacklight,        // arg0 level
+    kTraceACPICall,                 // arg0 method, arg1 latency in us << 32 | IOReturn
+    
+    // FnKeysHIKeyboardDevice
+    kTraceKeyQueued = 0x0200,       // arg0 scancode, arg1 repeat count
+    kTraceKeyBatch,                 // arg0 records sent
+    
+    // FnKeysHIKeyboard
+    kTraceKeyDispatch = 0x0300,     // arg0 scancode, arg1 repeat count
+    kTraceKeyCoalesced,             // arg0 scancode, arg1 backlog
+    kTraceKeyDropped,               // arg0 scancode, arg1 events dropped
+    
+    // KernEventServer
+    kTraceKernEvent = 0x0400,       // arg0 type, arg1 x << 32 | y
+    
+    // AsusFnKeys capture, the firmware inputs needed to replay a session
+    kCaptureNotify = 0x0500,        // arg0 notify value
+    kCaptureWED,                    // arg0 notify value, arg1 decoded event code, 0xFFFFFFFF if decoding failed
+    kCaptureACPI,                   // arg0 length << 16 | kCaptureObject* << 8 | method, arg1 latency in us << 32 | value
+    kCaptureKeyTime,                // arg0 message type, arg1 keypress time of a keypress-time message
+};
+
+/*
+ * Kind of object an ACPI method returned in a kCaptureACPI record. Length is
+ * the package element or buffer byte count, value the number, the first
+ * package element or the first 4 buffer bytes (little endian). A failed call
+ * has kind None and the low 16 bits of its IOReturn in place of the length,
+ * all IOReturns of the ACPI calls are 0xe00002xx.
+ */
+enum
+{
+    kCaptureObjectNone = 0,         // failed call or no result
+    kCaptureObjectNumber,
+    kCaptureObjectPackage,          // first element is a number
+    kCaptureObjectBuffer,
+    kCaptureObjectOther,            // string, package starting with something else, ...
+};
+
+class FnKeysTrace
+{
+public:
+    inline void record(UInt32 event, UInt32 arg0 = 0, UInt64 arg1 = 0)
+    {
+        if (__builtin_expect(!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE), 1))
+            return;
+        
+        if (drained)
+        {
+            recordDrained(event, arg0, arg1);
+            return;
+        }
+        
+        UInt32 index = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+        FnKeysTraceRecord *slot = &ring[index & (kTraceRingSize - 1)];
+        clock_get_uptime(&slot->time);
+        slot->event = event;
+        slot->arg0 = arg0;
+        slot->arg1 = arg1;
+    }
+    
+    void enable(bool on)
+    {
+        if (on && !ring)
+        {
+            FnKeysTraceRecord *buffer = (FnKeysTraceRecord *) IOMalloc(kTraceRingSize * sizeof(FnKeysTraceRecord));
+            if (!buffer)
+                return;
+            bzero(buffer, kTraceRingSize * sizeof(FnKeysTraceRecord));
+            
+            FnKeysTraceRecord *expected = NULL;
+            if (!__atomic_compare_exchange_n(&ring, &expected, buffer, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                IOFree(buffer, kTraceRingSize * sizeof(FnKeysTraceRecord));
+        }
+        __atomic_store_n(&enabled, on, __ATOMIC_RELEASE);
+    }
+    
+    bool active() const
+    {
+        return __atomic_load_n(&enabled, __ATOMIC_RELAXED);
+    }
+    
+    // Before the first enable()
+    void setDrained(bool on)
+    {
+        drained = on;
+    }
+    
+    // Records that found a drained ring full
+    UInt32 dropped() const
+    {
+        return __atomic_load_n(&lost, __ATOMIC_RELAXED);
+    }
+    
+    // Moves up to max records, oldest first, out of a drained ring. One
+    // consumer at a time; stops at a record still being written.
+    UInt32 drain(FnKeysTraceRecord *out, UInt32 max)
+    {
+        if (!ring)
+            return 0;
+        
+        UInt32 count = 0;
+        for (; count < max; count++)
+        {
+            FnKeysTraceRecord *slot = &ring[tail & (kTraceRingSize - 1)];
+            UInt32 event = __atomic_load_n(&slot->event, __ATOMIC_ACQUIRE);
+            if (!event)
+                break;
+            
+            out[count] = *slot;
+            out[count].event = event;
+            __atomic_store_n(&slot->event, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&tail, tail + 1, __ATOMIC_RELEASE);
+        }
+        return count;
+    }
+    
+    // Only once no trace point can run anymore
+    void free()
+    {
+        enabled = false;
+        if (ring)
+            IOFree(ring, kTraceRingSize * sizeof(FnKeysTraceRecord));
+        ring = NULL;
+        head = tail = lost = 0;
+    }
+    
+    // Snapshot of the ring, oldest record first; records being written may be torn
+    OSData * copyRecords() const
+    {
+        if (!ring)
+            return NULL;
+        
+        UInt32 end = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+        UInt32 count = end < kTraceRingSize ? end : kTraceRingSize;
+        UInt32 first = (end - count) & (kTraceRingSize - 1);
+        UInt32 wrapped = first + count > kTraceRingSize ? first + count - kTraceRingSize : 0;
+        
+        OSData *data = OSData::withCapacity(count * sizeof(FnKeysTraceRecord));
+        if (data)
+        {
+            data->appendBytes(&ring[first], (count - wrapped) * sizeof(FnKeysTraceRecord));
+            if (wrapped)
+                data->appendBytes(&ring[0], wrapped * sizeof(FnKeysTraceRecord));
+        }
+        return data;
+    }
+    
+    // Handle TraceEnabled (or key) in a setProperties() dictionary
+    bool setProperties(OSDictionary *dict, const char *key = "TraceEnabled")
+    {
+        OSBoolean *on = dict ? OSDynamicCast(OSBoolean, dict->getObject(key)) : NULL;
+        if (on)
+            enable(on->getValue());
+        return on != NULL;
+    }
+    
+    // Refresh TraceRecords (or name) on entry, called from serializeProperties()
+    void publish(IORegistryEntry *entry, const char *name = "TraceRecords") const
+    {
+        if (OSData *data = copyRecords())
+        {
+            entry->setProperty(name, data);
+            data->release();
+        }
+    }
+    
+private:
+    bool enabled = false;
+    bool drained = false;
+    UInt32 head = 0;
+    UInt32 tail = 0;        // drain mode only, next record to take out
+    UInt32 lost = 0;
+    FnKeysTraceRecord *ring = NULL;
+    
+    // A slot is free again once the consumer moved tail past it, its
+    // event is stored last so the consumer never sees half a record
+    void recordDrained(UInt32 event, UInt32 arg0, UInt64 arg1)
+    {
+        UInt32 index = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        do
+        {
+            if (index - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) >= kTraceRingSize)
+            {
+                __atomic_fetch_add(&lost, 1, __ATOMIC_RELAXED);
+                return;
+            }
+        } while (!__atomic_compare_exchange_n(&head, &index, index + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        
+        FnKeysTraceRecord *slot = &ring[index & (kTraceRingSize - 1)];
+        clock_get_uptime(&slot->time);
+        slot->arg0 = arg0;
+        slot->arg1 = arg1;
+        __atomic_store_n(&slot->event, event, __ATOMIC_RELEASE);
+    }
+};
+
+/*
+ * Any process can reach setProperties() through IORegistryEntrySetCFProperties,
+ * the instrumentation switches are for administrators only. True when dict
+ * holds one of the NULL terminated keys and the caller is not root.
+ */
+static inline bool instrumentationDenied(OSDictionary *dict, const char * const keys[])
+{
+    if (!dict)
+        return false;
+    for (; *keys; keys++)
+    {
+        if (dict->getObject(*keys))
+            return IOUserClient::clientHasPrivilege(current_task(), kIOClientPrivilegeAdministrator) != kIOReturnSuccess;
+    }
+    return false;
+}
+
+/*
+ * log2 latency histogram for the hotkey pipeline. Bucket 0 counts samples
+ * under 1us, bucket i samples in [2^(i-1), 2^i) us and the last bucket
+ * everything slower. Only relaxed atomic adds on the hot path.
+ */
+#define kLatencyBuckets 24
+
+typedef struct {
+    UInt32 buckets[kLatencyBuckets];
+} FnKeysLatency;
+
+static inline void latencyRecord(FnKeysLatency *hist, uint64_t delta)
+{
+    uint64_t ns;
+    absolutetime_to_nanoseconds(delta, &ns);
+    uint64_t us = ns / 1000;
+    unsigned int bucket = us ? 64 - __builtin_clzll(us) : 0;
+    if (bucket >= kLatencyBuckets)
+        bucket = kLatencyBuckets - 1;
+    __atomic_fetch_add(&hist->buckets[bucket], 1, __ATOMIC_RELAXED);
+}
+
+static inline void latencyReset(FnKeysLatency *hist)
+{
+    for (int i = 0; i < kLatencyBuckets; i++)
+        __atomic_store_n(&hist->buckets[i], 0, __ATOMIC_RELAXED);
+}
+
+// Add the histogram to dict as an array of bucket counts
+static inline void latencyPublish(OSDictionary *dict, const char *name, const FnKeysLatency *hist)
+{
+    OSArray *array = OSArray::withCapacity(kLatencyBuckets);
+    if (!array)
+        return;
+    for (int i = 0; i < kLatencyBuckets; i++)
+    {
+        if (OSNumber *count = OSNumber::withNumber(__atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED), 32))
+        {
+            array->setObject(count);
+            count->release();
+        }
+    }
+    dict->setObject(name, array);
+    array->release();
+}
+
+#endif //_FnKeysTrace_h